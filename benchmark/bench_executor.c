@@ -0,0 +1,85 @@
+/* -----------------------------------------------------------------------------
+ * Executor scaling: one thread posts events round robin to many instances,
+ * 1 to 32 workers run them. Every on_run does a little work (a short hash
+ * loop), so the time is spent in the workers rather than in posting.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+#include "../src/lovely_fsm_executor.h"
+
+#define INSTANCES      4096
+#define TOTAL_EVENTS   (1 << 20)
+#define WORK_ROUNDS    200
+#define MAX_WORKERS    32
+
+enum { ST_ACTIVE };
+enum { EV_WORK };
+
+typedef struct session_t {
+    uint32_t hash;
+} session_t;
+
+lfsm_return_t do_work(lfsm_t fsm) {
+    session_t* session = lfsm_user_data(fsm);
+    uint32_t hash = session->hash;
+    for (int i = 0 ; i < WORK_ROUNDS ; i++) {
+        hash = (hash ^ i) * 16777619u;
+    }
+    session->hash = hash;
+    return LFSM_OK;
+}
+
+lfsm_transitions_t transitions[] = {
+    { ST_ACTIVE , EV_WORK , NULL , ST_ACTIVE },
+};
+
+lfsm_state_functions_t states[] = {
+    { ST_ACTIVE , NULL , do_work , NULL },
+};
+
+static lfsm_t instances[INSTANCES];
+static session_t sessions[INSTANCES];
+
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void bench_workers(uint32_t worker_count) {
+    lfsm_executor_t executor = lfsm_executor_create(worker_count);
+    unsigned long queue_full = 0;
+
+    double start = now_seconds();
+    for (uint32_t i = 0 ; i < TOTAL_EVENTS ; i++) {
+        while (lfsm_executor_post(executor, instances[i % INSTANCES], EV_WORK) != LFSM_OK) {
+            queue_full++;
+            sched_yield();
+        }
+    }
+    lfsm_executor_wait_idle(executor);
+    double elapsed = now_seconds() - start;
+    lfsm_executor_destroy(executor);
+
+    printf("%7u | %10.2f | %12.1f | %10lu\n", worker_count, TOTAL_EVENTS / elapsed / 1e6,
+           elapsed * 1e9 / TOTAL_EVENTS, queue_full);
+}
+
+int main(void) {
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+    for (int i = 0 ; i < INSTANCES ; i++) {
+        instances[i] = lfsm_init(transitions, states, no_callbacks, &sessions[i], ST_ACTIVE);
+    }
+    printf("executor, %d instances, %d events\n", INSTANCES, TOTAL_EVENTS);
+    printf("workers | Mevents/s  | ns per event | queue full\n");
+    for (uint32_t workers = 1 ; workers <= MAX_WORKERS ; workers *= 2) {
+        bench_workers(workers);
+    }
+    for (int i = 0 ; i < INSTANCES ; i++) {
+        lfsm_deinit(instances[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* -----------------------------------------------------------------------------
+ * Many instances of one machine: one lfsm_t per instance driven by
+ * fsm_add_event() + lfsm_run(), compared to one lfsm_group_t processing the
+ * same (instance, event) batches. Single threaded, so the numbers are per core.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+
+#define INSTANCES      100000
+#define BATCH_SIZE     65536
+#define BATCH_COUNT    64
+
+enum { ST_IDLE, ST_CONNECTING, ST_OPEN, ST_CLOSING };
+enum { EV_NEXT, EV_DATA, EV_RESET };
+
+static unsigned long callback_count;
+
+lfsm_return_t count_run(lfsm_t fsm) {
+    callback_count++;
+    return LFSM_OK;
+}
+
+lfsm_transitions_t transitions[] = {
+    { ST_IDLE       , EV_NEXT  , NULL , ST_CONNECTING },
+    { ST_IDLE       , EV_DATA  , NULL , ST_IDLE       },
+    { ST_CONNECTING , EV_NEXT  , NULL , ST_OPEN       },
+    { ST_CONNECTING , EV_RESET , NULL , ST_IDLE       },
+    { ST_OPEN       , EV_NEXT  , NULL , ST_CLOSING    },
+    { ST_OPEN       , EV_DATA  , NULL , ST_OPEN       },
+    { ST_OPEN       , EV_RESET , NULL , ST_IDLE       },
+    { ST_CLOSING    , EV_NEXT  , NULL , ST_IDLE       },
+    { ST_CLOSING    , EV_RESET , NULL , ST_IDLE       },
+};
+
+lfsm_state_functions_t no_callbacks[] = {
+    { ST_IDLE       , NULL , NULL , NULL },
+    { ST_CONNECTING , NULL , NULL , NULL },
+    { ST_OPEN       , NULL , NULL , NULL },
+    { ST_CLOSING    , NULL , NULL , NULL },
+};
+
+lfsm_state_functions_t run_callbacks[] = {
+    { ST_IDLE       , NULL , count_run , NULL },
+    { ST_CONNECTING , NULL , count_run , NULL },
+    { ST_OPEN       , NULL , count_run , NULL },
+    { ST_CLOSING    , NULL , count_run , NULL },
+};
+
+static lfsm_t handles[INSTANCES];
+static lfsm_group_event_t batches[BATCH_COUNT][BATCH_SIZE];
+
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void fill_batches(void) {
+    uint32_t random = 2463534242u;
+    for (int batch = 0 ; batch < BATCH_COUNT ; batch++) {
+        for (int i = 0 ; i < BATCH_SIZE ; i++) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            batches[batch][i].instance = random % INSTANCES;
+            batches[batch][i].event = (random >> 24) % 3;
+        }
+    }
+}
+
+static double bench_handles(const lfsm_definition_t* definition) {
+    lfsm_buf_callbacks_t buffer_callbacks = { 0 };
+    for (int i = 0 ; i < INSTANCES ; i++) {
+        handles[i] = lfsm_init_definition(definition, buffer_callbacks, NULL, ST_IDLE);
+        if (handles[i] == NULL) {
+            fprintf(stderr, "lfsm_init_definition failed\n");
+            exit(1);
+        }
+    }
+    double start = now_seconds();
+    for (int batch = 0 ; batch < BATCH_COUNT ; batch++) {
+        for (int i = 0 ; i < BATCH_SIZE ; i++) {
+            lfsm_t fsm = handles[batches[batch][i].instance];
+            fsm_add_event(fsm, batches[batch][i].event);
+            lfsm_run(fsm);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    for (int i = 0 ; i < INSTANCES ; i++) {
+        lfsm_deinit(handles[i]);
+    }
+    return elapsed;
+}
+
+static double bench_group(const lfsm_definition_t* definition) {
+    lfsm_group_t group = lfsm_group_create(definition, INSTANCES, NULL, ST_IDLE);
+    double start = now_seconds();
+    for (int batch = 0 ; batch < BATCH_COUNT ; batch++) {
+        lfsm_group_run(group, batches[batch], BATCH_SIZE);
+    }
+    double elapsed = now_seconds() - start;
+    lfsm_group_destroy(group);
+    return elapsed;
+}
+
+static void report(const char* engine, const char* callbacks, double elapsed) {
+    double events = (double)BATCH_SIZE * BATCH_COUNT;
+    printf("%-8s | %-9s | %20.2f | %8.1f\n", engine, callbacks, events / elapsed / 1e6, elapsed * 1e9 / events);
+}
+
+int main(void) {
+    const lfsm_definition_t* plain = lfsm_definition_compile(transitions, ARRAYSIZE(transitions), no_callbacks, ARRAYSIZE(no_callbacks));
+    const lfsm_definition_t* counting = lfsm_definition_compile(transitions, ARRAYSIZE(transitions), run_callbacks, ARRAYSIZE(run_callbacks));
+
+    fill_batches();
+    printf("%d instances, %d batches of %d events\n", INSTANCES, BATCH_COUNT, BATCH_SIZE);
+    printf("engine   | callbacks | Mevents/s (1 core)   | ns/event\n");
+    report("lfsm_t", "none", bench_handles(plain));
+    report("group", "none", bench_group(plain));
+    report("lfsm_t", "on_run", bench_handles(counting));
+    report("group", "on_run", bench_group(counting));
+
+    lfsm_definition_free(plain);
+    lfsm_definition_free(counting);
+    return callback_count == 0;
+}
@@ -0,0 +1,84 @@
+/* -----------------------------------------------------------------------------
+ * Init time of large machines (LFSM_ID_BITS=16): lfsm_definition_build()
+ * sorting and indexing 1k to 256k transitions listed in random order, for the
+ * dense and the hash index, followed by the time per event run through the
+ * machine (next states are random, so every lookup hits a different row).
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+
+#if (LFSM_ID_BITS < 16)
+#error "build with -DLFSM_ID_BITS=16 (see Makefile)"
+#endif
+
+#define EVENTS   16
+#define RUNS     (1 << 22)
+
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// xorshift, so every run measures the same tables
+static uint32_t random_state = 2463534242u;
+static uint32_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void bench_machine(int transition_count, lfsm_index_type_t index_type) {
+    lfsm_transitions_t* transitions = malloc(transition_count * sizeof(lfsm_transitions_t));
+    int state_count = transition_count / EVENTS;
+    lfsm_definition_t definition;
+
+    for (int i = 0 ; i < transition_count ; i++) {
+        transitions[i] = (lfsm_transitions_t){ i / EVENTS, i % EVENTS, NULL, next_random() % state_count };
+    }
+    for (int i = transition_count - 1 ; i > 0 ; i--) {
+        int other = next_random() % (i + 1);
+        lfsm_transitions_t swap = transitions[i];
+        transitions[i] = transitions[other];
+        transitions[other] = swap;
+    }
+
+    double start = now_seconds();
+    if (lfsm_definition_build(&definition, transitions, transition_count, NULL, 0, index_type) != LFSM_OK) {
+        printf("%11d | build failed\n", transition_count);
+        free(transitions);
+        return;
+    }
+    double build_time = now_seconds() - start;
+
+    lfsm_t fsm = lfsm_init_definition(&definition, (lfsm_buf_callbacks_t){ 0 }, NULL, 0);
+    start = now_seconds();
+    for (uint32_t i = 0 ; i < RUNS ; i += LFSM_EV_QUEUE_SIZE) {
+        for (int event = 0 ; event < LFSM_EV_QUEUE_SIZE ; event++) {
+            fsm_add_event(fsm, next_random() % EVENTS);
+        }
+        lfsm_run_until_empty(fsm);
+    }
+    double run_time = now_seconds() - start;
+
+    printf("%11d | %5s | %12.3f | %11.1f\n", transition_count,
+           (index_type == LFSM_INDEX_HASH) ? "hash" : "dense", build_time * 1e3,
+           run_time * 1e9 / RUNS);
+    lfsm_deinit(fsm);
+    lfsm_definition_release(&definition);
+    free(transitions);
+}
+
+int main(void) {
+    printf("definition build (sort + index), %d events per state, %d bit ids\n", EVENTS, LFSM_ID_BITS);
+    printf("transitions | index | build ms     | ns / event\n");
+    for (int transitions = 1024 ; transitions <= (1 << 18) ; transitions *= 4) {
+        bench_machine(transitions, LFSM_INDEX_DENSE);
+        bench_machine(transitions, LFSM_INDEX_HASH);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include "bench_machine.h"
+
+static uint32_t random_state = 2463534242u;
+
+uint32_t bench_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+void bench_random_seed(uint32_t seed) {
+    random_state = (seed != 0) ? seed : 2463534242u;
+}
+
+static int bench_guard(lfsm_t fsm) {
+    return bench_random() & 1;
+}
+
+static lfsm_return_t bench_on_run(lfsm_t fsm) {
+    return LFSM_OK;
+}
+
+static void bench_add_pair(bench_machine_t* machine, const bench_machine_config_t* config, int state, int event) {
+    int transitions = (config->guards > 0) ? config->guards : 1;
+    for (int i = 0 ; i < transitions ; i++) {
+        lfsm_transitions_t* transition = &machine->transitions[machine->transition_count++];
+        transition->current_state = state;
+        transition->event = event;
+        transition->condition = (config->guards > 0) ? bench_guard : NULL;
+        transition->next_state = bench_random() % config->states;
+    }
+}
+
+int bench_machine_generate(bench_machine_t* machine, const bench_machine_config_t* config) {
+    int per_pair = (config->guards > 0) ? config->guards : 1;
+    size_t max_transitions = (size_t)config->states * config->events * per_pair;
+
+    machine->transitions = malloc(max_transitions * sizeof(lfsm_transitions_t));
+    machine->states = malloc(config->states * sizeof(lfsm_state_functions_t));
+    machine->transition_count = 0;
+    machine->state_count = config->states;
+    if ((machine->transitions == NULL) || (machine->states == NULL)) {
+        bench_machine_free(machine);
+        return 1;
+    }
+
+    bench_random_seed(config->seed);
+    for (int state = 0 ; state < config->states ; state++) {
+        int first_pair = machine->transition_count;
+        for (int event = 0 ; event < config->events ; event++) {
+            if ((int)(bench_random() % 100) < config->density) {
+                bench_add_pair(machine, config, state, event);
+            }
+        }
+        if (machine->transition_count == first_pair) {
+            bench_add_pair(machine, config, state, bench_random() % config->events);
+        }
+        machine->states[state] = (lfsm_state_functions_t){ state, NULL, bench_on_run, NULL };
+    }
+    // shuffle whole pairs, the guard order within a pair must stay the same
+    int pair_count = machine->transition_count / per_pair;
+    for (int pair = pair_count - 1 ; pair > 0 ; pair--) {
+        int other = bench_random() % (pair + 1);
+        for (int i = 0 ; i < per_pair ; i++) {
+            lfsm_transitions_t swap = machine->transitions[pair * per_pair + i];
+            machine->transitions[pair * per_pair + i] = machine->transitions[other * per_pair + i];
+            machine->transitions[other * per_pair + i] = swap;
+        }
+    }
+    return 0;
+}
+
+void bench_machine_free(bench_machine_t* machine) {
+    free(machine->transitions);
+    free(machine->states);
+    machine->transitions = NULL;
+    machine->states = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef __BENCH_MACHINE_H
+#define __BENCH_MACHINE_H
+
+/* -----------------------------------------------------------------------------
+ * Random machine generator for the benchmarks.
+ *
+ * Every (state,event) pair has a transition with a probability of density
+ * percent, every state has at least one. A pair gets 'guards' transitions
+ * whose condition accepts half of the events, or one transition without
+ * condition if guards is 0. Next states are random. The transitions are
+ * listed in random order, so building the definition includes sorting.
+ * The same seed gives the same machine.
+ * -------------------------------------------------------------------------- */
+#include <stdint.h>
+#include "../src/lovely_fsm.h"
+
+typedef struct bench_machine_config_t {
+    int states;
+    int events;
+    int density; // percent of the (state,event) pairs with transitions
+    int guards;  // conditional transitions per pair, 0: one without condition
+    uint32_t seed;
+} bench_machine_config_t;
+
+typedef struct bench_machine_t {
+    lfsm_transitions_t* transitions;
+    int transition_count;
+    lfsm_state_functions_t* states;
+    int state_count;
+} bench_machine_t;
+
+// returns 0 on success, free the machine with bench_machine_free()
+int bench_machine_generate(bench_machine_t* machine, const bench_machine_config_t* config);
+void bench_machine_free(bench_machine_t* machine);
+
+// random number used by the guards and the benchmarks, xorshift
+uint32_t bench_random(void);
+void bench_random_seed(uint32_t seed);
+
+#endif // __BENCH_MACHINE_H
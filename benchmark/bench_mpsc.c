@@ -0,0 +1,102 @@
+/* -----------------------------------------------------------------------------
+ * Producer contention benchmark for the multi producer event queue
+ * (LFSM_QUEUE_MULTI_PRODUCER). 1 to 32 threads add events to the same
+ * instance while one consumer thread drains it with lfsm_run_until_empty().
+ * A producer finding the queue full yields and retries.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+
+#if !(LFSM_QUEUE_MULTI_PRODUCER)
+#error "build with -DLFSM_QUEUE_MULTI_PRODUCER=1 (see Makefile)"
+#endif
+
+#define TOTAL_EVENTS   (1 << 22)
+#define MAX_PRODUCERS  32
+
+enum { ST_IDLE, ST_BUSY };
+enum { EV_PING, EV_PONG };
+
+lfsm_transitions_t transitions[] = {
+    { ST_IDLE , EV_PING , NULL , ST_BUSY },
+    { ST_IDLE , EV_PONG , NULL , ST_IDLE },
+    { ST_BUSY , EV_PING , NULL , ST_BUSY },
+    { ST_BUSY , EV_PONG , NULL , ST_IDLE },
+};
+
+lfsm_state_functions_t states[] = {
+    { ST_IDLE , NULL , NULL , NULL },
+    { ST_BUSY , NULL , NULL , NULL },
+};
+
+typedef struct bench_run_t {
+    lfsm_t fsm;
+    uint32_t events_per_producer;
+    atomic_uint producers_started;
+    atomic_ulong full_retries;
+} bench_run_t;
+
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void* producer(void* argument) {
+    bench_run_t* run = argument;
+    unsigned long retries = 0;
+
+    atomic_fetch_add(&run->producers_started, 1);
+    for (uint32_t i = 0 ; i < run->events_per_producer ; i++) {
+        while (fsm_add_event(run->fsm, i & 1) != LFSM_OK) {
+            retries++;
+            sched_yield();
+        }
+    }
+    atomic_fetch_add(&run->full_retries, retries);
+    return NULL;
+}
+
+static void bench_producers(int producer_count) {
+    pthread_t threads[MAX_PRODUCERS];
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+    bench_run_t run;
+    uint64_t processed = 0;
+
+    run.fsm = lfsm_init(transitions, states, no_callbacks, NULL, ST_IDLE);
+    run.events_per_producer = TOTAL_EVENTS / producer_count;
+    atomic_init(&run.producers_started, 0);
+    atomic_init(&run.full_retries, 0);
+    uint64_t expected = (uint64_t)run.events_per_producer * producer_count;
+
+    double start = now_seconds();
+    for (int i = 0 ; i < producer_count ; i++) {
+        pthread_create(&threads[i], NULL, producer, &run);
+    }
+    while (processed < expected) {
+        processed += lfsm_run_until_empty(run.fsm).events;
+    }
+    double elapsed = now_seconds() - start;
+    for (int i = 0 ; i < producer_count ; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%9d | %10.2f | %12.1f | %12lu\n", producer_count, expected / elapsed / 1e6,
+           elapsed * 1e9 / expected, (unsigned long)atomic_load(&run.full_retries));
+    lfsm_deinit(run.fsm);
+}
+
+int main(void) {
+    printf("multi producer queue, %d events, queue size %d\n", TOTAL_EVENTS, LFSM_EV_QUEUE_SIZE);
+    printf("producers | Mevents/s  | ns per event | full retries\n");
+    for (int producers = 1 ; producers <= MAX_PRODUCERS ; producers *= 2) {
+        bench_producers(producers);
+    }
+    return 0;
+}
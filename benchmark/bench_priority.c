@@ -0,0 +1,108 @@
+/* -----------------------------------------------------------------------------
+ * Reaction latency of an emergency stop behind a full queue of measurements
+ * (LFSM_EVENT_PRIORITIES=2, LFSM_EV_QUEUE_SIZE=1024): the stop is added
+ * after DEPTH measurements and the time until its transition ran is taken,
+ * - fifo:     the stop in the same class as the measurements
+ * - priority: the stop in the higher class
+ * Median and worst case over REPEAT runs per queue depth.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+
+#if (LFSM_EVENT_PRIORITIES < 2)
+#error "build with -DLFSM_EVENT_PRIORITIES=2 (see Makefile)"
+#endif
+
+#define REPEAT 2000
+
+enum { ST_RUNNING, ST_STOPPED };
+enum { EV_MEASURE, EV_STOP, EV_START };
+
+static volatile uint32_t measurements;
+static uint64_t stop_time;
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t first = *(const uint64_t*)a, second = *(const uint64_t*)b;
+    return (first > second) - (first < second);
+}
+
+static int measure(lfsm_t fsm) {
+    (void)fsm;
+    measurements++;
+    return 0;
+}
+
+static lfsm_return_t stopped_entry(lfsm_t fsm) {
+    (void)fsm;
+    stop_time = now_ns();
+    return LFSM_OK;
+}
+
+static lfsm_transitions_t transitions[] = {
+    { ST_RUNNING , EV_MEASURE , measure , ST_RUNNING },
+    { ST_RUNNING , EV_STOP    , NULL    , ST_STOPPED },
+    { ST_STOPPED , EV_START   , NULL    , ST_RUNNING },
+    { ST_STOPPED , EV_MEASURE , NULL    , ST_STOPPED },
+};
+
+static lfsm_state_functions_t states[] = {
+    { ST_STOPPED , stopped_entry , NULL , NULL },
+};
+
+static void bench_depth(const lfsm_definition_t* definition, const char* name, int depth) {
+    static uint64_t samples[REPEAT];
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+    lfsm_t fsm = lfsm_init_definition(definition, no_callbacks, NULL, ST_RUNNING);
+
+    for (int i = 0 ; i < REPEAT ; i++) {
+        for (int event = 0 ; event < depth ; event++) {
+            fsm_add_event(fsm, EV_MEASURE);
+        }
+        fsm_add_event(fsm, EV_STOP);
+        uint64_t start = now_ns();
+        while (lfsm_get_state(fsm) != ST_STOPPED) {
+            lfsm_run(fsm);
+        }
+        samples[i] = stop_time - start;
+        lfsm_run_until_empty(fsm);
+        fsm_add_event(fsm, EV_START);
+        lfsm_run(fsm);
+    }
+    qsort(samples, REPEAT, sizeof(uint64_t), compare_u64);
+    printf("  %-8s depth %4d: median %7llu ns, max %7llu ns\n", name, depth,
+           (unsigned long long)samples[REPEAT / 2], (unsigned long long)samples[REPEAT - 1]);
+    lfsm_deinit(fsm);
+}
+
+int main(void) {
+    static const uint8_t fifo_priorities[] = { 0, 0, 0 };
+    static const uint8_t stop_first[] = { 0, 1, 0 };
+    lfsm_definition_t fifo, priority;
+    const int depths[] = { 0, 16, 256, LFSM_EV_QUEUE_SIZE - 1 };
+
+    if ((lfsm_definition_build(&fifo, transitions, 4, states, 1, LFSM_INDEX_AUTO) != LFSM_OK) ||
+        (lfsm_definition_build(&priority, transitions, 4, states, 1, LFSM_INDEX_AUTO) != LFSM_OK)) {
+        fprintf(stderr, "bench_priority: build failed\n");
+        return 1;
+    }
+    fifo.event_priorities = fifo_priorities;
+    priority.event_priorities = stop_first;
+
+    printf("emergency stop latency behind queued measurements\n");
+    for (int i = 0 ; i < (int)(sizeof(depths) / sizeof(depths[0])) ; i++) {
+        bench_depth(&fifo, "fifo", depths[i]);
+        bench_depth(&priority, "priority", depths[i]);
+    }
+    lfsm_definition_release(&fifo);
+    lfsm_definition_release(&priority);
+    return 0;
+}
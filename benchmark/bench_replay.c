@@ -0,0 +1,235 @@
+/* -----------------------------------------------------------------------------
+ * Event recorder and replay, built with LFSM_ENABLE_RECORDER=1:
+ *
+ *   bench_replay [-o recording.bin]   record a generated workload, replay it
+ *   bench_replay recording.bin        replay a recording of this benchmark
+ *
+ * The workload is shaped like production traffic: INSTANCES instances of one
+ * random machine (bench_machine.h, without guards, so a replay is
+ * deterministic), a tenth of the instances get 90% of the events, and events
+ * come in bursts of 1 .. 8 per instance that are run right after they were
+ * added. It runs once without and once with the recorder (cost of recording
+ * per event), then the recording is replayed into new instances with
+ * lfsm_replay(), as fast as possible: events/s and whether the final states
+ * are the recorded ones. A recording given on the command line must come
+ * from this machine; its final states are summarized by a checksum.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+#include "bench_machine.h"
+
+#define INSTANCES     10000
+#define HOT_INSTANCES (INSTANCES / 10)
+#define EVENTS        (1 << 22)
+#define MAX_BURST     8
+
+static const bench_machine_config_t machine_config = { 64, 16, 50, 0, 7 };
+
+typedef struct recording_t {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} recording_t;
+
+static lfsm_group_event_t workload[EVENTS];
+
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void fail(const char* message) {
+    fprintf(stderr, "bench_replay: %s\n", message);
+    exit(1);
+}
+
+static void write_recording(const void* data, uint32_t size, void* context) {
+    recording_t* recording = context;
+    if (recording->size + size > recording->capacity) {
+        recording->capacity = (recording->size + size) * 2;
+        recording->data = realloc(recording->data, recording->capacity);
+        if (recording->data == NULL) fail("out of memory");
+    }
+    memcpy(recording->data + recording->size, data, size);
+    recording->size += size;
+}
+
+static void read_recording(const char* path, recording_t* recording) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    recording->size = recording->capacity = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    recording->data = malloc(recording->size);
+    if ((recording->data == NULL) || (fread(recording->data, 1, recording->size, file) != recording->size)) {
+        fail("cannot read the recording");
+    }
+    fclose(file);
+}
+
+static void fill_workload(void) {
+    bench_random_seed(12345);
+    for (uint32_t i = 0 ; i < EVENTS ; ) {
+        uint32_t hot = (bench_random() % 100) < 90;
+        uint32_t instance = hot ? bench_random() % HOT_INSTANCES : HOT_INSTANCES + bench_random() % (INSTANCES - HOT_INSTANCES);
+        uint32_t burst = 1 + bench_random() % MAX_BURST;
+        for ( ; (burst > 0) && (i < EVENTS) ; burst--, i++) {
+            workload[i].instance = instance;
+            workload[i].event = bench_random() % machine_config.events;
+        }
+    }
+}
+
+static void create_instances(const lfsm_definition_t* definition, lfsm_t* instances, uint32_t count) {
+    lfsm_buf_callbacks_t buffer_callbacks = { 0 };
+    for (uint32_t i = 0 ; i < count ; i++) {
+        instances[i] = lfsm_init_definition(definition, buffer_callbacks, NULL, 0);
+        if (instances[i] == NULL) fail("lfsm_init_definition failed");
+    }
+}
+
+static void destroy_instances(lfsm_t* instances, uint32_t count) {
+    for (uint32_t i = 0 ; i < count ; i++) {
+        lfsm_deinit(instances[i]);
+    }
+}
+
+// a burst ends where the next event is for another instance
+static double run_workload(lfsm_t* instances) {
+    double start = now_seconds();
+    for (uint32_t i = 0 ; i < EVENTS ; i++) {
+        lfsm_t fsm = instances[workload[i].instance];
+        if (fsm_add_event(fsm, workload[i].event) != LFSM_OK) {
+            lfsm_run_until_empty(fsm);
+            fsm_add_event(fsm, workload[i].event);
+        }
+        if ((i + 1 == EVENTS) || (workload[i + 1].instance != workload[i].instance)) {
+            lfsm_run_until_empty(fsm);
+        }
+    }
+    return now_seconds() - start;
+}
+
+// FNV-1a over (instance number, state) of the instances that left the
+// initial state 0, the same for a recording replayed here and from a file
+static uint32_t state_checksum(lfsm_t* instances, uint32_t count) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0 ; i < count ; i++) {
+        lfsm_id_t state = (instances[i] != NULL) ? lfsm_get_state(instances[i]) : 0;
+        if (state == 0) continue;
+        hash = (hash ^ i) * 16777619u;
+        hash = (hash ^ state) * 16777619u;
+    }
+    return hash;
+}
+
+// instances[n] receives the events of recorded instance number n
+static double replay(const recording_t* recording, lfsm_t* instances, uint32_t count, lfsm_replay_result_t* result) {
+    double start = now_seconds();
+    if (lfsm_replay(recording->data, recording->size, instances, count, result) != LFSM_OK) {
+        fail("broken recording");
+    }
+    return now_seconds() - start;
+}
+
+static void report_replay(const recording_t* recording, const lfsm_replay_result_t* result, double elapsed) {
+    printf("recording: %llu events, %zu bytes (%.2f bytes/event), %.3f s recorded\n",
+           (unsigned long long)(result->events + result->skipped), recording->size,
+           (double)recording->size / (result->events + result->skipped), result->duration * 1e-9);
+    printf("replay:    %8.2f Mevents/s | %6.1f ns/event | %llu transitions\n",
+           result->events / elapsed / 1e6, elapsed * 1e9 / result->events,
+           (unsigned long long)result->transitions);
+}
+
+static int replay_file(const lfsm_definition_t* definition, const char* path) {
+    recording_t recording = { 0 };
+    lfsm_replay_result_t result;
+    read_recording(path, &recording);
+    if (lfsm_replay(recording.data, recording.size, NULL, 0, &result) != LFSM_OK) fail("broken recording");
+
+    lfsm_t* instances = malloc(result.instance_count * sizeof(lfsm_t));
+    if (instances == NULL) fail("out of memory");
+    create_instances(definition, instances, result.instance_count);
+    double elapsed = replay(&recording, instances, result.instance_count, &result);
+    report_replay(&recording, &result, elapsed);
+    printf("final states: %u instances, checksum 0x%08x\n", result.instance_count, state_checksum(instances, result.instance_count));
+    destroy_instances(instances, result.instance_count);
+    free(instances);
+    free(recording.data);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    static lfsm_t live[INSTANCES];
+    const char* output = NULL;
+    bench_machine_t machine;
+
+    if (bench_machine_generate(&machine, &machine_config) != 0) fail("out of memory");
+    const lfsm_definition_t* definition = lfsm_definition_compile(machine.transitions, machine.transition_count, machine.states, machine.state_count);
+    if (definition == NULL) fail("lfsm_definition_compile failed");
+    if ((argc == 3) && (strcmp(argv[1], "-o") == 0)) {
+        output = argv[2];
+    } else if (argc == 2) {
+        return replay_file(definition, argv[1]);
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: bench_replay [-o recording.bin] | bench_replay recording.bin\n");
+        return 1;
+    }
+
+    fill_workload();
+    printf("%d instances, %d events in bursts of 1 .. %d\n", INSTANCES, EVENTS, MAX_BURST);
+    create_instances(definition, live, INSTANCES);
+    double plain = run_workload(live);
+    destroy_instances(live, INSTANCES);
+
+    recording_t recording = { 0 };
+    create_instances(definition, live, INSTANCES);
+    if (lfsm_recorder_start(write_recording, &recording) != LFSM_OK) fail("recorder compiled out");
+    double recorded = run_workload(live);
+    lfsm_recorder_stop();
+    printf("live:      %8.2f Mevents/s | %6.1f ns/event\n", EVENTS / plain / 1e6, plain * 1e9 / EVENTS);
+    printf("recording: %8.2f Mevents/s | %6.1f ns/event (+%.1f ns)\n", EVENTS / recorded / 1e6, recorded * 1e9 / EVENTS,
+           (recorded - plain) * 1e9 / EVENTS);
+    if (output != NULL) {
+        FILE* file = fopen(output, "wb");
+        if ((file == NULL) || (fwrite(recording.data, 1, recording.size, file) != recording.size)) fail("cannot write the recording");
+        fclose(file);
+    }
+
+    // the replayed instances get the numbers of the recorded ones
+    lfsm_replay_result_t result;
+    lfsm_replay(recording.data, recording.size, NULL, 0, &result);
+    lfsm_t* replayed = calloc(result.instance_count, sizeof(lfsm_t));
+    lfsm_t* created = malloc(INSTANCES * sizeof(lfsm_t));
+    if ((replayed == NULL) || (created == NULL)) fail("out of memory");
+    create_instances(definition, created, INSTANCES);
+    for (uint32_t i = 0 ; i < INSTANCES ; i++) {
+        replayed[lfsm_get_instance_number(live[i])] = created[i];
+    }
+    double elapsed = replay(&recording, replayed, result.instance_count, &result);
+    report_replay(&recording, &result, elapsed);
+
+    int mismatches = 0;
+    for (uint32_t i = 0 ; i < INSTANCES ; i++) {
+        mismatches += lfsm_get_state(live[i]) != lfsm_get_state(created[i]);
+    }
+    printf("final states: %s (%d of %d differ), checksum 0x%08x\n", (mismatches == 0) ? "match" : "DIFFER",
+           mismatches, INSTANCES, state_checksum(replayed, result.instance_count));
+
+    destroy_instances(live, INSTANCES);
+    destroy_instances(created, INSTANCES);
+    free(replayed);
+    free(created);
+    free(recording.data);
+    lfsm_definition_free(definition);
+    bench_machine_free(&machine);
+    return mismatches != 0;
+}
@@ -0,0 +1,203 @@
+/* -----------------------------------------------------------------------------
+ * Benchmark suite with JSON output, for tracking regressions:
+ *
+ *   bench_suite                                  default set of machines
+ *   bench_suite STATES EVENTS DENSITY GUARDS [SEED]   one random machine
+ *
+ * For each random machine (see bench_machine.h) it measures
+ * - lfsm_init_func(): first call (unsorted table), rebuild, shared definition
+ * - per index type (dense, hash, linear): lfsm_definition_build() time and
+ *   index memory, mean ns per event for fsm_add_event() + lfsm_run() and
+ *   the p50/p99 latency of single events (timer overhead subtracted)
+ * Built with LFSM_ID_BITS=16, so machines may have more than 253 states.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+#include "bench_machine.h"
+
+#define INIT_REPEAT      20
+#define LATENCY_SAMPLES  20000
+#define THROUGHPUT_EVENTS (1 << 18)
+
+static const bench_machine_config_t default_machines[] = {
+    //  states events density guards seed
+    {     16,    8,   100,     0,    1 },
+    {     64,   32,    50,     2,    2 },
+    {    250,   64,    10,     0,    3 },
+    {   1000,   64,    25,     1,    4 },
+    {   4000,  100,     5,     0,    5 },
+};
+
+static const struct {
+    lfsm_index_type_t type;
+    const char* name;
+} engines[] = {
+    { LFSM_INDEX_DENSE  , "dense"  },
+    { LFSM_INDEX_HASH   , "hash"   },
+    { LFSM_INDEX_LINEAR , "linear" },
+};
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t first = *(const uint64_t*)a, second = *(const uint64_t*)b;
+    return (first > second) - (first < second);
+}
+
+// lookup table and dispatch record memory of a definition, without the
+// transition table itself
+static size_t index_bytes(const lfsm_definition_t* definition) {
+    size_t state_range = definition->state_number_max - definition->state_number_min + 1;
+    size_t bytes = state_range * sizeof(lfsm_state_functions_t*);
+
+    if (definition->index_type == LFSM_INDEX_DENSE) {
+        bytes += state_range * definition->event_count * sizeof(lfsm_transitions_t*);
+    } else if (definition->index_type == LFSM_INDEX_HASH) {
+        bytes += ((size_t)(UINT32_MAX >> definition->hash_shift) + 1) * sizeof(lfsm_index_entry_t);
+    }
+    if (definition->dispatch_table != NULL) {
+        bytes += definition->transition_count * sizeof(lfsm_dispatch_t);
+    }
+    return bytes;
+}
+
+static uint64_t timer_overhead_ns(void) {
+    static uint64_t samples[1024];
+    for (int i = 0 ; i < 1024 ; i++) {
+        uint64_t start = now_ns();
+        samples[i] = now_ns() - start;
+    }
+    qsort(samples, 1024, sizeof(uint64_t), compare_u64);
+    return samples[512];
+}
+
+static void print_init(bench_machine_t* machine) {
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+    uint64_t start = now_ns();
+    lfsm_t fsm = lfsm_init_func(machine->transitions, machine->transition_count, machine->states,
+                                machine->state_count, no_callbacks, NULL, 0);
+    uint64_t first = now_ns() - start;
+    lfsm_deinit(fsm);
+
+    // the table is sorted now, the definition is rebuilt as it was released
+    start = now_ns();
+    for (int i = 0 ; i < INIT_REPEAT ; i++) {
+        fsm = lfsm_init_func(machine->transitions, machine->transition_count, machine->states,
+                             machine->state_count, no_callbacks, NULL, 0);
+        lfsm_deinit(fsm);
+    }
+    uint64_t rebuild = (now_ns() - start) / INIT_REPEAT;
+
+    lfsm_t owner = lfsm_init_func(machine->transitions, machine->transition_count, machine->states,
+                                  machine->state_count, no_callbacks, NULL, 0);
+    start = now_ns();
+    for (int i = 0 ; i < INIT_REPEAT ; i++) {
+        fsm = lfsm_init_func(machine->transitions, machine->transition_count, machine->states,
+                             machine->state_count, no_callbacks, NULL, 0);
+        lfsm_deinit(fsm);
+    }
+    uint64_t shared = (now_ns() - start) / INIT_REPEAT;
+    lfsm_deinit(owner);
+
+    printf("      \"init\": { \"first_ns\": %llu, \"rebuild_ns\": %llu, \"shared_ns\": %llu },\n",
+           (unsigned long long)first, (unsigned long long)rebuild, (unsigned long long)shared);
+}
+
+static void print_engine(bench_machine_t* machine, int events, int engine, uint64_t overhead) {
+    static uint64_t samples[LATENCY_SAMPLES];
+    lfsm_definition_t definition;
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+
+    uint64_t start = now_ns();
+    if (lfsm_definition_build(&definition, machine->transitions, machine->transition_count,
+                              machine->states, machine->state_count, engines[engine].type) != LFSM_OK) {
+        printf("        { \"index\": \"%s\", \"error\": \"build failed\" }", engines[engine].name);
+        return;
+    }
+    uint64_t build = now_ns() - start;
+    lfsm_t fsm = lfsm_init_definition(&definition, no_callbacks, NULL, 0);
+
+    start = now_ns();
+    for (int i = 0 ; i < THROUGHPUT_EVENTS ; i++) {
+        fsm_add_event(fsm, bench_random() % events);
+        lfsm_run(fsm);
+    }
+    double ns_per_event = (double)(now_ns() - start) / THROUGHPUT_EVENTS;
+
+    for (int i = 0 ; i < LATENCY_SAMPLES ; i++) {
+        uint32_t event = bench_random() % events;
+        start = now_ns();
+        fsm_add_event(fsm, event);
+        lfsm_run(fsm);
+        uint64_t elapsed = now_ns() - start;
+        samples[i] = (elapsed > overhead) ? elapsed - overhead : 0;
+    }
+    qsort(samples, LATENCY_SAMPLES, sizeof(uint64_t), compare_u64);
+
+    printf("        { \"index\": \"%s\", \"build_ns\": %llu, \"index_bytes\": %zu, \"ns_per_event\": %.1f, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu }", engines[engine].name, (unsigned long long)build,
+           index_bytes(&definition), ns_per_event, (unsigned long long)samples[LATENCY_SAMPLES / 2],
+           (unsigned long long)samples[LATENCY_SAMPLES * 99 / 100]);
+    lfsm_deinit(fsm);
+    lfsm_definition_release(&definition);
+}
+
+static int bench_config(const bench_machine_config_t* config, uint64_t overhead, int last) {
+    bench_machine_t machine;
+    if (bench_machine_generate(&machine, config) != 0) {
+        fprintf(stderr, "bench_suite: out of memory\n");
+        return 1;
+    }
+    printf("    {\n");
+    printf("      \"machine\": { \"states\": %d, \"events\": %d, \"density\": %d, \"guards\": %d, "
+           "\"seed\": %u, \"transitions\": %d },\n", config->states, config->events, config->density,
+           config->guards, config->seed, machine.transition_count);
+    print_init(&machine);
+    printf("      \"engines\": [\n");
+    for (int engine = 0 ; engine < (int)(sizeof(engines) / sizeof(engines[0])) ; engine++) {
+        print_engine(&machine, config->events, engine, overhead);
+        printf(engine + 1 < (int)(sizeof(engines) / sizeof(engines[0])) ? ",\n" : "\n");
+    }
+    printf("      ]\n    }%s\n", last ? "" : ",");
+    bench_machine_free(&machine);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const bench_machine_config_t* configs = default_machines;
+    int config_count = sizeof(default_machines) / sizeof(default_machines[0]);
+    bench_machine_config_t single;
+
+    if (argc >= 5) {
+        single.states  = atoi(argv[1]);
+        single.events  = atoi(argv[2]);
+        single.density = atoi(argv[3]);
+        single.guards  = atoi(argv[4]);
+        single.seed    = (argc >= 6) ? (uint32_t)strtoul(argv[5], NULL, 0) : 1;
+        if ((single.states <= 0) || (single.events <= 0) || (single.guards < 0)) {
+            fprintf(stderr, "usage: bench_suite [STATES EVENTS DENSITY GUARDS [SEED]]\n");
+            return 1;
+        }
+        configs = &single;
+        config_count = 1;
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: bench_suite [STATES EVENTS DENSITY GUARDS [SEED]]\n");
+        return 1;
+    }
+
+    uint64_t overhead = timer_overhead_ns();
+    printf("{\n  \"id_bits\": %d,\n  \"queue_size\": %d,\n  \"timer_overhead_ns\": %llu,\n  \"machines\": [\n",
+           LFSM_ID_BITS, LFSM_EV_QUEUE_SIZE, (unsigned long long)overhead);
+    for (int i = 0 ; i < config_count ; i++) {
+        if (bench_config(&configs[i], overhead, i + 1 == config_count) != 0) return 1;
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+/* -----------------------------------------------------------------------------
+ * Generated switch dispatcher against the table engine, same machine
+ * (bench_switch.lfsm) and the same random event sequence:
+ *
+ *   table   the definition generated by lfsm_gen, interpreted by lfsm_run()
+ *   switch  the same definition with the step function of 'lfsm_gen --switch'
+ *
+ * The generated file is included at the end, after the callbacks, so the
+ * compiler can inline them into the step function.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+
+#define EVENTS     (1 << 22)
+#define EVENT_KINDS 5
+
+typedef struct frame_t {
+    uint32_t header_bytes;
+    uint32_t payload_bytes;
+    uint32_t frames;
+    uint32_t errors;
+    uint32_t checksum;
+} frame_t;
+
+extern const lfsm_definition_t bench_switch_definition;
+
+static uint32_t random_state = 1;
+
+static uint32_t bench_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+static frame_t* frame(lfsm_t context) {
+    return (frame_t*)lfsm_user_data(context);
+}
+
+// --- guards ---
+static int header_done(lfsm_t context)    { return ++frame(context)->header_bytes >= 4; }
+static int payload_full(lfsm_t context)   { return frame(context)->payload_bytes >= 64; }
+static int checksum_valid(lfsm_t context) { return (frame(context)->checksum & 3) != 0; }
+
+// --- state functions ---
+static lfsm_return_t idle_entry(lfsm_t context) {
+    frame(context)->frames++;
+    return LFSM_OK;
+}
+
+static lfsm_return_t header_run(lfsm_t context) {
+    frame(context)->checksum += 7;
+    return LFSM_OK;
+}
+
+static lfsm_return_t payload_entry(lfsm_t context) {
+    frame(context)->header_bytes = 0;
+    frame(context)->payload_bytes = 0;
+    return LFSM_OK;
+}
+
+static lfsm_return_t payload_run(lfsm_t context) {
+    frame(context)->payload_bytes++;
+    frame(context)->checksum += frame(context)->payload_bytes;
+    return LFSM_OK;
+}
+
+static lfsm_return_t payload_exit(lfsm_t context) {
+    frame(context)->checksum ^= frame(context)->payload_bytes;
+    return LFSM_OK;
+}
+
+static lfsm_return_t error_entry(lfsm_t context) {
+    frame(context)->errors++;
+    return LFSM_OK;
+}
+
+static lfsm_return_t error_exit(lfsm_t context) {
+    frame(context)->header_bytes = 0;
+    return LFSM_OK;
+}
+
+// data bytes dominate, like in a real stream
+static uint8_t next_event(void) {
+    uint32_t value = bench_random() % 32;
+    if (value < 26) return 1; // EV_DATA
+    return value % EVENT_KINDS;
+}
+
+static double bench_run(const lfsm_definition_t* definition, frame_t* data) {
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+    lfsm_t fsm = lfsm_init_definition(definition, no_callbacks, data, 0);
+
+    random_state = 1;
+    uint64_t start = now_ns();
+    for (int i = 0 ; i < EVENTS ; i++) {
+        fsm_add_event(fsm, next_event());
+        lfsm_run(fsm);
+    }
+    uint64_t elapsed = now_ns() - start;
+    lfsm_deinit(fsm);
+    return (double)elapsed / EVENTS;
+}
+
+int main(void) {
+    lfsm_definition_t table_definition = bench_switch_definition;
+    frame_t table_data = { 0 }, switch_data = { 0 };
+
+    table_definition.step = NULL;
+    double table_ns = bench_run(&table_definition, &table_data);
+    double switch_ns = bench_run(&bench_switch_definition, &switch_data);
+
+    printf("switch dispatcher vs table engine, %d events\n", EVENTS);
+    printf("  table : %6.2f ns/event (%u frames, %u errors)\n", table_ns, table_data.frames, table_data.errors);
+    printf("  switch: %6.2f ns/event (%u frames, %u errors)\n", switch_ns, switch_data.frames, switch_data.errors);
+    if ((table_data.frames != switch_data.frames) || (table_data.errors != switch_data.errors)
+            || (table_data.checksum != switch_data.checksum)) {
+        printf("  results differ!\n");
+        return 1;
+    }
+    return 0;
+}
+
+#include "bench_switch_fsm.c"
@@ -0,0 +1,103 @@
+/* -----------------------------------------------------------------------------
+ * Timing wheel with 200k instances, each waiting for an acknowledge with a
+ * timeout tied to its state (the timer is posted in on_entry):
+ * - post: lfsm_post_state_event_after() for every instance
+ * - ack: half of the instances get EV_ACK and leave the state, which
+ *   cancels their timer (time per lfsm_run(), including the cancel)
+ * - expire: lfsm_timers_advance() one tick (1 ms) at a time until all other
+ *   timeouts fired (time per fired timer, including fsm_add_event())
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../src/lovely_fsm.h"
+
+#if !(LFSM_ENABLE_TIMERS)
+#error "build with -DLFSM_ENABLE_TIMERS=1 (see Makefile)"
+#endif
+
+#define INSTANCES  200000
+#define MAX_DELAY  1000
+
+enum { ST_IDLE, ST_WAIT, ST_RETRY };
+enum { EV_SEND, EV_ACK, EV_TIMEOUT };
+
+static uint32_t random_state = 2463534242u;
+static uint32_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static lfsm_return_t wait_entry(lfsm_t fsm) {
+    lfsm_post_state_event_after(fsm, EV_TIMEOUT, 100 + next_random() % (MAX_DELAY - 100));
+    return LFSM_OK;
+}
+
+static lfsm_transitions_t transitions[] = {
+    { ST_IDLE  , EV_SEND    , NULL , ST_WAIT  },
+    { ST_WAIT  , EV_ACK     , NULL , ST_IDLE  },
+    { ST_WAIT  , EV_TIMEOUT , NULL , ST_RETRY },
+};
+
+static lfsm_state_functions_t states[] = {
+    { ST_WAIT , wait_entry , NULL , NULL },
+};
+
+static lfsm_t instances[INSTANCES];
+
+int main(void) {
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+    uint64_t now = lfsm_timers_now();
+
+    for (int i = 0 ; i < INSTANCES ; i++) {
+        instances[i] = lfsm_init(transitions, states, no_callbacks, NULL, ST_IDLE);
+        if (instances[i] == NULL) {
+            fprintf(stderr, "bench_timers: out of instances\n");
+            return 1;
+        }
+    }
+
+    double start = now_seconds();
+    for (int i = 0 ; i < INSTANCES ; i++) {
+        fsm_add_event(instances[i], EV_SEND);
+        lfsm_run(instances[i]);
+    }
+    double post = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0 ; i < INSTANCES ; i += 2) {
+        fsm_add_event(instances[i], EV_ACK);
+        lfsm_run(instances[i]);
+    }
+    double ack = now_seconds() - start;
+
+    uint32_t fired = 0;
+    start = now_seconds();
+    for (int tick = 1 ; tick <= MAX_DELAY ; tick++) {
+        fired += lfsm_timers_advance(now + tick);
+    }
+    double expire = now_seconds() - start;
+
+    int retrying = 0;
+    for (int i = 0 ; i < INSTANCES ; i++) {
+        lfsm_run(instances[i]);
+        retrying += (lfsm_get_state(instances[i]) == ST_RETRY);
+        lfsm_deinit(instances[i]);
+    }
+
+    printf("timing wheel, %d instances\n", INSTANCES);
+    printf("  send + post timeout : %6.1f ns per instance\n", post * 1e9 / INSTANCES);
+    printf("  ack + cancel        : %6.1f ns per instance\n", ack * 1e9 / (INSTANCES / 2));
+    printf("  expire              : %6.1f ns per timer (%u fired, %d retrying)\n",
+           expire * 1e9 / (fired ? fired : 1), fired, retrying);
+    return (fired == INSTANCES / 2) && (retrying == INSTANCES / 2) ? 0 : 1;
+}
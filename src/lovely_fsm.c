@@ -1,67 +1,527 @@
 #include "lovely_fsm.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdatomic.h>
+#if (LFSM_USE_BUILTIN_QUEUE)
+#include "lovely_fsm_queue.h"
+#endif
+
+#if (LFSM_EVENT_PAYLOADS) && !(LFSM_USE_BUILTIN_QUEUE)
+#error "LFSM_EVENT_PAYLOADS needs the built-in queue (LFSM_USE_BUILTIN_QUEUE)"
+#endif
+#if (LFSM_EVENT_PRIORITIES > 1) && !(LFSM_USE_BUILTIN_QUEUE)
+#error "LFSM_EVENT_PRIORITIES needs the built-in queue (LFSM_USE_BUILTIN_QUEUE)"
+#endif
+#if (LFSM_PAYLOAD_ARENA_SIZE & (LFSM_PAYLOAD_ARENA_SIZE - 1))
+#error "LFSM_PAYLOAD_ARENA_SIZE must be a power of two"
+#endif
+#if (LFSM_ADAPTIVE_GUARDS) && ((LFSM_GUARD_REORDER_INTERVAL < 1) || (LFSM_GUARD_REORDER_INTERVAL > 65535))
+#error "LFSM_GUARD_REORDER_INTERVAL must be 1 .. 65535"
+#endif
+#if (LFSM_MAX_STATE_DEPTH < 1) || (LFSM_MAX_STATE_DEPTH > 255)
+#error "LFSM_MAX_STATE_DEPTH must be 1 .. 255"
+#endif
+#define LFSM_PAYLOAD_ARENA_MASK   (LFSM_PAYLOAD_ARENA_SIZE - 1)
+#define LFSM_PAYLOAD_ALIGNMENT    8
+#define LFSM_PAYLOAD_HEADER_SIZE  8 // holds the arena position after the payload
+
+#define LFSM_CACHE_LINE 64
+
+#if (LFSM_ENABLE_STATS)
+#ifndef LFSM_STATS_CYCLES
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LFSM_STATS_CYCLES() __rdtsc()
+#elif defined(__aarch64__)
+#define LFSM_STATS_CYCLES() lfsm_read_virtual_counter()
+#else
+#define LFSM_STATS_CYCLES() lfsm_read_clock_ns()
+#define LFSM_USE_CLOCK_NS
+#endif
+#endif
+
+// Counters of one instance, allocated cache line aligned when it is created.
+// The producer counters are written by the thread(s) adding events and get
+// a cache line of their own; all others are only written by the thread
+// running the instance (relaxed load + store, no locked instructions).
+typedef struct lfsm_callback_counters_t {
+    _Atomic uint32_t calls;
+    _Atomic uint64_t cycles;
+    _Atomic uint32_t histogram[LFSM_STATS_HISTOGRAM_BUCKETS];
+} lfsm_callback_counters_t;
+
+typedef struct lfsm_transition_counters_t {
+    _Atomic uint32_t fired;
+    _Atomic uint32_t guard_evaluations;
+    _Atomic uint32_t guard_rejections;
+} lfsm_transition_counters_t;
+
+typedef struct lfsm_instance_stats_t {
+    _Alignas(LFSM_CACHE_LINE) _Atomic uint32_t events_rejected;
+    _Atomic uint32_t queue_full;
+    _Atomic uint32_t events_coalesced;
+    _Alignas(LFSM_CACHE_LINE) _Atomic uint32_t events_run;
+    _Atomic uint32_t events_without_transition;
+    _Atomic uint32_t events_dropped;
+    uint32_t transition_count;
+    uint32_t state_count;
+    lfsm_callback_counters_t (*states)[LFSM_CALLBACK_KINDS];
+    lfsm_transition_counters_t* transitions;
+} lfsm_instance_stats_t;
+
+#define LFSM_STATS_COUNT(fsm, counter) \
+    do { if ((fsm)->stats != NULL) lfsm_stats_increment(&(fsm)->stats->counter); } while (0)
+#define LFSM_STATS_COUNT_PRODUCER(fsm, counter) \
+    do { if ((fsm)->stats != NULL) atomic_fetch_add_explicit(&(fsm)->stats->counter, 1, memory_order_relaxed); } while (0)
+#define LFSM_STATS_COUNT_TRANSITION(fsm, transition, counter) \
+    do { if ((fsm)->stats != NULL) lfsm_stats_increment(&(fsm)->stats->transitions[(transition) - (fsm)->definition->transition_table].counter); } while (0)
+#define LFSM_RUN_STATE_CALLBACK(fsm, callbacks, function, kind) lfsm_run_timed_callback(fsm, callbacks, (callbacks)->function, kind)
+#else
+#define LFSM_STATS_COUNT(fsm, counter)
+#define LFSM_STATS_COUNT_PRODUCER(fsm, counter)
+#define LFSM_STATS_COUNT_TRANSITION(fsm, transition, counter)
+#define LFSM_RUN_STATE_CALLBACK(fsm, callbacks, function, kind) lfsm_run_callback(fsm, (callbacks)->function)
+#endif
+
+#if (LFSM_ENABLE_TRACE)
+#if (LFSM_TRACE_RING_SIZE & (LFSM_TRACE_RING_SIZE - 1))
+#error "LFSM_TRACE_RING_SIZE must be a power of two"
+#endif
+#define LFSM_TRACE_MASK (LFSM_TRACE_RING_SIZE - 1)
+#ifndef LFSM_TRACE_CLOCK
+#define LFSM_TRACE_CLOCK() lfsm_read_clock_ns()
+#define LFSM_TRACE_TICKS_PER_SECOND 1000000000u
+#define LFSM_USE_CLOCK_NS
+#elif !defined(LFSM_TRACE_TICKS_PER_SECOND)
+#error "LFSM_TRACE_CLOCK needs LFSM_TRACE_TICKS_PER_SECOND"
+#endif
+
+// Ring of one thread, written by that thread only. A record is stored as
+// four words with relaxed atomics (plain moves), so lfsm_trace_dump() can
+// read it while the thread writes the next ones.
+typedef struct lfsm_trace_ring_t {
+    _Alignas(LFSM_CACHE_LINE) _Atomic uint64_t head; // records written
+    _Atomic uint64_t start;  // first record to dump, see lfsm_trace_clear()
+    uint32_t thread;
+    struct lfsm_trace_ring_t* next;
+    _Alignas(LFSM_CACHE_LINE) _Atomic uint64_t records[LFSM_TRACE_RING_SIZE][4];
+} lfsm_trace_ring_t;
+
+#define LFSM_TRACE(fsm, transition) lfsm_trace_transition(fsm, transition)
+#else
+#define LFSM_TRACE(fsm, transition)
+#endif
+
+#if (LFSM_ENABLE_RECORDER)
+#if (LFSM_RECORDER_BUFFER_SIZE < 256)
+#error "LFSM_RECORDER_BUFFER_SIZE must be at least 256"
+#endif
+#ifndef LFSM_RECORDER_CLOCK
+#define LFSM_RECORDER_CLOCK() lfsm_read_clock_ns()
+#define LFSM_RECORDER_TICKS_PER_SECOND 1000000000u
+#define LFSM_USE_CLOCK_NS
+#elif !defined(LFSM_RECORDER_TICKS_PER_SECOND)
+#error "LFSM_RECORDER_CLOCK needs LFSM_RECORDER_TICKS_PER_SECOND"
+#endif
+#define LFSM_RECORDER_MAX_PAYLOAD (LFSM_RECORDER_BUFFER_SIZE / 2)
+#define LFSM_RECORD_MAX_HEADER    32 // time, instance, event and length varints
+
+typedef enum lfsm_recorder_mode_t {
+    LFSM_RECORDER_OFF,
+    LFSM_RECORDER_RECORDING,
+    LFSM_RECORDER_STOPPING,  // nothing is recorded, the last buffer is written
+} lfsm_recorder_mode_t;
+
+// Records are encoded under the lock together with adding the event, so
+// the recorded order is the order in which the events were queued. A full
+// buffer is swapped with the spare one under the lock and written outside
+// of it, see lfsm_recorder_write_buffer().
+typedef struct lfsm_recorder_t {
+    _Atomic uint32_t mode;   // lfsm_recorder_mode_t, changed under the lock
+    atomic_flag lock;
+    lfsm_recording_writer_t write;
+    void* context;
+    uint8_t* buffer;
+    uint8_t* spare;          // NULL while the other buffer is being written
+    uint32_t used;
+    uint64_t time;           // of the last record
+    uint32_t instance;       // of the last record
+    uint32_t mark;           // buffer before the record being added,
+    uint64_t mark_time;      // restored by lfsm_record_end() if the event
+    uint32_t mark_instance;  // was not queued
+} lfsm_recorder_t;
+
+#define LFSM_RECORDER_MODE() atomic_load_explicit(&lfsm_system.recorder.mode, memory_order_relaxed)
+#endif
+#ifdef LFSM_USE_CLOCK_NS
+#include <time.h>
+#endif
+
+#if (LFSM_ENABLE_TIMERS)
+#if (LFSM_TIMER_CHUNK_SIZE & (LFSM_TIMER_CHUNK_SIZE - 1))
+#error "LFSM_TIMER_CHUNK_SIZE must be a power of two"
+#endif
+#define LFSM_TIMER_SLOT_BITS 8
+#define LFSM_TIMER_SLOTS     (1u << LFSM_TIMER_SLOT_BITS)
+#define LFSM_TIMER_LEVELS    4
+#define LFSM_TIMER_NO_SLOT   UINT16_MAX
+
+// Lists link nodes by number (index + 1), 0 ends a list. A node is in one
+// slot list of the wheel (or the free list) and in the list of its instance.
+typedef struct lfsm_timer_node_t {
+    uint64_t deadline;
+    struct lfsm_context_t* fsm;
+    uint32_t next;
+    uint32_t previous;
+    uint32_t instance_next;
+    uint32_t instance_previous;
+    uint32_t generation; // upper half of the handle, changes on every reuse
+    uint16_t slot;       // level * LFSM_TIMER_SLOTS + slot, LFSM_TIMER_NO_SLOT if free
+    lfsm_id_t event;
+    lfsm_id_t state;     // LFSM_INVALID: not tied to a state
+} lfsm_timer_node_t;
+
+// Level n slots are 256^n ticks wide. A timer goes into the level that
+// covers its remaining delay and moves down (cascades) when the lower level
+// wraps around to its slot, so every timer is touched at most 4 times.
+typedef struct lfsm_timer_wheel_t {
+    atomic_flag lock;
+    uint64_t now;
+    uint32_t count;
+    uint32_t level_count[LFSM_TIMER_LEVELS];
+    uint32_t slots[LFSM_TIMER_LEVELS * LFSM_TIMER_SLOTS];
+    uint32_t free_list;
+    uint32_t node_count;
+    lfsm_timer_node_t* chunks[LFSM_TIMER_MAX_CHUNKS];
+} lfsm_timer_wheel_t;
+
+#define LFSM_LEAVE_STATE(fsm, from, to) \
+    do { if (((from) != (to)) && (atomic_load_explicit(&(fsm)->state_timers, memory_order_relaxed) != 0)) lfsm_timers_remove(fsm, from, 0); } while (0)
+#else
+#define LFSM_LEAVE_STATE(fsm, from, to)
+#endif
+
+#if (LFSM_ENABLE_STORE)
+#if !(LFSM_USE_BUILTIN_QUEUE) || (LFSM_EVENT_PAYLOADS)
+#error "LFSM_ENABLE_STORE needs the built-in queue without payloads"
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Store file: the header, then `capacity` records from records_offset on.
+// Everything is fixed width and located by offsets, no pointers, so the
+// file can be mapped at any address by the next process (same build
+// configuration, checked with the record size and the queue settings).
+#define LFSM_STORE_MAGIC "LFSMSTO2"
+
+typedef struct lfsm_store_header_t {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t records_offset;
+    uint32_t id_size;        // sizeof(lfsm_id_t)
+    uint32_t queue_size;     // LFSM_EV_QUEUE_SIZE
+    uint32_t priorities;     // LFSM_EVENT_PRIORITIES
+    uint32_t multi_producer; // LFSM_QUEUE_MULTI_PRODUCER
+} lfsm_store_header_t;
+
+typedef struct lfsm_store_record_t {
+    uint32_t used;
+    uint32_t definition;     // lfsm_definition_hash()
+    lfsm_id_t current_state; // written after every state change
+    lfsm_events_t queue;
+} lfsm_store_record_t;
+
+typedef struct lfsm_store_t {
+    lfsm_store_header_t* header; // NULL: no store open
+    lfsm_store_record_t* records;
+    size_t size;
+} lfsm_store_t;
+
+#define LFSM_EVENTS(fsm) ((fsm)->events)
+#define LFSM_STORE_STATE(fsm) \
+    do { if ((fsm)->record != NULL) (fsm)->record->current_state = (fsm)->current_state; } while (0)
+#else
+#define LFSM_EVENTS(fsm) (&(fsm)->event_queue)
+#define LFSM_STORE_STATE(fsm)
+#endif
+
+#if (LFSM_ADAPTIVE_GUARDS)
+// Per instance and transition (same index as the sorted transition table).
+// For a block of exclusive guards starting at index b with n transitions:
+// [b].length is n and [b].countdown the events until the next reordering,
+// [b + i].order the block offset of the i-th guard to try and [b + i].hits
+// how often the guard of transition b + i accepted (halved on reordering).
+typedef struct lfsm_guard_order_t {
+    uint16_t length;
+    uint16_t countdown;
+    uint16_t order;
+    uint16_t hits;
+} lfsm_guard_order_t;
+#endif
 
 /* -----------------------------------------------------------------------------
  * Managed internally, user needs lfsm_context_t (pointer) only
  * -------------------------------------------------------------------------- */
+// Orthogonal region of an instance, see lfsm_init_regions(). The records of
+// all regions and their event bitmaps are one allocation owned by region 0.
+typedef struct lfsm_region_t {
+    struct lfsm_context_t* context;
+    const uint32_t* events; // bit (event - event_number_min of the owner) set: has transitions
+} lfsm_region_t;
+
 typedef struct lfsm_context_t {
+    // pool bookkeeping, kept when the instance is released
+    _Atomic uint32_t next_free; // pool index + 1 of the next free instance
+    uint32_t pool_index;
+    // everything from here is cleared when the instance is claimed/released
     uint8_t is_active;
-    uint8_t state_number_min;
-    uint8_t state_number_max;
-    uint8_t event_number_min;
-    uint8_t event_number_max;
-    uint8_t transition_count;
-    uint8_t state_func_count;
-    uint8_t event_count; // used multiple times, lets not calculate it all the time!
-    uint8_t current_state;
-    uint8_t previous_step_state;
-    uint8_t event_queue_buffer[LFSM_EV_QUEUE_SIZE];
+    uint8_t owns_definition; // acquired by lfsm_init_func(), release on deinit
+    lfsm_id_t current_state;
+    lfsm_id_t previous_step_state;
+#if (LFSM_USE_BUILTIN_QUEUE)
+    lfsm_events_t event_queue;
+#else
+    lfsm_id_t event_queue_buffer[LFSM_EV_QUEUE_SIZE];
     lfsm_buf_callbacks_t buf_func;
     buffer_handle_type buffer_handle;
+#endif
     void*   user_data;
-    lfsm_transitions_t*      transition_table;
-    lfsm_state_functions_t*  functions_table;
-    lfsm_transitions_t**     transition_lookup_table;
-    lfsm_state_functions_t** function_lookup_table;
+    const lfsm_definition_t* definition;
+    lfsm_id_t event_number_min; // events accepted by the queue, those of the
+    lfsm_id_t event_number_max; // definition or of all regions
+    lfsm_region_t* regions;     // NULL unless created by lfsm_init_regions()
+    uint32_t region_count;
+    struct lfsm_context_t* region_owner; // region 0, owns the queue, NULL for it
+    _Atomic uint32_t scheduling_state;
+    _Atomic uint32_t* coalesce_pending; // queued coalescing events, NULL without
+#if (LFSM_EVENT_PAYLOADS)
+    lfsm_queue_payload_t current_payload; // payload of the event being run
+    uint32_t arena_release;      // consumer: arena position to free after the run
+    uint8_t  arena_release_pending;
+    uint32_t arena_head;         // producer: next arena position to allocate
+    _Atomic uint32_t arena_tail; // consumer: arena positions before this are free
+#if (LFSM_PAYLOAD_ARENA_SIZE > 0)
+    _Alignas(LFSM_PAYLOAD_ALIGNMENT) uint8_t payload_arena[LFSM_PAYLOAD_ARENA_SIZE];
+#endif
+#endif
+#if (LFSM_ENABLE_STATS)
+    struct lfsm_instance_stats_t* stats;
+#endif
+#if (LFSM_ADAPTIVE_GUARDS)
+    lfsm_guard_order_t* guard_order; // NULL without exclusive guard blocks
+#endif
+#if (LFSM_ENABLE_TIMERS)
+    uint32_t timers;               // first node of the instance's timers
+    _Atomic uint32_t state_timers; // pending timers tied to a state
+#endif
+#if (LFSM_ENABLE_STORE)
+    lfsm_events_t* events;         // event_queue or the queue of the record
+    lfsm_store_record_t* record;   // NULL unless created in the store
+#endif
+#if (LFSM_ENABLE_RECORDER)
+    _Atomic uint32_t replaying;    // set by lfsm_replay(), other events are refused
+#endif
 } lfsm_context_t;
 
+// Definitions built at runtime are shared by all instances using the same
+// transition table, so the table is sorted and indexed only once.
+typedef struct lfsm_compiled_definition_t {
+    lfsm_definition_t definition;
+    lfsm_state_functions_t* states;
+    int reference_count;
+    struct lfsm_compiled_definition_t* next;
+} lfsm_compiled_definition_t;
+
+#define LFSM_CONTEXT_RESET_OFFSET offsetof(lfsm_context_t, is_active)
+#define LFSM_POOL_CAPACITY ((uint32_t)LFSM_MAX_COUNT + (uint32_t)LFSM_POOL_CHUNK_SIZE * LFSM_POOL_MAX_CHUNKS)
+#define LFSM_POOL_TAG_STEP ((uint64_t)1 << 32)
+
+// Instance pool: pool index 0 .. LFSM_MAX_COUNT-1 are the static contexts,
+// the following indices live in chunks allocated on demand. Instances are
+// claimed from the free list (a stack of released instances) or, if it is
+// empty, from the never used range starting at unused_index. Both are lock
+// free, so instances can be created and released from any thread in O(1).
 typedef struct lfsm_system_t {
     lfsm_context_t contexts[LFSM_MAX_COUNT];
+#if (LFSM_POOL_CHUNK_SIZE > 0)
+    _Atomic(lfsm_context_t*) chunks[LFSM_POOL_MAX_CHUNKS];
+#endif
+    // low 32 bits: pool index + 1 of the top instance (0: empty),
+    // high 32 bits: changed by every push/pop, so a stale pop fails (ABA)
+    _Atomic uint64_t free_list;
+    _Atomic uint32_t unused_index;
+    atomic_flag definitions_lock;
+    lfsm_compiled_definition_t* compiled_definitions;
+#if (LFSM_ENABLE_TRACE)
+    _Atomic(lfsm_trace_ring_t*) trace_rings; // list of all rings, newest first
+    _Atomic uint32_t trace_thread_count;
+#endif
+#if (LFSM_ENABLE_TIMERS)
+    lfsm_timer_wheel_t timers;
+#endif
+#if (LFSM_ENABLE_STORE)
+    lfsm_store_t store;
+#endif
+#if (LFSM_ENABLE_RECORDER)
+    lfsm_recorder_t recorder;
+#endif
 } lfsm_system_t;
-lfsm_system_t lfsm_system;
+lfsm_system_t lfsm_system = { .definitions_lock = ATOMIC_FLAG_INIT,
+#if (LFSM_ENABLE_TIMERS)
+                              .timers = { .lock = ATOMIC_FLAG_INIT },
+#endif
+#if (LFSM_ENABLE_RECORDER)
+                              .recorder = { .lock = ATOMIC_FLAG_INIT },
+#endif
+};
+#if (LFSM_ENABLE_TRACE)
+_Thread_local lfsm_trace_ring_t* lfsm_trace_ring; // ring of the calling thread
+#endif
 
-typedef struct lfsm_lookup_element_t {
-    lfsm_transitions_t* transition;
-    lfsm_state_functions_t* functions;
-} lfsm_lookup_element_t;
+// Group of instances of one definition, see lovely_fsm.h. The work areas are
+// reused by every batch and grow with the largest batch seen.
+typedef struct lfsm_group_context_t {
+    const lfsm_definition_t* definition;
+    uint32_t instance_count;
+    lfsm_id_t* states;
+    void** user_data;
+    lfsm_context_t callback_context; // lfsm_t passed to callbacks
+    uint32_t* events_seen;   // per instance, events in the current batch
+    uint32_t* bucket_end;    // per transition (+1 for none), see lfsm_group_run_round()
+    uint32_t capacity;       // batch entries the following areas can hold
+    uint32_t* round;         // per batch entry: n-th event of its instance
+    uint32_t* round_start;
+    uint32_t* by_round;      // batch entries ordered by round
+    uint32_t* by_transition; // entries of one round ordered by transition
+    uint32_t* transition_number;
+} lfsm_group_context_t;
 
 // public functions
-lfsm_return_t fsm_add_event(lfsm_t context, uint8_t event);
+lfsm_return_t fsm_add_event(lfsm_t context, lfsm_id_t event);
 
 // private functions
 lfsm_t lfsm_get_unused_context();
+void lfsm_release_context(lfsm_context_t* context);
+lfsm_context_t* lfsm_pool_context(uint32_t pool_index);
+lfsm_context_t* lfsm_pool_pop_free();
+lfsm_context_t* lfsm_pool_claim_unused();
+lfsm_return_t lfsm_pool_add_chunk(uint32_t chunk_number);
+void lfsm_lock_definitions();
+void lfsm_unlock_definitions();
+lfsm_return_t lfsm_group_reserve(lfsm_group_context_t* group, uint32_t event_count);
+uint32_t lfsm_group_order_by_round(lfsm_group_context_t* group, const lfsm_group_event_t* events, uint32_t event_count);
+void lfsm_group_run_round(lfsm_group_context_t* group, const lfsm_group_event_t* events, const uint32_t* entries, uint32_t entry_count, lfsm_batch_result_t* result);
+void lfsm_group_run_transition(lfsm_group_context_t* group, const lfsm_group_event_t* events, const uint32_t* entries, uint32_t entry_count, const lfsm_transitions_t* transition, lfsm_batch_result_t* result);
+void lfsm_group_run_without_transition(lfsm_group_context_t* group, const lfsm_group_event_t* events, const uint32_t* entries, uint32_t entry_count);
+lfsm_context_t* lfsm_group_callback_context(lfsm_group_context_t* group, uint32_t instance);
+lfsm_t lfsm_attach_definition(lfsm_t new_fsm, const lfsm_definition_t* definition, lfsm_buf_callbacks_t buffer_callbacks, void* user_data, lfsm_id_t initial_state);
+lfsm_t lfsm_prepare_context(lfsm_t new_fsm, const lfsm_definition_t* definition, lfsm_buf_callbacks_t buffer_callbacks, void* user_data, lfsm_id_t initial_state);
 lfsm_return_t lfsm_initialize_buffers(lfsm_t fsm);
 lfsm_return_t lfsm_set_context_buf_callbacks(lfsm_t context, lfsm_buf_callbacks_t buffer_callbacks);
 lfsm_return_t lfsm_set_context_buf_callbacks(lfsm_t new_fsm, lfsm_buf_callbacks_t buffer_callbacks);
 
-void lfsm_bubble_sort_list(lfsm_t context);
-void lfsm_find_state_event_min_max_count(lfsm_t context);
-lfsm_return_t lfsm_alloc_lookup_table(lfsm_t context);
-lfsm_return_t lfsm_fill_transition_lookup_table(lfsm_t context);
-lfsm_return_t lfsm_fill_state_function_lookup_table(lfsm_t context);
-lfsm_transitions_t* lfsm_get_transition_from_lookup(lfsm_context_t* fsm, uint8_t event);
-lfsm_transitions_t* lfsm_find_transition_to_execute(lfsm_context_t* fsm, lfsm_transitions_t* transition, uint8_t event);
-lfsm_return_t lfsm_execute_transition(lfsm_context_t* fsm, lfsm_transitions_t* transition);
-lfsm_state_functions_t* lfsm_get_state_function(lfsm_context_t* fsm, uint8_t state);
+lfsm_return_t lfsm_sort_transitions(lfsm_transitions_t* transitions, int list_length);
+int lfsm_transition_precedes(const lfsm_transitions_t* first, const lfsm_transitions_t* second);
+lfsm_return_t lfsm_find_state_event_min_max_count(lfsm_definition_t* definition);
+int lfsm_count_state_event_pairs(lfsm_definition_t* definition);
+lfsm_index_type_t lfsm_choose_index_type(lfsm_definition_t* definition, int pair_count);
+lfsm_return_t lfsm_alloc_lookup_table(lfsm_definition_t* definition, lfsm_transitions_t*** transition_lookup, lfsm_state_functions_t*** function_lookup);
+lfsm_return_t lfsm_alloc_hash_index(lfsm_definition_t* definition, int pair_count, lfsm_index_entry_t** hash_index);
+lfsm_return_t lfsm_fill_transition_lookup_table(lfsm_definition_t* definition, lfsm_transitions_t** transition_lookup);
+lfsm_return_t lfsm_fill_hash_index(lfsm_definition_t* definition, lfsm_index_entry_t* hash_index);
+uint32_t lfsm_hash_index_slot(lfsm_id_t state, lfsm_id_t event, uint8_t hash_shift);
+void lfsm_hash_index_insert(lfsm_definition_t* definition, lfsm_index_entry_t* hash_index, lfsm_id_t state, lfsm_id_t event, const lfsm_transitions_t* transition);
+lfsm_return_t lfsm_fill_state_function_lookup_table(lfsm_definition_t* definition, lfsm_state_functions_t** function_lookup);
+void lfsm_fill_dispatch_table(lfsm_definition_t* definition, lfsm_dispatch_t* dispatch_table);
+int lfsm_has_hierarchy(const lfsm_definition_t* definition);
+lfsm_return_t lfsm_build_state_paths(lfsm_definition_t* definition);
+uint32_t lfsm_transitions_lower_bound(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event);
+const lfsm_transitions_t* lfsm_search_transitions(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event);
+int lfsm_inherit_transitions(lfsm_definition_t* definition, const lfsm_transitions_t** transition_lookup, lfsm_index_entry_t* hash_index);
+uint8_t lfsm_common_ancestor_depth(const lfsm_definition_t* definition, lfsm_id_t first, lfsm_id_t second);
+const lfsm_transitions_t* lfsm_get_transition_from_lookup(lfsm_context_t* fsm, lfsm_id_t event);
+const lfsm_transitions_t* lfsm_scan_transitions(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event);
+const lfsm_transitions_t* const* lfsm_get_lookup_row(lfsm_context_t* fsm);
+const lfsm_transitions_t* lfsm_find_transition_to_execute(lfsm_context_t* fsm, const lfsm_transitions_t* transition, lfsm_id_t event);
+#if (LFSM_ADAPTIVE_GUARDS)
+lfsm_return_t lfsm_guard_order_alloc(lfsm_context_t* fsm);
+const lfsm_transitions_t* lfsm_find_exclusive_transition(lfsm_context_t* fsm, const lfsm_transitions_t* first, lfsm_guard_order_t* block);
+void lfsm_reorder_guards(lfsm_guard_order_t* block);
+#endif
+lfsm_return_t lfsm_execute_transition(lfsm_context_t* fsm, const lfsm_transitions_t* transition);
+lfsm_step_result_t lfsm_run_step(lfsm_context_t* fsm, lfsm_id_t event);
+lfsm_batch_result_t lfsm_run_batch_step(lfsm_context_t* fsm, uint32_t max_events);
+lfsm_step_result_t lfsm_run_event(lfsm_context_t* fsm, lfsm_id_t event);
+uint32_t lfsm_run_regions(lfsm_context_t* fsm, lfsm_id_t event);
+lfsm_batch_result_t lfsm_run_batch_regions(lfsm_context_t* fsm, uint32_t max_events);
+void lfsm_run_dispatch(lfsm_context_t* fsm, const lfsm_dispatch_t* dispatch);
+void lfsm_run_state_path(lfsm_context_t* fsm, lfsm_id_t from, const lfsm_dispatch_t* dispatch);
+void lfsm_enter_state_path(lfsm_context_t* fsm, lfsm_id_t state, uint8_t lca_depth);
+const lfsm_state_functions_t* lfsm_get_state_function(lfsm_context_t* fsm, lfsm_id_t state);
 lfsm_return_t lfsm_run_callback(lfsm_context_t* fsm, lfsm_return_t (*function)());
 lfsm_return_t lfsm_run_all_callbacks(lfsm_context_t* fsm);
 uint8_t lfsm_no_event_queued(lfsm_context_t* fsm);
-uint8_t lfsm_get_next_event(lfsm_context_t* fsm);
+uint32_t lfsm_queued_event_count(lfsm_context_t* fsm);
+lfsm_id_t lfsm_get_next_event(lfsm_context_t* fsm);
+void lfsm_release_payloads(lfsm_context_t* fsm);
+lfsm_return_t lfsm_coalesce_alloc(lfsm_context_t* fsm);
+uint8_t lfsm_event_priority(const lfsm_definition_t* definition, lfsm_id_t event);
+lfsm_return_t lfsm_add_coalescing_event(lfsm_context_t* fsm, lfsm_id_t event);
+lfsm_return_t lfsm_enqueue_event(lfsm_context_t* fsm, lfsm_id_t event);
+uint32_t lfsm_hash_word(uint32_t hash, uint32_t word);
+int lfsm_state_in_range(const lfsm_definition_t* definition, lfsm_id_t state);
+int lfsm_snapshot_definition(const lfsm_definition_t** definitions, uint32_t definition_count, const lfsm_definition_t* definition);
+uint32_t lfsm_snapshot_instance(lfsm_context_t* fsm, lfsm_snapshot_instance_t* record, lfsm_id_t* events);
+#if (LFSM_ENABLE_STORE)
+lfsm_store_record_t* lfsm_store_record(uint32_t slot);
+void lfsm_store_mark_coalescing(lfsm_context_t* fsm);
+#endif
+#if (LFSM_ENABLE_RECORDER)
+void lfsm_record_begin(lfsm_context_t* fsm, lfsm_id_t event, const void* data, uint32_t length);
+void lfsm_record_end(int queued);
+void lfsm_recorder_write_buffer(lfsm_recorder_t* recorder);
+uint8_t* lfsm_put_varint(uint8_t* out, uint64_t value);
+const uint8_t* lfsm_get_varint(const uint8_t* in, const uint8_t* end, uint64_t* value);
+lfsm_return_t lfsm_replay_event(lfsm_context_t* fsm, lfsm_id_t event, const void* data, uint32_t length);
+void lfsm_lock_recorder();
+void lfsm_unlock_recorder();
+#endif
+#if (LFSM_ENABLE_STATS)
+lfsm_return_t lfsm_stats_alloc(lfsm_context_t* fsm);
+void lfsm_stats_increment(_Atomic uint32_t* counter);
+lfsm_return_t lfsm_run_timed_callback(lfsm_context_t* fsm, const lfsm_state_functions_t* callbacks, lfsm_return_t (*function)(), lfsm_callback_kind_t kind);
+uint64_t lfsm_read_virtual_counter();
+#endif
+#if (LFSM_ENABLE_TRACE)
+void lfsm_trace_transition(lfsm_context_t* fsm, const lfsm_transitions_t* transition);
+lfsm_trace_ring_t* lfsm_trace_ring_create();
+uint32_t lfsm_trace_copy_ring(lfsm_trace_ring_t* ring, lfsm_trace_record_t* records, uint64_t* lost);
+#endif
+#if (LFSM_ENABLE_TIMERS)
+lfsm_timer_t lfsm_timer_post(lfsm_context_t* fsm, lfsm_id_t event, uint64_t delay, lfsm_id_t state);
+lfsm_timer_node_t* lfsm_timer_node(uint32_t number);
+uint32_t lfsm_timer_alloc();
+void lfsm_timer_free(uint32_t number);
+void lfsm_timer_insert(lfsm_timer_wheel_t* wheel, uint32_t number);
+void lfsm_timer_unlink(lfsm_timer_wheel_t* wheel, uint32_t number);
+void lfsm_timer_remove(lfsm_timer_wheel_t* wheel, uint32_t number);
+void lfsm_timer_cascade(lfsm_timer_wheel_t* wheel, int level, uint32_t slot);
+uint32_t lfsm_timer_fire_slot(lfsm_timer_wheel_t* wheel, uint32_t slot);
+void lfsm_timers_remove(lfsm_context_t* fsm, lfsm_id_t state, uint8_t all);
+void lfsm_lock_timers();
+void lfsm_unlock_timers();
+#endif
+#ifdef LFSM_USE_CLOCK_NS
+uint64_t lfsm_read_clock_ns();
+#endif
 
 /* ---------------------------------------------------------------------------
  * MAIN FUNCTIONS FOR LIBRARY USERS
- * 
+ *
  * The main functions are
  * - init
  * - add event
@@ -76,69 +536,238 @@ lfsm_t lfsm_init_func(lfsm_transitions_t* transitions, \
                         int state_count,\
                         lfsm_buf_callbacks_t buffer_callbacks, \
                         void* user_data, \
-                        uint8_t initial_state)
+                        lfsm_id_t initial_state)
 {
     lfsm_t new_fsm = lfsm_get_unused_context();
     if (new_fsm) {
-        new_fsm->functions_table = states;
-        new_fsm->state_func_count = state_count;
-        new_fsm->transition_table = transitions;
-        new_fsm->transition_count = trans_count;
-        new_fsm->current_state = initial_state;
-
-        lfsm_set_context_buf_callbacks(new_fsm, buffer_callbacks);
-        if (lfsm_initialize_buffers(new_fsm) == LFSM_OK) {
-            lfsm_bubble_sort_list(new_fsm);
-            lfsm_find_state_event_min_max_count(new_fsm);
-            if (lfsm_alloc_lookup_table(new_fsm) == LFSM_OK) {
-                lfsm_fill_transition_lookup_table(new_fsm);
-                lfsm_fill_state_function_lookup_table(new_fsm);
-                new_fsm->user_data = user_data;
-                lfsm_run_all_callbacks(new_fsm);
+        const lfsm_definition_t* definition = lfsm_definition_compile(transitions, trans_count, states, state_count);
+        if (definition != NULL) {
+            if (lfsm_attach_definition(new_fsm, definition, buffer_callbacks, user_data, initial_state)) {
+                new_fsm->owns_definition = 1;
                 return new_fsm;
             }
+            lfsm_definition_free(definition);
         }
+        lfsm_release_context(new_fsm);
     }
     return NULL;
 }
 
-// Adds an event to the event buffer.
-lfsm_return_t fsm_add_event(lfsm_t context, uint8_t event) {
+// Creates an instance from an already built (or generated, const) definition.
+// Nothing is sorted or allocated, the definition must outlive the instance.
+lfsm_t lfsm_init_definition(const lfsm_definition_t* definition, \
+                        lfsm_buf_callbacks_t buffer_callbacks, \
+                        void* user_data, \
+                        lfsm_id_t initial_state)
+{
+    lfsm_t new_fsm = lfsm_get_unused_context();
+    if (new_fsm) {
+        if (lfsm_attach_definition(new_fsm, definition, buffer_callbacks, user_data, initial_state)) {
+            return new_fsm;
+        }
+        lfsm_release_context(new_fsm);
+    }
+    return NULL;
+}
+
+// Creates one instance running definitions[i] from initial_states[i] in
+// region i. Region 0 is the returned instance, the others are instances of
+// their own that share its queue and are deinitialized with it.
+lfsm_t lfsm_init_regions(const lfsm_definition_t* const* definitions, \
+                        uint32_t region_count, \
+                        lfsm_buf_callbacks_t buffer_callbacks, \
+                        void* user_data, \
+                        const lfsm_id_t* initial_states)
+{
+    if ((definitions == NULL) || (initial_states == NULL) || (region_count == 0)) return NULL;
+    lfsm_id_t event_min = definitions[0]->event_number_min;
+    lfsm_id_t event_max = definitions[0]->event_number_max;
+    for (uint32_t i = 1 ; i < region_count ; i++) {
+        if (definitions[i]->event_number_min < event_min) event_min = definitions[i]->event_number_min;
+        if (definitions[i]->event_number_max > event_max) event_max = definitions[i]->event_number_max;
+    }
+    uint32_t words = LFSM_COALESCE_WORDS(event_max - event_min + 1);
+    lfsm_region_t* regions = calloc(1, region_count * (sizeof(lfsm_region_t) + words * sizeof(uint32_t)));
+    if (regions == NULL) return NULL;
+
+    uint32_t* events = (uint32_t*)(regions + region_count);
+    for (uint32_t i = 0 ; i < region_count ; i++) {
+        const lfsm_definition_t* definition = definitions[i];
+        uint32_t* region_events = &events[i * words];
+        for (uint32_t t = 0 ; t < definition->transition_count ; t++) {
+            uint32_t index = definition->transition_table[t].event - event_min;
+            region_events[index / 32] |= (uint32_t)1 << (index % 32);
+        }
+        regions[i].events = region_events;
+    }
+
+    lfsm_context_t* fsm = NULL;
+    for (uint32_t i = 0 ; i < region_count ; i++) {
+        lfsm_context_t* region = lfsm_get_unused_context();
+        if (region == NULL) break;
+        region->region_owner = fsm;
+        if (lfsm_attach_definition(region, definitions[i], buffer_callbacks, user_data, initial_states[i]) == NULL) {
+            lfsm_release_context(region);
+            break;
+        }
+        regions[i].context = region;
+        if (fsm == NULL) {
+            fsm = region;
+            fsm->event_number_min = event_min;
+            fsm->event_number_max = event_max;
+            fsm->regions = regions;
+        }
+        fsm->region_count = i + 1;
+    }
+    if (fsm == NULL) {
+        free(regions);
+    } else if (fsm->region_count < region_count) {
+        lfsm_deinit(fsm);
+        fsm = NULL;
+    }
+    return fsm;
+}
+
+// Region of an instance created by lfsm_init_regions(), an instance without
+// regions is its own region 0. NULL for other indices.
+lfsm_t lfsm_get_region(lfsm_t context, uint32_t index) {
     lfsm_context_t* fsm = (lfsm_context_t*) context;
+    if (fsm->regions == NULL) {
+        return (index == 0) ? fsm : NULL;
+    }
+    return (index < fsm->region_count) ? fsm->regions[index].context : NULL;
+}
+
+// Adds an event to the event buffer.
+// Events added to a region go to the queue of the instance it belongs to.
+lfsm_return_t fsm_add_event(lfsm_t context, lfsm_id_t event) {
+    lfsm_context_t* fsm = (context->region_owner != NULL) ? context->region_owner : context;
 
     int out_of_bounds = (event < fsm->event_number_min) || (event > fsm->event_number_max);
-    if (out_of_bounds) return LFSM_ERROR;
+    if (out_of_bounds) {
+        LFSM_STATS_COUNT_PRODUCER(fsm, events_rejected);
+        return LFSM_ERROR;
+    }
+#if (LFSM_ENABLE_RECORDER)
+    if (atomic_load_explicit(&fsm->replaying, memory_order_relaxed)) {
+        LFSM_STATS_COUNT_PRODUCER(fsm, events_rejected);
+        return LFSM_ERROR;
+    }
+    int recording = (LFSM_RECORDER_MODE() == LFSM_RECORDER_RECORDING);
+    if (recording) lfsm_record_begin(fsm, event, NULL, 0);
+#endif
+    lfsm_return_t result = lfsm_enqueue_event(fsm, event);
+#if (LFSM_ENABLE_RECORDER)
+    if (recording) lfsm_record_end(result == LFSM_OK);
+#endif
+    return (result == LFSM_NOP) ? LFSM_OK : result;
+}
 
-    uint8_t error = context->buf_func.add(context->buffer_handle, event);
-    if (error) return LFSM_ERROR;
+// Adds an event carrying a reference to data (not copied). The data must stay
+// valid until the event has been run; data taken from lfsm_payload_alloc() is
+// released automatically after lfsm_run() or the batch that ran the event.
+lfsm_return_t fsm_add_event_payload(lfsm_t context, lfsm_id_t event, const void* data, uint32_t length) {
+#if (LFSM_EVENT_PAYLOADS)
+    lfsm_context_t* fsm = (context->region_owner != NULL) ? context->region_owner : context;
+    const lfsm_definition_t* definition = fsm->definition;
+    lfsm_queue_payload_t payload = { data, length, 0, 0 };
 
-    return LFSM_OK;
+    int out_of_bounds = (event < fsm->event_number_min) || (event > fsm->event_number_max);
+    if (out_of_bounds) {
+        LFSM_STATS_COUNT_PRODUCER(fsm, events_rejected);
+        return LFSM_ERROR;
+    }
+
+#if (LFSM_PAYLOAD_ARENA_SIZE > 0)
+    const uint8_t* bytes = data;
+    int in_arena = (bytes >= fsm->payload_arena) && (bytes < fsm->payload_arena + LFSM_PAYLOAD_ARENA_SIZE);
+    if (in_arena) {
+        memcpy(&payload.arena_end, bytes - LFSM_PAYLOAD_HEADER_SIZE, sizeof(uint32_t));
+        payload.in_arena = 1;
+    }
+#endif
+#if (LFSM_ENABLE_RECORDER)
+    if (atomic_load_explicit(&fsm->replaying, memory_order_relaxed)) {
+        LFSM_STATS_COUNT_PRODUCER(fsm, events_rejected);
+        return LFSM_ERROR;
+    }
+    int recording = (LFSM_RECORDER_MODE() == LFSM_RECORDER_RECORDING);
+    if (recording) lfsm_record_begin(fsm, event, data, length);
+#endif
+    lfsm_return_t result = LFSM_OK;
+    if (lfsm_events_add_payload(LFSM_EVENTS(fsm), lfsm_event_priority(definition, event), event, &payload)) {
+        LFSM_STATS_COUNT_PRODUCER(fsm, queue_full);
+        result = LFSM_ERROR;
+    }
+#if (LFSM_ENABLE_RECORDER)
+    if (recording) lfsm_record_end(result == LFSM_OK);
+#endif
+    return result;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+// Allocates payload memory from the instance's arena (a byte ring buffer),
+// NULL if it is full. Only one thread may allocate and add payloads per
+// instance, and payloads must be added in the order they were allocated.
+void* lfsm_payload_alloc(lfsm_t context, uint32_t size) {
+#if (LFSM_EVENT_PAYLOADS) && (LFSM_PAYLOAD_ARENA_SIZE > 0)
+    lfsm_context_t* fsm = (context->region_owner != NULL) ? context->region_owner : context;
+    uint32_t needed = LFSM_PAYLOAD_HEADER_SIZE + ((size + LFSM_PAYLOAD_ALIGNMENT - 1) & ~(uint32_t)(LFSM_PAYLOAD_ALIGNMENT - 1));
+    uint32_t head = fsm->arena_head;
+    uint32_t offset = head & LFSM_PAYLOAD_ARENA_MASK;
+
+    if ((size == 0) || (needed > LFSM_PAYLOAD_ARENA_SIZE)) return NULL;
+    // an allocation never wraps around, the rest of the arena is skipped
+    uint32_t skip = (offset + needed > LFSM_PAYLOAD_ARENA_SIZE) ? LFSM_PAYLOAD_ARENA_SIZE - offset : 0;
+    uint32_t tail = atomic_load_explicit(&fsm->arena_tail, memory_order_acquire);
+    if ((head + skip + needed) - tail > LFSM_PAYLOAD_ARENA_SIZE) return NULL;
+
+    uint8_t* header = &fsm->payload_arena[(head + skip) & LFSM_PAYLOAD_ARENA_MASK];
+    fsm->arena_head = head + skip + needed;
+    memcpy(header, &fsm->arena_head, sizeof(uint32_t));
+    return header + LFSM_PAYLOAD_HEADER_SIZE;
+#else
+    return NULL;
+#endif
+}
+
+// Payload of the event currently being run, for conditions and callbacks.
+// NULL (length 0) outside of lfsm_run()/lfsm_run_batch() or without payload.
+const void* lfsm_event_payload(lfsm_t context, uint32_t* length) {
+#if (LFSM_EVENT_PAYLOADS)
+    if (length != NULL) *length = context->current_payload.length;
+    return context->current_payload.data;
+#else
+    if (length != NULL) *length = 0;
+    return NULL;
+#endif
 }
 
 // Retrieves an event from the event buffer and handles state changes and
 // callback function execution.
 lfsm_return_t lfsm_run(lfsm_t context) {
     lfsm_context_t* fsm = (lfsm_context_t*) context;
+    lfsm_step_result_t result;
 
     if (lfsm_no_event_queued(fsm)) {
         return LFSM_NOP;
     }
 
-    uint8_t next_event = lfsm_get_next_event(fsm);
+    lfsm_id_t next_event = lfsm_get_next_event(fsm);
+    LFSM_STATS_COUNT(fsm, events_run);
 
-    lfsm_transitions_t* transition;
-    transition = lfsm_get_transition_from_lookup(fsm, next_event);
-
-    if (transition != NULL) {
-        transition = lfsm_find_transition_to_execute(fsm, transition, next_event);
-        if (transition == NULL) {
-            return LFSM_NOP;
-        }
-        if (transition != NULL) {
-            lfsm_execute_transition(fsm, transition);
-        }
+    if (fsm->regions != NULL) {
+        lfsm_run_regions(fsm, next_event);
+        result = LFSM_STEP_NONE;
+    } else {
+        result = lfsm_run_event(fsm, next_event);
+    }
+    lfsm_release_payloads(fsm);
+    if (result == LFSM_STEP_REJECTED) {
+        return LFSM_NOP;
     }
-    lfsm_run_all_callbacks(fsm);
 
     if (lfsm_no_event_queued(fsm)) {
         return LFSM_OK;
@@ -147,33 +776,1856 @@ lfsm_return_t lfsm_run(lfsm_t context) {
     }
 }
 
-// deinitialize the state machine and free reserved memory.
-lfsm_return_t lfsm_deinit(lfsm_t context) {
-    lfsm_context_t* fsm = (lfsm_context_t*)context;
-    free(fsm->transition_lookup_table);
-    free(fsm->function_lookup_table);
+// Runs up to max_events queued events in one call. Behaves like calling
+// lfsm_run() repeatedly, but the lookup row and the state functions of the
+// current state are only resolved again when the state changes, and the
+// built-in queue is only checked again once all known events are consumed.
+lfsm_batch_result_t lfsm_run_batch(lfsm_t context, uint32_t max_events) {
+    lfsm_context_t* fsm = (lfsm_context_t*) context;
+    const lfsm_definition_t* definition = fsm->definition;
+    lfsm_id_t event_offset = definition->event_number_min;
+    lfsm_batch_result_t result = { 0, 0 };
+
+    if (fsm->regions != NULL) {
+        return lfsm_run_batch_regions(fsm, max_events);
+    }
+    if (definition->step != NULL) {
+        return lfsm_run_batch_step(fsm, max_events);
+    }
+    const lfsm_transitions_t* const* lookup_row = lfsm_get_lookup_row(fsm);
+    const lfsm_state_functions_t* callbacks = lfsm_get_state_function(fsm, fsm->current_state);
+
+    uint32_t available = 0;
+    while (result.events < max_events) {
+        const lfsm_transitions_t* transition;
+        if (available == 0) {
+            available = lfsm_queued_event_count(fsm);
+            if (available == 0) break;
+        }
+        available--;
+        lfsm_id_t next_event = lfsm_get_next_event(fsm);
+        result.events++;
+        LFSM_STATS_COUNT(fsm, events_run);
+
+        if (lookup_row != NULL) {
+            transition = (next_event != LFSM_INVALID) ? lookup_row[next_event - event_offset] : NULL;
+        } else {
+            transition = lfsm_get_transition_from_lookup(fsm, next_event);
+        }
+
+        if (transition == NULL) {
+            LFSM_STATS_COUNT(fsm, events_without_transition);
+        } else {
+            transition = lfsm_find_transition_to_execute(fsm, transition, next_event);
+            if (transition == NULL) {
+                continue;
+            }
+            result.transitions++;
+            LFSM_TRACE(fsm, transition);
+            if (definition->dispatch_table != NULL) {
+                const lfsm_dispatch_t* dispatch = &definition->dispatch_table[transition - definition->transition_table];
+                lfsm_id_t state = fsm->current_state;
+                lfsm_run_dispatch(fsm, dispatch);
+                if (dispatch->next_state != state) {
+                    lookup_row = lfsm_get_lookup_row(fsm);
+                }
+                callbacks = dispatch->to;
+                continue;
+            }
+            if (transition->next_state != fsm->current_state) {
+                lfsm_execute_transition(fsm, transition);
+                LFSM_LEAVE_STATE(fsm, fsm->previous_step_state, fsm->current_state);
+                if ((callbacks != NULL) && (fsm->previous_step_state != LFSM_INVALID)) {
+                    LFSM_RUN_STATE_CALLBACK(fsm, callbacks, on_exit, LFSM_CALLBACK_EXIT);
+                }
+                fsm->previous_step_state = fsm->current_state;
+                lookup_row = lfsm_get_lookup_row(fsm);
+                callbacks = lfsm_get_state_function(fsm, fsm->current_state);
+                if (callbacks != NULL) {
+                    LFSM_RUN_STATE_CALLBACK(fsm, callbacks, on_entry, LFSM_CALLBACK_ENTRY);
+                }
+            }
+        }
+        if (callbacks != NULL) {
+            LFSM_RUN_STATE_CALLBACK(fsm, callbacks, on_run, LFSM_CALLBACK_RUN);
+        }
+    }
+    lfsm_release_payloads(fsm);
+    return result;
+}
+
+lfsm_batch_result_t lfsm_run_until_empty(lfsm_t context) {
+    return lfsm_run_batch(context, UINT32_MAX);
+}
+
+// deinitialize the state machine and return it to the instance pool.
+// Regions other than region 0 are deinitialized with it.
+lfsm_return_t lfsm_deinit(lfsm_t context) {
+    lfsm_context_t* fsm = (lfsm_context_t*)context;
+    if (!fsm->is_active) return LFSM_ERROR;
+    if (fsm->region_owner != NULL) return LFSM_ERROR;
+    if (fsm->regions != NULL) {
+        for (uint32_t i = 1 ; i < fsm->region_count ; i++) {
+            fsm->regions[i].context->region_owner = NULL;
+            lfsm_deinit(fsm->regions[i].context);
+        }
+        free(fsm->regions);
+    }
+#if (LFSM_ENABLE_TIMERS)
+    lfsm_timers_remove(fsm, LFSM_INVALID, 1);
+#endif
+#if (LFSM_ENABLE_STORE)
+    if (fsm->record != NULL) {
+        fsm->record->used = 0;
+    }
+#endif
+    if (fsm->owns_definition) {
+        lfsm_definition_free(fsm->definition);
+    }
+
+    lfsm_release_context(fsm);
+    return LFSM_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * - STATISTICS
+ * -------------------------------------------------------------------------*/
+
+lfsm_stats_t* lfsm_get_stats(lfsm_t context) {
+#if (LFSM_ENABLE_STATS)
+    lfsm_context_t* fsm = (lfsm_context_t*) context;
+    lfsm_instance_stats_t* counters = fsm->stats;
+    if (counters == NULL) return NULL;
+
+    size_t size = sizeof(lfsm_stats_t) + counters->state_count * sizeof(lfsm_state_stats_t) \
+                + counters->transition_count * sizeof(lfsm_transition_stats_t);
+    lfsm_stats_t* stats = malloc(size);
+    if (stats == NULL) return NULL;
+
+    stats->events_run = atomic_load_explicit(&counters->events_run, memory_order_relaxed);
+    stats->events_without_transition = atomic_load_explicit(&counters->events_without_transition, memory_order_relaxed);
+    stats->events_dropped = atomic_load_explicit(&counters->events_dropped, memory_order_relaxed);
+    stats->events_rejected = atomic_load_explicit(&counters->events_rejected, memory_order_relaxed);
+    stats->queue_full = atomic_load_explicit(&counters->queue_full, memory_order_relaxed);
+    stats->events_coalesced = atomic_load_explicit(&counters->events_coalesced, memory_order_relaxed);
+    stats->state_count = counters->state_count;
+    stats->transition_count = counters->transition_count;
+    stats->states = (lfsm_state_stats_t*)(stats + 1);
+    stats->transitions = (lfsm_transition_stats_t*)(stats->states + counters->state_count);
+
+    for (uint32_t state = 0 ; state < counters->state_count ; state++) {
+        stats->states[state].state = fsm->definition->state_number_min + state;
+        for (int kind = 0 ; kind < LFSM_CALLBACK_KINDS ; kind++) {
+            lfsm_callback_counters_t* from = &counters->states[state][kind];
+            lfsm_callback_stats_t* to = &stats->states[state].callbacks[kind];
+            to->calls = atomic_load_explicit(&from->calls, memory_order_relaxed);
+            to->cycles = atomic_load_explicit(&from->cycles, memory_order_relaxed);
+            for (int bucket = 0 ; bucket < LFSM_STATS_HISTOGRAM_BUCKETS ; bucket++) {
+                to->histogram[bucket] = atomic_load_explicit(&from->histogram[bucket], memory_order_relaxed);
+            }
+        }
+    }
+    for (uint32_t i = 0 ; i < counters->transition_count ; i++) {
+        stats->transitions[i].fired = atomic_load_explicit(&counters->transitions[i].fired, memory_order_relaxed);
+        stats->transitions[i].guard_evaluations = atomic_load_explicit(&counters->transitions[i].guard_evaluations, memory_order_relaxed);
+        stats->transitions[i].guard_rejections = atomic_load_explicit(&counters->transitions[i].guard_rejections, memory_order_relaxed);
+    }
+    return stats;
+#else
+    return NULL;
+#endif
+}
+
+void lfsm_stats_free(lfsm_stats_t* stats) {
+    free(stats);
+}
+
+#if (LFSM_ENABLE_STATS)
+// one block: the header, per state callback counters, per transition counters
+lfsm_return_t lfsm_stats_alloc(lfsm_context_t* fsm) {
+    const lfsm_definition_t* definition = fsm->definition;
+    uint32_t state_count = definition->state_number_max - definition->state_number_min + 1;
+    size_t size = sizeof(lfsm_instance_stats_t) \
+                + state_count * sizeof(lfsm_callback_counters_t[LFSM_CALLBACK_KINDS]) \
+                + definition->transition_count * sizeof(lfsm_transition_counters_t);
+
+    size = (size + LFSM_CACHE_LINE - 1) & ~(size_t)(LFSM_CACHE_LINE - 1);
+    lfsm_instance_stats_t* stats = aligned_alloc(LFSM_CACHE_LINE, size);
+    if (stats == NULL) return LFSM_ERROR;
+    memset(stats, 0, size);
+    stats->state_count = state_count;
+    stats->transition_count = definition->transition_count;
+    stats->states = (lfsm_callback_counters_t(*)[LFSM_CALLBACK_KINDS])(stats + 1);
+    stats->transitions = (lfsm_transition_counters_t*)(stats->states + state_count);
+    fsm->stats = stats;
+    return LFSM_OK;
+}
+
+// single writer, so no read-modify-write instruction is needed
+void lfsm_stats_increment(_Atomic uint32_t* counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+lfsm_return_t lfsm_run_timed_callback(lfsm_context_t* fsm, const lfsm_state_functions_t* callbacks, lfsm_return_t (*function)(), lfsm_callback_kind_t kind) {
+    if ((function == NULL) || (fsm->stats == NULL)) {
+        return lfsm_run_callback(fsm, function);
+    }
+    uint64_t start = LFSM_STATS_CYCLES();
+    lfsm_return_t result = function(fsm);
+    uint64_t cycles = LFSM_STATS_CYCLES() - start;
+
+    lfsm_callback_counters_t* counters = &fsm->stats->states[callbacks->state - fsm->definition->state_number_min][kind];
+    int bucket = (cycles == 0) ? 0 : 64 - __builtin_clzll(cycles);
+    if (bucket >= LFSM_STATS_HISTOGRAM_BUCKETS) bucket = LFSM_STATS_HISTOGRAM_BUCKETS - 1;
+    lfsm_stats_increment(&counters->calls);
+    lfsm_stats_increment(&counters->histogram[bucket]);
+    atomic_store_explicit(&counters->cycles, atomic_load_explicit(&counters->cycles, memory_order_relaxed) + cycles, memory_order_relaxed);
+    return result;
+}
+
+#if defined(__aarch64__)
+uint64_t lfsm_read_virtual_counter() {
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+}
+#endif
+
+#endif
+
+/* ---------------------------------------------------------------------------
+ * - TRACE
+ * -------------------------------------------------------------------------*/
+
+lfsm_return_t lfsm_trace_dump(lfsm_trace_writer_t write, void* context) {
+#if (LFSM_ENABLE_TRACE)
+    lfsm_trace_ring_t* first_ring = atomic_load_explicit(&lfsm_system.trace_rings, memory_order_acquire);
+    lfsm_trace_header_t header = { .record_size = sizeof(lfsm_trace_record_t),
+                                   .ticks_per_second = LFSM_TRACE_TICKS_PER_SECOND };
+
+    lfsm_trace_record_t* records = malloc(LFSM_TRACE_RING_SIZE * sizeof(lfsm_trace_record_t));
+    if (records == NULL) return LFSM_ERROR;
+    memcpy(header.magic, LFSM_TRACE_MAGIC, sizeof(header.magic));
+    // rings are only added in front of the list, so the list from first_ring on stays the same
+    for (lfsm_trace_ring_t* ring = first_ring ; ring != NULL ; ring = ring->next) {
+        header.thread_count++;
+    }
+    write(&header, sizeof(header), context);
+    for (lfsm_trace_ring_t* ring = first_ring ; ring != NULL ; ring = ring->next) {
+        lfsm_trace_thread_t thread = { .thread = ring->thread };
+        thread.record_count = lfsm_trace_copy_ring(ring, records, &thread.lost);
+        write(&thread, sizeof(thread), context);
+        if (thread.record_count > 0) {
+            write(records, thread.record_count * sizeof(lfsm_trace_record_t), context);
+        }
+    }
+    free(records);
+    return LFSM_OK;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+void lfsm_trace_clear(void) {
+#if (LFSM_ENABLE_TRACE)
+    lfsm_trace_ring_t* ring = atomic_load_explicit(&lfsm_system.trace_rings, memory_order_acquire);
+    for ( ; ring != NULL ; ring = ring->next) {
+        atomic_store_explicit(&ring->start, atomic_load_explicit(&ring->head, memory_order_acquire), memory_order_relaxed);
+    }
+#endif
+}
+
+#if (LFSM_ENABLE_TRACE)
+// Called before the transition is executed. The guard position is counted
+// back to the first transition of the (state,event) block, so the lookup
+// does not need to pass it along.
+void lfsm_trace_transition(lfsm_context_t* fsm, const lfsm_transitions_t* transition) {
+    lfsm_trace_ring_t* ring = lfsm_trace_ring;
+    if (ring == NULL) {
+        ring = lfsm_trace_ring_create();
+        if (ring == NULL) return;
+    }
+    const lfsm_transitions_t* table = fsm->definition->transition_table;
+    const lfsm_transitions_t* block = transition;
+    while ((block > table) && (block[-1].current_state == transition->current_state) \
+            && (block[-1].event == transition->event)) {
+        block--;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    _Atomic uint64_t* record = ring->records[head & LFSM_TRACE_MASK];
+    // a dump that reads the new words also sees a head of at least this record
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&record[0], LFSM_TRACE_CLOCK(), memory_order_relaxed);
+    atomic_store_explicit(&record[1], fsm->pool_index | (uint64_t)transition->event << 32, memory_order_relaxed);
+    atomic_store_explicit(&record[2], fsm->current_state | (uint64_t)transition->next_state << 32, memory_order_relaxed);
+    atomic_store_explicit(&record[3], (uint64_t)(transition - block) | (head << 32), memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+lfsm_trace_ring_t* lfsm_trace_ring_create() {
+    lfsm_trace_ring_t* ring = aligned_alloc(LFSM_CACHE_LINE, sizeof(lfsm_trace_ring_t));
+    if (ring == NULL) return NULL;
+    memset(ring, 0, sizeof(lfsm_trace_ring_t));
+    ring->thread = atomic_fetch_add_explicit(&lfsm_system.trace_thread_count, 1, memory_order_relaxed);
+
+    lfsm_trace_ring_t* next = atomic_load_explicit(&lfsm_system.trace_rings, memory_order_relaxed);
+    do {
+        ring->next = next;
+    } while (!atomic_compare_exchange_weak_explicit(&lfsm_system.trace_rings, &next, ring,
+                                                    memory_order_release, memory_order_relaxed));
+    lfsm_trace_ring = ring;
+    return ring;
+}
+
+// Copies the records since lfsm_trace_clear(), oldest first. Slots the
+// owning thread overwrote while they were copied are left out: a slot read
+// after the head reached n may hold record n (being written) instead of
+// record n - LFSM_TRACE_RING_SIZE, so only the records after that are kept.
+uint32_t lfsm_trace_copy_ring(lfsm_trace_ring_t* ring, lfsm_trace_record_t* records, uint64_t* lost) {
+    uint64_t start = atomic_load_explicit(&ring->start, memory_order_relaxed);
+    uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t begin = (end - start > LFSM_TRACE_RING_SIZE) ? end - LFSM_TRACE_RING_SIZE : start;
+    uint64_t words[4];
+
+    for (uint64_t i = begin ; i < end ; i++) {
+        _Atomic uint64_t* record = ring->records[i & LFSM_TRACE_MASK];
+        for (int word = 0 ; word < 4 ; word++) {
+            words[word] = atomic_load_explicit(&record[word], memory_order_relaxed);
+        }
+        records[i - begin] = (lfsm_trace_record_t){
+            .timestamp = words[0],
+            .instance = (uint32_t)words[1], .event = (uint32_t)(words[1] >> 32),
+            .from_state = (uint32_t)words[2], .to_state = (uint32_t)(words[2] >> 32),
+            .guard = (uint32_t)words[3], .sequence = (uint32_t)(words[3] >> 32),
+        };
+    }
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t valid = (head >= LFSM_TRACE_RING_SIZE) ? head - LFSM_TRACE_RING_SIZE + 1 : 0;
+    uint32_t skip = 0;
+    if (valid > begin) {
+        skip = (valid >= end) ? (uint32_t)(end - begin) : (uint32_t)(valid - begin);
+        memmove(records, records + skip, (end - begin - skip) * sizeof(lfsm_trace_record_t));
+    }
+    *lost = begin + skip - start;
+    return (uint32_t)(end - begin - skip);
+}
+#endif
+
+#ifdef LFSM_USE_CLOCK_NS
+uint64_t lfsm_read_clock_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + time.tv_nsec;
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * - TIMERS
+ * -------------------------------------------------------------------------*/
+
+lfsm_timer_t lfsm_post_event_after(lfsm_t context, lfsm_id_t event, uint64_t delay) {
+#if (LFSM_ENABLE_TIMERS)
+    return lfsm_timer_post(context, event, delay, LFSM_INVALID);
+#else
+    return LFSM_NO_TIMER;
+#endif
+}
+
+lfsm_timer_t lfsm_post_state_event_after(lfsm_t context, lfsm_id_t event, uint64_t delay) {
+#if (LFSM_ENABLE_TIMERS)
+    return lfsm_timer_post(context, event, delay, context->current_state);
+#else
+    return LFSM_NO_TIMER;
+#endif
+}
+
+lfsm_return_t lfsm_timer_cancel(lfsm_timer_t timer) {
+#if (LFSM_ENABLE_TIMERS)
+    lfsm_timer_wheel_t* wheel = &lfsm_system.timers;
+    uint32_t number = (uint32_t)timer;
+    lfsm_return_t result = LFSM_NOP;
+
+    lfsm_lock_timers();
+    if ((number != 0) && (number <= wheel->node_count)) {
+        lfsm_timer_node_t* node = lfsm_timer_node(number);
+        if ((node->generation == (uint32_t)(timer >> 32)) && (node->slot != LFSM_TIMER_NO_SLOT)) {
+            lfsm_timer_remove(wheel, number);
+            result = LFSM_OK;
+        }
+    }
+    lfsm_unlock_timers();
+    return result;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+uint32_t lfsm_timers_advance(uint64_t now) {
+#if (LFSM_ENABLE_TIMERS)
+    lfsm_timer_wheel_t* wheel = &lfsm_system.timers;
+    uint32_t posted = 0;
+
+    lfsm_lock_timers();
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            wheel->now = now;
+            break;
+        }
+        // nothing to fire below the lowest used level: skip to the end of
+        // the current slot of that level, where it cascades
+        int level = 0;
+        while (wheel->level_count[level] == 0) level++;
+        if (level > 0) {
+            uint64_t slot_end = wheel->now | (((uint64_t)1 << (LFSM_TIMER_SLOT_BITS * level)) - 1);
+            wheel->now = (slot_end < now) ? slot_end : now;
+            if (wheel->now == now) break;
+        }
+        uint64_t tick = ++wheel->now;
+        for (level = 1 ; level < LFSM_TIMER_LEVELS ; level++) {
+            if (tick & (((uint64_t)1 << (LFSM_TIMER_SLOT_BITS * level)) - 1)) break;
+            lfsm_timer_cascade(wheel, level, (tick >> (LFSM_TIMER_SLOT_BITS * level)) & (LFSM_TIMER_SLOTS - 1));
+        }
+        posted += lfsm_timer_fire_slot(wheel, tick & (LFSM_TIMER_SLOTS - 1));
+    }
+    lfsm_unlock_timers();
+    return posted;
+#else
+    return 0;
+#endif
+}
+
+uint64_t lfsm_timers_now(void) {
+#if (LFSM_ENABLE_TIMERS)
+    lfsm_lock_timers();
+    uint64_t now = lfsm_system.timers.now;
+    lfsm_unlock_timers();
+    return now;
+#else
+    return 0;
+#endif
+}
+
+#if (LFSM_ENABLE_TIMERS)
+lfsm_timer_t lfsm_timer_post(lfsm_context_t* fsm, lfsm_id_t event, uint64_t delay, lfsm_id_t state) {
+    lfsm_timer_wheel_t* wheel = &lfsm_system.timers;
+    const lfsm_definition_t* definition = fsm->definition;
+
+    if ((event < definition->event_number_min) || (event > definition->event_number_max)) {
+        return LFSM_NO_TIMER;
+    }
+    lfsm_lock_timers();
+    uint32_t number = lfsm_timer_alloc();
+    if (number == 0) {
+        lfsm_unlock_timers();
+        return LFSM_NO_TIMER;
+    }
+    lfsm_timer_node_t* node = lfsm_timer_node(number);
+    node->deadline = wheel->now + ((delay > 0) ? delay : 1);
+    node->fsm = fsm;
+    node->event = event;
+    node->state = state;
+    lfsm_timer_insert(wheel, number);
+
+    node->instance_previous = 0;
+    node->instance_next = fsm->timers;
+    if (fsm->timers != 0) lfsm_timer_node(fsm->timers)->instance_previous = number;
+    fsm->timers = number;
+    if (state != LFSM_INVALID) {
+        atomic_store_explicit(&fsm->state_timers, atomic_load_explicit(&fsm->state_timers, memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+    wheel->count++;
+    lfsm_timer_t handle = ((uint64_t)node->generation << 32) | number;
+    lfsm_unlock_timers();
+    return handle;
+}
+
+lfsm_timer_node_t* lfsm_timer_node(uint32_t number) {
+    uint32_t index = number - 1;
+    return &lfsm_system.timers.chunks[index / LFSM_TIMER_CHUNK_SIZE][index & (LFSM_TIMER_CHUNK_SIZE - 1)];
+}
+
+// node number from the free list or a new one, 0 if none is left
+uint32_t lfsm_timer_alloc() {
+    lfsm_timer_wheel_t* wheel = &lfsm_system.timers;
+
+    if (wheel->free_list != 0) {
+        uint32_t number = wheel->free_list;
+        wheel->free_list = lfsm_timer_node(number)->next;
+        return number;
+    }
+    if (wheel->node_count == (uint32_t)LFSM_TIMER_CHUNK_SIZE * LFSM_TIMER_MAX_CHUNKS) return 0;
+    if ((wheel->node_count & (LFSM_TIMER_CHUNK_SIZE - 1)) == 0) {
+        lfsm_timer_node_t* chunk = calloc(LFSM_TIMER_CHUNK_SIZE, sizeof(lfsm_timer_node_t));
+        if (chunk == NULL) return 0;
+        wheel->chunks[wheel->node_count / LFSM_TIMER_CHUNK_SIZE] = chunk;
+    }
+    return ++wheel->node_count;
+}
+
+void lfsm_timer_free(uint32_t number) {
+    lfsm_timer_node_t* node = lfsm_timer_node(number);
+    node->generation++;
+    node->slot = LFSM_TIMER_NO_SLOT;
+    node->next = lfsm_system.timers.free_list;
+    lfsm_system.timers.free_list = number;
+}
+
+// Into the level covering deadline - now. Deadlines beyond the top level are
+// placed as far as it reaches and inserted again when they cascade.
+void lfsm_timer_insert(lfsm_timer_wheel_t* wheel, uint32_t number) {
+    lfsm_timer_node_t* node = lfsm_timer_node(number);
+    uint64_t delta = node->deadline - wheel->now;
+    uint64_t deadline = node->deadline;
+    int level = 0;
+
+    while ((level < LFSM_TIMER_LEVELS - 1) && (delta >> (LFSM_TIMER_SLOT_BITS * (level + 1)))) level++;
+    if (delta >> (LFSM_TIMER_SLOT_BITS * LFSM_TIMER_LEVELS)) {
+        deadline = wheel->now + ((uint64_t)1 << (LFSM_TIMER_SLOT_BITS * LFSM_TIMER_LEVELS)) - 1;
+    }
+    node->slot = level * LFSM_TIMER_SLOTS + ((deadline >> (LFSM_TIMER_SLOT_BITS * level)) & (LFSM_TIMER_SLOTS - 1));
+    node->previous = 0;
+    node->next = wheel->slots[node->slot];
+    if (node->next != 0) lfsm_timer_node(node->next)->previous = number;
+    wheel->slots[node->slot] = number;
+    wheel->level_count[level]++;
+}
+
+// takes the node out of its slot and its instance's list
+void lfsm_timer_unlink(lfsm_timer_wheel_t* wheel, uint32_t number) {
+    lfsm_timer_node_t* node = lfsm_timer_node(number);
+    lfsm_context_t* fsm = node->fsm;
+
+    if (node->previous != 0) {
+        lfsm_timer_node(node->previous)->next = node->next;
+    } else {
+        wheel->slots[node->slot] = node->next;
+    }
+    if (node->next != 0) lfsm_timer_node(node->next)->previous = node->previous;
+    wheel->level_count[node->slot / LFSM_TIMER_SLOTS]--;
+
+    if (node->instance_previous != 0) {
+        lfsm_timer_node(node->instance_previous)->instance_next = node->instance_next;
+    } else {
+        fsm->timers = node->instance_next;
+    }
+    if (node->instance_next != 0) lfsm_timer_node(node->instance_next)->instance_previous = node->instance_previous;
+    if (node->state != LFSM_INVALID) {
+        atomic_store_explicit(&fsm->state_timers, atomic_load_explicit(&fsm->state_timers, memory_order_relaxed) - 1, memory_order_relaxed);
+    }
+    wheel->count--;
+}
+
+void lfsm_timer_remove(lfsm_timer_wheel_t* wheel, uint32_t number) {
+    lfsm_timer_unlink(wheel, number);
+    lfsm_timer_free(number);
+}
+
+void lfsm_timer_cascade(lfsm_timer_wheel_t* wheel, int level, uint32_t slot) {
+    uint32_t number = wheel->slots[level * LFSM_TIMER_SLOTS + slot];
+
+    wheel->slots[level * LFSM_TIMER_SLOTS + slot] = 0;
+    while (number != 0) {
+        uint32_t next = lfsm_timer_node(number)->next;
+        wheel->level_count[level]--;
+        lfsm_timer_insert(wheel, number);
+        number = next;
+    }
+}
+
+// all timers in a level 0 slot are due at the current tick
+uint32_t lfsm_timer_fire_slot(lfsm_timer_wheel_t* wheel, uint32_t slot) {
+    uint32_t posted = 0;
+
+    while (wheel->slots[slot] != 0) {
+        uint32_t number = wheel->slots[slot];
+        lfsm_timer_node_t* node = lfsm_timer_node(number);
+        lfsm_context_t* fsm = node->fsm;
+        lfsm_id_t event = node->event;
+
+        lfsm_timer_remove(wheel, number);
+        if (fsm_add_event(fsm, event) == LFSM_OK) posted++;
+    }
+    return posted;
+}
+
+// Timers of the instance tied to the state, or all of them.
+void lfsm_timers_remove(lfsm_context_t* fsm, lfsm_id_t state, uint8_t all) {
+    lfsm_timer_wheel_t* wheel = &lfsm_system.timers;
+
+    lfsm_lock_timers();
+    uint32_t number = fsm->timers;
+    while (number != 0) {
+        lfsm_timer_node_t* node = lfsm_timer_node(number);
+        uint32_t next = node->instance_next;
+        if (all || ((node->state != LFSM_INVALID) && (node->state == state))) {
+            lfsm_timer_remove(wheel, number);
+        }
+        number = next;
+    }
+    lfsm_unlock_timers();
+}
+
+void lfsm_lock_timers() {
+    while (atomic_flag_test_and_set_explicit(&lfsm_system.timers.lock, memory_order_acquire)) {
+    }
+}
+
+void lfsm_unlock_timers() {
+    atomic_flag_clear_explicit(&lfsm_system.timers.lock, memory_order_release);
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * - GROUPS OF INSTANCES
+ * -------------------------------------------------------------------------*/
+
+// Creates instance_count instances of a definition, all in initial_state.
+// user_data may be NULL or an array with one pointer per instance, it is
+// used in place and must outlive the group.
+lfsm_group_t lfsm_group_create(const lfsm_definition_t* definition, \
+                        uint32_t instance_count, \
+                        void** user_data, \
+                        lfsm_id_t initial_state)
+{
+    if ((definition == NULL) || (instance_count == 0)) return NULL;
+
+    lfsm_group_context_t* group = calloc(1, sizeof(lfsm_group_context_t));
+    if (group == NULL) return NULL;
+    group->definition = definition;
+    group->instance_count = instance_count;
+    group->user_data = user_data;
+    group->states = malloc(instance_count * sizeof(lfsm_id_t));
+    group->events_seen = calloc(instance_count, sizeof(uint32_t));
+    group->bucket_end = malloc((definition->transition_count + 1) * sizeof(uint32_t));
+    if ((group->states == NULL) || (group->events_seen == NULL) || (group->bucket_end == NULL)) {
+        lfsm_group_destroy(group);
+        return NULL;
+    }
+    for (uint32_t instance = 0 ; instance < instance_count ; instance++) {
+        group->states[instance] = initial_state;
+    }
+
+    group->callback_context.is_active = 1;
+    group->callback_context.definition = definition;
+#if (LFSM_USE_BUILTIN_QUEUE)
+    lfsm_events_init(&group->callback_context.event_queue);
+#endif
+#if (LFSM_ENABLE_STORE)
+    group->callback_context.events = &group->callback_context.event_queue;
+#endif
+    const lfsm_state_functions_t* callbacks = lfsm_get_state_function(&group->callback_context, initial_state);
+    if ((callbacks != NULL) || (definition->state_paths != NULL)) {
+        for (uint32_t instance = 0 ; instance < instance_count ; instance++) {
+            lfsm_context_t* fsm = lfsm_group_callback_context(group, instance);
+            fsm->previous_step_state = LFSM_INVALID; // entered like a single instance
+            lfsm_run_all_callbacks(fsm);
+        }
+    }
+    return group;
+}
+
+void lfsm_group_destroy(lfsm_group_t group) {
+    free(group->states);
+    free(group->events_seen);
+    free(group->bucket_end);
+    free(group->round);
+    free(group->round_start);
+    free(group->by_round);
+    free(group->by_transition);
+    free(group->transition_number);
+    free(group);
+}
+
+// Processes a batch of events. Behaves like adding every event to its
+// instance and calling lfsm_run() for it, in batch order. Events for
+// instances outside the group are ignored and not counted.
+lfsm_batch_result_t lfsm_group_run(lfsm_group_t group, const lfsm_group_event_t* events, uint32_t event_count) {
+    lfsm_batch_result_t result = { 0, 0 };
+
+    if (lfsm_group_reserve(group, event_count) != LFSM_OK) return result;
+
+    uint32_t round_count = lfsm_group_order_by_round(group, events, event_count);
+    for (uint32_t round = 0 ; round < round_count ; round++) {
+        uint32_t first = group->round_start[round];
+        uint32_t entry_count = group->round_start[round + 1] - first;
+        lfsm_group_run_round(group, events, group->by_round + first, entry_count, &result);
+    }
+    return result;
+}
+
+lfsm_id_t lfsm_group_get_state(lfsm_group_t group, uint32_t instance) {
+    if (instance >= group->instance_count) return LFSM_INVALID;
+    return group->states[instance];
+}
+
+/* ---------------------------------------------------------------------------
+ * - SNAPSHOTS
+ * -------------------------------------------------------------------------*/
+
+// Two passes over the pool: the first collects the definitions and checks
+// that every instance can be saved, the second writes the instances.
+lfsm_return_t lfsm_snapshot(lfsm_snapshot_writer_t write, void* context) {
+#if (LFSM_USE_BUILTIN_QUEUE)
+    uint32_t pool_size = atomic_load_explicit(&lfsm_system.unused_index, memory_order_acquire);
+    lfsm_snapshot_header_t header = { .version = LFSM_SNAPSHOT_VERSION, .id_size = sizeof(lfsm_id_t) };
+    lfsm_id_t events[LFSM_EV_QUEUE_SIZE * LFSM_EVENT_PRIORITIES];
+    lfsm_snapshot_instance_t record;
+    lfsm_return_t result = LFSM_OK;
+
+    // at most one definition per instance
+    const lfsm_definition_t** definitions = malloc((pool_size + 1) * sizeof(lfsm_definition_t*));
+    uint32_t* hashes = malloc((pool_size + 1) * sizeof(uint32_t));
+    if ((definitions == NULL) || (hashes == NULL)) {
+        result = LFSM_ERROR;
+    }
+    for (uint32_t i = 0 ; (i < pool_size) && (result == LFSM_OK) ; i++) {
+        lfsm_context_t* fsm = lfsm_pool_context(i);
+        if (!fsm->is_active) continue;
+        if ((fsm->regions != NULL) || (fsm->region_owner != NULL) \
+            || (lfsm_snapshot_instance(fsm, &record, NULL) == UINT32_MAX)) {
+            result = LFSM_ERROR;
+            break;
+        }
+        if (lfsm_snapshot_definition(definitions, header.definition_count, fsm->definition) < 0) {
+            definitions[header.definition_count] = fsm->definition;
+            hashes[header.definition_count] = lfsm_definition_hash(fsm->definition);
+            header.definition_count++;
+        }
+        header.instance_count++;
+    }
+    if (result == LFSM_OK) {
+        memcpy(header.magic, LFSM_SNAPSHOT_MAGIC, sizeof(header.magic));
+        write(&header, sizeof(header), context);
+        write(hashes, header.definition_count * sizeof(uint32_t), context);
+        for (uint32_t i = 0 ; i < pool_size ; i++) {
+            lfsm_context_t* fsm = lfsm_pool_context(i);
+            if (!fsm->is_active) continue;
+            lfsm_snapshot_instance(fsm, &record, events);
+            record.definition = lfsm_snapshot_definition(definitions, header.definition_count, fsm->definition);
+            write(&record, sizeof(record), context);
+            if (record.event_count > 0) {
+                write(events, record.event_count * sizeof(lfsm_id_t), context);
+            }
+        }
+    }
+    free(definitions);
+    free(hashes);
+    return result;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+int lfsm_state_in_range(const lfsm_definition_t* definition, lfsm_id_t state) {
+    return (state >= definition->state_number_min) && (state <= definition->state_number_max);
+}
+
+// index of the definition, -1 if it is not in the list
+int lfsm_snapshot_definition(const lfsm_definition_t** definitions, uint32_t definition_count, const lfsm_definition_t* definition) {
+    for (uint32_t i = 0 ; i < definition_count ; i++) {
+        if (definitions[i] == definition) return i;
+    }
+    return -1;
+}
+
+// Fills the record of an instance and copies its queued events in run order
+// (highest class first) if events is not NULL. UINT32_MAX if an event has a
+// payload, the payload would point into this process.
+uint32_t lfsm_snapshot_instance(lfsm_context_t* fsm, lfsm_snapshot_instance_t* record, lfsm_id_t* events) {
+#if (LFSM_USE_BUILTIN_QUEUE)
+    lfsm_snapshot_instance_t empty = { 0 };
+    *record = empty;
+    record->current_state = fsm->current_state;
+    record->previous_state = fsm->previous_step_state;
+    for (int priority = LFSM_EVENT_PRIORITIES - 1 ; priority >= 0 ; priority--) {
+        lfsm_queue_t* queue = lfsm_events_class(LFSM_EVENTS(fsm), priority);
+        uint32_t length = lfsm_queue_length(queue);
+        for (uint32_t i = 0 ; i < length ; i++) {
+            lfsm_queue_payload_t payload = { NULL, 0, 0, 0 };
+            lfsm_id_t event = lfsm_queue_peek(queue, i, &payload);
+            if (payload.data != NULL) return UINT32_MAX;
+            if (events != NULL) events[record->event_count] = event;
+            record->event_count++;
+        }
+    }
+    return record->event_count;
+#else
+    return UINT32_MAX;
+#endif
+}
+
+// Creates the instances of the snapshot in its order. States and events are
+// checked against the definition. The events are queued like by
+// fsm_add_event(), so coalescing bits and priority classes are set up like
+// for the original instance, but they are not recorded again.
+lfsm_return_t lfsm_restore(const void* snapshot, uint32_t size, \
+                        const lfsm_definition_t* const* definitions, \
+                        uint32_t definition_count, \
+                        lfsm_t* instances, \
+                        uint32_t* instance_count)
+{
+#if (LFSM_USE_BUILTIN_QUEUE)
+    const uint8_t* data = snapshot;
+    lfsm_snapshot_header_t header;
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+    uint32_t restored = 0;
+    lfsm_return_t result = LFSM_OK;
+
+    if (size < sizeof(header)) return LFSM_ERROR;
+    memcpy(&header, data, sizeof(header));
+    int usable = (memcmp(header.magic, LFSM_SNAPSHOT_MAGIC, sizeof(header.magic)) == 0) \
+              && (header.version == LFSM_SNAPSHOT_VERSION) && (header.id_size == sizeof(lfsm_id_t)) \
+              && (header.instance_count <= *instance_count) \
+              && ((size - sizeof(header)) / sizeof(uint32_t) >= header.definition_count);
+    if (!usable) return LFSM_ERROR;
+    uint32_t position = sizeof(header) + header.definition_count * sizeof(uint32_t);
+
+    const lfsm_definition_t** matching = malloc((header.definition_count + 1) * sizeof(lfsm_definition_t*));
+    if (matching == NULL) return LFSM_ERROR;
+    for (uint32_t i = 0 ; i < header.definition_count ; i++) {
+        uint32_t hash;
+        memcpy(&hash, data + sizeof(header) + i * sizeof(uint32_t), sizeof(hash));
+        matching[i] = NULL;
+        for (uint32_t d = 0 ; d < definition_count ; d++) {
+            if (lfsm_definition_hash(definitions[d]) == hash) {
+                matching[i] = definitions[d];
+                break;
+            }
+        }
+        if (matching[i] == NULL) result = LFSM_ERROR;
+    }
+
+    for ( ; (restored < header.instance_count) && (result == LFSM_OK) ; restored++) {
+        lfsm_snapshot_instance_t record;
+        result = LFSM_ERROR;
+        if (size - position < sizeof(record)) break;
+        memcpy(&record, data + position, sizeof(record));
+        position += sizeof(record);
+        int valid = (record.definition < header.definition_count) \
+                 && (record.event_count <= (size - position) / sizeof(lfsm_id_t)) \
+                 && lfsm_state_in_range(matching[record.definition], record.current_state) \
+                 && ((record.previous_state == LFSM_INVALID) \
+                     || lfsm_state_in_range(matching[record.definition], record.previous_state));
+        if (!valid) break;
+
+        lfsm_context_t* fsm = lfsm_get_unused_context();
+        if (fsm == NULL) break;
+        if (lfsm_prepare_context(fsm, matching[record.definition], no_callbacks, NULL, record.current_state) == NULL) {
+            lfsm_release_context(fsm);
+            break;
+        }
+        fsm->previous_step_state = record.previous_state;
+        instances[restored] = fsm;
+        result = LFSM_OK;
+        for (uint32_t i = 0 ; (i < record.event_count) && (result == LFSM_OK) ; i++) {
+            lfsm_id_t event;
+            memcpy(&event, data + position + i * sizeof(lfsm_id_t), sizeof(event));
+            int in_range = (event >= fsm->event_number_min) && (event <= fsm->event_number_max);
+            result = (in_range && (lfsm_enqueue_event(fsm, event) != LFSM_ERROR)) ? LFSM_OK : LFSM_ERROR;
+        }
+        position += record.event_count * sizeof(lfsm_id_t);
+    }
+    free(matching);
+
+    if (result != LFSM_OK) {
+        for (uint32_t i = 0 ; i < restored ; i++) {
+            lfsm_deinit(instances[i]);
+        }
+        return LFSM_ERROR;
+    }
+    *instance_count = restored;
+    return LFSM_OK;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * - INSTANCE STORE
+ * -------------------------------------------------------------------------*/
+
+// Maps the store file, creating it with room for capacity instances. An
+// existing file must have the same capacity, record layout and queue settings
+// (id size, queue size, priority classes, producers). The magic is
+// written last, so a file whose creation was interrupted is not used.
+lfsm_return_t lfsm_store_open(const char* path, uint32_t capacity) {
+#if (LFSM_ENABLE_STORE)
+    lfsm_store_t* store = &lfsm_system.store;
+    uint32_t records_offset = (sizeof(lfsm_store_header_t) + LFSM_CACHE_LINE - 1) & ~(uint32_t)(LFSM_CACHE_LINE - 1);
+    size_t size = records_offset + (size_t)capacity * sizeof(lfsm_store_record_t);
+    struct stat file_status;
+
+    if ((store->header != NULL) || (capacity == 0)) return LFSM_ERROR;
+    int file = open(path, O_RDWR | O_CREAT, 0644);
+    if (file < 0) return LFSM_ERROR;
+    if (fstat(file, &file_status) != 0) {
+        close(file);
+        return LFSM_ERROR;
+    }
+    int created = (file_status.st_size == 0);
+    int usable = created ? (ftruncate(file, size) == 0) : ((size_t)file_status.st_size == size);
+    void* memory = usable ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+    close(file);
+    if (memory == MAP_FAILED) return LFSM_ERROR;
+
+    lfsm_store_header_t* header = memory;
+    if (created) {
+        header->record_size = sizeof(lfsm_store_record_t);
+        header->capacity = capacity;
+        header->records_offset = records_offset;
+        header->id_size = sizeof(lfsm_id_t);
+        header->queue_size = LFSM_EV_QUEUE_SIZE;
+        header->priorities = LFSM_EVENT_PRIORITIES;
+        header->multi_producer = LFSM_QUEUE_MULTI_PRODUCER;
+        memcpy(header->magic, LFSM_STORE_MAGIC, sizeof(header->magic));
+    }
+    int valid = (memcmp(header->magic, LFSM_STORE_MAGIC, sizeof(header->magic)) == 0) \
+             && (header->record_size == sizeof(lfsm_store_record_t)) \
+             && (header->capacity == capacity) && (header->records_offset == records_offset) \
+             && (header->id_size == sizeof(lfsm_id_t)) && (header->queue_size == LFSM_EV_QUEUE_SIZE) \
+             && (header->priorities == LFSM_EVENT_PRIORITIES) \
+             && (header->multi_producer == LFSM_QUEUE_MULTI_PRODUCER);
+    if (!valid) {
+        munmap(memory, size);
+        return LFSM_ERROR;
+    }
+    store->records = (lfsm_store_record_t*)((uint8_t*)memory + records_offset);
+    store->size = size;
+    store->header = header;
+    return LFSM_OK;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+// Releases the instances in the store without clearing their records, like
+// a process exit, and writes the file back.
+void lfsm_store_close(void) {
+#if (LFSM_ENABLE_STORE)
+    lfsm_store_t* store = &lfsm_system.store;
+    uint32_t pool_size = atomic_load_explicit(&lfsm_system.unused_index, memory_order_acquire);
+
+    if (store->header == NULL) return;
+    for (uint32_t i = 0 ; i < pool_size ; i++) {
+        lfsm_context_t* fsm = lfsm_pool_context(i);
+        if (fsm->is_active && (fsm->record != NULL)) {
+            fsm->record = NULL;
+            lfsm_deinit(fsm);
+        }
+    }
+    msync(store->header, store->size, MS_SYNC);
+    munmap(store->header, store->size);
+    store->header = NULL;
+    store->records = NULL;
+#endif
+}
+
+// Creates an instance in a slot of the store, replacing what the slot held.
+// Only one instance may use a slot at a time.
+lfsm_t lfsm_init_stored(const lfsm_definition_t* definition, uint32_t slot, void* user_data, lfsm_id_t initial_state) {
+#if (LFSM_ENABLE_STORE)
+    lfsm_store_record_t* record = lfsm_store_record(slot);
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+
+    if ((record == NULL) || (definition == NULL)) return NULL;
+    lfsm_context_t* fsm = lfsm_get_unused_context();
+    if (fsm == NULL) return NULL;
+    if (lfsm_prepare_context(fsm, definition, no_callbacks, user_data, initial_state) == NULL) {
+        lfsm_release_context(fsm);
+        return NULL;
+    }
+    record->used = 0;
+    lfsm_events_init(&record->queue);
+    record->definition = lfsm_definition_hash(definition);
+    record->current_state = initial_state;
+    record->used = 1;
+    fsm->record = record;
+    fsm->events = &record->queue;
+    lfsm_run_all_callbacks(fsm);
+    return fsm;
+#else
+    return NULL;
+#endif
+}
+
+// Continues the instance of a slot with its state and queued events, no
+// callbacks run. NULL if the slot is free, was used for another definition or
+// holds a state the definition does not have.
+lfsm_t lfsm_store_attach(const lfsm_definition_t* definition, uint32_t slot, void* user_data) {
+#if (LFSM_ENABLE_STORE)
+    lfsm_store_record_t* record = lfsm_store_record(slot);
+    lfsm_buf_callbacks_t no_callbacks = { 0 };
+
+    int matching = (record != NULL) && (definition != NULL) && record->used \
+                && (record->definition == lfsm_definition_hash(definition)) \
+                && lfsm_state_in_range(definition, record->current_state);
+    if (!matching) return NULL;
+    lfsm_context_t* fsm = lfsm_get_unused_context();
+    if (fsm == NULL) return NULL;
+    if (lfsm_prepare_context(fsm, definition, no_callbacks, user_data, record->current_state) == NULL) {
+        lfsm_release_context(fsm);
+        return NULL;
+    }
+    fsm->previous_step_state = record->current_state;
+    lfsm_events_recover(&record->queue, LFSM_INVALID);
+    fsm->record = record;
+    fsm->events = &record->queue;
+    lfsm_store_mark_coalescing(fsm);
+    return fsm;
+#else
+    return NULL;
+#endif
+}
+
+#if (LFSM_ENABLE_STORE)
+lfsm_store_record_t* lfsm_store_record(uint32_t slot) {
+    lfsm_store_t* store = &lfsm_system.store;
+    if ((store->header == NULL) || (slot >= store->header->capacity)) return NULL;
+    return &store->records[slot];
+}
+
+// The pending bits of coalescing events are not stored, they are set again
+// for the events in the queue.
+void lfsm_store_mark_coalescing(lfsm_context_t* fsm) {
+    const lfsm_definition_t* definition = fsm->definition;
+    if (fsm->coalesce_pending == NULL) return;
+
+    for (int priority = 0 ; priority < LFSM_EVENT_PRIORITIES ; priority++) {
+        lfsm_queue_t* queue = lfsm_events_class(LFSM_EVENTS(fsm), priority);
+        uint32_t length = lfsm_queue_length(queue);
+        for (uint32_t i = 0 ; i < length ; i++) {
+            lfsm_id_t event = lfsm_queue_peek(queue, i, NULL);
+            int in_range = (event >= definition->event_number_min) && (event <= definition->event_number_max);
+            if (!in_range) continue;
+            uint32_t index = event - definition->event_number_min;
+            uint32_t bit = (uint32_t)1 << (index % 32);
+            if (definition->coalesce_events[index / 32] & bit) {
+                atomic_fetch_or_explicit(&fsm->coalesce_pending[index / 32], bit, memory_order_relaxed);
+            }
+        }
+    }
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * - EVENT RECORDER
+ * -------------------------------------------------------------------------*/
+
+lfsm_return_t lfsm_recorder_start(lfsm_recording_writer_t write, void* context) {
+#if (LFSM_ENABLE_RECORDER)
+    lfsm_recorder_t* recorder = &lfsm_system.recorder;
+    lfsm_recording_header_t header = { .ticks_per_second = LFSM_RECORDER_TICKS_PER_SECOND,
+                                       .version = LFSM_RECORDING_VERSION,
+                                       .id_size = sizeof(lfsm_id_t),
+                                       .max_payload = LFSM_RECORDER_MAX_PAYLOAD };
+    lfsm_return_t result = LFSM_ERROR;
+
+    lfsm_lock_recorder();
+    int idle = (atomic_load_explicit(&recorder->mode, memory_order_relaxed) == LFSM_RECORDER_OFF);
+    if (idle) {
+        recorder->buffer = malloc(LFSM_RECORDER_BUFFER_SIZE);
+        recorder->spare = malloc(LFSM_RECORDER_BUFFER_SIZE);
+        if ((recorder->buffer == NULL) || (recorder->spare == NULL)) {
+            free(recorder->buffer);
+            free(recorder->spare);
+            recorder->buffer = recorder->spare = NULL;
+            idle = 0;
+        }
+    }
+    if (idle) {
+        // the header goes out with the first records
+        memcpy(header.magic, LFSM_RECORDING_MAGIC, sizeof(header.magic));
+        header.start_time = LFSM_RECORDER_CLOCK();
+        memcpy(recorder->buffer, &header, sizeof(header));
+        recorder->write = write;
+        recorder->context = context;
+        recorder->used = sizeof(header);
+        recorder->time = header.start_time;
+        recorder->instance = 0;
+        atomic_store_explicit(&recorder->mode, LFSM_RECORDER_RECORDING, memory_order_relaxed);
+        result = LFSM_OK;
+    }
+    lfsm_unlock_recorder();
+    return result;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+// Passes the buffered records to the writer, e.g. periodically so that a
+// crash loses little of the recording.
+lfsm_return_t lfsm_recorder_flush(void) {
+#if (LFSM_ENABLE_RECORDER)
+    lfsm_return_t result = LFSM_ERROR;
+    lfsm_lock_recorder();
+    if (atomic_load_explicit(&lfsm_system.recorder.mode, memory_order_relaxed) == LFSM_RECORDER_RECORDING) {
+        lfsm_recorder_write_buffer(&lfsm_system.recorder);
+        result = LFSM_OK;
+    }
+    lfsm_unlock_recorder();
+    return result;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+lfsm_return_t lfsm_recorder_stop(void) {
+#if (LFSM_ENABLE_RECORDER)
+    lfsm_recorder_t* recorder = &lfsm_system.recorder;
+
+    lfsm_lock_recorder();
+    if (atomic_load_explicit(&recorder->mode, memory_order_relaxed) != LFSM_RECORDER_RECORDING) {
+        lfsm_unlock_recorder();
+        return LFSM_ERROR;
+    }
+    // events queued from now on are not recorded, so the buffer taken below
+    // is the last one; a buffer still being written is waited for first
+    atomic_store_explicit(&recorder->mode, LFSM_RECORDER_STOPPING, memory_order_relaxed);
+    while (recorder->spare == NULL) {
+        lfsm_unlock_recorder();
+        lfsm_lock_recorder();
+    }
+    uint8_t* last = recorder->buffer;
+    uint32_t size = recorder->used;
+    lfsm_unlock_recorder();
+    if (size > 0) recorder->write(last, size, recorder->context);
+
+    lfsm_lock_recorder();
+    free(recorder->buffer);
+    free(recorder->spare);
+    recorder->buffer = recorder->spare = NULL;
+    atomic_store_explicit(&recorder->mode, LFSM_RECORDER_OFF, memory_order_relaxed);
+    lfsm_unlock_recorder();
+    return LFSM_OK;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+uint32_t lfsm_get_instance_number(lfsm_t context) {
+    return context->pool_index;
+}
+
+// Decodes the records one by one and runs each event right away, so the
+// queues never fill up and events of different instances keep their
+// recorded order. The given instances refuse other events meanwhile.
+lfsm_return_t lfsm_replay(const void* recording, uint32_t size, \
+                        const lfsm_t* instances, \
+                        uint32_t instance_count, \
+                        lfsm_replay_result_t* result)
+{
+#if (LFSM_ENABLE_RECORDER)
+    const uint8_t* in = recording;
+    const uint8_t* end = in + size;
+    lfsm_recording_header_t header;
+    lfsm_replay_result_t replayed = { 0 };
+    lfsm_return_t status = LFSM_OK;
+
+    if (size < sizeof(header)) return LFSM_ERROR;
+    memcpy(&header, in, sizeof(header));
+    int usable = (memcmp(header.magic, LFSM_RECORDING_MAGIC, sizeof(header.magic)) == 0) \
+              && (header.version == LFSM_RECORDING_VERSION) && (header.id_size == sizeof(lfsm_id_t));
+    if (!usable) return LFSM_ERROR;
+    in += sizeof(header);
+    for (uint32_t i = 0 ; i < instance_count ; i++) {
+        if (instances[i] != NULL) atomic_store_explicit(&instances[i]->replaying, 1, memory_order_relaxed);
+    }
+
+    uint64_t time = header.start_time;
+    uint64_t first_time = 0;
+    uint32_t instance = 0;
+    while (in < end) {
+        uint64_t delta, instance_delta, event_word, length = 0;
+        const uint8_t* payload = NULL;
+        in = lfsm_get_varint(in, end, &delta);
+        if (in != NULL) in = lfsm_get_varint(in, end, &instance_delta);
+        if (in != NULL) in = lfsm_get_varint(in, end, &event_word);
+        if ((in != NULL) && (event_word & 1)) {
+            in = lfsm_get_varint(in, end, &length);
+            if ((in != NULL) && (length > (uint64_t)(end - in))) in = NULL;
+            if (in != NULL) {
+                payload = in;
+                in += length;
+            }
+        }
+        if (in == NULL) {
+            status = LFSM_ERROR;
+            break;
+        }
+
+        time += delta;
+        instance += (uint32_t)((instance_delta >> 1) ^ (0 - (instance_delta & 1))); // zigzag
+        if (replayed.events + replayed.skipped == 0) first_time = time;
+        replayed.duration = time - first_time;
+        if (instance >= replayed.instance_count) replayed.instance_count = instance + 1;
+
+        lfsm_context_t* fsm = (instance < instance_count) ? instances[instance] : NULL;
+        lfsm_id_t event = (lfsm_id_t)(event_word >> 1);
+        if ((fsm == NULL) || (lfsm_replay_event(fsm, event, payload, (uint32_t)length) != LFSM_OK)) {
+            replayed.skipped++;
+            continue;
+        }
+        replayed.events++;
+        replayed.transitions += lfsm_run_until_empty(fsm).transitions;
+    }
+
+    for (uint32_t i = 0 ; i < instance_count ; i++) {
+        if (instances[i] != NULL) atomic_store_explicit(&instances[i]->replaying, 0, memory_order_relaxed);
+    }
+    if (result != NULL) *result = replayed;
+    return status;
+#else
+    return LFSM_ERROR;
+#endif
+}
+
+#if (LFSM_ENABLE_RECORDER)
+// Takes the recorder lock for adding one event and encodes the record (an
+// event is only recorded while the lock is held, see lfsm_record_end()).
+void lfsm_record_begin(lfsm_context_t* fsm, lfsm_id_t event, const void* data, uint32_t length) {
+    lfsm_recorder_t* recorder = &lfsm_system.recorder;
+
+    if (length > LFSM_RECORDER_MAX_PAYLOAD) length = LFSM_RECORDER_MAX_PAYLOAD;
+    lfsm_lock_recorder();
+    // writing a full buffer releases the lock, others may record or stop
+    for (;;) {
+        if (atomic_load_explicit(&recorder->mode, memory_order_relaxed) != LFSM_RECORDER_RECORDING) return;
+        if (recorder->used + LFSM_RECORD_MAX_HEADER + ((data != NULL) ? length : 0) <= LFSM_RECORDER_BUFFER_SIZE) break;
+        lfsm_recorder_write_buffer(recorder);
+    }
+    recorder->mark = recorder->used;
+    recorder->mark_time = recorder->time;
+    recorder->mark_instance = recorder->instance;
+
+    uint64_t time = LFSM_RECORDER_CLOCK();
+    if (time < recorder->time) time = recorder->time; // deltas are unsigned
+    int64_t instance_delta = (int64_t)fsm->pool_index - (int64_t)recorder->instance;
+    uint8_t* out = recorder->buffer + recorder->used;
+    out = lfsm_put_varint(out, time - recorder->time);
+    out = lfsm_put_varint(out, ((uint64_t)instance_delta << 1) ^ (uint64_t)(instance_delta >> 63)); // zigzag
+    out = lfsm_put_varint(out, ((uint64_t)event << 1) | (data != NULL));
+    if (data != NULL) {
+        out = lfsm_put_varint(out, length);
+        memcpy(out, data, length);
+        out += length;
+    }
+    recorder->used = out - recorder->buffer;
+    recorder->time = time;
+    recorder->instance = fsm->pool_index;
+}
+
+// Drops the record of an event that was not queued and releases the lock.
+void lfsm_record_end(int queued) {
+    lfsm_recorder_t* recorder = &lfsm_system.recorder;
+    int recorded = (atomic_load_explicit(&recorder->mode, memory_order_relaxed) == LFSM_RECORDER_RECORDING);
+    if (!queued && recorded) {
+        recorder->used = recorder->mark;
+        recorder->time = recorder->mark_time;
+        recorder->instance = recorder->mark_instance;
+    }
+    lfsm_unlock_recorder();
+}
+
+// Called with the lock held, returns with it held. The filled buffer is
+// swapped with the spare one and passed to the writer without the lock, so
+// producers only wait for the writer if the spare buffer fills up as well.
+// One buffer is written at a time, in recorded order.
+void lfsm_recorder_write_buffer(lfsm_recorder_t* recorder) {
+    while ((atomic_load_explicit(&recorder->mode, memory_order_relaxed) == LFSM_RECORDER_RECORDING) \
+            && (recorder->spare == NULL)) {
+        lfsm_unlock_recorder();
+        lfsm_lock_recorder();
+    }
+    if ((atomic_load_explicit(&recorder->mode, memory_order_relaxed) != LFSM_RECORDER_RECORDING) || (recorder->used == 0)) {
+        return;
+    }
+    uint8_t* full = recorder->buffer;
+    uint32_t size = recorder->used;
+    lfsm_recording_writer_t write = recorder->write;
+    void* context = recorder->context;
+    recorder->buffer = recorder->spare;
+    recorder->spare = NULL;
+    recorder->used = 0;
+    recorder->mark = 0;
+    lfsm_unlock_recorder();
+    write(full, size, context);
+    lfsm_lock_recorder();
+    recorder->spare = full;
+}
+
+// unsigned LEB128: 7 bits per byte, lowest first, high bit set if more follow
+uint8_t* lfsm_put_varint(uint8_t* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// NULL if the varint is truncated or too long
+const uint8_t* lfsm_get_varint(const uint8_t* in, const uint8_t* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0 ; (in < end) && (shift < 64) ; shift += 7) {
+        uint8_t byte = *in++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return in;
+    }
+    return NULL;
+}
+
+// Adds a recorded event without recording it again. LFSM_ERROR if it is out
+// of range of the instance; the queue cannot be full, it is run empty after
+// every event.
+lfsm_return_t lfsm_replay_event(lfsm_context_t* fsm, lfsm_id_t event, const void* data, uint32_t length) {
+    if ((event < fsm->event_number_min) || (event > fsm->event_number_max)) return LFSM_ERROR;
+#if (LFSM_EVENT_PAYLOADS)
+    if (data != NULL) {
+        lfsm_queue_payload_t payload = { data, length, 0, 0 };
+        return lfsm_events_add_payload(LFSM_EVENTS(fsm), lfsm_event_priority(fsm->definition, event), event, &payload) ? LFSM_ERROR : LFSM_OK;
+    }
+#endif
+    return (lfsm_enqueue_event(fsm, event) == LFSM_ERROR) ? LFSM_ERROR : LFSM_OK;
+}
+
+void lfsm_lock_recorder() {
+    while (atomic_flag_test_and_set_explicit(&lfsm_system.recorder.lock, memory_order_acquire)) {
+    }
+}
+
+void lfsm_unlock_recorder() {
+    atomic_flag_clear_explicit(&lfsm_system.recorder.lock, memory_order_release);
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * - MACHINE DEFINITION
+ * -------------------------------------------------------------------------*/
+
+// Sorts the transition table (in place!) and builds the lookup tables.
+// Use lfsm_definition_release() to free the lookup tables again.
+// LFSM_INDEX_AUTO picks the (state,event) index based on the density.
+lfsm_return_t lfsm_definition_build(lfsm_definition_t* definition, \
+                        lfsm_transitions_t* transitions, \
+                        int trans_count, \
+                        lfsm_state_functions_t* states, \
+                        int state_count, \
+                        lfsm_index_type_t index_type)
+{
+    lfsm_transitions_t** transition_lookup;
+    lfsm_state_functions_t** function_lookup;
+    lfsm_index_entry_t* hash_index;
+    int pair_count;
+
+    memset((unsigned char*)definition, 0, sizeof(lfsm_definition_t));
+    if ((transitions == NULL) || (trans_count <= 0)) return LFSM_ERROR;
+
+    if (lfsm_sort_transitions(transitions, trans_count) != LFSM_OK) return LFSM_ERROR;
+    definition->transition_table = transitions;
+    definition->transition_count = trans_count;
+    definition->functions_table = states;
+    definition->state_func_count = state_count;
+    if (lfsm_find_state_event_min_max_count(definition) != LFSM_OK) return LFSM_ERROR;
+    if (lfsm_has_hierarchy(definition) && (lfsm_build_state_paths(definition) != LFSM_OK)) return LFSM_ERROR;
+
+    pair_count = lfsm_count_state_event_pairs(definition);
+    if (definition->state_paths != NULL) {
+        pair_count += lfsm_inherit_transitions(definition, NULL, NULL);
+    }
+    if (index_type == LFSM_INDEX_AUTO) {
+        index_type = lfsm_choose_index_type(definition, pair_count);
+    }
+    definition->index_type = index_type;
+
+    if (index_type == LFSM_INDEX_LINEAR) {
+        if (lfsm_alloc_lookup_table(definition, NULL, &function_lookup) != LFSM_OK) {
+            lfsm_definition_release(definition);
+            return LFSM_ERROR;
+        }
+    } else if (index_type == LFSM_INDEX_HASH) {
+        if (lfsm_alloc_hash_index(definition, pair_count, &hash_index) != LFSM_OK) {
+            lfsm_definition_release(definition);
+            return LFSM_ERROR;
+        }
+        if (lfsm_alloc_lookup_table(definition, NULL, &function_lookup) != LFSM_OK) {
+            free(hash_index);
+            lfsm_definition_release(definition);
+            return LFSM_ERROR;
+        }
+        lfsm_fill_hash_index(definition, hash_index);
+        if (definition->state_paths != NULL) {
+            lfsm_inherit_transitions(definition, NULL, hash_index);
+        }
+        definition->hash_index = hash_index;
+    } else {
+        if (lfsm_alloc_lookup_table(definition, &transition_lookup, &function_lookup) != LFSM_OK) {
+            lfsm_definition_release(definition);
+            return LFSM_ERROR;
+        }
+        lfsm_fill_transition_lookup_table(definition, transition_lookup);
+        if (definition->state_paths != NULL) {
+            lfsm_inherit_transitions(definition, (const lfsm_transitions_t**)transition_lookup, NULL);
+        }
+        definition->transition_lookup_table = (const lfsm_transitions_t* const*)transition_lookup;
+    }
+    lfsm_fill_state_function_lookup_table(definition, function_lookup);
+    definition->function_lookup_table = (const lfsm_state_functions_t* const*)function_lookup;
+
+    lfsm_dispatch_t* dispatch_table = malloc(definition->transition_count * sizeof(lfsm_dispatch_t));
+    if (dispatch_table == NULL) {
+        lfsm_definition_release(definition);
+        return LFSM_ERROR;
+    }
+    lfsm_fill_dispatch_table(definition, dispatch_table);
+    definition->dispatch_table = dispatch_table;
+    return LFSM_OK;
+}
+
+// Frees the lookup tables of a definition created by lfsm_definition_build().
+// Never call this for generated (const) definitions.
+void lfsm_definition_release(lfsm_definition_t* definition) {
+    free((void*)definition->transition_lookup_table);
+    free((void*)definition->function_lookup_table);
+    free((void*)definition->hash_index);
+    free((void*)definition->dispatch_table);
+    free((void*)definition->state_paths);
+    definition->transition_lookup_table = NULL;
+    definition->function_lookup_table = NULL;
+    definition->hash_index = NULL;
+    definition->dispatch_table = NULL;
+    definition->state_paths = NULL;
+}
+
+// Returns the shared definition for a transition table, building it on first
+// use. Every call must be matched by lfsm_definition_free().
+const lfsm_definition_t* lfsm_definition_compile(lfsm_transitions_t* transitions, \
+                        int trans_count, \
+                        lfsm_state_functions_t* states, \
+                        int state_count)
+{
+    lfsm_lock_definitions();
+    lfsm_compiled_definition_t* compiled = lfsm_system.compiled_definitions;
+    while (compiled != NULL) {
+        int same_tables = (compiled->definition.transition_table == transitions) \
+                          && (compiled->definition.transition_count == trans_count) \
+                          && (compiled->states == states);
+        if (same_tables) {
+            compiled->reference_count++;
+            lfsm_unlock_definitions();
+            return &compiled->definition;
+        }
+        compiled = compiled->next;
+    }
+
+    compiled = malloc(sizeof(lfsm_compiled_definition_t));
+    if (compiled != NULL) {
+        if (lfsm_definition_build(&compiled->definition, transitions, trans_count, states, state_count, LFSM_INDEX_AUTO) == LFSM_OK) {
+            compiled->states = states;
+            compiled->reference_count = 1;
+            compiled->next = lfsm_system.compiled_definitions;
+            lfsm_system.compiled_definitions = compiled;
+        } else {
+            free(compiled);
+            compiled = NULL;
+        }
+    }
+    lfsm_unlock_definitions();
+    return (compiled != NULL) ? &compiled->definition : NULL;
+}
+
+// Drops one reference to a definition returned by lfsm_definition_compile().
+void lfsm_definition_free(const lfsm_definition_t* definition) {
+    lfsm_lock_definitions();
+    lfsm_compiled_definition_t** link = &lfsm_system.compiled_definitions;
+    while (*link != NULL) {
+        lfsm_compiled_definition_t* compiled = *link;
+        if (&compiled->definition == definition) {
+            if (--compiled->reference_count == 0) {
+                *link = compiled->next;
+                lfsm_definition_release(&compiled->definition);
+                free(compiled);
+            }
+            break;
+        }
+        link = &compiled->next;
+    }
+    lfsm_unlock_definitions();
+}
+
+// FNV-1a over what the behaviour of a definition depends on, without any
+// addresses: the ranges, the transitions and per state its parent and which
+// callbacks exist. Equal for a definition built at runtime and generated.
+uint32_t lfsm_definition_hash(const lfsm_definition_t* definition) {
+    uint32_t hash = 2166136261u;
+
+    hash = lfsm_hash_word(hash, definition->state_number_min);
+    hash = lfsm_hash_word(hash, definition->state_number_max);
+    hash = lfsm_hash_word(hash, definition->event_number_min);
+    hash = lfsm_hash_word(hash, definition->event_number_max);
+    hash = lfsm_hash_word(hash, definition->transition_count);
+    for (uint32_t i = 0 ; i < definition->transition_count ; i++) {
+        const lfsm_transitions_t* transition = &definition->transition_table[i];
+        hash = lfsm_hash_word(hash, transition->current_state);
+        hash = lfsm_hash_word(hash, transition->event);
+        hash = lfsm_hash_word(hash, transition->next_state);
+        hash = lfsm_hash_word(hash, (transition->condition != NULL) | (uint32_t)transition->flags << 1);
+    }
+    for (uint32_t state = definition->state_number_min ; state <= definition->state_number_max ; state++) {
+        const lfsm_state_functions_t* functions = definition->function_lookup_table[state - definition->state_number_min];
+        uint32_t callbacks = 0;
+        if (functions != NULL) {
+            callbacks = 0x08 | (functions->on_entry != NULL) | (functions->on_run != NULL) << 1 \
+                      | (functions->on_exit != NULL) << 2;
+            hash = lfsm_hash_word(hash, functions->parent);
+        }
+        hash = lfsm_hash_word(hash, callbacks);
+    }
+    return hash;
+}
+
+uint32_t lfsm_hash_word(uint32_t hash, uint32_t word) {
+    for (int byte = 0 ; byte < 4 ; byte++) {
+        hash = (hash ^ ((word >> (8 * byte)) & 0xFF)) * 16777619u;
+    }
+    return hash;
+}
+
+// The registry is only used when instances are created or deinitialized,
+// a spinlock is sufficient.
+void lfsm_lock_definitions() {
+    while (atomic_flag_test_and_set_explicit(&lfsm_system.definitions_lock, memory_order_acquire)) {
+    }
+}
+
+void lfsm_unlock_definitions() {
+    atomic_flag_clear_explicit(&lfsm_system.definitions_lock, memory_order_release);
+}
+
+/* ---------------------------------------------------------------------------
+ * - FUNCTIONS EMBEDDED IN MAIN USER FUNCTIONS
+ * -------------------------------------------------------------------------*/
+
+lfsm_t lfsm_get_unused_context() {
+    lfsm_context_t* context = lfsm_pool_pop_free();
+    if (context == NULL) {
+        context = lfsm_pool_claim_unused();
+        if (context == NULL) return NULL;
+    }
+    memset((unsigned char*)context + LFSM_CONTEXT_RESET_OFFSET, 0, sizeof(lfsm_context_t) - LFSM_CONTEXT_RESET_OFFSET);
+    context->current_state = LFSM_INVALID;
+    context->previous_step_state = LFSM_INVALID;
+    context->is_active = 1;
+    return context;
+}
+
+// clears the instance and pushes it onto the free list
+void lfsm_release_context(lfsm_context_t* context) {
+    uint64_t head = atomic_load_explicit(&lfsm_system.free_list, memory_order_relaxed);
+    uint64_t new_head;
+
+#if (LFSM_ENABLE_STATS)
+    free(context->stats);
+#endif
+#if (LFSM_ADAPTIVE_GUARDS)
+    free(context->guard_order);
+#endif
+    free(context->coalesce_pending);
+    memset((unsigned char*)context + LFSM_CONTEXT_RESET_OFFSET, 0, sizeof(lfsm_context_t) - LFSM_CONTEXT_RESET_OFFSET);
+    do {
+        atomic_store_explicit(&context->next_free, (uint32_t)head, memory_order_relaxed);
+        new_head = ((head & ~(uint64_t)UINT32_MAX) + LFSM_POOL_TAG_STEP) | (context->pool_index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&lfsm_system.free_list, &head, new_head,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+lfsm_context_t* lfsm_pool_context(uint32_t pool_index) {
+    if (pool_index < LFSM_MAX_COUNT) {
+        return &lfsm_system.contexts[pool_index];
+    }
+#if (LFSM_POOL_CHUNK_SIZE > 0)
+    pool_index -= LFSM_MAX_COUNT;
+    lfsm_context_t* chunk = atomic_load_explicit(&lfsm_system.chunks[pool_index / LFSM_POOL_CHUNK_SIZE], memory_order_acquire);
+    return &chunk[pool_index % LFSM_POOL_CHUNK_SIZE];
+#else
+    return NULL;
+#endif
+}
+
+// Instances on the free list stay valid memory (chunks are never freed), so
+// reading next_free of an instance another thread just claimed is harmless,
+// the tag makes the compare and swap fail in that case.
+lfsm_context_t* lfsm_pool_pop_free() {
+    uint64_t head = atomic_load_explicit(&lfsm_system.free_list, memory_order_acquire);
+    uint64_t new_head;
+    lfsm_context_t* context;
+
+    do {
+        uint32_t top = (uint32_t)head;
+        if (top == 0) return NULL;
+        context = lfsm_pool_context(top - 1);
+        uint32_t next = atomic_load_explicit(&context->next_free, memory_order_relaxed);
+        new_head = ((head & ~(uint64_t)UINT32_MAX) + LFSM_POOL_TAG_STEP) | next;
+    } while (!atomic_compare_exchange_weak_explicit(&lfsm_system.free_list, &head, new_head,
+                                                    memory_order_acquire, memory_order_acquire));
+    return context;
+}
+
+// takes the next never used instance, allocating its chunk if needed
+lfsm_context_t* lfsm_pool_claim_unused() {
+    uint32_t pool_index = atomic_load_explicit(&lfsm_system.unused_index, memory_order_relaxed);
+    lfsm_context_t* context;
+
+    do {
+        if (pool_index >= LFSM_POOL_CAPACITY) return NULL;
+#if (LFSM_POOL_CHUNK_SIZE > 0)
+        if ((pool_index >= LFSM_MAX_COUNT) \
+            && (lfsm_pool_add_chunk((pool_index - LFSM_MAX_COUNT) / LFSM_POOL_CHUNK_SIZE) != LFSM_OK)) {
+            return NULL;
+        }
+#endif
+    } while (!atomic_compare_exchange_weak_explicit(&lfsm_system.unused_index, &pool_index, pool_index + 1,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    context = lfsm_pool_context(pool_index);
+    context->pool_index = pool_index;
+    return context;
+}
+
+lfsm_return_t lfsm_group_reserve(lfsm_group_context_t* group, uint32_t event_count) {
+    if (event_count <= group->capacity) return LFSM_OK;
+
+    free(group->round);
+    free(group->round_start);
+    free(group->by_round);
+    free(group->by_transition);
+    free(group->transition_number);
+    group->round = malloc(event_count * sizeof(uint32_t));
+    group->round_start = malloc((event_count + 1) * sizeof(uint32_t));
+    group->by_round = malloc(event_count * sizeof(uint32_t));
+    group->by_transition = malloc(event_count * sizeof(uint32_t));
+    group->transition_number = malloc(event_count * sizeof(uint32_t));
+    int out_of_memory = (group->round == NULL) || (group->round_start == NULL) || (group->by_round == NULL) \
+                     || (group->by_transition == NULL) || (group->transition_number == NULL);
+    if (out_of_memory) {
+        group->capacity = 0;
+        return LFSM_ERROR;
+    }
+    group->capacity = event_count;
+    return LFSM_OK;
+}
+
+// Round n holds the n-th event of every instance in the batch. Instances are
+// independent, so within a round the events may run in any order; the rounds
+// keep the order of events for the same instance. Returns the round count.
+uint32_t lfsm_group_order_by_round(lfsm_group_context_t* group, const lfsm_group_event_t* events, uint32_t event_count) {
+    uint32_t round_count = 0;
+
+    for (uint32_t i = 0 ; i < event_count ; i++) {
+        uint32_t instance = events[i].instance;
+        if (instance >= group->instance_count) {
+            group->round[i] = UINT32_MAX;
+            continue;
+        }
+        uint32_t round = group->events_seen[instance]++;
+        group->round[i] = round;
+        if (round >= round_count) round_count = round + 1;
+    }
+    memset(group->round_start, 0, (round_count + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0 ; i < event_count ; i++) {
+        if (group->round[i] == UINT32_MAX) continue;
+        group->events_seen[events[i].instance] = 0;
+        group->round_start[group->round[i] + 1]++;
+    }
+    for (uint32_t round = 0 ; round < round_count ; round++) {
+        group->round_start[round + 1] += group->round_start[round];
+    }
+    // round[] becomes the insert position, round_start[] is restored below
+    for (uint32_t i = 0 ; i < event_count ; i++) {
+        if (group->round[i] == UINT32_MAX) continue;
+        group->by_round[group->round_start[group->round[i]]++] = i;
+    }
+    for (uint32_t round = round_count ; round > 0 ; round--) {
+        group->round_start[round] = group->round_start[round - 1];
+    }
+    group->round_start[0] = 0;
+    return round_count;
+}
+
+// Sorts the entries of one round by the transition block of their
+// (state,event) pair (counting sort, the last bucket is "no transition"), then
+// runs each block for all of its entries.
+void lfsm_group_run_round(lfsm_group_context_t* group, const lfsm_group_event_t* events, const uint32_t* entries, uint32_t entry_count, lfsm_batch_result_t* result) {
+    const lfsm_definition_t* definition = group->definition;
+    uint32_t no_transition = definition->transition_count;
+    uint32_t* bucket_end = group->bucket_end;
+
+    memset(bucket_end, 0, (no_transition + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0 ; i < entry_count ; i++) {
+        const lfsm_group_event_t* entry = &events[entries[i]];
+        const lfsm_transitions_t* transition = lfsm_lookup_transition(definition, group->states[entry->instance], entry->event);
+        uint32_t number = (transition != NULL) ? (uint32_t)(transition - definition->transition_table) : no_transition;
+        group->transition_number[i] = number;
+        bucket_end[number]++;
+    }
+    for (uint32_t number = 1 ; number <= no_transition ; number++) {
+        bucket_end[number] += bucket_end[number - 1];
+    }
+    // filled from the back, so bucket_end[] ends up holding the bucket starts
+    for (uint32_t i = entry_count ; i > 0 ; i--) {
+        group->by_transition[--bucket_end[group->transition_number[i - 1]]] = entries[i - 1];
+    }
+
+    for (uint32_t number = 0 ; number <= no_transition ; number++) {
+        uint32_t first = bucket_end[number];
+        uint32_t end = (number < no_transition) ? bucket_end[number + 1] : entry_count;
+        if (first == end) continue;
+        if (number < no_transition) {
+            lfsm_group_run_transition(group, events, group->by_transition + first, end - first, \
+                                      definition->transition_table + number, result);
+        } else {
+            lfsm_group_run_without_transition(group, events, group->by_transition + first, end - first);
+        }
+    }
+    result->events += entry_count;
+}
+
+// All entries are in transition->current_state (or a descendant inheriting
+// the event) and got transition->event. Without a condition and hierarchy
+// the next state and the callbacks are the same for all of them, and
+// without callbacks only the state array is written.
+void lfsm_group_run_transition(lfsm_group_context_t* group, const lfsm_group_event_t* events, const uint32_t* entries, uint32_t entry_count, const lfsm_transitions_t* transition, lfsm_batch_result_t* result) {
+    const lfsm_definition_t* definition = group->definition;
+    lfsm_context_t* scratch = &group->callback_context;
+    lfsm_id_t state = transition->current_state;
+    lfsm_id_t event = transition->event;
+
+    if ((transition->condition == NULL) && (definition->state_paths == NULL)) {
+        lfsm_id_t next_state = transition->next_state;
+        const lfsm_state_functions_t* callbacks_from = lfsm_get_state_function(scratch, state);
+        const lfsm_state_functions_t* callbacks_to = lfsm_get_state_function(scratch, next_state);
+        int state_changes = (next_state != state);
+        lfsm_return_t (*on_exit)() = (state_changes && callbacks_from) ? callbacks_from->on_exit : NULL;
+        lfsm_return_t (*on_entry)() = (state_changes && callbacks_to) ? callbacks_to->on_entry : NULL;
+        lfsm_return_t (*on_run)() = callbacks_to ? callbacks_to->on_run : NULL;
+
+        result->transitions += entry_count;
+        if ((on_exit == NULL) && (on_entry == NULL) && (on_run == NULL)) {
+            for (uint32_t i = 0 ; i < entry_count ; i++) {
+                group->states[events[entries[i]].instance] = next_state;
+            }
+            return;
+        }
+        for (uint32_t i = 0 ; i < entry_count ; i++) {
+            uint32_t instance = events[entries[i]].instance;
+            lfsm_context_t* fsm = lfsm_group_callback_context(group, instance);
+            group->states[instance] = next_state;
+            fsm->current_state = next_state; // on_exit sees the next state, as in lfsm_run()
+            lfsm_run_callback(fsm, on_exit);
+            lfsm_run_callback(fsm, on_entry);
+            lfsm_run_callback(fsm, on_run);
+        }
+        return;
+    }
+
+    // conditions may depend on the user data, evaluate them per instance
+    for (uint32_t i = 0 ; i < entry_count ; i++) {
+        uint32_t instance = events[entries[i]].instance;
+        lfsm_context_t* fsm = lfsm_group_callback_context(group, instance);
+        const lfsm_transitions_t* selected = lfsm_find_transition_to_execute(fsm, transition, event);
+        if (selected == NULL) continue;
+
+        result->transitions++;
+        if (definition->state_paths != NULL) {
+            lfsm_id_t from = fsm->current_state;
+            fsm->current_state = selected->next_state;
+            group->states[instance] = selected->next_state;
+            lfsm_run_state_path(fsm, from, &definition->dispatch_table[selected - definition->transition_table]);
+        } else if (selected->next_state != state) {
+            const lfsm_state_functions_t* callbacks = lfsm_get_state_function(fsm, state);
+            fsm->current_state = selected->next_state;
+            group->states[instance] = selected->next_state;
+            if (callbacks != NULL) lfsm_run_callback(fsm, callbacks->on_exit);
+            callbacks = lfsm_get_state_function(fsm, selected->next_state);
+            if (callbacks != NULL) lfsm_run_callback(fsm, callbacks->on_entry);
+        }
+        const lfsm_state_functions_t* callbacks = lfsm_get_state_function(fsm, fsm->current_state);
+        if (callbacks != NULL) lfsm_run_callback(fsm, callbacks->on_run);
+    }
+}
+
+// like lfsm_run() for an event without transition: only run the state's on_run
+void lfsm_group_run_without_transition(lfsm_group_context_t* group, const lfsm_group_event_t* events, const uint32_t* entries, uint32_t entry_count) {
+    for (uint32_t i = 0 ; i < entry_count ; i++) {
+        uint32_t instance = events[entries[i]].instance;
+        const lfsm_state_functions_t* callbacks = lfsm_get_state_function(&group->callback_context, group->states[instance]);
+        if ((callbacks != NULL) && (callbacks->on_run != NULL)) {
+            lfsm_run_callback(lfsm_group_callback_context(group, instance), callbacks->on_run);
+        }
+    }
+}
+
+lfsm_context_t* lfsm_group_callback_context(lfsm_group_context_t* group, uint32_t instance) {
+    lfsm_context_t* fsm = &group->callback_context;
+    fsm->current_state = group->states[instance];
+    fsm->previous_step_state = fsm->current_state;
+    fsm->user_data = (group->user_data != NULL) ? group->user_data[instance] : NULL;
+    return fsm;
+}
+
+#if (LFSM_POOL_CHUNK_SIZE > 0)
+// several threads may allocate the same chunk, only the first one is kept
+lfsm_return_t lfsm_pool_add_chunk(uint32_t chunk_number) {
+    lfsm_context_t* expected = NULL;
 
-    memset((unsigned char*)context, 0, sizeof(lfsm_context_t));
+    if (atomic_load_explicit(&lfsm_system.chunks[chunk_number], memory_order_acquire) != NULL) {
+        return LFSM_OK;
+    }
+    lfsm_context_t* chunk = calloc(LFSM_POOL_CHUNK_SIZE, sizeof(lfsm_context_t));
+    if (chunk == NULL) return LFSM_ERROR;
+    if (!atomic_compare_exchange_strong_explicit(&lfsm_system.chunks[chunk_number], &expected, chunk,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        free(chunk);
+    }
     return LFSM_OK;
 }
+#endif
 
-/* ---------------------------------------------------------------------------
- * - FUNCTIONS EMBEDDED IN MAIN USER FUNCTIONS
- * -------------------------------------------------------------------------*/
+lfsm_t lfsm_attach_definition(lfsm_t new_fsm, const lfsm_definition_t* definition, lfsm_buf_callbacks_t buffer_callbacks, void* user_data, lfsm_id_t initial_state) {
+    if (lfsm_prepare_context(new_fsm, definition, buffer_callbacks, user_data, initial_state) == NULL) {
+        return NULL;
+    }
+    lfsm_run_all_callbacks(new_fsm);
+    return new_fsm;
+}
 
-lfsm_t lfsm_get_unused_context() {
-    lfsm_context_t* context;
-    for (int index = 0 ; index < LFSM_MAX_COUNT ; index++) {
-        if (!(lfsm_system.contexts[index].is_active)) {
-            context = &lfsm_system.contexts[index];
-            memset((unsigned char*)context, 0, sizeof(lfsm_context_t));
-            context->current_state = LFSM_INVALID;
-            context->previous_step_state = LFSM_INVALID;
-            lfsm_system.contexts[index].is_active = 1;
-            return context;
-        }
+// lfsm_attach_definition() without running the callbacks of the initial state
+lfsm_t lfsm_prepare_context(lfsm_t new_fsm, const lfsm_definition_t* definition, lfsm_buf_callbacks_t buffer_callbacks, void* user_data, lfsm_id_t initial_state) {
+    if (definition == NULL) return NULL;
+
+    new_fsm->definition = definition;
+    new_fsm->event_number_min = definition->event_number_min;
+    new_fsm->event_number_max = definition->event_number_max;
+    new_fsm->current_state = initial_state;
+    lfsm_set_context_buf_callbacks(new_fsm, buffer_callbacks);
+    if (lfsm_initialize_buffers(new_fsm) != LFSM_OK) {
+        return NULL;
     }
-    return NULL;
+#if (LFSM_ENABLE_STATS)
+    if (lfsm_stats_alloc(new_fsm) != LFSM_OK) {
+        return NULL;
+    }
+#endif
+#if (LFSM_ADAPTIVE_GUARDS)
+    if (lfsm_guard_order_alloc(new_fsm) != LFSM_OK) {
+        return NULL;
+    }
+#endif
+    if (lfsm_coalesce_alloc(new_fsm) != LFSM_OK) {
+        return NULL;
+    }
+    new_fsm->user_data = user_data;
+    return new_fsm;
 }
 
 
@@ -190,6 +2642,13 @@ lfsm_return_t lfsm_set_lovely_buf_callbacks(lfsm_buf_callbacks_t* callbacks) {
 #endif
 
 lfsm_return_t lfsm_initialize_buffers(lfsm_t fsm) {
+#if (LFSM_USE_BUILTIN_QUEUE)
+    lfsm_events_init(&fsm->event_queue);
+#if (LFSM_ENABLE_STORE)
+    fsm->events = &fsm->event_queue;
+#endif
+    return LFSM_OK;
+#else
 #if (USE_LOVELY_BUFFER)
     buf_data_info_t data_info;
     data_info.array = fsm->event_queue_buffer;
@@ -205,13 +2664,17 @@ lfsm_return_t lfsm_initialize_buffers(lfsm_t fsm) {
 #endif
     if (fsm->buffer_handle == NULL) return LFSM_ERROR;
     return LFSM_OK;
+#endif
 }
 
 
+// the built-in queue does not need any callbacks, they are ignored
 lfsm_return_t lfsm_set_context_buf_callbacks(lfsm_t context, lfsm_buf_callbacks_t buffer_callbacks){
+#if !(LFSM_USE_BUILTIN_QUEUE)
     lfsm_context_t* fsm = (lfsm_context_t*)context;
     fsm->buf_func = buffer_callbacks;
     // todo: add checks for NULL?!
+#endif
     return LFSM_OK;
 }
 
@@ -222,160 +2685,509 @@ void* lfsm_user_data(lfsm_t context) {
     return context->user_data;
 }
 
-lfsm_transitions_t* lfsm_get_transition_table(lfsm_t context) {
+void lfsm_set_user_data(lfsm_t context, void* user_data) {
+    context->user_data = user_data;
+}
+
+_Atomic uint32_t* lfsm_scheduling_state(lfsm_t context) {
+    return &context->scheduling_state;
+}
+
+const lfsm_transitions_t* lfsm_get_transition_table(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->transition_table;
+    return details->definition->transition_table;
 }
 int lfsm_get_transition_count(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->transition_count;
+    return details->definition->transition_count;
 }
-lfsm_transitions_t** lfsm_get_transition_lookup_table(lfsm_t context) {
+const lfsm_transitions_t* const* lfsm_get_transition_lookup_table(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->transition_lookup_table;
+    return details->definition->transition_lookup_table;
 }
-lfsm_state_functions_t* lfsm_get_state_function_table(lfsm_t context) {
+const lfsm_state_functions_t* lfsm_get_state_function_table(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->functions_table;
+    return details->definition->functions_table;
 }
 int lfsm_get_state_function_count(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->state_func_count;
+    return details->definition->state_func_count;
 }
-lfsm_state_functions_t** lfsm_get_state_function_lookup_table(lfsm_t context) {
+const lfsm_state_functions_t* const* lfsm_get_state_function_lookup_table(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->function_lookup_table;
+    return details->definition->function_lookup_table;
 }
 int lfsm_get_state_min(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->state_number_min;
+    return details->definition->state_number_min;
 }
 int lfsm_get_state_max(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->state_number_max;
+    return details->definition->state_number_max;
 }
 int lfsm_get_event_min(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->event_number_min;
+    return details->definition->event_number_min;
 }
 int lfsm_get_event_max(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->event_number_max;
+    return details->definition->event_number_max;
 }
-uint8_t lfsm_get_state(lfsm_t context) {
+int lfsm_get_index_type(lfsm_t context) {
+    lfsm_context_t* details = context;
+    return details->definition->index_type;
+}
+lfsm_id_t lfsm_get_state(lfsm_t context) {
     lfsm_context_t* details = context;
     return details->current_state;
 }
-uint8_t lfsm_set_state(lfsm_t context, uint8_t state) {
+uint8_t lfsm_set_state(lfsm_t context, lfsm_id_t state) {
     lfsm_context_t* details = context;
     details->current_state = state;
     details->previous_step_state = state;
     return 0;
 }
-uint8_t lfsm_get_state_func_count(lfsm_t context) {
+uint32_t lfsm_get_state_func_count(lfsm_t context) {
     lfsm_context_t* details = context;
-    return details->state_func_count;
+    return details->definition->state_func_count;
 }
-uint8_t lfsm_read_event_queue_element(lfsm_t context, uint8_t index) {
+lfsm_id_t lfsm_read_event_queue_element(lfsm_t context, uint8_t index) {
     lfsm_context_t* details = context;
     int out_of_bounds = (index < 0) || (index >= LFSM_EV_QUEUE_SIZE);
 
     if (out_of_bounds) {
         return LFSM_INVALID;
     }
+#if (LFSM_USE_BUILTIN_QUEUE) && (LFSM_EVENT_PRIORITIES > 1)
+    return LFSM_EVENTS(details)->classes[0].events[index];
+#elif (LFSM_USE_BUILTIN_QUEUE)
+    return LFSM_EVENTS(details)->events[index];
+#else
     return details->event_queue_buffer[index];
+#endif
 }
-uint8_t lfsm_read_event(lfsm_t context) {
+lfsm_id_t lfsm_read_event(lfsm_t context) {
     lfsm_context_t* details = context;
-    uint8_t next_event = details->buf_func.read(details->buffer_handle);
+#if (LFSM_USE_BUILTIN_QUEUE)
+    lfsm_id_t next_event = lfsm_events_read_payload(LFSM_EVENTS(details), NULL);
+#else
+    lfsm_id_t next_event = details->buf_func.read(details->buffer_handle);
+#endif
     return next_event;
 }
 
 // --------------------------------------------------------------------------------
 
 
-void swap_elements(lfsm_transitions_t* items, int index_first, int index_second ) {
-    lfsm_transitions_t temp_item;
-    temp_item           = items[index_first];
-    items[index_first]  = items[index_second];
-    items[index_second] = temp_item;
+int lfsm_transition_precedes(const lfsm_transitions_t* first, const lfsm_transitions_t* second) {
+    if (first->current_state != second->current_state) {
+        return first->current_state < second->current_state;
+    }
+    return first->event < second->event;
 }
 
-void lfsm_bubble_sort_list(lfsm_t context) {
-    lfsm_transitions_t* sorter;
-    int swap_for_state, swap_for_event, same_state;
-    int list_length = context->transition_count;
-
-    for (int unsorted = list_length - 1; unsorted > 0 ; unsorted--) {
-        sorter = context->transition_table;
-        for (int i = 0; i < unsorted; i++) {
-            swap_for_state = sorter->current_state >  (sorter+1)->current_state;
-            same_state     = sorter->current_state == (sorter+1)->current_state;
-            swap_for_event = sorter->event         >  (sorter+1)->event;
-
-            if (swap_for_state || (same_state && swap_for_event) ) {
-                swap_elements(context->transition_table, i, i+1);
+// Sorts by state, then event. Stable (bottom up merge sort, O(n log n)), so
+// transitions of the same state/event keep the order their conditions are
+// checked in. Tables that are already sorted are left untouched.
+lfsm_return_t lfsm_sort_transitions(lfsm_transitions_t* transitions, int list_length) {
+    int is_sorted = 1;
+    for (int i = 1 ; i < list_length ; i++) {
+        if (lfsm_transition_precedes(&transitions[i], &transitions[i-1])) {
+            is_sorted = 0;
+            break;
+        }
+    }
+    if (is_sorted) return LFSM_OK;
+
+    lfsm_transitions_t* buffer = malloc(list_length * sizeof(lfsm_transitions_t));
+    if (buffer == NULL) return LFSM_ERROR;
+
+    lfsm_transitions_t* from = transitions;
+    lfsm_transitions_t* to = buffer;
+    for (int width = 1 ; width < list_length ; width *= 2) {
+        for (int start = 0 ; start < list_length ; start += 2 * width) {
+            int middle = (start + width < list_length) ? start + width : list_length;
+            int end = (middle + width < list_length) ? middle + width : list_length;
+            int left = start, right = middle;
+            for (int i = start ; i < end ; i++) {
+                // take from the right run only if strictly smaller (stable)
+                int take_right = (right < end) && ((left >= middle) || lfsm_transition_precedes(&from[right], &from[left]));
+                to[i] = take_right ? from[right++] : from[left++];
             }
-            sorter++;
         }
+        lfsm_transitions_t* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != transitions) {
+        memcpy(transitions, from, list_length * sizeof(lfsm_transitions_t));
     }
+    free(buffer);
+    return LFSM_OK;
+}
+
+const lfsm_transitions_t* lfsm_get_transition_from_lookup(lfsm_context_t* fsm, lfsm_id_t event) {
+    return lfsm_lookup_transition(fsm->definition, fsm->current_state, event);
 }
 
-lfsm_transitions_t* lfsm_get_transition_from_lookup(lfsm_context_t* fsm, uint8_t event) {
-    lfsm_transitions_t** transition_table = fsm->transition_lookup_table;
-    lfsm_transitions_t* transition_pointer;
-    uint16_t lookup_entry_number;
+// Both index types resolve a (state,event) pair in O(1), including the
+// events a state inherits from its ancestors. The hash index uses linear
+// probing on a table that is at most half full.
+const lfsm_transitions_t* lfsm_lookup_transition(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event) {
+    const lfsm_transitions_t* const* transition_table = definition->transition_lookup_table;
+    const lfsm_transitions_t* transition_pointer;
+    size_t lookup_entry_number;
+
+    if (definition->index_type == LFSM_INDEX_LINEAR) {
+        transition_pointer = lfsm_scan_transitions(definition, state, event);
+        // no index to hold the inherited events, ask the ancestors
+        while ((transition_pointer == NULL) && (definition->state_paths != NULL) \
+                && (state >= definition->state_number_min) && (state <= definition->state_number_max)) {
+            state = definition->state_paths[state - definition->state_number_min].parent;
+            if (state == LFSM_INVALID) break;
+            transition_pointer = lfsm_scan_transitions(definition, state, event);
+        }
+        return transition_pointer;
+    }
+
+    if (definition->index_type == LFSM_INDEX_HASH) {
+        uint32_t slot_mask = (UINT32_MAX >> definition->hash_shift);
+        uint32_t slot = lfsm_hash_index_slot(state, event, definition->hash_shift);
+        const lfsm_index_entry_t* entry = &definition->hash_index[slot];
+        while (entry->transition != NULL) {
+            if ((entry->state == state) && (entry->event == event)) {
+                return entry->transition;
+            }
+            slot = (slot + 1) & slot_mask;
+            entry = &definition->hash_index[slot];
+        }
+        return NULL;
+    }
 
-    int out_of_bounds = (event > fsm->event_number_max) || (event < fsm->event_number_min);
+    int out_of_bounds = (event > definition->event_number_max) || (event < definition->event_number_min) \
+                     || (state > definition->state_number_max) \
+                     || (state < definition->state_number_min);
     if (out_of_bounds) {
         return NULL;
     }
 
-    uint16_t current_state = fsm->current_state;
-    uint16_t state_offset = fsm->state_number_min;
-    uint16_t event_offset = fsm->event_number_min;
-    uint16_t event_count = fsm->event_count;
-    lookup_entry_number = (current_state - state_offset) * event_count + event - event_offset;
+    size_t state_offset = definition->state_number_min;
+    size_t event_offset = definition->event_number_min;
+    size_t event_count = definition->event_count;
+    lookup_entry_number = (state - state_offset) * event_count + event - event_offset;
     transition_pointer = *(transition_table + lookup_entry_number);
     return transition_pointer;
 }
 
+// O(n) search without an index, stops at the first transition past the pair
+// as the table is sorted.
+const lfsm_transitions_t* lfsm_scan_transitions(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event) {
+    const lfsm_transitions_t* transition = definition->transition_table;
+    const lfsm_transitions_t* table_end = transition + definition->transition_count;
+
+    for ( ; transition < table_end ; transition++) {
+        if ((lfsm_id_t)transition->current_state < state) continue;
+        if ((lfsm_id_t)transition->current_state > state) break;
+        if ((lfsm_id_t)transition->event == event) return transition;
+        if ((lfsm_id_t)transition->event > event) break;
+    }
+    return NULL;
+}
+
+// Part of the dense lookup table for the current state, indexed by
+// (event - event_number_min). NULL without a dense index or for an unknown state.
+const lfsm_transitions_t* const* lfsm_get_lookup_row(lfsm_context_t* fsm) {
+    const lfsm_definition_t* definition = fsm->definition;
+    int out_of_bounds = (fsm->current_state > definition->state_number_max) \
+                     || (fsm->current_state < definition->state_number_min);
+
+    if ((definition->transition_lookup_table == NULL) || out_of_bounds) {
+        return NULL;
+    }
+    return definition->transition_lookup_table \
+           + (size_t)(fsm->current_state - definition->state_number_min) * definition->event_count;
+}
+
 // runs through the block of transitions for the same state/event and returns
 // the first element with a valid 'condition' function (NULL function is valid)
-lfsm_transitions_t* lfsm_find_transition_to_execute(lfsm_context_t* fsm, lfsm_transitions_t* transition, uint8_t event) {
+const lfsm_transitions_t* lfsm_find_transition_to_execute(lfsm_context_t* fsm, const lfsm_transitions_t* transition, lfsm_id_t event) {
+    const lfsm_transitions_t* table_end = fsm->definition->transition_table + fsm->definition->transition_count;
+    int state = transition->current_state; // an ancestor of the current state for inherited events
     int more_transitions_for_pair;
+#if (LFSM_ADAPTIVE_GUARDS)
+    if ((transition->flags & LFSM_EXCLUSIVE_GUARD) && (fsm->guard_order != NULL)) {
+        lfsm_guard_order_t* block = &fsm->guard_order[transition - fsm->definition->transition_table];
+        if (block->length != 0) {
+            return lfsm_find_exclusive_transition(fsm, transition, block);
+        }
+    }
+#endif
     do {
         if (transition->condition == NULL) {
+            LFSM_STATS_COUNT_TRANSITION(fsm, transition, fired);
             return transition;
         }
+        LFSM_STATS_COUNT_TRANSITION(fsm, transition, guard_evaluations);
         if (transition->condition(fsm)) {
+            LFSM_STATS_COUNT_TRANSITION(fsm, transition, fired);
             return transition;
         }
+        LFSM_STATS_COUNT_TRANSITION(fsm, transition, guard_rejections);
         transition++;
-        more_transitions_for_pair = \
-                (transition->current_state == fsm->current_state) \
-                &&(transition->event == event);
+        more_transitions_for_pair = (transition < table_end) \
+                && (transition->current_state == state) \
+                && (transition->event == event);
     } while (more_transitions_for_pair);
     return NULL;
 }
 
-lfsm_return_t lfsm_execute_transition(lfsm_context_t* fsm, lfsm_transitions_t* transition) {
+#if (LFSM_ADAPTIVE_GUARDS)
+// Blocks of 2 or more transitions, all with a condition and flagged
+// LFSM_EXCLUSIVE_GUARD, start in table order. Nothing is allocated if the
+// definition has none.
+lfsm_return_t lfsm_guard_order_alloc(lfsm_context_t* fsm) {
+    const lfsm_transitions_t* table = fsm->definition->transition_table;
+    uint32_t count = fsm->definition->transition_count;
+    lfsm_guard_order_t* guard_order = NULL;
+
+    for (uint32_t first = 0, end ; first < count ; first = end) {
+        uint8_t exclusive = 1;
+        for (end = first ; (end < count) && (table[end].current_state == table[first].current_state) \
+                && (table[end].event == table[first].event) ; end++) {
+            exclusive &= (table[end].condition != NULL) && (table[end].flags & LFSM_EXCLUSIVE_GUARD);
+        }
+        if (!exclusive || (end - first < 2) || (end - first > UINT16_MAX)) continue;
+
+        if (guard_order == NULL) {
+            guard_order = calloc(count, sizeof(lfsm_guard_order_t));
+            if (guard_order == NULL) return LFSM_ERROR;
+        }
+        guard_order[first].length = end - first;
+        guard_order[first].countdown = LFSM_GUARD_REORDER_INTERVAL;
+        for (uint32_t i = first ; i < end ; i++) {
+            guard_order[i].order = i - first;
+        }
+    }
+    fsm->guard_order = guard_order;
+    return LFSM_OK;
+}
+
+// At most one guard accepts, so the first one found in the learned order is
+// the one lfsm_find_transition_to_execute() would find in table order.
+const lfsm_transitions_t* lfsm_find_exclusive_transition(lfsm_context_t* fsm, const lfsm_transitions_t* first, lfsm_guard_order_t* block) {
+    const lfsm_transitions_t* selected = NULL;
+
+    for (uint32_t i = 0 ; i < block->length ; i++) {
+        uint16_t offset = block[i].order;
+        const lfsm_transitions_t* transition = first + offset;
+        LFSM_STATS_COUNT_TRANSITION(fsm, transition, guard_evaluations);
+        if (transition->condition(fsm)) {
+            LFSM_STATS_COUNT_TRANSITION(fsm, transition, fired);
+            if (block[offset].hits < UINT16_MAX) block[offset].hits++;
+            selected = transition;
+            break;
+        }
+        LFSM_STATS_COUNT_TRANSITION(fsm, transition, guard_rejections);
+    }
+    if (--block->countdown == 0) {
+        lfsm_reorder_guards(block);
+        block->countdown = LFSM_GUARD_REORDER_INTERVAL;
+    }
+    return selected;
+}
+
+// insertion sort by hits, most first; stable, so ties keep their order
+void lfsm_reorder_guards(lfsm_guard_order_t* block) {
+    for (uint32_t i = 1 ; i < block->length ; i++) {
+        uint16_t offset = block[i].order;
+        uint32_t position = i;
+        while ((position > 0) && (block[block[position - 1].order].hits < block[offset].hits)) {
+            block[position].order = block[position - 1].order;
+            position--;
+        }
+        block[position].order = offset;
+    }
+    for (uint32_t i = 0 ; i < block->length ; i++) {
+        block[i].hits /= 2;
+    }
+}
+#endif
+
+lfsm_return_t lfsm_execute_transition(lfsm_context_t* fsm, const lfsm_transitions_t* transition) {
     fsm->previous_step_state = fsm->current_state;
     fsm->current_state = transition->next_state;
+    LFSM_STORE_STATE(fsm);
     return LFSM_OK;
 }
 
+// Runs an event through the generated dispatcher of the definition. Stats
+// count events, the dispatcher itself is not instrumented.
+lfsm_step_result_t lfsm_run_step(lfsm_context_t* fsm, lfsm_id_t event) {
+    lfsm_step_result_t result = fsm->definition->step(fsm, &fsm->current_state, event);
+    LFSM_STORE_STATE(fsm);
+    LFSM_LEAVE_STATE(fsm, fsm->previous_step_state, fsm->current_state);
+    fsm->previous_step_state = fsm->current_state;
+    if (result == LFSM_STEP_NONE) {
+        LFSM_STATS_COUNT(fsm, events_without_transition);
+    }
+    return result;
+}
+
+lfsm_batch_result_t lfsm_run_batch_step(lfsm_context_t* fsm, uint32_t max_events) {
+    lfsm_batch_result_t result = { 0, 0 };
+    uint32_t available = 0;
+
+    while (result.events < max_events) {
+        if (available == 0) {
+            available = lfsm_queued_event_count(fsm);
+            if (available == 0) break;
+        }
+        available--;
+        lfsm_id_t next_event = lfsm_get_next_event(fsm);
+        result.events++;
+        LFSM_STATS_COUNT(fsm, events_run);
+        if (lfsm_run_step(fsm, next_event) == LFSM_STEP_TRANSITION) {
+            result.transitions++;
+        }
+    }
+    lfsm_release_payloads(fsm);
+    return result;
+}
+
+// Runs one event taken from the queue: finds the transition for the current
+// state and executes it with its callbacks.
+lfsm_step_result_t lfsm_run_event(lfsm_context_t* fsm, lfsm_id_t event) {
+    const lfsm_definition_t* definition = fsm->definition;
+    const lfsm_transitions_t* transition;
+
+    if (definition->step != NULL) {
+        return lfsm_run_step(fsm, event);
+    }
+    transition = lfsm_get_transition_from_lookup(fsm, event);
+    if (transition == NULL) {
+        LFSM_STATS_COUNT(fsm, events_without_transition);
+        lfsm_run_all_callbacks(fsm);
+        return LFSM_STEP_NONE;
+    }
+    transition = lfsm_find_transition_to_execute(fsm, transition, event);
+    if (transition == NULL) {
+        return LFSM_STEP_REJECTED;
+    }
+    LFSM_TRACE(fsm, transition);
+    if (definition->dispatch_table != NULL) {
+        lfsm_run_dispatch(fsm, &definition->dispatch_table[transition - definition->transition_table]);
+    } else {
+        lfsm_execute_transition(fsm, transition);
+        lfsm_run_all_callbacks(fsm);
+    }
+    return LFSM_STEP_TRANSITION;
+}
+
+// Runs an event in all regions with transitions for it, in region order.
+// The regions see the payload of the event while they run.
+uint32_t lfsm_run_regions(lfsm_context_t* fsm, lfsm_id_t event) {
+    uint32_t transitions = 0;
+
+    if (event == LFSM_INVALID) return 0;
+    uint32_t index = event - fsm->event_number_min;
+    uint32_t bit = (uint32_t)1 << (index % 32);
+    for (uint32_t i = 0 ; i < fsm->region_count ; i++) {
+        const lfsm_region_t* region = &fsm->regions[i];
+        if ((region->events[index / 32] & bit) == 0) continue;
+#if (LFSM_EVENT_PAYLOADS)
+        region->context->current_payload = fsm->current_payload;
+#endif
+        if (lfsm_run_event(region->context, event) == LFSM_STEP_TRANSITION) {
+            transitions++;
+        }
+        if (region->context != fsm) {
+            lfsm_release_payloads(region->context);
+        }
+    }
+    return transitions;
+}
+
+lfsm_batch_result_t lfsm_run_batch_regions(lfsm_context_t* fsm, uint32_t max_events) {
+    lfsm_batch_result_t result = { 0, 0 };
+    uint32_t available = 0;
+
+    while (result.events < max_events) {
+        if (available == 0) {
+            available = lfsm_queued_event_count(fsm);
+            if (available == 0) break;
+        }
+        available--;
+        lfsm_id_t next_event = lfsm_get_next_event(fsm);
+        result.events++;
+        LFSM_STATS_COUNT(fsm, events_run);
+        result.transitions += lfsm_run_regions(fsm, next_event);
+    }
+    lfsm_release_payloads(fsm);
+    return result;
+}
+
+// lfsm_execute_transition() and lfsm_run_all_callbacks() in one, with the
+// state functions and the callbacks to run taken from the dispatch record
+void lfsm_run_dispatch(lfsm_context_t* fsm, const lfsm_dispatch_t* dispatch) {
+    uint8_t callbacks = dispatch->callbacks;
+
+    fsm->previous_step_state = fsm->current_state;
+    fsm->current_state = dispatch->next_state;
+    LFSM_STORE_STATE(fsm);
+    LFSM_LEAVE_STATE(fsm, fsm->previous_step_state, fsm->current_state);
+    if (callbacks != 0) {
+        if (callbacks & LFSM_DISPATCH_PATH) {
+            lfsm_run_state_path(fsm, fsm->previous_step_state, dispatch);
+        }
+        if (callbacks & LFSM_DISPATCH_EXIT) {
+            LFSM_RUN_STATE_CALLBACK(fsm, dispatch->from, on_exit, LFSM_CALLBACK_EXIT);
+        }
+        if (callbacks & LFSM_DISPATCH_ENTRY) {
+            LFSM_RUN_STATE_CALLBACK(fsm, dispatch->to, on_entry, LFSM_CALLBACK_ENTRY);
+        }
+        if (callbacks & LFSM_DISPATCH_RUN) {
+            LFSM_RUN_STATE_CALLBACK(fsm, dispatch->to, on_run, LFSM_CALLBACK_RUN);
+        }
+    }
+    fsm->previous_step_state = fsm->current_state;
+}
+
+// Exits from the state the transition starts in up to the least common
+// ancestor, then enters from below it down to the next state. Both are
+// slices of the precomputed state paths.
+void lfsm_run_state_path(lfsm_context_t* fsm, lfsm_id_t from, const lfsm_dispatch_t* dispatch) {
+    const lfsm_definition_t* definition = fsm->definition;
+    const lfsm_state_path_t* path = &definition->state_paths[from - definition->state_number_min];
+
+    for (uint32_t i = 0 ; i + dispatch->lca_depth < path->depth ; i++) {
+        if (path->functions[i] != NULL) {
+            LFSM_RUN_STATE_CALLBACK(fsm, path->functions[i], on_exit, LFSM_CALLBACK_EXIT);
+        }
+    }
+    lfsm_enter_state_path(fsm, dispatch->next_state, dispatch->lca_depth);
+}
+
+// on_entry of the states below lca_depth on the path of the state, outermost first
+void lfsm_enter_state_path(lfsm_context_t* fsm, lfsm_id_t state, uint8_t lca_depth) {
+    const lfsm_state_path_t* path = &fsm->definition->state_paths[state - fsm->definition->state_number_min];
+
+    for (uint32_t i = path->depth - lca_depth ; i > 0 ; i--) {
+        if (path->functions[i - 1] != NULL) {
+            LFSM_RUN_STATE_CALLBACK(fsm, path->functions[i - 1], on_entry, LFSM_CALLBACK_ENTRY);
+        }
+    }
+}
 
-lfsm_state_functions_t* lfsm_get_state_function(lfsm_context_t* fsm, uint8_t state) {
-    lfsm_state_functions_t* state_functions;
+const lfsm_state_functions_t* lfsm_get_state_function(lfsm_context_t* fsm, lfsm_id_t state) {
+    const lfsm_definition_t* definition = fsm->definition;
+    const lfsm_state_functions_t* state_functions;
     int address_offset;
 
-    if (state <= fsm->state_number_max) {
-        address_offset = state - fsm->state_number_min;
-        state_functions = *(fsm->function_lookup_table + address_offset);
+    if ((state >= definition->state_number_min) && (state <= definition->state_number_max)) {
+        address_offset = state - definition->state_number_min;
+        state_functions = *(definition->function_lookup_table + address_offset);
         return state_functions;
     } else {
-        asm(" nop");
         return NULL;
     }
 }
@@ -388,64 +3200,197 @@ lfsm_return_t lfsm_run_callback(lfsm_context_t* fsm, lfsm_return_t (*function)()
 }
 
 lfsm_return_t lfsm_run_all_callbacks(lfsm_context_t* fsm) {
-    lfsm_state_functions_t* callbacks_current;
-    lfsm_state_functions_t* callbacks_previous;
+    const lfsm_state_functions_t* callbacks_current;
+    const lfsm_state_functions_t* callbacks_previous;
     int state_changed;
 
     state_changed = fsm->previous_step_state != fsm->current_state;
     callbacks_current = lfsm_get_state_function(fsm, fsm->current_state);
 
     if (state_changed) {
+        LFSM_LEAVE_STATE(fsm, fsm->previous_step_state, fsm->current_state);
         callbacks_previous = lfsm_get_state_function(fsm, fsm->previous_step_state);
         if ((callbacks_previous != NULL)  && (fsm->previous_step_state != LFSM_INVALID)) {
-            lfsm_run_callback(fsm, callbacks_previous->on_exit);
+            LFSM_RUN_STATE_CALLBACK(fsm, callbacks_previous, on_exit, LFSM_CALLBACK_EXIT);
+        }
+        // the initial state of a hierarchy is entered with its ancestors,
+        // transitions between its states always use the dispatch records
+        int enter_path = (fsm->definition->state_paths != NULL) && (fsm->previous_step_state == LFSM_INVALID) \
+                      && (fsm->current_state >= fsm->definition->state_number_min) \
+                      && (fsm->current_state <= fsm->definition->state_number_max);
+        if (enter_path) {
+            lfsm_enter_state_path(fsm, fsm->current_state, 0);
+        } else if (callbacks_current != NULL) {
+            LFSM_RUN_STATE_CALLBACK(fsm, callbacks_current, on_entry, LFSM_CALLBACK_ENTRY);
         }
         if (callbacks_current != NULL) {
-            lfsm_run_callback(fsm, callbacks_current->on_entry);
-            lfsm_run_callback(fsm, callbacks_current->on_run);
+            LFSM_RUN_STATE_CALLBACK(fsm, callbacks_current, on_run, LFSM_CALLBACK_RUN);
         }
     } else {
         if (callbacks_current != NULL) {
-            lfsm_run_callback(fsm, callbacks_current->on_run);
+            LFSM_RUN_STATE_CALLBACK(fsm, callbacks_current, on_run, LFSM_CALLBACK_RUN);
         }
     }
+    // entry/exit callbacks of this state change are done
+    fsm->previous_step_state = fsm->current_state;
     return LFSM_OK;
 }
 
 uint8_t lfsm_no_event_queued(lfsm_context_t* fsm) {
+#if (LFSM_USE_BUILTIN_QUEUE)
+    int nothing_to_do = lfsm_events_is_empty(LFSM_EVENTS(fsm));
+#else
     int nothing_to_do = fsm->buf_func.is_empty(fsm->buffer_handle);
+#endif
     return nothing_to_do;
 }
 
-uint8_t lfsm_get_next_event(lfsm_context_t* fsm) {
-    uint8_t next_event;
+// buffer callbacks can only tell whether at least one event is queued
+uint32_t lfsm_queued_event_count(lfsm_context_t* fsm) {
+#if (LFSM_USE_BUILTIN_QUEUE)
+    return lfsm_events_count(LFSM_EVENTS(fsm));
+#else
+    return !fsm->buf_func.is_empty(fsm->buffer_handle);
+#endif
+}
+
+lfsm_id_t lfsm_get_next_event(lfsm_context_t* fsm) {
+    const lfsm_definition_t* definition = fsm->definition;
+    lfsm_id_t next_event;
     int out_of_bounds;
 
+#if (LFSM_EVENT_PAYLOADS)
+    next_event = lfsm_events_read_payload(LFSM_EVENTS(fsm), &fsm->current_payload);
+    if (fsm->current_payload.in_arena) {
+        fsm->arena_release = fsm->current_payload.arena_end;
+        fsm->arena_release_pending = 1;
+    }
+#elif (LFSM_USE_BUILTIN_QUEUE)
+    next_event = lfsm_events_read_payload(LFSM_EVENTS(fsm), NULL);
+#else
     next_event = fsm->buf_func.read(fsm->buffer_handle);
+#endif
     out_of_bounds = (next_event > fsm->event_number_max) || (next_event < fsm->event_number_min);
     if (out_of_bounds) {
+        LFSM_STATS_COUNT(fsm, events_dropped);
         return LFSM_INVALID;
     }
+    // events added from now on are queued again, the run may miss their data
+    int coalescing = (fsm->coalesce_pending != NULL) \
+                  && (next_event >= definition->event_number_min) && (next_event <= definition->event_number_max);
+    if (coalescing) {
+        uint32_t index = next_event - definition->event_number_min;
+        uint32_t bit = (uint32_t)1 << (index % 32);
+        if (definition->coalesce_events[index / 32] & bit) {
+            atomic_fetch_and_explicit(&fsm->coalesce_pending[index / 32], ~bit, memory_order_acq_rel);
+        }
+    }
     return next_event;
 }
 
-uint8_t max(uint8_t a, uint8_t b) {
+// class of the event queue, the highest class for priorities above it, 0 for
+// events of other regions than the first one
+uint8_t lfsm_event_priority(const lfsm_definition_t* definition, lfsm_id_t event) {
+#if (LFSM_EVENT_PRIORITIES > 1)
+    int in_range = (event >= definition->event_number_min) && (event <= definition->event_number_max);
+    if ((definition->event_priorities != NULL) && in_range) {
+        uint8_t priority = definition->event_priorities[event - definition->event_number_min];
+        return (priority < LFSM_EVENT_PRIORITIES) ? priority : LFSM_EVENT_PRIORITIES - 1;
+    }
+#endif
+    return 0;
+}
+
+lfsm_return_t lfsm_coalesce_alloc(lfsm_context_t* fsm) {
+    const lfsm_definition_t* definition = fsm->definition;
+    if (definition->coalesce_events == NULL) return LFSM_OK;
+    fsm->coalesce_pending = calloc(LFSM_COALESCE_WORDS(definition->event_count), sizeof(_Atomic uint32_t));
+    return (fsm->coalesce_pending != NULL) ? LFSM_OK : LFSM_ERROR;
+}
+
+// Puts an event (in range) into the queue of an instance. LFSM_NOP if it
+// was coalesced with a queued one, LFSM_ERROR if the queue is full.
+lfsm_return_t lfsm_enqueue_event(lfsm_context_t* fsm, lfsm_id_t event) {
+    const lfsm_definition_t* definition = fsm->definition;
+
+    // with regions only events of the first one's definition can coalesce
+    int coalescing = (definition->coalesce_events != NULL) \
+                  && (event >= definition->event_number_min) && (event <= definition->event_number_max);
+    if (coalescing) {
+        uint32_t index = event - definition->event_number_min;
+        if (definition->coalesce_events[index / 32] & ((uint32_t)1 << (index % 32))) {
+            return lfsm_add_coalescing_event(fsm, event);
+        }
+    }
+
+#if (LFSM_USE_BUILTIN_QUEUE)
+    uint8_t error = lfsm_events_add_payload(LFSM_EVENTS(fsm), lfsm_event_priority(definition, event), event, NULL);
+#else
+    uint8_t error = fsm->buf_func.add(fsm->buffer_handle, event);
+#endif
+    if (error) {
+        LFSM_STATS_COUNT_PRODUCER(fsm, queue_full);
+        return LFSM_ERROR;
+    }
+    return LFSM_OK;
+}
+
+// The pending bit is set with a read-modify-write like it is cleared by the
+// consumer, so a producer that finds it set is ordered before the clearing
+// and its data is seen by the run of the queued event.
+lfsm_return_t lfsm_add_coalescing_event(lfsm_context_t* fsm, lfsm_id_t event) {
+    uint32_t index = event - fsm->definition->event_number_min;
+    uint32_t bit = (uint32_t)1 << (index % 32);
+    _Atomic uint32_t* pending = &fsm->coalesce_pending[index / 32];
+
+    if (atomic_fetch_or_explicit(pending, bit, memory_order_acq_rel) & bit) {
+        LFSM_STATS_COUNT_PRODUCER(fsm, events_coalesced);
+        return LFSM_NOP;
+    }
+#if (LFSM_USE_BUILTIN_QUEUE)
+    uint8_t error = lfsm_events_add_payload(LFSM_EVENTS(fsm), lfsm_event_priority(fsm->definition, event), event, NULL);
+#else
+    uint8_t error = fsm->buf_func.add(fsm->buffer_handle, event);
+#endif
+    if (error) {
+        atomic_fetch_and_explicit(pending, ~bit, memory_order_relaxed);
+        LFSM_STATS_COUNT_PRODUCER(fsm, queue_full);
+        return LFSM_ERROR;
+    }
+    return LFSM_OK;
+}
+
+// Payloads of the events run so far are no longer needed, hand their arena
+// memory back to the producer in one step.
+void lfsm_release_payloads(lfsm_context_t* fsm) {
+#if (LFSM_EVENT_PAYLOADS)
+    static const lfsm_queue_payload_t no_payload = { NULL, 0, 0, 0 };
+    fsm->current_payload = no_payload;
+    if (fsm->arena_release_pending) {
+        atomic_store_explicit(&fsm->arena_tail, fsm->arena_release, memory_order_release);
+        fsm->arena_release_pending = 0;
+    }
+#endif
+}
+
+int max(int a, int b) {
     if (a > b) return a;
     return b;
 }
 
-uint8_t min(uint8_t a, uint8_t b) {
+int min(int a, int b) {
     if (a < b) return a;
     return b;
 }
 
-void lfsm_find_state_event_min_max_count(lfsm_t context) {
-    int list_length = context->transition_count;
-    lfsm_transitions_t* transition = context->transition_table;
-    uint8_t max_state = 0;
-    uint8_t min_state  = 255;
-    uint8_t max_event = 0;
-    uint8_t min_event  = 255;
+// fails if a state or event does not fit lfsm_id_t (see LFSM_ID_BITS)
+lfsm_return_t lfsm_find_state_event_min_max_count(lfsm_definition_t* definition) {
+    int list_length = definition->transition_count;
+    const lfsm_transitions_t* transition = definition->transition_table;
+    int max_state = 0;
+    int min_state  = INT32_MAX;
+    int max_event = 0;
+    int min_event  = INT32_MAX;
 
     for (int i = 0; i < list_length ; i++, transition++) {
         min_event = min(min_event, transition->event);
@@ -454,46 +3399,128 @@ void lfsm_find_state_event_min_max_count(lfsm_t context) {
         min_state = min(min_state, min(transition->current_state, transition->next_state));
         max_state = max(max_state, max(transition->current_state, transition->next_state));
     }
-    context->state_number_min = min_state;
-    context->state_number_max = max_state;
-    context->event_number_min = min_event;
-    context->event_number_max = max_event;
-    context->event_count = max_event - min_event + 1;
+    // parents may have no transitions of their own, their functions still run
+    const lfsm_state_functions_t* functions = definition->functions_table;
+    for (int i = 0 ; (functions != NULL) && (i < definition->state_func_count) ; i++, functions++) {
+        if (functions->parent == 0) continue;
+        min_state = min(min_state, min(functions->state, functions->parent - 1));
+        max_state = max(max_state, max(functions->state, functions->parent - 1));
+    }
+    int out_of_range = (min_state < 0) || (min_event < 0) \
+                    || ((uint32_t)max_state > LFSM_ID_MAX) || ((uint32_t)max_event > LFSM_ID_MAX);
+    if (out_of_range) return LFSM_ERROR;
+
+    definition->state_number_min = min_state;
+    definition->state_number_max = max_state;
+    definition->event_number_min = min_event;
+    definition->event_number_max = max_event;
+    definition->event_count = max_event - min_event + 1;
+    return LFSM_OK;
 }
 
-lfsm_return_t lfsm_alloc_lookup_table(lfsm_t context) {
-    uint8_t range_state_numbers = context->state_number_max - context->state_number_min + 1;
-    uint8_t range_event_numbers = context->event_number_max - context->event_number_min + 1;
-    
-    uint32_t max_lookup_elements = range_state_numbers * range_event_numbers;
-    context->transition_lookup_table = malloc(max_lookup_elements * sizeof(lfsm_transitions_t*));
-    if (context->transition_lookup_table == NULL) {
+// transition_lookup may be NULL if no dense (state,event) index is needed
+lfsm_return_t lfsm_alloc_lookup_table(lfsm_definition_t* definition, lfsm_transitions_t*** transition_lookup, lfsm_state_functions_t*** function_lookup) {
+    uint32_t range_state_numbers = definition->state_number_max - definition->state_number_min + 1;
+    uint32_t range_event_numbers = definition->event_number_max - definition->event_number_min + 1;
+
+    size_t max_lookup_elements = (size_t)range_state_numbers * range_event_numbers;
+    if (transition_lookup != NULL) {
+        *transition_lookup = calloc(max_lookup_elements, sizeof(lfsm_transitions_t*));
+        if (*transition_lookup == NULL) {
+            return LFSM_ERROR;
+        }
+    }
+    *function_lookup = calloc(range_state_numbers, sizeof(lfsm_state_functions_t*));
+    if (*function_lookup == NULL) {
+        if (transition_lookup != NULL) free(*transition_lookup);
         return LFSM_ERROR;
     }
-    context->function_lookup_table = malloc(range_state_numbers * sizeof(lfsm_state_functions_t*));
-    if (context->function_lookup_table == NULL) {
-        free(context->transition_lookup_table);
+    return LFSM_OK;
+}
+
+// number of distinct state/event combinations in the sorted transition table
+int lfsm_count_state_event_pairs(lfsm_definition_t* definition) {
+    const lfsm_transitions_t* transition = definition->transition_table;
+    int pair_count = 1;
+
+    for (int i = 1 ; i < definition->transition_count ; i++, transition++) {
+        int differs_from_previous_transition = (transition->current_state != (transition+1)->current_state) \
+                                            || (transition->event != (transition+1)->event);
+        pair_count += differs_from_previous_transition;
+    }
+    return pair_count;
+}
+
+lfsm_index_type_t lfsm_choose_index_type(lfsm_definition_t* definition, int pair_count) {
+    uint32_t range_state_numbers = definition->state_number_max - definition->state_number_min + 1;
+    uint64_t dense_elements = (uint64_t)range_state_numbers * definition->event_count;
+
+    if ((uint64_t)pair_count * 100 < dense_elements * LFSM_SPARSE_INDEX_DENSITY) {
+        return LFSM_INDEX_HASH;
+    }
+    return LFSM_INDEX_DENSE;
+}
+
+// Fibonacci hashing of the state/event pair, returns the top bits
+uint32_t lfsm_hash_index_slot(lfsm_id_t state, lfsm_id_t event, uint8_t hash_shift) {
+    uint32_t key = ((uint32_t)state << 16) ^ event;
+    return (uint32_t)(key * 2654435769u) >> hash_shift;
+}
+
+// at least twice as many slots as pairs, so probe sequences stay short
+lfsm_return_t lfsm_alloc_hash_index(lfsm_definition_t* definition, int pair_count, lfsm_index_entry_t** hash_index) {
+    uint32_t slot_count = 4;
+    uint8_t hash_shift = 30;
+
+    while (slot_count < 2 * (uint32_t)pair_count) {
+        slot_count <<= 1;
+        hash_shift--;
+    }
+    *hash_index = calloc(slot_count, sizeof(lfsm_index_entry_t));
+    if (*hash_index == NULL) {
         return LFSM_ERROR;
     }
-    memset(context->transition_lookup_table , 0, max_lookup_elements * sizeof(lfsm_transitions_t*));
-    memset(context->transition_lookup_table , 0, range_state_numbers * sizeof(lfsm_state_functions_t*));
+    definition->hash_shift = hash_shift;
+    return LFSM_OK;
+}
+
+lfsm_return_t lfsm_fill_hash_index(lfsm_definition_t* definition, lfsm_index_entry_t* hash_index) {
+    const lfsm_transitions_t* transition = definition->transition_table;
+
+    for (int i = 0 ; i < definition->transition_count ; i++, transition++) {
+        int first_of_pair = (i == 0) || (transition->current_state != (transition-1)->current_state) \
+                                     || (transition->event != (transition-1)->event);
+        if (!first_of_pair) continue;
+        lfsm_hash_index_insert(definition, hash_index, transition->current_state, transition->event, transition);
+    }
     return LFSM_OK;
 }
 
-lfsm_return_t lfsm_fill_transition_lookup_table(lfsm_t context) {
-    lfsm_transitions_t* transition = lfsm_get_transition_table(context);
-    lfsm_transitions_t** transition_lookup = lfsm_get_transition_lookup_table(context);
-    uint8_t current_state, previous_state, current_event, previous_event;
-    uint8_t state_count, event_count, state_offset, event_offset;
-    int transition_count, address_offset, differs_from_previous_transition;
+// the pair must not be in the index yet
+void lfsm_hash_index_insert(lfsm_definition_t* definition, lfsm_index_entry_t* hash_index, lfsm_id_t state, lfsm_id_t event, const lfsm_transitions_t* transition) {
+    uint32_t slot_mask = (UINT32_MAX >> definition->hash_shift);
+    uint32_t slot = lfsm_hash_index_slot(state, event, definition->hash_shift);
+
+    while (hash_index[slot].transition != NULL) {
+        slot = (slot + 1) & slot_mask;
+    }
+    hash_index[slot].state = state;
+    hash_index[slot].event = event;
+    hash_index[slot].transition = transition;
+}
+
+lfsm_return_t lfsm_fill_transition_lookup_table(lfsm_definition_t* definition, lfsm_transitions_t** transition_lookup) {
+    lfsm_transitions_t* transition = (lfsm_transitions_t*)definition->transition_table;
+    lfsm_id_t current_state, previous_state, current_event, previous_event;
+    size_t event_count, state_offset, event_offset, address_offset;
+    int transition_count, differs_from_previous_transition;
 
     if ((transition == NULL) || (transition_lookup == 0)) return LFSM_ERROR;
 
-    transition_count = lfsm_get_transition_count(context);
-    state_offset = lfsm_get_state_min(context);
-    state_count  = lfsm_get_state_max(context) - state_offset + 1;
-    event_offset = lfsm_get_event_min(context);
-    event_count  = lfsm_get_event_max(context) - event_offset + 1;
+    transition_count = definition->transition_count;
+    state_offset = definition->state_number_min;
+    event_offset = definition->event_number_min;
+    event_count  = definition->event_count;
     // fill with value that is 100% not the value of the first element!
     previous_state = transition->current_state + 1;
     previous_event = transition->event + 1;
@@ -515,27 +3542,224 @@ lfsm_return_t lfsm_fill_transition_lookup_table(lfsm_t context) {
     return LFSM_OK;
 }
 
-lfsm_return_t lfsm_fill_state_function_lookup_table(lfsm_t context) {
+// states that never appear in a transition have no lookup entry and are skipped
+lfsm_return_t lfsm_fill_state_function_lookup_table(lfsm_definition_t* definition, lfsm_state_functions_t** function_lookup) {
     lfsm_state_functions_t* state_table;
-    lfsm_state_functions_t** state_lookup_table;
-    uint8_t state_offset;
-    uint8_t state_table_size;
-    uint8_t address_offset;
-
-    state_table = lfsm_get_state_function_table(context);
-    state_offset = lfsm_get_state_min(context);
-    state_lookup_table = lfsm_get_state_function_lookup_table(context);
-    state_table_size = lfsm_get_state_max(context) - state_offset + 1;
-
-    for (int i = 0 ; i < state_table_size ; i++) {
-        address_offset = state_table->state - state_offset;
-        *(state_lookup_table + address_offset) = state_table;
+    int state_offset;
+    int address_offset;
+
+    state_table = (lfsm_state_functions_t*)definition->functions_table;
+    state_offset = definition->state_number_min;
+    if (state_table == NULL) return LFSM_OK;
+
+    for (int i = 0 ; i < definition->state_func_count ; i++) {
+        int out_of_bounds = (state_table->state < definition->state_number_min) \
+                            || (state_table->state > definition->state_number_max);
+        if (!out_of_bounds) {
+            address_offset = state_table->state - state_offset;
+            *(function_lookup + address_offset) = state_table;
+        }
         state_table++;
     }
 
     return LFSM_OK;
 }
 
+// Needs the state function lookup table (and the state paths of a
+// hierarchy). Flat machines have the same rules as lfsm_run_all_callbacks():
+// exit and entry only if the state changes.
+void lfsm_fill_dispatch_table(lfsm_definition_t* definition, lfsm_dispatch_t* dispatch_table) {
+    const lfsm_state_functions_t* const* function_lookup = definition->function_lookup_table;
+
+    for (uint32_t i = 0 ; i < definition->transition_count ; i++) {
+        const lfsm_transitions_t* transition = &definition->transition_table[i];
+        lfsm_dispatch_t* dispatch = &dispatch_table[i];
+        int state_changes = (transition->next_state != transition->current_state);
+        int next_in_range = (transition->next_state >= definition->state_number_min) \
+                            && (transition->next_state <= definition->state_number_max);
+
+        dispatch->from = function_lookup[transition->current_state - definition->state_number_min];
+        dispatch->to = next_in_range ? function_lookup[transition->next_state - definition->state_number_min] : NULL;
+        dispatch->next_state = transition->next_state;
+        dispatch->callbacks = 0;
+        dispatch->lca_depth = 0;
+        if (definition->state_paths != NULL) {
+            // the states to exit depend on the current state (inherited events)
+            dispatch->callbacks = LFSM_DISPATCH_PATH;
+            dispatch->lca_depth = lfsm_common_ancestor_depth(definition, transition->current_state, transition->next_state);
+        } else {
+            if (state_changes && (dispatch->from != NULL) && (dispatch->from->on_exit != NULL)) {
+                dispatch->callbacks |= LFSM_DISPATCH_EXIT;
+            }
+            if (state_changes && (dispatch->to != NULL) && (dispatch->to->on_entry != NULL)) {
+                dispatch->callbacks |= LFSM_DISPATCH_ENTRY;
+            }
+        }
+        if ((dispatch->to != NULL) && (dispatch->to->on_run != NULL)) {
+            dispatch->callbacks |= LFSM_DISPATCH_RUN;
+        }
+    }
+}
+
+int lfsm_has_hierarchy(const lfsm_definition_t* definition) {
+    for (uint32_t i = 0 ; (definition->functions_table != NULL) && (i < definition->state_func_count) ; i++) {
+        if (definition->functions_table[i].parent != 0) return 1;
+    }
+    return 0;
+}
+
+// One allocation: the paths of all states in the range, followed by their
+// functions. Like in the function lookup table, the last entry of a state
+// in the functions table counts.
+lfsm_return_t lfsm_build_state_paths(lfsm_definition_t* definition) {
+    uint32_t state_range = definition->state_number_max - definition->state_number_min + 1;
+    lfsm_state_path_t* scratch = calloc(state_range, sizeof(lfsm_state_path_t));
+    const lfsm_state_functions_t** functions = calloc(state_range, sizeof(lfsm_state_functions_t*));
+    lfsm_state_path_t* paths = NULL;
+    size_t function_count = 0;
+    lfsm_return_t result = LFSM_ERROR;
+
+    if ((scratch == NULL) || (functions == NULL)) {
+        free(scratch);
+        free(functions);
+        return LFSM_ERROR;
+    }
+    for (uint32_t state = 0 ; state < state_range ; state++) {
+        scratch[state].parent = LFSM_INVALID;
+    }
+    for (uint32_t i = 0 ; i < definition->state_func_count ; i++) {
+        const lfsm_state_functions_t* entry = &definition->functions_table[i];
+        int out_of_bounds = (entry->state < (int)definition->state_number_min) \
+                            || (entry->state > (int)definition->state_number_max);
+        if (out_of_bounds) continue;
+        functions[entry->state - definition->state_number_min] = entry;
+        scratch[entry->state - definition->state_number_min].parent = (entry->parent != 0) ? entry->parent - 1 : LFSM_INVALID;
+    }
+    // a cycle never reaches a top level state and ends up too deep
+    int too_deep = 0;
+    for (uint32_t state = 0 ; (state < state_range) && !too_deep ; state++) {
+        uint32_t depth = 1;
+        lfsm_id_t parent = scratch[state].parent;
+        for ( ; (parent != LFSM_INVALID) && (depth <= LFSM_MAX_STATE_DEPTH) ; depth++) {
+            parent = scratch[parent - definition->state_number_min].parent;
+        }
+        too_deep = (depth > LFSM_MAX_STATE_DEPTH);
+        scratch[state].depth = depth;
+        function_count += depth;
+    }
+
+    if (!too_deep) {
+        paths = malloc(state_range * sizeof(lfsm_state_path_t) + function_count * sizeof(lfsm_state_functions_t*));
+    }
+    if (paths != NULL) {
+        const lfsm_state_functions_t** path_functions = (const lfsm_state_functions_t**)(paths + state_range);
+        for (uint32_t state = 0 ; state < state_range ; state++) {
+            uint32_t ancestor = state;
+            paths[state] = scratch[state];
+            paths[state].functions = path_functions;
+            for (uint32_t i = 0 ; i < scratch[state].depth ; i++) {
+                *path_functions++ = functions[ancestor];
+                if (scratch[ancestor].parent != LFSM_INVALID) {
+                    ancestor = scratch[ancestor].parent - definition->state_number_min;
+                }
+            }
+        }
+        definition->state_paths = paths;
+        result = LFSM_OK;
+    }
+    free(scratch);
+    free(functions);
+    return result;
+}
+
+// position of the first transition not preceding (state,event) in the
+// sorted table
+uint32_t lfsm_transitions_lower_bound(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event) {
+    lfsm_transitions_t key = { .current_state = state, .event = event };
+    uint32_t low = 0;
+    uint32_t high = definition->transition_count;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (lfsm_transition_precedes(&definition->transition_table[middle], &key)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// first transition of the (state,event) block or NULL, without an index
+const lfsm_transitions_t* lfsm_search_transitions(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event) {
+    uint32_t position = lfsm_transitions_lower_bound(definition, state, event);
+    const lfsm_transitions_t* transition = &definition->transition_table[position];
+
+    if ((position < definition->transition_count) && ((lfsm_id_t)transition->current_state == state) \
+            && ((lfsm_id_t)transition->event == event)) {
+        return transition;
+    }
+    return NULL;
+}
+
+// Adds a (state,event) entry to the index for every event a state has no
+// transitions for but one of its ancestors has, pointing to the block of the
+// nearest such ancestor. Returns the number of these pairs, with both index
+// pointers NULL it only counts them.
+int lfsm_inherit_transitions(lfsm_definition_t* definition, const lfsm_transitions_t** transition_lookup, lfsm_index_entry_t* hash_index) {
+    const lfsm_state_path_t* paths = definition->state_paths;
+    const lfsm_transitions_t* table = definition->transition_table;
+    lfsm_id_t state_offset = definition->state_number_min;
+    int inherited = 0;
+
+    for (uint32_t state = definition->state_number_min ; state <= definition->state_number_max ; state++) {
+        lfsm_id_t ancestor = paths[state - state_offset].parent;
+        for ( ; ancestor != LFSM_INVALID ; ancestor = paths[ancestor - state_offset].parent) {
+            uint32_t position = lfsm_transitions_lower_bound(definition, ancestor, 0);
+            for ( ; (position < definition->transition_count) && ((lfsm_id_t)table[position].current_state == ancestor) ; position++) {
+                const lfsm_transitions_t* block = &table[position];
+                if ((position > 0) && (block->event == (block - 1)->event) \
+                        && (block->current_state == (block - 1)->current_state)) continue;
+
+                // handled by the state itself or by an ancestor below this one
+                int handled = 0;
+                for (lfsm_id_t below = state ; below != ancestor ; below = paths[below - state_offset].parent) {
+                    if (lfsm_search_transitions(definition, below, block->event) != NULL) {
+                        handled = 1;
+                        break;
+                    }
+                }
+                if (handled) continue;
+
+                inherited++;
+                if (transition_lookup != NULL) {
+                    transition_lookup[(size_t)(state - state_offset) * definition->event_count \
+                                      + block->event - definition->event_number_min] = block;
+                }
+                if (hash_index != NULL) {
+                    lfsm_hash_index_insert(definition, hash_index, state, block->event, block);
+                }
+            }
+        }
+    }
+    return inherited;
+}
+
+// depth of the deepest state on both paths, 0 if the paths only meet above
+// the top level states
+uint8_t lfsm_common_ancestor_depth(const lfsm_definition_t* definition, lfsm_id_t first, lfsm_id_t second) {
+    const lfsm_state_path_t* paths = definition->state_paths;
+    lfsm_id_t offset = definition->state_number_min;
+
+    while (paths[first - offset].depth > paths[second - offset].depth) first = paths[first - offset].parent;
+    while (paths[second - offset].depth > paths[first - offset].depth) second = paths[second - offset].parent;
+    while (first != second) {
+        if (paths[first - offset].depth == 1) return 0;
+        first = paths[first - offset].parent;
+        second = paths[second - offset].parent;
+    }
+    return paths[first - offset].depth;
+}
 
 int lfsm_always() {
     return 1;
@@ -5,6 +5,7 @@
 #define lfsm_init(transition_table, state_table, buf_callbacks, user_data, initial_state) lfsm_init_func(&transition_table[0], ARRAYSIZE(transition_table), &state_table[0], ARRAYSIZE(state_table), buf_callbacks, user_data, initial_state)
 // --------------------------------------------
 #include <stdint.h>
+#include <stdatomic.h>
 #include "lovely_fsm_config.h"
 /* -----------------------------------------------------------------------------
  *  User exposed pointer to LFSM context and function return types
@@ -17,7 +18,15 @@ typedef enum lfsm_return_t {
     LFSM_ERROR,
 } lfsm_return_t;
 
-#define LFSM_INVALID  0xFE
+// largest id value - 1, never a valid state or event (see LFSM_ID_BITS)
+#define LFSM_INVALID  ((lfsm_id_t)~(lfsm_id_t)1)
+#define LFSM_ID_MAX   ((lfsm_id_t)(LFSM_INVALID - 1))
+
+// result of lfsm_run_batch() / lfsm_run_until_empty()
+typedef struct lfsm_batch_result_t {
+    uint32_t events;      // events taken from the queue
+    uint32_t transitions; // transitions executed (including self transitions)
+} lfsm_batch_result_t;
 
 /* -----------------------------------------------------------------------------
  *  For convenience
@@ -33,20 +42,144 @@ typedef struct lfsm_state_functions_t {
     lfsm_return_t (*on_entry) ( lfsm_t );
     lfsm_return_t (*on_run  ) ( lfsm_t );
     lfsm_return_t (*on_exit ) ( lfsm_t );
+    int parent; // LFSM_PARENT(state), 0 for a top level state; may be left out of initializers
 } lfsm_state_functions_t;
 
+// Hierarchical states: a state with a parent takes every event it has no
+// transition for from its nearest ancestor that has one. On a transition
+// the states are exited from the current state up to the least common
+// ancestor of the state declaring the transition and the next state, and
+// entered from below it down to the next state (on_exit innermost first,
+// on_entry outermost first). A transition to the declaring state itself or
+// one of its descendants does not exit the declaring state. Any state can
+// be the current one, entering a parent does not enter a child. on_run is
+// only called for the current state.
+#define LFSM_PARENT(state) ((state) + 1)
+
 typedef struct lfsm_transitions_t {
     int current_state;
     int event;
     int (*condition)( lfsm_t );
     int next_state;
+    uint8_t flags; // LFSM_EXCLUSIVE_GUARD, may be left out of initializers
 } lfsm_transitions_t;
 
+// The condition never accepts together with another one of the same
+// (state,event), so the guards may be tried in any order. If all
+// transitions of a (state,event) have guards and this flag, every instance
+// counts which one accepts and tries the most frequent first (see
+// LFSM_ADAPTIVE_GUARDS).
+#define LFSM_EXCLUSIVE_GUARD  0x01
+
+/* -----------------------------------------------------------------------------
+ *  Compiled machine definition
+ *
+ *  Sorted transition table plus the (state,event) and state function lookup
+ *  tables. A definition is immutable and shared by any number of instances.
+ *  lfsm_init() compiles one at runtime (once per transition table), or use
+ *  lfsm_definition_compile() and lfsm_init_definition() directly. It may also
+ *  be generated ahead of time as const data using tools/lfsm_gen.
+ *
+ *  The (state,event) index is either a dense table over all state/event
+ *  combinations or, for sparse machines, an open addressing hash table that
+ *  only stores existing combinations (see LFSM_SPARSE_INDEX_DENSITY).
+ *  LFSM_INDEX_LINEAR builds no index and scans the sorted transition table
+ *  like lovelyFSM-light, it is never chosen automatically.
+ * -------------------------------------------------------------------------- */
+typedef enum lfsm_index_type_t {
+    LFSM_INDEX_AUTO,
+    LFSM_INDEX_DENSE,
+    LFSM_INDEX_HASH,
+    LFSM_INDEX_LINEAR,
+} lfsm_index_type_t;
+
+// Transition with its callbacks resolved when the definition is built, one
+// per entry of the sorted transition table. Running it needs no state
+// function lookup; 'callbacks' tells which ones exist for this transition
+// (exit/entry only if the state changes).
+#define LFSM_DISPATCH_EXIT   0x01
+#define LFSM_DISPATCH_ENTRY  0x02
+#define LFSM_DISPATCH_RUN    0x04
+// hierarchical states: exit and entry along the state paths, see below
+#define LFSM_DISPATCH_PATH   0x08
+
+typedef struct lfsm_dispatch_t {
+    const lfsm_state_functions_t* from; // functions of current_state or NULL
+    const lfsm_state_functions_t* to;   // functions of next_state or NULL
+    lfsm_id_t next_state;
+    uint8_t callbacks; // LFSM_DISPATCH_EXIT | LFSM_DISPATCH_ENTRY | LFSM_DISPATCH_RUN | LFSM_DISPATCH_PATH
+    uint8_t lca_depth; // LFSM_DISPATCH_PATH: depth of the least common ancestor, 0 for none
+} lfsm_dispatch_t;
+
+// Path of a state up to its top level state, built with the definition of a
+// machine with hierarchical states. functions[0] belongs to the state
+// itself, functions[depth - 1] to its top level state (NULL without
+// functions). A transition with LFSM_DISPATCH_PATH exits
+// functions[0 .. depth - lca_depth - 1] of the current state's path and
+// enters the same slice of the next state's path backwards, so running it
+// never walks the hierarchy.
+typedef struct lfsm_state_path_t {
+    const lfsm_state_functions_t* const* functions;
+    lfsm_id_t parent; // LFSM_INVALID for a top level state
+    uint8_t depth;    // 1 for a top level state
+} lfsm_state_path_t;
+
+// Dispatcher generated by 'lfsm_gen --switch': runs one event (guards and
+// callbacks called directly, no table lookups) and stores the next state
+// in *state before the callbacks run, like lfsm_run().
+typedef enum lfsm_step_result_t {
+    LFSM_STEP_NONE,       // no transition for the (state,event), on_run ran
+    LFSM_STEP_REJECTED,   // all guards rejected, no callbacks ran
+    LFSM_STEP_TRANSITION, // transition executed
+} lfsm_step_result_t;
+typedef lfsm_step_result_t (*lfsm_step_func_t)(lfsm_t fsm, lfsm_id_t* state, lfsm_id_t event);
+
+typedef struct lfsm_index_entry_t {
+    lfsm_id_t state;
+    lfsm_id_t event;
+    const lfsm_transitions_t* transition; // NULL for an empty slot
+} lfsm_index_entry_t;
+
+typedef struct lfsm_definition_t {
+    const lfsm_transitions_t*            transition_table;
+    const lfsm_state_functions_t*        functions_table;
+    const lfsm_transitions_t* const*     transition_lookup_table; // dense index
+    const lfsm_state_functions_t* const* function_lookup_table;
+    const lfsm_index_entry_t*            hash_index; // hash index
+    const lfsm_dispatch_t*               dispatch_table; // NULL: resolved per event
+    lfsm_step_func_t                     step; // generated dispatcher, NULL: tables
+    const uint32_t*                      coalesce_events; // bitmap, NULL: none, see below
+    const uint8_t*                       event_priorities; // per event, NULL: all 0, see below
+    const lfsm_state_path_t*             state_paths; // per state, NULL: no hierarchy (needs dispatch_table)
+    uint8_t index_type;
+    uint8_t hash_shift; // 32 - log2(number of hash index slots)
+    uint32_t transition_count;
+    uint32_t state_func_count;
+    lfsm_id_t state_number_min;
+    lfsm_id_t state_number_max;
+    lfsm_id_t event_number_min;
+    lfsm_id_t event_number_max;
+    uint32_t event_count;
+} lfsm_definition_t;
+
+// Coalescing events: bit (event - event_number_min) of coalesce_events set
+// means adding the event while the same event is still queued for the
+// instance does nothing (and returns LFSM_OK), e.g. for a measurement that
+// is read by the guards anyway. The bit is cleared when the queued event is
+// taken for running. Set coalesce_events before creating instances from
+// the definition; fsm_add_event_payload() never coalesces.
+#define LFSM_COALESCE_WORDS(event_count) (((event_count) + 31) / 32)
+
+// Event priorities (LFSM_EVENT_PRIORITIES > 1): event_priorities[event -
+// event_number_min] is the class of the event, higher classes are run
+// first, events of one class in the order they were added. Classes above
+// LFSM_EVENT_PRIORITIES - 1 use the highest one. Ignored with one class.
+
 
 /* -----------------------------------------------------------------------------
  *  Buffer Setup
  * -------------------------------------------------------------------------- */
-#ifdef USE_LOVELY_BUFFER
+#if (USE_LOVELY_BUFFER)
 typedef uint8_t (*lfsm_buf_sys_init_func_t)();
 typedef buffer_handle_type (*lfsm_buf_init_func_t)(buf_data_info_t*);
 #else
@@ -68,9 +201,17 @@ typedef struct lfsm_buf_callbacks_t {
     lfsm_buf_is_full_func_t   is_full ;
 } lfsm_buf_callbacks_t;
 
-lfsm_return_t fsm_add_event(lfsm_t context, uint8_t event);
+lfsm_return_t fsm_add_event(lfsm_t context, lfsm_id_t event);
 lfsm_return_t lfsm_deinit(lfsm_t context);
+
+// Event payloads (LFSM_EVENT_PAYLOADS), without it these always fail/return NULL
+lfsm_return_t fsm_add_event_payload(lfsm_t context, lfsm_id_t event, const void* data, uint32_t length);
+void* lfsm_payload_alloc(lfsm_t context, uint32_t size);
+const void* lfsm_event_payload(lfsm_t context, uint32_t* length);
+
 lfsm_return_t lfsm_run(lfsm_t context);
+lfsm_batch_result_t lfsm_run_batch(lfsm_t context, uint32_t max_events);
+lfsm_batch_result_t lfsm_run_until_empty(lfsm_t context);
 
 lfsm_t lfsm_init_func(lfsm_transitions_t* transitions, \
                         int trans_count,\
@@ -78,34 +219,384 @@ lfsm_t lfsm_init_func(lfsm_transitions_t* transitions, \
                         int state_count,\
                         lfsm_buf_callbacks_t buffer_callbacks, \
                         void* user_data, \
-                        uint8_t initial_state);
+                        lfsm_id_t initial_state);
+
+lfsm_t lfsm_init_definition(const lfsm_definition_t* definition, \
+                        lfsm_buf_callbacks_t buffer_callbacks, \
+                        void* user_data, \
+                        lfsm_id_t initial_state);
+
+lfsm_return_t lfsm_definition_build(lfsm_definition_t* definition, \
+                        lfsm_transitions_t* transitions, \
+                        int trans_count, \
+                        lfsm_state_functions_t* states, \
+                        int state_count, \
+                        lfsm_index_type_t index_type);
+void lfsm_definition_release(lfsm_definition_t* definition);
+// First transition of the (state,event) block lfsm_run() would try, also for
+// events the state inherits from an ancestor; NULL if there is none. O(1)
+// unless the definition has no index (LFSM_INDEX_LINEAR).
+const lfsm_transitions_t* lfsm_lookup_transition(const lfsm_definition_t* definition, lfsm_id_t state, lfsm_id_t event);
+
+const lfsm_definition_t* lfsm_definition_compile(lfsm_transitions_t* transitions, \
+                        int trans_count, \
+                        lfsm_state_functions_t* states, \
+                        int state_count);
+void lfsm_definition_free(const lfsm_definition_t* definition);
 
 void* lfsm_user_data(lfsm_t context);
-uint8_t lfsm_get_state(lfsm_t context);
+void lfsm_set_user_data(lfsm_t context, void* user_data);
+lfsm_id_t lfsm_get_state(lfsm_t context);
+
+// Scheduling word of an instance for executors (see lovely_fsm_executor.h),
+// 0 after init. Not used by lovelyFSM itself.
+_Atomic uint32_t* lfsm_scheduling_state(lfsm_t context);
+
+/* -----------------------------------------------------------------------------
+ *  Statistics (LFSM_ENABLE_STATS)
+ *
+ *  Every instance counts events and transitions while it runs and measures
+ *  the cycles spent in each state callback. lfsm_get_stats() returns a copy
+ *  of the counters, it may be called from any thread. Instances in groups
+ *  are not counted.
+ * -------------------------------------------------------------------------- */
+typedef enum lfsm_callback_kind_t {
+    LFSM_CALLBACK_ENTRY,
+    LFSM_CALLBACK_RUN,
+    LFSM_CALLBACK_EXIT,
+    LFSM_CALLBACK_KINDS,
+} lfsm_callback_kind_t;
+
+typedef struct lfsm_callback_stats_t {
+    uint32_t calls;
+    uint64_t cycles; // sum over all calls
+    uint32_t histogram[LFSM_STATS_HISTOGRAM_BUCKETS];
+} lfsm_callback_stats_t;
+
+typedef struct lfsm_transition_stats_t {
+    uint32_t fired;
+    uint32_t guard_evaluations;
+    uint32_t guard_rejections;
+} lfsm_transition_stats_t;
+
+typedef struct lfsm_state_stats_t {
+    lfsm_id_t state;
+    lfsm_callback_stats_t callbacks[LFSM_CALLBACK_KINDS];
+} lfsm_state_stats_t;
+
+typedef struct lfsm_stats_t {
+    uint32_t events_run;
+    uint32_t events_without_transition; // no transition for the (state,event)
+    uint32_t events_dropped;  // out of range when run (buffer callbacks only)
+    uint32_t events_rejected; // out of range when added
+    uint32_t queue_full;      // adding failed, the queue was full
+    uint32_t events_coalesced; // not queued, the same event was pending
+    uint32_t transition_count; // same order as the sorted transition table
+    uint32_t state_count;      // state_number_min .. state_number_max
+    lfsm_transition_stats_t* transitions;
+    lfsm_state_stats_t* states;
+} lfsm_stats_t;
+
+// Snapshot of the counters, free it with lfsm_stats_free(). NULL without
+// LFSM_ENABLE_STATS.
+lfsm_stats_t* lfsm_get_stats(lfsm_t context);
+void lfsm_stats_free(lfsm_stats_t* stats);
+
+/* -----------------------------------------------------------------------------
+ *  Transition trace (LFSM_ENABLE_TRACE)
+ *
+ *  lfsm_run() and lfsm_run_batch() write a record per transition into a ring
+ *  of the calling thread (LFSM_TRACE_RING_SIZE records, the oldest ones are
+ *  overwritten). lfsm_trace_dump() writes all rings in the binary format
+ *  below, tools/lfsm_trace converts it to Chrome/Perfetto trace JSON. Rings
+ *  are allocated on the first traced transition of a thread and kept, so
+ *  the records of finished threads can still be dumped. Instances in groups
+ *  are not traced.
+ *
+ *  Dump format (host byte order): lfsm_trace_header_t, then per thread an
+ *  lfsm_trace_thread_t followed by its records, oldest first.
+ * -------------------------------------------------------------------------- */
+#define LFSM_TRACE_MAGIC "LFSMTRC1"
+
+typedef struct lfsm_trace_record_t {
+    uint64_t timestamp;  // LFSM_TRACE_CLOCK() ticks
+    uint32_t instance;   // pool index of the instance
+    uint32_t event;
+    uint32_t from_state;
+    uint32_t to_state;
+    uint32_t guard;      // position of the transition in its (state,event) block
+    uint32_t sequence;   // n-th record of the thread (low 32 bits)
+} lfsm_trace_record_t;
+
+typedef struct lfsm_trace_header_t {
+    char magic[8];       // LFSM_TRACE_MAGIC, not 0 terminated
+    uint32_t record_size;
+    uint32_t thread_count;
+    uint64_t ticks_per_second;
+} lfsm_trace_header_t;
+
+typedef struct lfsm_trace_thread_t {
+    uint32_t thread;       // numbered in order of the first traced transition
+    uint32_t record_count;
+    uint64_t lost;         // records overwritten before the dump
+} lfsm_trace_thread_t;
+
+typedef void (*lfsm_trace_writer_t)(const void* data, uint32_t size, void* context);
+
+// Passes the dump to write() in pieces. May be called while other threads
+// run instances; records overwritten during the dump are left out (and
+// counted as lost). LFSM_ERROR without LFSM_ENABLE_TRACE or out of memory.
+lfsm_return_t lfsm_trace_dump(lfsm_trace_writer_t write, void* context);
+// Drops the records written so far, e.g. after a warm-up phase.
+void lfsm_trace_clear(void);
+
+/* -----------------------------------------------------------------------------
+ *  Timers (LFSM_ENABLE_TIMERS)
+ *
+ *  Delayed events for all instances, kept in one hierarchical timing wheel:
+ *  posting and cancelling are O(1), lfsm_timers_advance() moves the wheel to
+ *  the given time and adds the events that are due with fsm_add_event().
+ *  Time is in ticks of any clock, e.g. milliseconds of a real clock or a
+ *  simulated one; a delay of 0 counts as 1 tick.
+ *
+ *  A timer posted with lfsm_post_state_event_after() is tied to the current
+ *  state of the instance and cancelled when the instance leaves that state
+ *  (before on_exit runs; generated step functions after the step). An event
+ *  already added to the queue is not removed again. lfsm_deinit() cancels
+ *  all timers of the instance. Not for instances in groups.
+ * -------------------------------------------------------------------------- */
+typedef uint64_t lfsm_timer_t; // handle, LFSM_NO_TIMER when posting failed
+#define LFSM_NO_TIMER 0
+
+lfsm_timer_t lfsm_post_event_after(lfsm_t context, lfsm_id_t event, uint64_t delay);
+lfsm_timer_t lfsm_post_state_event_after(lfsm_t context, lfsm_id_t event, uint64_t delay);
+// LFSM_NOP if the timer fired or was cancelled already
+lfsm_return_t lfsm_timer_cancel(lfsm_timer_t timer);
+// Returns the number of events added. Times before the current one are ignored.
+uint32_t lfsm_timers_advance(uint64_t now);
+uint64_t lfsm_timers_now(void);
+
+/* -----------------------------------------------------------------------------
+ *  Groups of instances
+ *
+ *  Many instances of one definition, stored as arrays (one state byte and
+ *  one user data pointer per instance) instead of one lfsm_t each. Events
+ *  are passed in batches of (instance, event) pairs rather than queued. A
+ *  batch is grouped by (state,event) so each transition and its callbacks
+ *  run in one loop over all instances it applies to. Events for the same
+ *  instance are processed in batch order.
+ *
+ *  Callbacks get a temporary lfsm_t that is only valid during the call;
+ *  lfsm_user_data() and lfsm_get_state() work as usual, fsm_add_event() must
+ *  not be used (add the event to the next batch instead).
+ * -------------------------------------------------------------------------- */
+typedef struct lfsm_group_context_t* lfsm_group_t;
+
+typedef struct lfsm_group_event_t {
+    uint32_t  instance;
+    lfsm_id_t event;
+} lfsm_group_event_t;
+
+lfsm_group_t lfsm_group_create(const lfsm_definition_t* definition, \
+                        uint32_t instance_count, \
+                        void** user_data, \
+                        lfsm_id_t initial_state);
+void lfsm_group_destroy(lfsm_group_t group);
+lfsm_batch_result_t lfsm_group_run(lfsm_group_t group, const lfsm_group_event_t* events, uint32_t event_count);
+lfsm_id_t lfsm_group_get_state(lfsm_group_t group, uint32_t instance);
+
+/* -----------------------------------------------------------------------------
+ *  Orthogonal regions
+ *
+ *  One instance made of several state machines (regions) that run side by
+ *  side and share one event queue. lfsm_run() takes an event once and runs
+ *  it in every region whose definition has transitions for it, in region
+ *  order; regions without any are skipped (a per region event bitmap), so
+ *  their on_run callbacks only run for their own events.
+ *
+ *  The returned instance is region 0 and is used for adding events and
+ *  running. lfsm_get_region() returns the instance of a region, e.g. for
+ *  lfsm_get_state(); events added to it go to the shared queue, timers work
+ *  per region. Coalescing and priorities follow the definition of region 0.
+ *  lfsm_deinit() of region 0 deinitializes all regions.
+ * -------------------------------------------------------------------------- */
+lfsm_t lfsm_init_regions(const lfsm_definition_t* const* definitions, \
+                        uint32_t region_count, \
+                        lfsm_buf_callbacks_t buffer_callbacks, \
+                        void* user_data, \
+                        const lfsm_id_t* initial_states);
+lfsm_t lfsm_get_region(lfsm_t context, uint32_t index);
+
+/* -----------------------------------------------------------------------------
+ *  Snapshots (LFSM_USE_BUILTIN_QUEUE)
+ *
+ *  lfsm_snapshot() writes the current and previous state and the queued
+ *  events of all active instances, lfsm_restore() creates the instances of
+ *  a snapshot again, e.g. after a restart, without running any callbacks.
+ *  Definitions are identified by lfsm_definition_hash() (transitions, state
+ *  numbers and which callbacks/guards exist, not their addresses), restore
+ *  gets the definitions to use and fails for a snapshot of other ones.
+ *
+ *  No thread may add or run events while the snapshot is taken. Instances
+ *  with queued payloads or regions cannot be saved (LFSM_ERROR), timers,
+ *  stats and user data are not saved; restored instances start with NULL
+ *  user data, see lfsm_set_user_data().
+ *
+ *  Format (host byte order): lfsm_snapshot_header_t, definition_count
+ *  uint32_t hashes, then per instance (pool order) an
+ *  lfsm_snapshot_instance_t followed by its event_count lfsm_id_t events in
+ *  run order. The writer is called with pieces of it.
+ * -------------------------------------------------------------------------- */
+#define LFSM_SNAPSHOT_MAGIC "LFSMSNP1"
+#define LFSM_SNAPSHOT_VERSION 1
+
+typedef struct lfsm_snapshot_header_t {
+    char magic[8];       // LFSM_SNAPSHOT_MAGIC, not 0 terminated
+    uint16_t version;
+    uint16_t id_size;    // sizeof(lfsm_id_t)
+    uint32_t definition_count;
+    uint32_t instance_count;
+} lfsm_snapshot_header_t;
+
+typedef struct lfsm_snapshot_instance_t {
+    uint32_t definition; // index of the hash
+    uint32_t event_count;
+    lfsm_id_t current_state;
+    lfsm_id_t previous_state;
+} lfsm_snapshot_instance_t;
+
+typedef void (*lfsm_snapshot_writer_t)(const void* data, uint32_t size, void* context);
+
+uint32_t lfsm_definition_hash(const lfsm_definition_t* definition);
+lfsm_return_t lfsm_snapshot(lfsm_snapshot_writer_t write, void* context);
+// instances: room for *instance_count instances, set to the number restored.
+// Nothing is restored if it fails.
+lfsm_return_t lfsm_restore(const void* snapshot, uint32_t size, \
+                        const lfsm_definition_t* const* definitions, \
+                        uint32_t definition_count, \
+                        lfsm_t* instances, \
+                        uint32_t* instance_count);
+
+/* -----------------------------------------------------------------------------
+ *  Instance store (LFSM_ENABLE_STORE)
+ *
+ *  A file mapped into memory (POSIX mmap) with a fixed number of slots, each
+ *  holding the current state and the event queue of one instance. An
+ *  instance created with lfsm_init_stored() adds and takes its events
+ *  directly in the file and writes its state there after every state
+ *  change, so after a restart (or a crash of the process) the instance of a
+ *  slot is continued by lfsm_store_attach() without loading anything. A
+ *  crash loses at most the event that was being run.
+ *
+ *  Slots hold no pointers; a slot is matched to its definition with
+ *  lfsm_definition_hash(). User data, timers and stats are not stored.
+ *  Only one store is open at a time, it needs the built-in queue without
+ *  payloads. lfsm_deinit() frees the slot of an instance,
+ *  lfsm_store_close() releases all stored instances and keeps their slots.
+ * -------------------------------------------------------------------------- */
+lfsm_return_t lfsm_store_open(const char* path, uint32_t capacity);
+void lfsm_store_close(void);
+lfsm_t lfsm_init_stored(const lfsm_definition_t* definition, uint32_t slot, void* user_data, lfsm_id_t initial_state);
+lfsm_t lfsm_store_attach(const lfsm_definition_t* definition, uint32_t slot, void* user_data);
+
+/* -----------------------------------------------------------------------------
+ *  Event recorder (LFSM_ENABLE_RECORDER)
+ *
+ *  While recording, every event that goes into a queue (fsm_add_event(),
+ *  fsm_add_event_payload(), timers, events added by callbacks) is appended
+ *  to the recording with its time, instance number and payload. Events not
+ *  queued (out of range, queue full, coalesced) are left out. Producers take
+ *  a spin lock while recording; when the recorder is off, adding an event
+ *  costs one relaxed load more.
+ *
+ *  lfsm_replay() adds the recorded events to instances[instance number] in
+ *  recorded order and runs the instance right after each event
+ *  (lfsm_run_until_empty()), without waiting for the recorded times. While
+ *  it runs, the given instances refuse other events (from callbacks, timers
+ *  or other threads) with LFSM_ERROR, the recording holds them already.
+ *  Other instances queue events as usual. A replay ends in the recorded
+ *  states if guards and callbacks only depend on events and payloads (and
+ *  priority classes did not reorder events of an instance).
+ *
+ *  Format: lfsm_recording_header_t, then per event the unsigned LEB128
+ *  varints  time - time of the previous event,
+ *           zigzag(instance number - instance number of the previous event),
+ *           event << 1 | has payload
+ *  and with payload its length (varint) and bytes. The previous event of
+ *  the first one is (start_time, instance 0). Usually 3 to 5 bytes per
+ *  event without payload.
+ * -------------------------------------------------------------------------- */
+#define LFSM_RECORDING_MAGIC "LFSMREC1"
+#define LFSM_RECORDING_VERSION 1
+
+typedef struct lfsm_recording_header_t {
+    char magic[8];       // LFSM_RECORDING_MAGIC, not 0 terminated
+    uint64_t ticks_per_second;
+    uint64_t start_time; // clock at lfsm_recorder_start()
+    uint16_t version;
+    uint16_t id_size;    // sizeof(lfsm_id_t)
+    uint32_t max_payload; // longer payloads were cut to this length
+} lfsm_recording_header_t;
+
+typedef struct lfsm_replay_result_t {
+    uint64_t events;       // events added to instances and run
+    uint64_t skipped;      // events of instances not given or out of their range
+    uint64_t transitions;
+    uint64_t duration;     // recorded ticks from the first to the last event
+    uint32_t instance_count; // highest recorded instance number + 1
+} lfsm_replay_result_t;
+
+typedef void (*lfsm_recording_writer_t)(const void* data, uint32_t size, void* context);
+
+// Records are collected in one of two buffers. When it is full (or on
+// flush/stop) it is swapped with the other one and passed to the writer
+// without holding the recorder lock, the header goes out with the first
+// buffer. One buffer is written at a time, in recorded order. The writer
+// must not add events: they would be recorded, and if the other buffer
+// fills up meanwhile the writer would wait for itself. LFSM_ERROR if
+// already recording or still stopping. Events queued after stop was called
+// are not recorded.
+lfsm_return_t lfsm_recorder_start(lfsm_recording_writer_t write, void* context);
+lfsm_return_t lfsm_recorder_flush(void);
+lfsm_return_t lfsm_recorder_stop(void);
+// Number of the instance in recordings (its position in the instance pool).
+uint32_t lfsm_get_instance_number(lfsm_t context);
+// instances[n] gets the events recorded for instance number n, NULL skips
+// them; result may be NULL. With instance_count 0 a recording is only
+// scanned (result). Until it returns, the given instances are flagged as
+// replaying and fsm_add_event() refuses other events to them (LFSM_ERROR);
+// other instances are not affected and may be recorded meanwhile.
+// LFSM_ERROR for a broken recording (result holds what was replayed up to
+// there).
+lfsm_return_t lfsm_replay(const void* recording, uint32_t size, \
+                        const lfsm_t* instances, \
+                        uint32_t instance_count, \
+                        lfsm_replay_result_t* result);
 
 
-#ifdef USE_LOVELY_BUFFER
+#if (USE_LOVELY_BUFFER)
 lfsm_return_t lfsm_set_lovely_buf_callbacks(lfsm_buf_callbacks_t* callbacks);
 #endif
 
 #ifdef TEST
-lfsm_transitions_t* lfsm_get_transition_table(lfsm_t context);
+const lfsm_transitions_t* lfsm_get_transition_table(lfsm_t context);
 int lfsm_get_transition_count(lfsm_t context);
-lfsm_state_functions_t* lfsm_get_state_function(struct lfsm_context_t* fsm, uint8_t state);
-lfsm_state_functions_t* lfsm_get_state_function_table(lfsm_t context);
+const lfsm_state_functions_t* lfsm_get_state_function(struct lfsm_context_t* fsm, lfsm_id_t state);
+const lfsm_state_functions_t* lfsm_get_state_function_table(lfsm_t context);
 int lfsm_get_state_function_count(lfsm_t context);
-lfsm_transitions_t** lfsm_get_transition_lookup_table(lfsm_t context);
-lfsm_state_functions_t** lfsm_get_state_function_lookup_table(lfsm_t context);
+const lfsm_transitions_t* const* lfsm_get_transition_lookup_table(lfsm_t context);
+const lfsm_state_functions_t* const* lfsm_get_state_function_lookup_table(lfsm_t context);
 int lfsm_get_state_min(lfsm_t context);
 int lfsm_get_state_max(lfsm_t context);
 int lfsm_get_event_min(lfsm_t context);
 int lfsm_get_event_max(lfsm_t context);
-uint8_t lfsm_set_state(lfsm_t context, uint8_t state);
-uint8_t lfsm_get_state_func_count(lfsm_t context);
-lfsm_transitions_t* lfsm_get_transition_from_lookup(lfsm_t context, uint8_t event);
-uint8_t lfsm_read_event_queue_element(lfsm_t context, uint8_t index);
+int lfsm_get_index_type(lfsm_t context);
+uint8_t lfsm_set_state(lfsm_t context, lfsm_id_t state);
+uint32_t lfsm_get_state_func_count(lfsm_t context);
+const lfsm_transitions_t* lfsm_get_transition_from_lookup(lfsm_t context, lfsm_id_t event);
+lfsm_id_t lfsm_read_event_queue_element(lfsm_t context, uint8_t index);
 uint8_t lfsm_no_event_queued(struct lfsm_context_t* fsm);
-uint8_t lfsm_read_event(lfsm_t context);
+lfsm_id_t lfsm_read_event(lfsm_t context);
 #endif
 
 
@@ -1,21 +1,186 @@
 #ifndef __LOVELY_FSM_CONFIG_H
 #define __LOVELY_FSM_CONFIG_H
 
-// --- maximum number of state machines (static memory allocation!) ---
+// --- width of state and event ids: 8, 16 or 32 bit. Ids from 0 up to the
+// --- largest value of the type - 2 can be used (see LFSM_INVALID). The number
+// --- of transitions and states is not limited by this.
+#ifndef LFSM_ID_BITS
+#define LFSM_ID_BITS            8
+#endif
+
+// --- number of statically allocated state machine instances ---
+#ifndef LFSM_MAX_COUNT
 #define LFSM_MAX_COUNT          3
+#endif
+
+// --- When all static instances are in use, the instance pool grows by
+// --- LFSM_POOL_CHUNK_SIZE instances (one malloc) at a time, up to
+// --- LFSM_POOL_MAX_CHUNKS chunks. Chunks are never freed, released instances
+// --- are reused. Set LFSM_POOL_CHUNK_SIZE to 0 to use static memory only.
+// --- Without the built-in queue every instance also takes a buffer from the
+// --- buffer callbacks, which cannot give it back (lovelyBuffer: BUF_MAX), so
+// --- more instances than that backend holds need the built-in queue.
+#ifndef LFSM_POOL_CHUNK_SIZE
+#define LFSM_POOL_CHUNK_SIZE    256
+#endif
+#ifndef LFSM_POOL_MAX_CHUNKS
+#define LFSM_POOL_MAX_CHUNKS    1024
+#endif
 
 // --- size of event queue for each state machine. Will allocate this number
 // --- of ints as part of the state machine representation. If you buffer
 // --- system allocates memory itsself, you should set this value to 1.  ---
-#define LFSM_EV_QUEUE_SIZE      5
+// --- Must be a power of two for the built-in queue.
+#ifndef LFSM_EV_QUEUE_SIZE
+#define LFSM_EV_QUEUE_SIZE      8
+#endif
 
 // --- Create a lookup table for all state/event combinations, then run a small
 // --- for loop through all conditions for this state/event combination.
 // --- Alternatively, do not create a jump table and run through all entries.
 #define OPTIMIZE_FOR_SPEED      1
 
-// --- buffer functions ---
-#define USE_LOVELY_BUFFER       1
+// --- The (state,event) index is a dense table with one pointer for every
+// --- state/event combination in the id ranges used. When less than this
+// --- percentage of combinations have transitions, a hash index holding only
+// --- the existing combinations is built instead (smaller, still O(1)).
+#define LFSM_SPARSE_INDEX_DENSITY   25
+
+// --- hierarchical states (parent in lfsm_state_functions_t): deepest nesting
+// --- of states, a top level state has depth 1. Building a definition with a
+// --- deeper or cyclic parent chain fails.
+#ifndef LFSM_MAX_STATE_DEPTH
+#define LFSM_MAX_STATE_DEPTH    16
+#endif
+
+// --- event queue: 1 uses the built-in lock free single producer/single
+// --- consumer ring buffer, the buffer callbacks passed to lfsm_init() are
+// --- ignored. 0 uses the buffer callbacks (e.g. lovelyBuffer, see below).
+#ifndef LFSM_USE_BUILTIN_QUEUE
+#define LFSM_USE_BUILTIN_QUEUE  1
+#endif
+
+// --- built-in queue only: 1 allows several threads to add events to the same
+// --- instance concurrently (lock free). 0 allows only one producer, which
+// --- makes adding events slightly cheaper.
+#ifndef LFSM_QUEUE_MULTI_PRODUCER
+#define LFSM_QUEUE_MULTI_PRODUCER 0
+#endif
+
+// --- built-in queue only: number of event priority classes (1 .. 32). Each
+// --- class gets its own ring of LFSM_EV_QUEUE_SIZE events per instance and
+// --- lfsm_run() takes the next event from the highest class holding one,
+// --- see event_priorities in lovely_fsm.h. 1: one FIFO for all events.
+#ifndef LFSM_EVENT_PRIORITIES
+#define LFSM_EVENT_PRIORITIES   1
+#endif
+
+// --- built-in queue only: 1 lets events carry a payload reference (pointer
+// --- and length) that callbacks can read with lfsm_event_payload(). Every
+// --- instance also gets an arena of LFSM_PAYLOAD_ARENA_SIZE bytes (power of
+// --- two, 0 for none) for payloads, released after each lfsm_run() or batch.
+#ifndef LFSM_EVENT_PAYLOADS
+#define LFSM_EVENT_PAYLOADS     0
+#endif
+#ifndef LFSM_PAYLOAD_ARENA_SIZE
+#define LFSM_PAYLOAD_ARENA_SIZE 256
+#endif
+
+// --- executor (lovely_fsm_executor.c): tasks each worker can hold in its own
+// --- deque (power of two), further tasks go to the shared queue. Events an
+// --- instance processes before other ready instances get their turn.
+#ifndef LFSM_EXECUTOR_DEQUE_SIZE
+#define LFSM_EXECUTOR_DEQUE_SIZE    1024
+#endif
+#ifndef LFSM_EXECUTOR_BATCH
+#define LFSM_EXECUTOR_BATCH         64
+#endif
+
+// --- 1 counts fired transitions, guard evaluations/rejections, dropped and
+// --- rejected events and times every state callback, per instance (see
+// --- lfsm_get_stats()). 0 compiles all of it out.
+#ifndef LFSM_ENABLE_STATS
+#define LFSM_ENABLE_STATS           0
+#endif
+// --- callback times are counted in log2 buckets: bucket n holds calls that
+// --- took 2^(n-1) up to 2^n - 1 cycles, the last bucket everything above.
+#ifndef LFSM_STATS_HISTOGRAM_BUCKETS
+#define LFSM_STATS_HISTOGRAM_BUCKETS 24
+#endif
+// --- LFSM_STATS_CYCLES() may be defined to read a cycle counter (uint64_t),
+// --- e.g. DWT->CYCCNT on Cortex-M. Default: TSC on x86, the virtual counter
+// --- on AArch64, nanoseconds (clock_gettime) elsewhere.
+
+// --- Adaptive guard order for (state,event) blocks whose transitions are all
+// --- flagged LFSM_EXCLUSIVE_GUARD: every instance counts the accepted guards
+// --- and sorts the block by them after LFSM_GUARD_REORDER_INTERVAL events
+// --- (counts are halved then). Costs 8 bytes per transition and instance,
+// --- only for definitions with such blocks. 0 ignores the flag.
+#ifndef LFSM_ADAPTIVE_GUARDS
+#define LFSM_ADAPTIVE_GUARDS        1
+#endif
+#ifndef LFSM_GUARD_REORDER_INTERVAL
+#define LFSM_GUARD_REORDER_INTERVAL 256
+#endif
+
+// --- Transition trace: every transition is written as a binary record (32
+// --- bytes, no formatting) into a lock free ring of the calling thread, see
+// --- lfsm_trace_dump() and tools/lfsm_trace.c. The ring size is in records
+// --- per thread and must be a power of two; a dump holds the last
+// --- LFSM_TRACE_RING_SIZE - 1 records of each thread.
+#ifndef LFSM_ENABLE_TRACE
+#define LFSM_ENABLE_TRACE           0
+#endif
+#ifndef LFSM_TRACE_RING_SIZE
+#define LFSM_TRACE_RING_SIZE        1024
+#endif
+// --- LFSM_TRACE_CLOCK() (uint64_t) and LFSM_TRACE_TICKS_PER_SECOND may be
+// --- defined together for another time source. Default: nanoseconds of
+// --- CLOCK_MONOTONIC.
+
+// --- Timers: lfsm_post_event_after() queues an event after a delay, in ticks
+// --- of the clock passed to lfsm_timers_advance(). One hierarchical timing
+// --- wheel (4 levels of 256 slots) serves all instances. Timer nodes are
+// --- allocated in chunks of LFSM_TIMER_CHUNK_SIZE (power of two), at most
+// --- LFSM_TIMER_MAX_CHUNKS of them, and kept for reuse.
+#ifndef LFSM_ENABLE_TIMERS
+#define LFSM_ENABLE_TIMERS          0
+#endif
+#ifndef LFSM_TIMER_CHUNK_SIZE
+#define LFSM_TIMER_CHUNK_SIZE       1024
+#endif
+#ifndef LFSM_TIMER_MAX_CHUNKS
+#define LFSM_TIMER_MAX_CHUNKS       4096
+#endif
+
+// --- Instance store: lfsm_store_open() maps a file (POSIX mmap) that holds
+// --- the current state and the event queue of instances created with
+// --- lfsm_init_stored(), lfsm_store_attach() continues them after a restart.
+// --- Needs the built-in queue without payloads.
+#ifndef LFSM_ENABLE_STORE
+#define LFSM_ENABLE_STORE           0
+#endif
+
+// --- Event recorder: lfsm_recorder_start() appends every queued event
+// --- (time, instance, event, payload) delta encoded to a writer,
+// --- lfsm_replay() runs a recording again. Records are collected in a
+// --- buffer of LFSM_RECORDER_BUFFER_SIZE bytes while a second one is being
+// --- written, payloads longer than LFSM_RECORDER_BUFFER_SIZE / 2 are
+// --- recorded cut to that length.
+#ifndef LFSM_ENABLE_RECORDER
+#define LFSM_ENABLE_RECORDER        0
+#endif
+#ifndef LFSM_RECORDER_BUFFER_SIZE
+#define LFSM_RECORDER_BUFFER_SIZE   65536
+#endif
+// --- LFSM_RECORDER_CLOCK() (uint64_t) and LFSM_RECORDER_TICKS_PER_SECOND may
+// --- be defined together for another time source. Default: nanoseconds of
+// --- CLOCK_MONOTONIC.
+
+// --- buffer functions: lovelyBuffer unless the built-in queue is used ---
+#ifndef USE_LOVELY_BUFFER
+#define USE_LOVELY_BUFFER       (!(LFSM_USE_BUILTIN_QUEUE))
+#endif
 
 // --- Optimize for code and ram size or optimize for speed?
 // --- OPTIMIZE_FOR_MEMORY will use only the transition and function tables and
@@ -27,11 +192,26 @@
 // --- transitions and their conditions are evaluated.
 
 
+#include <stdint.h>
+#if (LFSM_ID_BITS == 8)
+typedef uint8_t  lfsm_id_t;
+#elif (LFSM_ID_BITS == 16)
+typedef uint16_t lfsm_id_t;
+#elif (LFSM_ID_BITS == 32)
+typedef uint32_t lfsm_id_t;
+#else
+#error "LFSM_ID_BITS must be 8, 16 or 32"
+#endif
+
 #if (USE_LOVELY_BUFFER)
 #include "../lovelyBuffer/buf_buffer.h"
 
 #define buffer_handle_type                   buf_buffer_t
 #define BUFFER_OK   BUF_OK
+#elif (LFSM_USE_BUILTIN_QUEUE)
+#define DATA_TYPE                            lfsm_id_t
+#define buffer_handle_type                   void*
+#define BUFFER_OK   0
 #else
 #warning "Define your buffer system here!"
 #define buffer_handle_type
@@ -4,8 +4,8 @@
 #ifdef TEST
 
 void print_transition_table(lfsm_t context) {
-    lfsm_transitions_t* transition = lfsm_get_transition_table(context);
-    lfsm_state_functions_t* state_functions = lfsm_get_state_function_table(context);
+    const lfsm_transitions_t* transition = lfsm_get_transition_table(context);
+    const lfsm_state_functions_t* state_functions = lfsm_get_state_function_table(context);
     int transition_count = lfsm_get_transition_count(context);
 
     printf("\nTransition Table for LFSM @%d\n", (int)context);
@@ -13,9 +13,9 @@ void print_transition_table(lfsm_t context) {
     printf("| TRANS ADDRESS | STATE | EVENT | CONDITION_FUNC | STATE |\n");
     printf("|--------------------------------------------------------|\n");
     for (int i = 0 ; i < transition_count; i++, transition++) {
-        uint8_t old_state = transition->current_state;
-        uint8_t new_state = transition->next_state;
-        uint8_t event = transition->event;
+        lfsm_id_t old_state = transition->current_state;
+        lfsm_id_t new_state = transition->next_state;
+        lfsm_id_t event = transition->event;
         int condition_addr = (int)transition->condition;
         printf("| %13d | %5d | %5d | %14d | %5d |\n", (int)transition, old_state, event, condition_addr, new_state);
     }
@@ -23,14 +23,18 @@ void print_transition_table(lfsm_t context) {
 }
 
 void print_transition_lookup_table(lfsm_t context) {
-    lfsm_transitions_t* transition = lfsm_get_transition_table(context);
-    lfsm_transitions_t** lookup_table = lfsm_get_transition_lookup_table(context);
+    const lfsm_transitions_t* transition = lfsm_get_transition_table(context);
+    const lfsm_transitions_t* const* lookup_table = lfsm_get_transition_lookup_table(context);
     int min_state = lfsm_get_state_min(context);
     int max_state = lfsm_get_state_max(context);
     int min_event = lfsm_get_event_min(context);
     int max_event = lfsm_get_event_max(context);
     int lookup_size = (max_state - min_state + 1) * (max_event - min_event + 1);
 
+    if (lookup_table == NULL) {
+        printf("\nLFSM @%d has no dense lookup table (index type %d)\n", (int)context, lfsm_get_index_type(context));
+        return;
+    }
     printf("\nLookup Table for LFSM @%d\n", (int)context);
     printf("%d possible combinations, lookup table @%u\n", lookup_size, (int)lookup_table);
     printf("transition table @%u\n", (int)transition);
@@ -46,8 +50,8 @@ void print_transition_lookup_table(lfsm_t context) {
 }
 
 void print_state_function_table(lfsm_t context) {
-    lfsm_state_functions_t* table = lfsm_get_state_function_table(context);
-    uint8_t state_func_count = lfsm_get_state_func_count(context);
+    const lfsm_state_functions_t* table = lfsm_get_state_function_table(context);
+    uint32_t state_func_count = lfsm_get_state_func_count(context);
 
     printf("\nState function Table for LFSM @%d\n", (int)context);
     printf("|       |          ADDR |    ON_ENTRY() |      ON_RUN() |     ON_EXIT() |\n");
@@ -64,9 +68,9 @@ void print_state_function_table(lfsm_t context) {
 }
 
 void print_state_function_lookup_table(lfsm_t context) {
-    lfsm_state_functions_t** lookup_table = lfsm_get_state_function_lookup_table(context);
-    uint8_t state_min = lfsm_get_state_min(context);
-    uint8_t state_max = lfsm_get_state_max(context);
+    const lfsm_state_functions_t* const* lookup_table = lfsm_get_state_function_lookup_table(context);
+    lfsm_id_t state_min = lfsm_get_state_min(context);
+    lfsm_id_t state_max = lfsm_get_state_max(context);
 
     printf("\nState function Lookup for LFSM @%d\n", (int)context);
     printf("|       |          ADDR |\n");
@@ -0,0 +1,384 @@
+#include "lovely_fsm_executor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if (LFSM_EXECUTOR_DEQUE_SIZE & (LFSM_EXECUTOR_DEQUE_SIZE - 1))
+#error "LFSM_EXECUTOR_DEQUE_SIZE must be a power of two"
+#endif
+
+#define LFSM_DEQUE_MASK (LFSM_EXECUTOR_DEQUE_SIZE - 1)
+#define LFSM_CACHE_LINE 64
+
+/* -----------------------------------------------------------------------------
+ * Scheduling state of an instance (lfsm_scheduling_state()):
+ *   IDLE     -> READY     event posted, the instance is put into a deque
+ *   READY    -> RUNNING   a worker took it (only one worker can)
+ *   RUNNING  -> NOTIFIED  event posted while running
+ *   RUNNING  -> IDLE      queue empty and nothing posted meanwhile
+ *   NOTIFIED -> READY     put back into the deque by the worker
+ * -------------------------------------------------------------------------- */
+#define LFSM_TASK_IDLE      0
+#define LFSM_TASK_READY     1
+#define LFSM_TASK_RUNNING   2
+#define LFSM_TASK_NOTIFIED  3
+
+// Work stealing deque after Chase and Lev (fixed size, C11 version by Le et
+// al.). The owning worker pushes and takes at the bottom, others steal from
+// the top.
+typedef struct lfsm_deque_t {
+    _Alignas(LFSM_CACHE_LINE) _Atomic int64_t top;
+    _Alignas(LFSM_CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic(lfsm_t) tasks[LFSM_EXECUTOR_DEQUE_SIZE];
+} lfsm_deque_t;
+
+typedef struct lfsm_worker_t {
+    lfsm_deque_t deque;
+    struct lfsm_executor_context_t* executor;
+    uint32_t number;
+    pthread_t thread;
+} lfsm_worker_t;
+
+typedef struct lfsm_executor_context_t {
+    lfsm_worker_t* workers;
+    uint32_t worker_count;
+    uint32_t started_count;
+    // posts from other threads and deque overflow
+    pthread_mutex_t shared_lock;
+    lfsm_t* shared_tasks;
+    uint32_t shared_first;
+    uint32_t shared_capacity;
+    _Atomic uint32_t shared_count;
+    // sleeping workers wait for work_epoch to change
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_signal;
+    _Atomic uint32_t work_epoch;
+    _Atomic uint32_t sleeping;
+    _Atomic uint8_t stopping;
+    // instances ready or running
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_signal;
+    _Atomic uint32_t pending;
+} lfsm_executor_context_t;
+
+// worker of the calling thread, NULL outside of workers
+_Thread_local lfsm_worker_t* lfsm_current_worker;
+
+// private functions
+uint8_t lfsm_deque_push(lfsm_deque_t* deque, lfsm_t fsm);
+lfsm_t lfsm_deque_take(lfsm_deque_t* deque);
+lfsm_t lfsm_deque_steal(lfsm_deque_t* deque);
+lfsm_return_t lfsm_shared_push(lfsm_executor_context_t* executor, lfsm_t fsm);
+lfsm_t lfsm_shared_pop(lfsm_executor_context_t* executor);
+void lfsm_executor_enqueue(lfsm_executor_context_t* executor, lfsm_t fsm);
+void lfsm_executor_wake(lfsm_executor_context_t* executor);
+lfsm_t lfsm_executor_find_task(lfsm_worker_t* worker);
+void lfsm_executor_run_task(lfsm_worker_t* worker, lfsm_t fsm);
+void lfsm_executor_park(lfsm_worker_t* worker, uint32_t epoch);
+void* lfsm_executor_worker(void* argument);
+
+/* ---------------------------------------------------------------------------
+ * MAIN FUNCTIONS FOR LIBRARY USERS
+ * -------------------------------------------------------------------------*/
+
+lfsm_executor_t lfsm_executor_create(uint32_t worker_count) {
+    if (worker_count == 0) return NULL;
+
+    lfsm_executor_context_t* executor = calloc(1, sizeof(lfsm_executor_context_t));
+    if (executor == NULL) return NULL;
+    size_t workers_size = ((worker_count * sizeof(lfsm_worker_t)) + LFSM_CACHE_LINE - 1) & ~(size_t)(LFSM_CACHE_LINE - 1);
+    executor->workers = aligned_alloc(LFSM_CACHE_LINE, workers_size);
+    if (executor->workers == NULL) {
+        free(executor);
+        return NULL;
+    }
+    memset(executor->workers, 0, workers_size);
+    executor->worker_count = worker_count;
+    pthread_mutex_init(&executor->shared_lock, NULL);
+    pthread_mutex_init(&executor->park_lock, NULL);
+    pthread_cond_init(&executor->park_signal, NULL);
+    pthread_mutex_init(&executor->idle_lock, NULL);
+    pthread_cond_init(&executor->idle_signal, NULL);
+
+    for (uint32_t i = 0 ; i < worker_count ; i++) {
+        lfsm_worker_t* worker = &executor->workers[i];
+        worker->executor = executor;
+        worker->number = i;
+        if (pthread_create(&worker->thread, NULL, lfsm_executor_worker, worker) != 0) {
+            lfsm_executor_destroy(executor);
+            return NULL;
+        }
+        executor->started_count++;
+    }
+    return executor;
+}
+
+void lfsm_executor_destroy(lfsm_executor_t executor) {
+    lfsm_executor_wait_idle(executor);
+
+    pthread_mutex_lock(&executor->park_lock);
+    atomic_store(&executor->stopping, 1);
+    pthread_cond_broadcast(&executor->park_signal);
+    pthread_mutex_unlock(&executor->park_lock);
+    for (uint32_t i = 0 ; i < executor->started_count ; i++) {
+        pthread_join(executor->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&executor->shared_lock);
+    pthread_mutex_destroy(&executor->park_lock);
+    pthread_cond_destroy(&executor->park_signal);
+    pthread_mutex_destroy(&executor->idle_lock);
+    pthread_cond_destroy(&executor->idle_signal);
+    free(executor->shared_tasks);
+    free(executor->workers);
+    free(executor);
+}
+
+// The instance is scheduled even if its queue is full, so the queue drains.
+lfsm_return_t lfsm_executor_post(lfsm_executor_t executor, lfsm_t fsm, lfsm_id_t event) {
+    lfsm_return_t ret = fsm_add_event(fsm, event);
+    lfsm_executor_schedule(executor, fsm);
+    return ret;
+}
+
+void lfsm_executor_schedule(lfsm_executor_t executor, lfsm_t fsm) {
+    _Atomic uint32_t* state = lfsm_scheduling_state(fsm);
+    // Pairs with the fence in lfsm_executor_run_task(): the event added before
+    // this call is seen by the worker, or the worker's RUNNING is seen here.
+    // Without it, both sides could read the old values (store buffering), the
+    // worker goes idle on an empty queue and this call does not notify it.
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t current = atomic_load_explicit(state, memory_order_acquire);
+
+    for (;;) {
+        if (current == LFSM_TASK_IDLE) {
+            if (atomic_compare_exchange_weak_explicit(state, &current, LFSM_TASK_READY,
+                                                      memory_order_acq_rel, memory_order_acquire)) {
+                atomic_fetch_add(&executor->pending, 1);
+                lfsm_executor_enqueue(executor, fsm);
+                return;
+            }
+        } else if (current == LFSM_TASK_RUNNING) {
+            // the worker running it checks the state before it lets go
+            if (atomic_compare_exchange_weak_explicit(state, &current, LFSM_TASK_NOTIFIED,
+                                                      memory_order_acq_rel, memory_order_acquire)) {
+                return;
+            }
+        } else {
+            return; // READY or NOTIFIED: it will run (again) anyway
+        }
+    }
+}
+
+void lfsm_executor_wait_idle(lfsm_executor_t executor) {
+    pthread_mutex_lock(&executor->idle_lock);
+    while (atomic_load(&executor->pending) != 0) {
+        pthread_cond_wait(&executor->idle_signal, &executor->idle_lock);
+    }
+    pthread_mutex_unlock(&executor->idle_lock);
+}
+
+/* ---------------------------------------------------------------------------
+ * - WORKERS
+ * -------------------------------------------------------------------------*/
+
+void* lfsm_executor_worker(void* argument) {
+    lfsm_worker_t* worker = argument;
+    lfsm_executor_context_t* executor = worker->executor;
+
+    lfsm_current_worker = worker;
+    for (;;) {
+        lfsm_t fsm = lfsm_executor_find_task(worker);
+        if (fsm != NULL) {
+            lfsm_executor_run_task(worker, fsm);
+            continue;
+        }
+        if (atomic_load(&executor->stopping)) break;
+
+        // look once more after reading the epoch, so no post is missed
+        uint32_t epoch = atomic_load(&executor->work_epoch);
+        fsm = lfsm_executor_find_task(worker);
+        if (fsm != NULL) {
+            lfsm_executor_run_task(worker, fsm);
+            continue;
+        }
+        lfsm_executor_park(worker, epoch);
+    }
+    lfsm_current_worker = NULL;
+    return NULL;
+}
+
+// own deque first (most recently readied, still in cache), then the shared
+// queue, then steal the oldest task of another worker
+lfsm_t lfsm_executor_find_task(lfsm_worker_t* worker) {
+    lfsm_executor_context_t* executor = worker->executor;
+    lfsm_t fsm = lfsm_deque_take(&worker->deque);
+
+    if (fsm != NULL) return fsm;
+    fsm = lfsm_shared_pop(executor);
+    if (fsm != NULL) return fsm;
+    for (uint32_t i = 1 ; i < executor->worker_count ; i++) {
+        lfsm_worker_t* victim = &executor->workers[(worker->number + i) % executor->worker_count];
+        fsm = lfsm_deque_steal(&victim->deque);
+        if (fsm != NULL) return fsm;
+    }
+    return NULL;
+}
+
+// Runs up to LFSM_EXECUTOR_BATCH events, then lets other instances go first.
+void lfsm_executor_run_task(lfsm_worker_t* worker, lfsm_t fsm) {
+    lfsm_executor_context_t* executor = worker->executor;
+    _Atomic uint32_t* state = lfsm_scheduling_state(fsm);
+
+    atomic_store_explicit(state, LFSM_TASK_RUNNING, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst); // see lfsm_executor_schedule()
+    lfsm_batch_result_t result = lfsm_run_batch(fsm, LFSM_EXECUTOR_BATCH);
+
+    if (result.events < LFSM_EXECUTOR_BATCH) {
+        uint32_t expected = LFSM_TASK_RUNNING;
+        if (atomic_compare_exchange_strong_explicit(state, &expected, LFSM_TASK_IDLE,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            if (atomic_fetch_sub(&executor->pending, 1) == 1) {
+                pthread_mutex_lock(&executor->idle_lock);
+                pthread_cond_broadcast(&executor->idle_signal);
+                pthread_mutex_unlock(&executor->idle_lock);
+            }
+            return;
+        }
+        // NOTIFIED: an event was posted after the queue was found empty
+    }
+    atomic_store_explicit(state, LFSM_TASK_READY, memory_order_release);
+    lfsm_executor_enqueue(executor, fsm);
+}
+
+// Sleeps until work is posted. Both sides use sequentially consistent
+// operations: either the poster sees the worker sleeping and signals, or the
+// worker sees the new epoch and does not wait.
+void lfsm_executor_park(lfsm_worker_t* worker, uint32_t epoch) {
+    lfsm_executor_context_t* executor = worker->executor;
+
+    pthread_mutex_lock(&executor->park_lock);
+    atomic_fetch_add(&executor->sleeping, 1);
+    while (!atomic_load(&executor->stopping) && (atomic_load(&executor->work_epoch) == epoch)) {
+        pthread_cond_wait(&executor->park_signal, &executor->park_lock);
+    }
+    atomic_fetch_sub(&executor->sleeping, 1);
+    pthread_mutex_unlock(&executor->park_lock);
+}
+
+void lfsm_executor_enqueue(lfsm_executor_context_t* executor, lfsm_t fsm) {
+    lfsm_worker_t* worker = lfsm_current_worker;
+    int own_worker = (worker != NULL) && (worker->executor == executor);
+
+    if (!own_worker || lfsm_deque_push(&worker->deque, fsm)) {
+        // out of memory would lose the task, wait for a worker to make room
+        while (lfsm_shared_push(executor, fsm) != LFSM_OK) {
+            sched_yield();
+        }
+    }
+    lfsm_executor_wake(executor);
+}
+
+void lfsm_executor_wake(lfsm_executor_context_t* executor) {
+    atomic_fetch_add(&executor->work_epoch, 1);
+    if (atomic_load(&executor->sleeping) != 0) {
+        pthread_mutex_lock(&executor->park_lock);
+        pthread_cond_signal(&executor->park_signal);
+        pthread_mutex_unlock(&executor->park_lock);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * - QUEUES
+ * -------------------------------------------------------------------------*/
+
+// returns 0 on success, 1 if the deque is full (owner only)
+uint8_t lfsm_deque_push(lfsm_deque_t* deque, lfsm_t fsm) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (bottom - top >= LFSM_EXECUTOR_DEQUE_SIZE) return 1;
+    atomic_store_explicit(&deque->tasks[bottom & LFSM_DEQUE_MASK], fsm, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+// owner only, races with thieves for the last task
+lfsm_t lfsm_deque_take(lfsm_deque_t* deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    lfsm_t fsm = atomic_load_explicit(&deque->tasks[bottom & LFSM_DEQUE_MASK], memory_order_relaxed);
+    if (top == bottom) {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            fsm = NULL; // a thief was faster
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return fsm;
+}
+
+lfsm_t lfsm_deque_steal(lfsm_deque_t* deque) {
+    for (;;) {
+        int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+        if (top >= bottom) return NULL;
+        lfsm_t fsm = atomic_load_explicit(&deque->tasks[top & LFSM_DEQUE_MASK], memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                    memory_order_seq_cst, memory_order_relaxed)) {
+            return fsm;
+        }
+    }
+}
+
+// ring buffer, doubled when full
+lfsm_return_t lfsm_shared_push(lfsm_executor_context_t* executor, lfsm_t fsm) {
+    pthread_mutex_lock(&executor->shared_lock);
+    uint32_t count = atomic_load_explicit(&executor->shared_count, memory_order_relaxed);
+    if (count == executor->shared_capacity) {
+        uint32_t capacity = (count > 0) ? 2 * count : 64;
+        lfsm_t* tasks = malloc(capacity * sizeof(lfsm_t));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&executor->shared_lock);
+            return LFSM_ERROR;
+        }
+        for (uint32_t i = 0 ; i < count ; i++) {
+            tasks[i] = executor->shared_tasks[(executor->shared_first + i) % executor->shared_capacity];
+        }
+        free(executor->shared_tasks);
+        executor->shared_tasks = tasks;
+        executor->shared_first = 0;
+        executor->shared_capacity = capacity;
+    }
+    executor->shared_tasks[(executor->shared_first + count) % executor->shared_capacity] = fsm;
+    atomic_store_explicit(&executor->shared_count, count + 1, memory_order_relaxed);
+    pthread_mutex_unlock(&executor->shared_lock);
+    return LFSM_OK;
+}
+
+lfsm_t lfsm_shared_pop(lfsm_executor_context_t* executor) {
+    lfsm_t fsm = NULL;
+
+    // cheap check first, the lock is only taken if there may be a task
+    if (atomic_load_explicit(&executor->shared_count, memory_order_relaxed) == 0) return NULL;
+    pthread_mutex_lock(&executor->shared_lock);
+    uint32_t count = atomic_load_explicit(&executor->shared_count, memory_order_relaxed);
+    if (count > 0) {
+        fsm = executor->shared_tasks[executor->shared_first];
+        executor->shared_first = (executor->shared_first + 1) % executor->shared_capacity;
+        atomic_store_explicit(&executor->shared_count, count - 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&executor->shared_lock);
+    return fsm;
+}
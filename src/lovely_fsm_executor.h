@@ -0,0 +1,33 @@
+#ifndef __LOVELY_FSM_EXECUTOR_H
+#define __LOVELY_FSM_EXECUTOR_H
+
+/* -----------------------------------------------------------------------------
+ *  Executor (optional, needs POSIX threads)
+ *
+ *  A pool of worker threads running lovelyFSM instances that have queued
+ *  events. Posting an event marks its instance ready; ready instances are
+ *  spread over the workers using work stealing deques. An instance is never
+ *  run by two workers at the same time, so callbacks of one instance need no
+ *  locking. Workers without work sleep until an event is posted.
+ *
+ *  Events can be posted from any thread, including callbacks running on a
+ *  worker. With more than one posting thread per instance, enable
+ *  LFSM_QUEUE_MULTI_PRODUCER. Do not call lfsm_run() for instances driven
+ *  by an executor, and only deinit them while the executor is idle.
+ * -------------------------------------------------------------------------- */
+#include "lovely_fsm.h"
+
+typedef struct lfsm_executor_context_t* lfsm_executor_t;
+
+lfsm_executor_t lfsm_executor_create(uint32_t worker_count);
+// waits until all posted events are processed, then stops the workers
+void lfsm_executor_destroy(lfsm_executor_t executor);
+
+// Adds the event (see fsm_add_event()) and marks the instance ready.
+lfsm_return_t lfsm_executor_post(lfsm_executor_t executor, lfsm_t fsm, lfsm_id_t event);
+// Marks the instance ready, for events added with fsm_add_event().
+void lfsm_executor_schedule(lfsm_executor_t executor, lfsm_t fsm);
+// Blocks until no instance is ready or running.
+void lfsm_executor_wait_idle(lfsm_executor_t executor);
+
+#endif // __LOVELY_FSM_EXECUTOR_H
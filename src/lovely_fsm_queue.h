@@ -0,0 +1,320 @@
+#ifndef __LOVELY_FSM_QUEUE_H
+#define __LOVELY_FSM_QUEUE_H
+
+/* -----------------------------------------------------------------------------
+ *  Built-in event queue (LFSM_USE_BUILTIN_QUEUE)
+ *
+ *  Lock free ring buffer, only the thread calling lfsm_run() removes events.
+ *  head and tail are free running counters, the slot is counter & mask.
+ *
+ *  Single producer (default): one thread or interrupt adds events. The
+ *  producer publishes a slot with a release store of head, the consumer
+ *  frees it with a release store of tail.
+ *
+ *  Multi producer (LFSM_QUEUE_MULTI_PRODUCER): bounded queue after Dmitry
+ *  Vyukov. Every slot has a sequence number telling whether it is free for
+ *  the producer claiming position n (sequence == n) or holds the event of
+ *  position n (sequence == n + 1). Producers claim a position with a CAS on
+ *  head, never wait for each other and never block the consumer.
+ *
+ *  Payloads (LFSM_EVENT_PAYLOADS): every slot also holds a payload reference,
+ *  written before and read before the slot is handed over, like the event.
+ * -------------------------------------------------------------------------- */
+#include <stdint.h>
+#include <stdatomic.h>
+#include "lovely_fsm_config.h"
+
+#if (LFSM_EV_QUEUE_SIZE & (LFSM_EV_QUEUE_SIZE - 1))
+#error "LFSM_EV_QUEUE_SIZE must be a power of two for the built-in queue"
+#endif
+
+#define LFSM_QUEUE_MASK (LFSM_EV_QUEUE_SIZE - 1)
+
+// payload reference stored with an event, see fsm_add_event_payload()
+typedef struct lfsm_queue_payload_t {
+    const void* data;
+    uint32_t length;
+    uint32_t arena_end; // instance arena position after the payload
+    uint8_t  in_arena;  // data was taken from the instance arena
+} lfsm_queue_payload_t;
+
+typedef struct lfsm_queue_t {
+    _Atomic uint32_t head; // next slot to write, owned by the producer(s)
+    _Atomic uint32_t tail; // next slot to read, owned by the consumer
+#if (LFSM_QUEUE_MULTI_PRODUCER)
+    _Atomic uint32_t sequence[LFSM_EV_QUEUE_SIZE];
+#endif
+    lfsm_id_t events[LFSM_EV_QUEUE_SIZE];
+#if (LFSM_EVENT_PAYLOADS)
+    lfsm_queue_payload_t payloads[LFSM_EV_QUEUE_SIZE];
+#endif
+} lfsm_queue_t;
+
+// payload may be NULL (no payload), it is ignored without LFSM_EVENT_PAYLOADS
+static inline void lfsm_queue_store_payload(lfsm_queue_t* queue, uint32_t slot, const lfsm_queue_payload_t* payload) {
+#if (LFSM_EVENT_PAYLOADS)
+    static const lfsm_queue_payload_t no_payload = { NULL, 0, 0, 0 };
+    queue->payloads[slot] = (payload != NULL) ? *payload : no_payload;
+#endif
+}
+
+static inline void lfsm_queue_init(lfsm_queue_t* queue) {
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+#if (LFSM_QUEUE_MULTI_PRODUCER)
+    for (uint32_t i = 0 ; i < LFSM_EV_QUEUE_SIZE ; i++) {
+        atomic_init(&queue->sequence[i], i);
+    }
+#endif
+}
+
+#if (LFSM_QUEUE_MULTI_PRODUCER)
+
+// returns 0 on success, 1 if the queue is full. Safe to call from any thread.
+static inline uint8_t lfsm_queue_add_payload(lfsm_queue_t* queue, lfsm_id_t event, const lfsm_queue_payload_t* payload) {
+    uint32_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t slot;
+
+    for (;;) {
+        slot = position & LFSM_QUEUE_MASK;
+        uint32_t sequence = atomic_load_explicit(&queue->sequence[slot], memory_order_acquire);
+        int32_t difference = (int32_t)(sequence - position);
+        if (difference == 0) {
+            // on failure, position is updated to the current head
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return 1; // slot still holds an event from the previous round
+        } else {
+            position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+    queue->events[slot] = event;
+    lfsm_queue_store_payload(queue, slot, payload);
+    atomic_store_explicit(&queue->sequence[slot], position + 1, memory_order_release);
+    return 0;
+}
+
+// 1 if the next event has been published, 0 otherwise. Events claimed but
+// not yet written by a producer are not visible to the consumer.
+static inline uint32_t lfsm_queue_count(lfsm_queue_t* queue) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t sequence = atomic_load_explicit(&queue->sequence[tail & LFSM_QUEUE_MASK], memory_order_acquire);
+    return sequence == tail + 1;
+}
+
+#else
+
+// returns 0 on success, 1 if the queue is full
+static inline uint8_t lfsm_queue_add_payload(lfsm_queue_t* queue, lfsm_id_t event, const lfsm_queue_payload_t* payload) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if ((uint32_t)(head - tail) >= LFSM_EV_QUEUE_SIZE) {
+        return 1;
+    }
+    queue->events[head & LFSM_QUEUE_MASK] = event;
+    lfsm_queue_store_payload(queue, head & LFSM_QUEUE_MASK, payload);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 0;
+}
+
+// number of events ready to be read by the consumer
+static inline uint32_t lfsm_queue_count(lfsm_queue_t* queue) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    return head - tail;
+}
+
+#endif
+
+static inline uint8_t lfsm_queue_add(lfsm_queue_t* queue, lfsm_id_t event) {
+    return lfsm_queue_add_payload(queue, event, NULL);
+}
+
+static inline uint8_t lfsm_queue_is_empty(lfsm_queue_t* queue) {
+    return lfsm_queue_count(queue) == 0;
+}
+
+// consumer only, the queue must not be empty. payload may be NULL.
+static inline lfsm_id_t lfsm_queue_read_payload(lfsm_queue_t* queue, lfsm_queue_payload_t* payload) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    lfsm_id_t event = queue->events[tail & LFSM_QUEUE_MASK];
+#if (LFSM_EVENT_PAYLOADS)
+    if (payload != NULL) *payload = queue->payloads[tail & LFSM_QUEUE_MASK];
+#endif
+#if (LFSM_QUEUE_MULTI_PRODUCER)
+    // hand the slot to the producers of the next round
+    atomic_store_explicit(&queue->sequence[tail & LFSM_QUEUE_MASK], tail + LFSM_EV_QUEUE_SIZE, memory_order_release);
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_relaxed);
+#else
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+#endif
+    return event;
+}
+
+static inline lfsm_id_t lfsm_queue_read(lfsm_queue_t* queue) {
+    return lfsm_queue_read_payload(queue, NULL);
+}
+
+// For copying a queue while no thread adds or runs events: number of events
+// and the event at position index from the next one to read. payload may be NULL.
+static inline uint32_t lfsm_queue_length(lfsm_queue_t* queue) {
+    return atomic_load_explicit(&queue->head, memory_order_acquire) - atomic_load_explicit(&queue->tail, memory_order_relaxed);
+}
+
+// For a queue in memory that outlived the process using it: a producer
+// may have stopped between claiming a position and publishing the event.
+// Such positions are published with lost_event (e.g. an invalid event).
+static inline void lfsm_queue_recover(lfsm_queue_t* queue, lfsm_id_t lost_event) {
+#if (LFSM_QUEUE_MULTI_PRODUCER)
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (uint32_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed) ; position != head ; position++) {
+        uint32_t slot = position & LFSM_QUEUE_MASK;
+        if (atomic_load_explicit(&queue->sequence[slot], memory_order_relaxed) != position + 1) {
+            queue->events[slot] = lost_event;
+            atomic_store_explicit(&queue->sequence[slot], position + 1, memory_order_release);
+        }
+    }
+#else
+    (void)queue;
+    (void)lost_event;
+#endif
+}
+
+static inline lfsm_id_t lfsm_queue_peek(lfsm_queue_t* queue, uint32_t index, lfsm_queue_payload_t* payload) {
+    uint32_t slot = (atomic_load_explicit(&queue->tail, memory_order_relaxed) + index) & LFSM_QUEUE_MASK;
+#if (LFSM_EVENT_PAYLOADS)
+    if (payload != NULL) *payload = queue->payloads[slot];
+#else
+    (void)payload;
+#endif
+    return queue->events[slot];
+}
+
+/* -----------------------------------------------------------------------------
+ *  Event queue of an instance (lfsm_events_*)
+ *
+ *  One ring per priority class (LFSM_EVENT_PRIORITIES), the highest class
+ *  holding an event is read first. pending has a bit per class that may
+ *  hold events: producers set it after adding (release), the consumer picks
+ *  the highest bit and, when it finds that ring empty, clears the bit and
+ *  checks the ring once more. Both are read-modify-writes on pending, so a
+ *  producer's bit set before the clearing makes its event visible to the
+ *  check and no event is left behind an unset bit.
+ *  With one class this is the plain ring, the priority is ignored.
+ * -------------------------------------------------------------------------- */
+#if (LFSM_EVENT_PRIORITIES > 1)
+
+#if (LFSM_EVENT_PRIORITIES > 32)
+#error "LFSM_EVENT_PRIORITIES must be 1 .. 32"
+#endif
+
+typedef struct lfsm_events_t {
+    _Atomic uint32_t pending;
+    lfsm_queue_t classes[LFSM_EVENT_PRIORITIES];
+} lfsm_events_t;
+
+static inline void lfsm_events_init(lfsm_events_t* events) {
+    atomic_init(&events->pending, 0);
+    for (int priority = 0 ; priority < LFSM_EVENT_PRIORITIES ; priority++) {
+        lfsm_queue_init(&events->classes[priority]);
+    }
+}
+
+static inline uint8_t lfsm_events_add_payload(lfsm_events_t* events, uint8_t priority, lfsm_id_t event, const lfsm_queue_payload_t* payload) {
+    if (lfsm_queue_add_payload(&events->classes[priority], event, payload)) {
+        return 1;
+    }
+    atomic_fetch_or_explicit(&events->pending, (uint32_t)1 << priority, memory_order_release);
+    return 0;
+}
+
+// consumer only: highest class holding an event, -1 if all are empty
+static inline int lfsm_events_select(lfsm_events_t* events) {
+    uint32_t pending = atomic_load_explicit(&events->pending, memory_order_acquire);
+
+    while (pending != 0) {
+        int priority = 31 - __builtin_clz(pending);
+        uint32_t bit = (uint32_t)1 << priority;
+        if (!lfsm_queue_is_empty(&events->classes[priority])) return priority;
+        atomic_fetch_and_explicit(&events->pending, ~bit, memory_order_acq_rel);
+        if (!lfsm_queue_is_empty(&events->classes[priority])) {
+            atomic_fetch_or_explicit(&events->pending, bit, memory_order_relaxed);
+            return priority;
+        }
+        pending &= ~bit;
+    }
+    return -1;
+}
+
+static inline uint32_t lfsm_events_count(lfsm_events_t* events) {
+    uint32_t count = 0;
+    for (int priority = 0 ; priority < LFSM_EVENT_PRIORITIES ; priority++) {
+        count += lfsm_queue_count(&events->classes[priority]);
+    }
+    return count;
+}
+
+static inline uint8_t lfsm_events_is_empty(lfsm_events_t* events) {
+    return lfsm_events_select(events) < 0;
+}
+
+// consumer only, there must be an event
+static inline lfsm_id_t lfsm_events_read_payload(lfsm_events_t* events, lfsm_queue_payload_t* payload) {
+    return lfsm_queue_read_payload(&events->classes[lfsm_events_select(events)], payload);
+}
+
+static inline lfsm_queue_t* lfsm_events_class(lfsm_events_t* events, int priority) {
+    return &events->classes[priority];
+}
+
+// see lfsm_queue_recover(), also sets the pending bit of every class holding events
+static inline void lfsm_events_recover(lfsm_events_t* events, lfsm_id_t lost_event) {
+    for (int priority = 0 ; priority < LFSM_EVENT_PRIORITIES ; priority++) {
+        lfsm_queue_recover(&events->classes[priority], lost_event);
+        if (lfsm_queue_length(&events->classes[priority]) > 0) {
+            atomic_fetch_or_explicit(&events->pending, (uint32_t)1 << priority, memory_order_release);
+        }
+    }
+}
+
+#else
+
+typedef lfsm_queue_t lfsm_events_t;
+
+static inline void lfsm_events_init(lfsm_events_t* events) {
+    lfsm_queue_init(events);
+}
+
+static inline uint8_t lfsm_events_add_payload(lfsm_events_t* events, uint8_t priority, lfsm_id_t event, const lfsm_queue_payload_t* payload) {
+    (void)priority;
+    return lfsm_queue_add_payload(events, event, payload);
+}
+
+static inline uint32_t lfsm_events_count(lfsm_events_t* events) {
+    return lfsm_queue_count(events);
+}
+
+static inline uint8_t lfsm_events_is_empty(lfsm_events_t* events) {
+    return lfsm_queue_is_empty(events);
+}
+
+static inline lfsm_id_t lfsm_events_read_payload(lfsm_events_t* events, lfsm_queue_payload_t* payload) {
+    return lfsm_queue_read_payload(events, payload);
+}
+
+static inline lfsm_queue_t* lfsm_events_class(lfsm_events_t* events, int priority) {
+    (void)priority;
+    return events;
+}
+
+static inline void lfsm_events_recover(lfsm_events_t* events, lfsm_id_t lost_event) {
+    lfsm_queue_recover(events, lost_event);
+}
+
+#endif
+
+#endif // __LOVELY_FSM_QUEUE_H
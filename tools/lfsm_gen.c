@@ -0,0 +1,594 @@
+/* -----------------------------------------------------------------------------
+ * lfsm_gen - generates a const lfsm_definition_t from a machine description.
+ *
+ * The description mirrors the transition and state tables, one row per line:
+ *
+ *   machine    temperature
+ *   state      ST_NORMAL 1 normal_entry normal_run normal_exit
+ *   event      EV_MEASURE 11
+ *   transition ST_NORMAL EV_MEASURE temperature_warning ST_WARN
+ *
+ * Use '-' for a missing callback or condition, '#' starts a comment.
+ * A state line may end with 'parent NAME' (hierarchical states, the parent
+ * must be declared before), callbacks may then be left out.
+ * A transition line may end with 'exclusive' (LFSM_EXCLUSIVE_GUARD), an
+ * event line with 'coalesce' and/or 'priority N' (see coalesce_events and
+ * event_priorities in lovely_fsm.h).
+ * 'index dense', 'index hash' or 'index linear' (no index, smallest) forces
+ * the (state,event) index type, by default it is chosen like at runtime
+ * (LFSM_SPARSE_INDEX_DENSITY).
+ * The tables are built by the library itself (lfsm_definition_build), so the
+ * emitted data is exactly what lfsm_init() would create at runtime, only in
+ * ROM/.rodata:
+ *
+ *   lfsm_gen temperature.lfsm > temperature_fsm.c
+ *   lfsm_t fsm = lfsm_init_definition(&temperature_definition, ...);
+ *
+ * With --switch the definition also gets a step function: nested switch
+ * statements over state and event that call the guards and callbacks
+ * directly, in table order, instead of the table interpreter in lfsm_run().
+ * The API stays the same. To let the compiler inline the callbacks, include
+ * the generated file after their definitions (or build with LTO).
+ *
+ * The number of states, events, functions and transitions is only limited
+ * by memory (and state/event values by LFSM_ID_BITS); names are up to
+ * GEN_MAX_NAME_LENGTH - 1 characters, lines up to GEN_MAX_LINE_LENGTH.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../src/lovely_fsm.h"
+
+#define GEN_MAX_NAME_LENGTH 64
+#define GEN_MAX_LINE_LENGTH 512
+
+typedef struct gen_symbol_t {
+    char name[GEN_MAX_NAME_LENGTH];
+    int  value;
+    uint8_t coalesces; // events only
+    uint8_t priority;  // events only
+} gen_symbol_t;
+
+typedef struct gen_function_t {
+    char name[GEN_MAX_NAME_LENGTH];
+    uint8_t is_condition;
+} gen_function_t;
+
+// The tables grow with gen_grow() while the description is read.
+typedef struct gen_machine_t {
+    char name[GEN_MAX_NAME_LENGTH];
+    lfsm_index_type_t index_type;
+    gen_symbol_t* states;
+    int state_count, state_capacity;
+    gen_symbol_t* events;
+    int event_count, event_capacity;
+    // a function is referenced by (index + 1) in the tables
+    gen_function_t* functions;
+    int function_count, function_capacity;
+    lfsm_transitions_t* transitions;
+    int transition_count, transition_capacity;
+    lfsm_state_functions_t* state_functions;
+    int state_function_count, state_function_capacity;
+} gen_machine_t;
+
+static gen_machine_t machine;
+
+static void gen_fail(int line_number, const char* message, const char* token) {
+    fprintf(stderr, "lfsm_gen: line %d: %s '%s'\n", line_number, message, token ? token : "");
+    exit(1);
+}
+
+// room for one more item: doubles the table, new items are zeroed
+static void* gen_grow(void* items, int* capacity, size_t item_size) {
+    int grown = (*capacity > 0) ? *capacity * 2 : 64;
+    char* bytes = realloc(items, (size_t)grown * item_size);
+    if (bytes == NULL) {
+        fprintf(stderr, "lfsm_gen: out of memory\n");
+        exit(1);
+    }
+    memset(bytes + (size_t)*capacity * item_size, 0, (size_t)(grown - *capacity) * item_size);
+    *capacity = grown;
+    return bytes;
+}
+
+static int gen_find_symbol(gen_symbol_t* symbols, int count, const char* name) {
+    for (int i = 0 ; i < count ; i++) {
+        if (strcmp(symbols[i].name, name) == 0) return symbols[i].value;
+    }
+    return -1;
+}
+
+static const char* gen_symbol_name(gen_symbol_t* symbols, int count, int value) {
+    for (int i = 0 ; i < count ; i++) {
+        if (symbols[i].value == value) return symbols[i].name;
+    }
+    return "unused";
+}
+
+// returns a fake, but unique function pointer value for the given name
+static uintptr_t gen_function(const char* name, int is_condition) {
+    if (strcmp(name, "-") == 0 || strcmp(name, "NULL") == 0) return 0;
+    for (int i = 0 ; i < machine.function_count ; i++) {
+        if (strcmp(machine.functions[i].name, name) == 0) return i + 1;
+    }
+    if (machine.function_count == machine.function_capacity) {
+        machine.functions = gen_grow(machine.functions, &machine.function_capacity, sizeof(gen_function_t));
+    }
+    strncpy(machine.functions[machine.function_count].name, name, GEN_MAX_NAME_LENGTH - 1);
+    machine.functions[machine.function_count].is_condition = is_condition;
+    return ++machine.function_count;
+}
+
+static const char* gen_function_name(uintptr_t function) {
+    if (function == 0) return "NULL";
+    return machine.functions[function - 1].name;
+}
+
+static gen_symbol_t* gen_add_symbol(gen_symbol_t** symbols, int* count, int* capacity, char** tokens, int line_number) {
+    if (*count == *capacity) *symbols = gen_grow(*symbols, capacity, sizeof(gen_symbol_t));
+    gen_symbol_t* symbol = &(*symbols)[(*count)++];
+    strncpy(symbol->name, tokens[1], GEN_MAX_NAME_LENGTH - 1);
+    symbol->value = (int)strtol(tokens[2], NULL, 0);
+    if (symbol->value < 0 || symbol->value >= LFSM_INVALID) {
+        gen_fail(line_number, "value out of range for", tokens[1]);
+    }
+    return symbol;
+}
+
+static void gen_parse(FILE* input) {
+    char line[GEN_MAX_LINE_LENGTH];
+    char* tokens[8];
+    int line_number = 0;
+
+    while (fgets(line, sizeof(line), input)) {
+        int token_count = 0;
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        for (char* token = strtok(line, " \t\r\n,") ; token && token_count < 8 ; token = strtok(NULL, " \t\r\n,")) {
+            tokens[token_count++] = token;
+        }
+        if (token_count == 0) continue;
+
+        if (strcmp(tokens[0], "machine") == 0 && token_count == 2) {
+            strncpy(machine.name, tokens[1], GEN_MAX_NAME_LENGTH - 1);
+        } else if (strcmp(tokens[0], "index") == 0 && token_count == 2) {
+            if      (strcmp(tokens[1], "auto")  == 0) machine.index_type = LFSM_INDEX_AUTO;
+            else if (strcmp(tokens[1], "dense") == 0) machine.index_type = LFSM_INDEX_DENSE;
+            else if (strcmp(tokens[1], "hash")  == 0) machine.index_type = LFSM_INDEX_HASH;
+            else if (strcmp(tokens[1], "linear") == 0) machine.index_type = LFSM_INDEX_LINEAR;
+            else gen_fail(line_number, "unknown index type", tokens[1]);
+        } else if (strcmp(tokens[0], "event") == 0 && token_count >= 3) {
+            gen_symbol_t* event = gen_add_symbol(&machine.events, &machine.event_count, &machine.event_capacity, tokens, line_number);
+            for (int i = 3 ; i < token_count ; i++) {
+                if (strcmp(tokens[i], "coalesce") == 0) {
+                    event->coalesces = 1;
+                } else if ((strcmp(tokens[i], "priority") == 0) && (i + 1 < token_count)) {
+                    int priority = (int)strtol(tokens[++i], NULL, 0);
+                    if (priority < 0 || priority > 31) gen_fail(line_number, "priority out of range for", tokens[1]);
+                    event->priority = priority;
+                } else {
+                    gen_fail(line_number, "unknown flag", tokens[i]);
+                }
+            }
+        } else if (strcmp(tokens[0], "state") == 0 && token_count >= 3 && token_count <= 8) {
+            int has_parent = (token_count >= 5) && (strcmp(tokens[token_count - 2], "parent") == 0);
+            int callback_count = token_count - 3 - (has_parent ? 2 : 0);
+            if ((callback_count != 0) && (callback_count != 3)) gen_fail(line_number, "can not parse", tokens[1]);
+            gen_add_symbol(&machine.states, &machine.state_count, &machine.state_capacity, tokens, line_number);
+            if ((callback_count == 3) || has_parent) {
+                if (machine.state_function_count == machine.state_function_capacity) {
+                    machine.state_functions = gen_grow(machine.state_functions, &machine.state_function_capacity, sizeof(lfsm_state_functions_t));
+                }
+                lfsm_state_functions_t* functions = &machine.state_functions[machine.state_function_count++];
+                functions->state = machine.states[machine.state_count - 1].value;
+                if (callback_count == 3) {
+                    functions->on_entry = (lfsm_return_t (*)(lfsm_t))gen_function(tokens[3], 0);
+                    functions->on_run   = (lfsm_return_t (*)(lfsm_t))gen_function(tokens[4], 0);
+                    functions->on_exit  = (lfsm_return_t (*)(lfsm_t))gen_function(tokens[5], 0);
+                }
+                if (has_parent) {
+                    int parent = gen_find_symbol(machine.states, machine.state_count, tokens[token_count - 1]);
+                    if (parent < 0) gen_fail(line_number, "unknown state", tokens[token_count - 1]);
+                    functions->parent = LFSM_PARENT(parent);
+                }
+            }
+        } else if (strcmp(tokens[0], "transition") == 0 && (token_count == 5 || token_count == 6)) {
+            if (machine.transition_count == machine.transition_capacity) {
+                machine.transitions = gen_grow(machine.transitions, &machine.transition_capacity, sizeof(lfsm_transitions_t));
+            }
+            lfsm_transitions_t* transition = &machine.transitions[machine.transition_count++];
+            transition->current_state = gen_find_symbol(machine.states, machine.state_count, tokens[1]);
+            transition->event         = gen_find_symbol(machine.events, machine.event_count, tokens[2]);
+            transition->condition     = (int (*)(lfsm_t))gen_function(tokens[3], 1);
+            transition->next_state    = gen_find_symbol(machine.states, machine.state_count, tokens[4]);
+            if (transition->current_state < 0) gen_fail(line_number, "unknown state", tokens[1]);
+            if (transition->event < 0)         gen_fail(line_number, "unknown event", tokens[2]);
+            if (transition->next_state < 0)    gen_fail(line_number, "unknown state", tokens[4]);
+            if (token_count == 6) {
+                if (strcmp(tokens[5], "exclusive") != 0) gen_fail(line_number, "unknown flag", tokens[5]);
+                transition->flags = LFSM_EXCLUSIVE_GUARD;
+            }
+        } else {
+            gen_fail(line_number, "can not parse", tokens[0]);
+        }
+    }
+    if (machine.name[0] == '\0') gen_fail(line_number, "missing", "machine");
+    if (machine.transition_count == 0) gen_fail(line_number, "missing", "transition");
+}
+
+static void gen_emit_prototypes(FILE* out) {
+    for (int i = 0 ; i < machine.function_count ; i++) {
+        if (strcmp(machine.functions[i].name, "lfsm_always") == 0) continue;
+        if (strcmp(machine.functions[i].name, "always") == 0) continue;
+        if (machine.functions[i].is_condition) {
+            fprintf(out, "int %s(lfsm_t context);\n", machine.functions[i].name);
+        } else {
+            fprintf(out, "lfsm_return_t %s(lfsm_t context);\n", machine.functions[i].name);
+        }
+    }
+    fprintf(out, "\n");
+}
+
+static void gen_emit_dense_index(FILE* out, const lfsm_definition_t* definition);
+static void gen_emit_state_paths(FILE* out, const lfsm_definition_t* definition);
+
+static void gen_emit_tables(FILE* out, const lfsm_definition_t* definition) {
+    const char* name = machine.name;
+    const lfsm_transitions_t* transition = definition->transition_table;
+    int state_range = definition->state_number_max - definition->state_number_min + 1;
+
+    fprintf(out, "static const lfsm_transitions_t %s_transitions[] = {\n", name);
+    fprintf(out, "    // STATE, EVENT, CONDITION, TRANSITION TO, FLAGS\n");
+    for (int i = 0 ; i < definition->transition_count ; i++, transition++) {
+        fprintf(out, "    { %3d, %3d, %s, %3d, %s }, // %s, %s -> %s\n",
+                transition->current_state, transition->event,
+                gen_function_name((uintptr_t)transition->condition), transition->next_state,
+                (transition->flags & LFSM_EXCLUSIVE_GUARD) ? "LFSM_EXCLUSIVE_GUARD" : "0",
+                gen_symbol_name(machine.states, machine.state_count, transition->current_state),
+                gen_symbol_name(machine.events, machine.event_count, transition->event),
+                gen_symbol_name(machine.states, machine.state_count, transition->next_state));
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const lfsm_state_functions_t %s_states[] = {\n", name);
+    for (int i = 0 ; i < machine.state_function_count ; i++) {
+        const lfsm_state_functions_t* functions = &machine.state_functions[i];
+        char parent[GEN_MAX_NAME_LENGTH + 16] = "";
+        if (functions->parent) sprintf(parent, ", LFSM_PARENT(%d)", functions->parent - 1);
+        fprintf(out, "    { %3d, %s, %s, %s%s }, // %s\n", functions->state,
+                gen_function_name((uintptr_t)functions->on_entry),
+                gen_function_name((uintptr_t)functions->on_run),
+                gen_function_name((uintptr_t)functions->on_exit), parent,
+                gen_symbol_name(machine.states, machine.state_count, functions->state));
+    }
+    if (machine.state_function_count == 0) fprintf(out, "    { 0, NULL, NULL, NULL },\n");
+    fprintf(out, "};\n\n");
+
+    if (definition->index_type == LFSM_INDEX_HASH) {
+        uint32_t slot_count = (UINT32_MAX >> definition->hash_shift) + 1;
+        fprintf(out, "static const lfsm_index_entry_t %s_hash_index[] = {\n", name);
+        for (uint32_t slot = 0 ; slot < slot_count ; slot++) {
+            const lfsm_index_entry_t* entry = &definition->hash_index[slot];
+            if (entry->transition) {
+                fprintf(out, "    { %3d, %3d, &%s_transitions[%d] },\n", entry->state, entry->event,
+                        name, (int)(entry->transition - definition->transition_table));
+            } else {
+                fprintf(out, "    {   0,   0, NULL },\n");
+            }
+        }
+        fprintf(out, "};\n\n");
+    } else if (definition->index_type == LFSM_INDEX_DENSE) {
+        gen_emit_dense_index(out, definition);
+    }
+
+    fprintf(out, "static const lfsm_state_functions_t* const %s_function_lookup[] = {\n", name);
+    for (int state = 0 ; state < state_range ; state++) {
+        const lfsm_state_functions_t* entry = definition->function_lookup_table[state];
+        if (entry) {
+            fprintf(out, "    &%s_states[%d],\n", name, (int)(entry - definition->functions_table));
+        } else {
+            fprintf(out, "    NULL,\n");
+        }
+    }
+    fprintf(out, "};\n\n");
+
+    if (definition->state_paths != NULL) gen_emit_state_paths(out, definition);
+
+    fprintf(out, "static const lfsm_dispatch_t %s_dispatch[] = {\n", name);
+    fprintf(out, "    // FROM, TO, NEXT STATE, CALLBACKS, LCA DEPTH\n");
+    for (int i = 0 ; i < definition->transition_count ; i++) {
+        const lfsm_dispatch_t* dispatch = &definition->dispatch_table[i];
+        char from[GEN_MAX_NAME_LENGTH + 16] = "NULL", to[GEN_MAX_NAME_LENGTH + 16] = "NULL";
+        if (dispatch->from) sprintf(from, "&%s_states[%d]", name, (int)(dispatch->from - definition->functions_table));
+        if (dispatch->to) sprintf(to, "&%s_states[%d]", name, (int)(dispatch->to - definition->functions_table));
+        fprintf(out, "    { %s, %s, %3u, 0x%x, %u },\n", from, to, (unsigned)dispatch->next_state,
+                dispatch->callbacks, dispatch->lca_depth);
+    }
+    fprintf(out, "};\n\n");
+}
+
+// bitmap over the event range of the definition, 0 if no event coalesces
+static int gen_emit_coalesce_events(FILE* out, const lfsm_definition_t* definition) {
+    uint32_t* words = calloc(LFSM_COALESCE_WORDS(definition->event_count), sizeof(uint32_t));
+    int any = 0;
+
+    if (words == NULL) {
+        fprintf(stderr, "lfsm_gen: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0 ; i < machine.event_count ; i++) {
+        int event = machine.events[i].value;
+        if (!machine.events[i].coalesces) continue;
+        if ((event < definition->event_number_min) || (event > definition->event_number_max)) continue;
+        words[(event - definition->event_number_min) / 32] |= (uint32_t)1 << ((event - definition->event_number_min) % 32);
+        any = 1;
+    }
+    if (!any) {
+        free(words);
+        return 0;
+    }
+    fprintf(out, "static const uint32_t %s_coalesce_events[] = {", machine.name);
+    for (uint32_t word = 0 ; word < LFSM_COALESCE_WORDS(definition->event_count) ; word++) {
+        fprintf(out, "%s 0x%08x,", (word % 8) ? "" : "\n   ", (unsigned)words[word]);
+    }
+    fprintf(out, "\n};\n\n");
+    free(words);
+    return 1;
+}
+
+// priority class per event of the definition's range, 0 if all are 0
+static int gen_emit_event_priorities(FILE* out, const lfsm_definition_t* definition) {
+    int any = 0;
+
+    for (int i = 0 ; i < machine.event_count ; i++) {
+        any |= machine.events[i].priority;
+    }
+    if (!any) return 0;
+    fprintf(out, "static const uint8_t %s_event_priorities[] = {\n", machine.name);
+    for (int event = definition->event_number_min ; event <= definition->event_number_max ; event++) {
+        int symbol = 0;
+        while ((symbol < machine.event_count) && (machine.events[symbol].value != event)) symbol++;
+        fprintf(out, "    %2d, // %s\n", (symbol < machine.event_count) ? machine.events[symbol].priority : 0,
+                gen_symbol_name(machine.events, machine.event_count, event));
+    }
+    fprintf(out, "};\n\n");
+    return 1;
+}
+
+static void gen_emit_dense_index(FILE* out, const lfsm_definition_t* definition) {
+    const char* name = machine.name;
+    int state_range = definition->state_number_max - definition->state_number_min + 1;
+
+    fprintf(out, "static const lfsm_transitions_t* const %s_transition_lookup[] = {\n", name);
+    for (int state = 0 ; state < state_range ; state++) {
+        fprintf(out, "   ");
+        for (int event = 0 ; event < definition->event_count ; event++) {
+            const lfsm_transitions_t* entry = definition->transition_lookup_table[state * definition->event_count + event];
+            if (entry) {
+                fprintf(out, " &%s_transitions[%d],", name, (int)(entry - definition->transition_table));
+            } else {
+                fprintf(out, " NULL,");
+            }
+        }
+        fprintf(out, " // %s\n", gen_symbol_name(machine.states, machine.state_count, state + definition->state_number_min));
+    }
+    fprintf(out, "};\n\n");
+}
+
+// the paths share one array of functions, in the order the library built them
+static void gen_emit_state_paths(FILE* out, const lfsm_definition_t* definition) {
+    const char* name = machine.name;
+    int state_range = definition->state_number_max - definition->state_number_min + 1;
+    const lfsm_state_path_t* paths = definition->state_paths;
+
+    fprintf(out, "static const lfsm_state_functions_t* const %s_path_functions[] = {\n", name);
+    for (int state = 0 ; state < state_range ; state++) {
+        fprintf(out, "   ");
+        for (int i = 0 ; i < paths[state].depth ; i++) {
+            const lfsm_state_functions_t* functions = paths[state].functions[i];
+            if (functions) {
+                fprintf(out, " &%s_states[%d],", name, (int)(functions - definition->functions_table));
+            } else {
+                fprintf(out, " NULL,");
+            }
+        }
+        fprintf(out, " // %s\n", gen_symbol_name(machine.states, machine.state_count, state + definition->state_number_min));
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const lfsm_state_path_t %s_state_paths[] = {\n", name);
+    for (int state = 0 ; state < state_range ; state++) {
+        char parent[16] = "LFSM_INVALID";
+        if (paths[state].parent != LFSM_INVALID) sprintf(parent, "%u", (unsigned)paths[state].parent);
+        fprintf(out, "    { &%s_path_functions[%d], %s, %u }, // %s\n", name,
+                (int)(paths[state].functions - paths[0].functions), parent, paths[state].depth,
+                gen_symbol_name(machine.states, machine.state_count, state + definition->state_number_min));
+    }
+    fprintf(out, "};\n\n");
+}
+
+// lfsm_always is called like any guard by the library, here it is dropped
+static int gen_is_unconditional(const lfsm_transitions_t* transition) {
+    const char* name = gen_function_name((uintptr_t)transition->condition);
+    return (transition->condition == NULL) || (strcmp(name, "lfsm_always") == 0) || (strcmp(name, "always") == 0);
+}
+
+static void gen_emit_call(FILE* out, const char* indent, lfsm_return_t (*function)(lfsm_t)) {
+    if (function) fprintf(out, "%s%s(fsm);\n", indent, gen_function_name((uintptr_t)function));
+}
+
+// 'state' is the one of the case, for inherited events a descendant of the
+// transition's current_state: hierarchical exits start there
+static void gen_emit_transition(FILE* out, const lfsm_definition_t* definition, int index, int state, const char* indent) {
+    const lfsm_dispatch_t* dispatch = &definition->dispatch_table[index];
+
+    fprintf(out, "%s*state = %u; // %s\n", indent, (unsigned)dispatch->next_state,
+            gen_symbol_name(machine.states, machine.state_count, dispatch->next_state));
+    if (dispatch->callbacks & LFSM_DISPATCH_PATH) {
+        const lfsm_state_path_t* path = &definition->state_paths[state - definition->state_number_min];
+        for (int i = 0 ; i + dispatch->lca_depth < path->depth ; i++) {
+            if (path->functions[i]) gen_emit_call(out, indent, path->functions[i]->on_exit);
+        }
+        path = &definition->state_paths[dispatch->next_state - definition->state_number_min];
+        for (int i = path->depth - dispatch->lca_depth ; i > 0 ; i--) {
+            if (path->functions[i - 1]) gen_emit_call(out, indent, path->functions[i - 1]->on_entry);
+        }
+    }
+    if (dispatch->callbacks & LFSM_DISPATCH_EXIT) gen_emit_call(out, indent, dispatch->from->on_exit);
+    if (dispatch->callbacks & LFSM_DISPATCH_ENTRY) gen_emit_call(out, indent, dispatch->to->on_entry);
+    if (dispatch->callbacks & LFSM_DISPATCH_RUN) gen_emit_call(out, indent, dispatch->to->on_run);
+    fprintf(out, "%sreturn LFSM_STEP_TRANSITION;\n", indent);
+}
+
+static int gen_compare_int(const void* a, const void* b) {
+    return (*(const int*)a > *(const int*)b) - (*(const int*)a < *(const int*)b);
+}
+
+// One case per state with transitions (own or inherited) or state functions.
+// The guards of a (state,event) are tried in table order, after an
+// unconditional transition the rest of the block is unreachable and not
+// emitted. The blocks are found with the definition's index, like lfsm_run().
+static void gen_emit_step(FILE* out, const lfsm_definition_t* definition) {
+    const lfsm_transitions_t* table_end = definition->transition_table + definition->transition_count;
+    int* events = malloc(definition->transition_count * sizeof(int));
+    int event_count = 0;
+
+    if (events == NULL) {
+        fprintf(stderr, "lfsm_gen: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0 ; i < definition->transition_count ; i++) {
+        events[event_count++] = definition->transition_table[i].event;
+    }
+    qsort(events, event_count, sizeof(int), gen_compare_int);
+    int distinct = 0;
+    for (int i = 0 ; i < event_count ; i++) {
+        if ((distinct == 0) || (events[distinct - 1] != events[i])) events[distinct++] = events[i];
+    }
+    event_count = distinct;
+
+    fprintf(out, "static lfsm_step_result_t %s_step(lfsm_t fsm, lfsm_id_t* state, lfsm_id_t event) {\n", machine.name);
+    fprintf(out, "    switch (*state) {\n");
+    for (int state = definition->state_number_min ; state <= definition->state_number_max ; state++) {
+        const lfsm_state_functions_t* callbacks = definition->function_lookup_table[state - definition->state_number_min];
+        int has_transitions = 0;
+        for (int i = 0 ; (i < event_count) && !has_transitions ; i++) {
+            has_transitions = (lfsm_lookup_transition(definition, state, events[i]) != NULL);
+        }
+        if (!has_transitions && (callbacks == NULL)) continue;
+
+        fprintf(out, "    case %d: // %s\n", state, gen_symbol_name(machine.states, machine.state_count, state));
+        if (has_transitions) {
+            fprintf(out, "        switch (event) {\n");
+            for (int i = 0 ; i < event_count ; i++) {
+                const lfsm_transitions_t* transition = lfsm_lookup_transition(definition, state, events[i]);
+                int unconditional = 0;
+                if (transition == NULL) continue;
+                fprintf(out, "        case %d: // %s%s\n", events[i], gen_symbol_name(machine.events, machine.event_count, events[i]),
+                        (transition->current_state != state) ? ", inherited" : "");
+                for (const lfsm_transitions_t* first = transition ; (transition < table_end) \
+                        && (transition->current_state == first->current_state) && (transition->event == events[i]) ; transition++) {
+                    int index = transition - definition->transition_table;
+                    if (unconditional) continue;
+                    if (gen_is_unconditional(transition)) {
+                        gen_emit_transition(out, definition, index, state, "            ");
+                        unconditional = 1;
+                    } else {
+                        fprintf(out, "            if (%s(fsm)) {\n", gen_function_name((uintptr_t)transition->condition));
+                        gen_emit_transition(out, definition, index, state, "                ");
+                        fprintf(out, "            }\n");
+                    }
+                }
+                if (!unconditional) fprintf(out, "            return LFSM_STEP_REJECTED;\n");
+            }
+            fprintf(out, "        }\n");
+        }
+        if (callbacks != NULL) gen_emit_call(out, "        ", callbacks->on_run);
+        fprintf(out, "        return LFSM_STEP_NONE;\n");
+    }
+    fprintf(out, "    }\n");
+    fprintf(out, "    return LFSM_STEP_NONE;\n");
+    fprintf(out, "}\n\n");
+    free(events);
+}
+
+static void gen_emit_definition(FILE* out, const lfsm_definition_t* definition, int with_step, int with_coalesce, int with_priorities) {
+    const char* name = machine.name;
+    fprintf(out, "const lfsm_definition_t %s_definition = {\n", name);
+    fprintf(out, "    .transition_table        = %s_transitions,\n", name);
+    fprintf(out, "    .functions_table         = %s_states,\n", name);
+    if (definition->index_type == LFSM_INDEX_HASH) {
+        fprintf(out, "    .hash_index              = %s_hash_index,\n", name);
+        fprintf(out, "    .index_type              = LFSM_INDEX_HASH,\n");
+        fprintf(out, "    .hash_shift              = %d,\n", definition->hash_shift);
+    } else if (definition->index_type == LFSM_INDEX_DENSE) {
+        fprintf(out, "    .transition_lookup_table = %s_transition_lookup,\n", name);
+        fprintf(out, "    .index_type              = LFSM_INDEX_DENSE,\n");
+    } else {
+        fprintf(out, "    .index_type              = LFSM_INDEX_LINEAR,\n");
+    }
+    fprintf(out, "    .function_lookup_table   = %s_function_lookup,\n", name);
+    fprintf(out, "    .dispatch_table          = %s_dispatch,\n", name);
+    if (definition->state_paths != NULL) fprintf(out, "    .state_paths             = %s_state_paths,\n", name);
+    if (with_step) fprintf(out, "    .step                    = %s_step,\n", name);
+    if (with_coalesce) fprintf(out, "    .coalesce_events         = %s_coalesce_events,\n", name);
+    if (with_priorities) fprintf(out, "    .event_priorities        = %s_event_priorities,\n", name);
+    fprintf(out, "    .transition_count        = %u,\n", (unsigned)definition->transition_count);
+    fprintf(out, "    .state_func_count        = %d,\n", machine.state_function_count);
+    fprintf(out, "    .state_number_min        = %u,\n", (unsigned)definition->state_number_min);
+    fprintf(out, "    .state_number_max        = %u,\n", (unsigned)definition->state_number_max);
+    fprintf(out, "    .event_number_min        = %u,\n", (unsigned)definition->event_number_min);
+    fprintf(out, "    .event_number_max        = %u,\n", (unsigned)definition->event_number_max);
+    fprintf(out, "    .event_count             = %u,\n", (unsigned)definition->event_count);
+    fprintf(out, "};\n");
+}
+
+int main(int argc, char** argv) {
+    lfsm_definition_t definition;
+    FILE* input = stdin;
+    const char* path = NULL;
+    int with_step = 0;
+
+    for (int i = 1 ; i < argc ; i++) {
+        if (strcmp(argv[i], "--switch") == 0) {
+            with_step = 1;
+        } else if ((path == NULL) && (argv[i][0] != '-')) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "usage: lfsm_gen [--switch] [machine.lfsm] > machine.c\n");
+            return 1;
+        }
+    }
+    if (path != NULL) {
+        input = fopen(path, "r");
+        if (input == NULL) {
+            perror(path);
+            return 1;
+        }
+    }
+    gen_parse(input);
+
+    if (lfsm_definition_build(&definition, machine.transitions, machine.transition_count,
+                              machine.state_functions, machine.state_function_count,
+                              machine.index_type) != LFSM_OK) {
+        fprintf(stderr, "lfsm_gen: could not build the lookup tables (state or event id above %u?)\n",
+                (unsigned)LFSM_ID_MAX);
+        return 1;
+    }
+
+    printf("/* generated by lfsm_gen from %s - do not edit */\n", path ? path : "stdin");
+    printf("#include <stddef.h>\n");
+    printf("#include \"lovely_fsm.h\"\n\n");
+    printf("#if (LFSM_ID_BITS != %d)\n#error \"generated for LFSM_ID_BITS %d\"\n#endif\n\n", LFSM_ID_BITS, LFSM_ID_BITS);
+    gen_emit_prototypes(stdout);
+    gen_emit_tables(stdout, &definition);
+    int with_coalesce = gen_emit_coalesce_events(stdout, &definition);
+    int with_priorities = gen_emit_event_priorities(stdout, &definition);
+    if (with_step) gen_emit_step(stdout, &definition);
+    gen_emit_definition(stdout, &definition, with_step, with_coalesce, with_priorities);
+
+    lfsm_definition_release(&definition);
+    return 0;
+}
@@ -0,0 +1,216 @@
+/* -----------------------------------------------------------------------------
+ * lfsm_trace - decodes a transition trace written by lfsm_trace_dump().
+ *
+ *   lfsm_trace [-n machine.lfsm] [-t] trace.bin > trace.json
+ *
+ * Default output is Chrome trace JSON (chrome://tracing, ui.perfetto.dev):
+ * one track per instance, a slice for every stay in a state and an instant
+ * event for every transition (event, guard position, recording thread).
+ * -t prints one line per transition instead, ordered by time. With -n the
+ * state and event names are taken from the 'state' and 'event' lines of an
+ * lfsm_gen machine description.
+ *
+ * Records of all threads are merged, an instance run by several executor
+ * workers gets one track. Records lost to ring overruns are reported on
+ * stderr; the stay before a gap is then shown too long.
+ * -------------------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../src/lovely_fsm.h"
+
+#define TRACE_MAX_NAMES       1024
+#define TRACE_MAX_NAME_LENGTH 64
+
+typedef struct trace_entry_t {
+    lfsm_trace_record_t record;
+    uint32_t thread;
+} trace_entry_t;
+
+typedef struct trace_name_t {
+    char name[TRACE_MAX_NAME_LENGTH];
+    uint32_t value;
+} trace_name_t;
+
+static trace_name_t state_names[TRACE_MAX_NAMES];
+static int state_name_count;
+static trace_name_t event_names[TRACE_MAX_NAMES];
+static int event_name_count;
+
+static void trace_fail(const char* message, const char* detail) {
+    fprintf(stderr, "lfsm_trace: %s %s\n", message, detail ? detail : "");
+    exit(1);
+}
+
+static void trace_read(FILE* input, void* data, size_t size) {
+    if (fread(data, 1, size, input) != size) trace_fail("truncated trace", NULL);
+}
+
+static void trace_read_names(const char* path) {
+    char line[512], keyword[16], name[TRACE_MAX_NAME_LENGTH];
+    unsigned value;
+    FILE* input = fopen(path, "r");
+
+    if (input == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), input) != NULL) {
+        if (sscanf(line, "%15s %63s %u", keyword, name, &value) != 3) continue;
+        trace_name_t* names = NULL;
+        int* count = NULL;
+        if (strcmp(keyword, "state") == 0) {
+            names = state_names;
+            count = &state_name_count;
+        } else if (strcmp(keyword, "event") == 0) {
+            names = event_names;
+            count = &event_name_count;
+        }
+        if ((names != NULL) && (*count < TRACE_MAX_NAMES)) {
+            strcpy(names[*count].name, name);
+            names[(*count)++].value = value;
+        }
+    }
+    fclose(input);
+}
+
+// name of the id, or the number (buffer per kind, valid until the next call)
+static const char* trace_name(const trace_name_t* names, int count, uint32_t value, char* buffer) {
+    for (int i = 0 ; i < count ; i++) {
+        if (names[i].value == value) return names[i].name;
+    }
+    sprintf(buffer, "%u", value);
+    return buffer;
+}
+
+static const char* state_name(uint32_t state) {
+    static char buffer[2][16];
+    static int next;
+    next ^= 1;
+    return trace_name(state_names, state_name_count, state, buffer[next]);
+}
+
+static const char* event_name(uint32_t event) {
+    static char buffer[16];
+    return trace_name(event_names, event_name_count, event, buffer);
+}
+
+static int compare_by_instance(const void* a, const void* b) {
+    const lfsm_trace_record_t* first = &((const trace_entry_t*)a)->record;
+    const lfsm_trace_record_t* second = &((const trace_entry_t*)b)->record;
+    if (first->instance != second->instance) return (first->instance > second->instance) ? 1 : -1;
+    return (first->timestamp > second->timestamp) - (first->timestamp < second->timestamp);
+}
+
+static int compare_by_time(const void* a, const void* b) {
+    const lfsm_trace_record_t* first = &((const trace_entry_t*)a)->record;
+    const lfsm_trace_record_t* second = &((const trace_entry_t*)b)->record;
+    return (first->timestamp > second->timestamp) - (first->timestamp < second->timestamp);
+}
+
+static void print_text(trace_entry_t* entries, size_t count, uint64_t start, double ticks_per_us) {
+    qsort(entries, count, sizeof(trace_entry_t), compare_by_time);
+    printf("        time us | thread | instance | event            | from -> to (guard)\n");
+    for (size_t i = 0 ; i < count ; i++) {
+        const lfsm_trace_record_t* record = &entries[i].record;
+        printf("%15.3f | %6u | %8u | %-16s | %s -> %s (%u)\n",
+               (record->timestamp - start) / ticks_per_us, entries[i].thread, record->instance,
+               event_name(record->event), state_name(record->from_state), state_name(record->to_state),
+               record->guard);
+    }
+}
+
+static void print_json(trace_entry_t* entries, size_t count, uint64_t start, double ticks_per_us) {
+    const char* separator = "";
+
+    qsort(entries, count, sizeof(trace_entry_t), compare_by_instance);
+    printf("{ \"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (size_t i = 0 ; i < count ; i++) {
+        const lfsm_trace_record_t* record = &entries[i].record;
+        double time = (record->timestamp - start) / ticks_per_us;
+        int first_of_instance = (i == 0) || (entries[i - 1].record.instance != record->instance);
+        int last_of_instance = (i + 1 == count) || (entries[i + 1].record.instance != record->instance);
+
+        if (first_of_instance) {
+            printf("%s  { \"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %u, "
+                   "\"args\": { \"name\": \"instance %u\" } }", separator, record->instance, record->instance);
+            separator = ",\n";
+        }
+        printf("%s  { \"ph\": \"i\", \"s\": \"t\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, "
+               "\"args\": { \"from\": \"%s\", \"to\": \"%s\", \"guard\": %u, \"thread\": %u, \"sequence\": %u } }",
+               separator, event_name(record->event), record->instance, time, state_name(record->from_state),
+               state_name(record->to_state), record->guard, entries[i].thread, record->sequence);
+        // the stay in the new state ends with the next transition of the instance
+        if (!last_of_instance) {
+            double end = (entries[i + 1].record.timestamp - start) / ticks_per_us;
+            printf(",\n  { \"ph\": \"X\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f }",
+                   state_name(record->to_state), record->instance, time, end - time);
+        }
+    }
+    printf("\n] }\n");
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    int text = 0;
+
+    for (int i = 1 ; i < argc ; i++) {
+        if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+            trace_read_names(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            text = 1;
+        } else if ((path == NULL) && (argv[i][0] != '-')) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: lfsm_trace [-n machine.lfsm] [-t] trace.bin > trace.json\n");
+        return 1;
+    }
+    FILE* input = fopen(path, "rb");
+    if (input == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    lfsm_trace_header_t header;
+    trace_read(input, &header, sizeof(header));
+    if (memcmp(header.magic, LFSM_TRACE_MAGIC, sizeof(header.magic)) != 0) trace_fail("not a trace:", path);
+    if (header.record_size != sizeof(lfsm_trace_record_t)) trace_fail("unknown record size in", path);
+    if (header.ticks_per_second == 0) trace_fail("no clock rate in", path);
+
+    trace_entry_t* entries = NULL;
+    size_t count = 0;
+    for (uint32_t i = 0 ; i < header.thread_count ; i++) {
+        lfsm_trace_thread_t thread;
+        trace_read(input, &thread, sizeof(thread));
+        if (thread.lost > 0) {
+            fprintf(stderr, "lfsm_trace: thread %u lost %llu records (ring overrun)\n",
+                    thread.thread, (unsigned long long)thread.lost);
+        }
+        entries = realloc(entries, (count + thread.record_count) * sizeof(trace_entry_t));
+        if ((entries == NULL) && (count + thread.record_count > 0)) trace_fail("out of memory", NULL);
+        for (uint32_t record = 0 ; record < thread.record_count ; record++) {
+            trace_read(input, &entries[count].record, sizeof(lfsm_trace_record_t));
+            entries[count++].thread = thread.thread;
+        }
+    }
+    fclose(input);
+
+    uint64_t start = UINT64_MAX;
+    for (size_t i = 0 ; i < count ; i++) {
+        if (entries[i].record.timestamp < start) start = entries[i].record.timestamp;
+    }
+    double ticks_per_us = header.ticks_per_second / 1e6;
+    if (text) {
+        print_text(entries, count, start, ticks_per_us);
+    } else {
+        print_json(entries, count, start, ticks_per_us);
+    }
+    free(entries);
+    return 0;
+}
@@ -5,9 +5,15 @@
  * -------------------------------------------------------------------------- */
 
 #include "unity.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "../../src/lovely_fsm.h"
+#if (USE_LOVELY_BUFFER)
 #include "../../lovelyBuffer/buf_buffer.h"
+#endif
 // include last!
 #include "../../src/lovely_fsm_debug.c"
 // -------- User data structures -------------------------------------
@@ -49,7 +55,8 @@ my_data_t my_data;
 // 5. write the state functions (return fsm_return_t) and have them return
 //    FSM_OK. Returning anything else will trigger a callback function that
 //    will help you debug what was wrong. (callback not implemented yet)
-// 6. Set buffer callback functions in a lfsm_buf_callbacks_t
+// 6. Set buffer callback functions in a lfsm_buf_callbacks_t (not needed for
+//    the built-in queue, LFSM_USE_BUILTIN_QUEUE)
 // 7. Use lfsm_init() to create a state machine context with the arrays from 2.
 //    and 3., callbacks from 6. and user data. The maximum number of state
 //    machine instances is defined in the config file as LFSM_MAX_COUNT.
@@ -72,7 +79,12 @@ enum states {
 enum events_large_fsm {EV_0, EV_1, EV_2, EV_3, EV_4, EV_5, EV_6, EV_7, EV_8, EV_9};
 enum states_large_fsm {ST_0, ST_1, ST_2, ST_3, ST_4, ST_5, ST_6, ST_7, ST_8, ST_9};
 
+// scattered ids, only a few of the state/event combinations are used
+enum events_sparse_fsm {EV_SPARSE_A = 3, EV_SPARSE_B = 120, EV_SPARSE_C = 250};
+enum states_sparse_fsm {ST_SPARSE_A = 5, ST_SPARSE_B = 90, ST_SPARSE_C = 200};
+
 // -- state transitions: condition functions --
+int payload_temperature_critical(lfsm_t context);
 int temperature_okay(lfsm_t context);
 int temperature_warning(lfsm_t context);
 int temperature_critical(lfsm_t context);
@@ -199,6 +211,19 @@ lfsm_transitions_t my_transition_table[] = {
     { ST_9  , EV_9 , lfsm_always , ST_9 },
 };
 
+// the measured temperature is passed with the event
+lfsm_transitions_t payload_transition_table[] = {
+    { ST_NORMAL , EV_MEASURE      , payload_temperature_critical , ST_ALARM  },
+    { ST_ALARM  , EV_BUTTON_PRESS , NULL                         , ST_NORMAL },
+};
+
+lfsm_transitions_t sparse_transition_table[] = {
+    { ST_SPARSE_C , EV_SPARSE_C , lfsm_always , ST_SPARSE_A },
+    { ST_SPARSE_A , EV_SPARSE_A , lfsm_always , ST_SPARSE_B },
+    { ST_SPARSE_B , EV_SPARSE_B , NULL        , ST_SPARSE_C },
+    { ST_SPARSE_C , EV_SPARSE_A , lfsm_always , ST_SPARSE_B },
+};
+
 // -------------------------------------------------------------------------
 // - State function table
 // -------------------------------------------------------------------------
@@ -209,6 +234,12 @@ lfsm_state_functions_t state_func_table[] = {
     {ST_ALARM  , alarm_entry  , alarm_run , alarm_exit  },
 };
 
+lfsm_state_functions_t sparse_state_func_table[] = {
+    { ST_SPARSE_A , generic_entry , generic_run , generic_exit },
+    { ST_SPARSE_B , generic_entry , generic_run , generic_exit },
+    { ST_SPARSE_C , generic_entry , generic_run , generic_exit },
+};
+
 lfsm_state_functions_t my_state_func_table[] = {
     { ST_0  , generic_entry , generic_run , generic_exit },
     { ST_1  , generic_entry , generic_run , generic_exit },
@@ -222,7 +253,103 @@ lfsm_state_functions_t my_state_func_table[] = {
     { ST_9  , generic_entry , generic_run , generic_exit },
 };
 
+// -------------------------------------------------------------------------
+// - Same machine as above, as generated by tools/lfsm_gen from
+// - tools/examples/temperature.lfsm (const, no sorting or allocation on init)
+// -------------------------------------------------------------------------
+static const lfsm_transitions_t temperature_transitions[] = {
+    // STATE, EVENT, CONDITION, TRANSITION TO
+    {   1,  11, temperature_warning,   4 }, // ST_NORMAL, EV_MEASURE -> ST_WARN
+    {   1,  11, temperature_critical,   2 }, // ST_NORMAL, EV_MEASURE -> ST_ALARM
+    {   2,  10, temperature_okay,   1 }, // ST_ALARM, EV_BUTTON_PRESS -> ST_NORMAL
+    {   4,  11, temperature_okay,   1 }, // ST_WARN, EV_MEASURE -> ST_NORMAL
+    {   4,  11, temperature_critical,   2 }, // ST_WARN, EV_MEASURE -> ST_ALARM
+};
+
+static const lfsm_state_functions_t temperature_states[] = {
+    {   1, normal_entry, normal_run, normal_exit }, // ST_NORMAL
+    {   2, alarm_entry, alarm_run, alarm_exit }, // ST_ALARM
+    {   4, warn_entry, warn_run, warn_exit }, // ST_WARN
+};
+
+static const lfsm_transitions_t* const temperature_transition_lookup[] = {
+    NULL, &temperature_transitions[0], // ST_NORMAL
+    &temperature_transitions[2], NULL, // ST_ALARM
+    NULL, NULL, // unused
+    NULL, &temperature_transitions[3], // ST_WARN
+};
+
+static const lfsm_state_functions_t* const temperature_function_lookup[] = {
+    &temperature_states[0],
+    &temperature_states[1],
+    NULL,
+    &temperature_states[2],
+};
+
+const lfsm_definition_t temperature_definition = {
+    .transition_table        = temperature_transitions,
+    .functions_table         = temperature_states,
+    .transition_lookup_table = temperature_transition_lookup,
+    .index_type              = LFSM_INDEX_DENSE,
+    .function_lookup_table   = temperature_function_lookup,
+    .transition_count        = 5,
+    .state_func_count        = 3,
+    .state_number_min        = 1,
+    .state_number_max        = 4,
+    .event_number_min        = 10,
+    .event_number_max        = 11,
+    .event_count             = 2,
+};
+
+// step function of 'lfsm_gen --switch', ST_WARN left out
+static lfsm_step_result_t temperature_step(lfsm_t fsm, lfsm_id_t* state, lfsm_id_t event) {
+    switch (*state) {
+    case 1: // ST_NORMAL
+        switch (event) {
+        case 11: // EV_MEASURE
+            if (temperature_warning(fsm)) {
+                *state = 4; // ST_WARN
+                normal_exit(fsm);
+                warn_entry(fsm);
+                warn_run(fsm);
+                return LFSM_STEP_TRANSITION;
+            }
+            if (temperature_critical(fsm)) {
+                *state = 2; // ST_ALARM
+                normal_exit(fsm);
+                alarm_entry(fsm);
+                alarm_run(fsm);
+                return LFSM_STEP_TRANSITION;
+            }
+            return LFSM_STEP_REJECTED;
+        }
+        normal_run(fsm);
+        return LFSM_STEP_NONE;
+    case 2: // ST_ALARM
+        switch (event) {
+        case 10: // EV_BUTTON_PRESS
+            if (temperature_okay(fsm)) {
+                *state = 1; // ST_NORMAL
+                alarm_exit(fsm);
+                normal_entry(fsm);
+                normal_run(fsm);
+                return LFSM_STEP_TRANSITION;
+            }
+            return LFSM_STEP_REJECTED;
+        }
+        alarm_run(fsm);
+        return LFSM_STEP_NONE;
+    }
+    return LFSM_STEP_NONE;
+}
+
 // -- Transition condition functions ----
+int payload_temperature_critical(lfsm_t context) {
+    uint32_t length;
+    const int16_t* temperature = lfsm_event_payload(context, &length);
+    return (length == sizeof(int16_t)) && (*temperature >= ALARM_TEMP);
+}
+
 int temperature_okay(lfsm_t context) {
     my_data_t* data = (my_data_t*)lfsm_user_data(context);
     return data->temperature <= WARN_TEMP;
@@ -299,8 +426,10 @@ lfsm_t lfsm_handler;
 // -------- UNITY SETUP AND TEARDOWN CALLBACKS ----------
 void setUp(void) {
     memset((char*)&my_data, 0, sizeof(my_data_t));
+#if (USE_LOVELY_BUFFER)
     buf_init_system();
     lfsm_set_lovely_buf_callbacks(&buffer_callbacks);
+#endif
     lfsm_handler = lfsm_init(transition_table, state_func_table, buffer_callbacks, &my_data, ST_NORMAL);
     TEST_ASSERT_NOT_NULL(lfsm_handler);
 }
@@ -335,9 +464,9 @@ void test_set_get_state() {
 // find the correct state/event combo. This is the locaton the lookup table
 // should point to 
 void test_get_transition_address_from_lookup( void ) {
-    lfsm_transitions_t* transition_from_lookup;
-    lfsm_transitions_t* transition_temporary;
-    lfsm_transitions_t* transition_for_loop_runner;
+    const lfsm_transitions_t* transition_from_lookup;
+    const lfsm_transitions_t* transition_temporary;
+    const lfsm_transitions_t* transition_for_loop_runner;
     uint8_t emin = lfsm_get_event_min(lfsm_handler);
     uint8_t emax = lfsm_get_event_max(lfsm_handler);
     uint8_t smin = lfsm_get_state_min(lfsm_handler);
@@ -401,15 +530,26 @@ void test_add_event_to_buffer_and_read( void ) {
     TEST_ASSERT_EQUAL(EV_BUTTON_PRESS, event);
 }
 
+void test_add_event_to_full_queue_fails(void) {
+    for (int i = 0 ; i < LFSM_EV_QUEUE_SIZE ; i++) {
+        TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(lfsm_handler, EV_MEASURE));
+    }
+    TEST_ASSERT_EQUAL(LFSM_ERROR, fsm_add_event(lfsm_handler, EV_MEASURE));
+
+    TEST_ASSERT_EQUAL(LFSM_ERROR, fsm_add_event(lfsm_handler, EV_BUTTON_PRESS + 10));
+    TEST_ASSERT_EQUAL(LFSM_EV_QUEUE_SIZE, lfsm_run_until_empty(lfsm_handler).events);
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(lfsm_handler, EV_MEASURE));
+}
+
 void test_get_transition_from_lookuo_existing(void) {
-    lfsm_transitions_t* transition;
+    const lfsm_transitions_t* transition;
     lfsm_set_state(lfsm_handler, ST_NORMAL);
     transition = lfsm_get_transition_from_lookup(lfsm_handler, EV_MEASURE);
     TEST_ASSERT_NOT_NULL(transition);
 }
 
 void test_get_transition_from_lookuo_non_existing(void) {
-    lfsm_transitions_t* transition;
+    const lfsm_transitions_t* transition;
     lfsm_set_state(lfsm_handler, ST_NORMAL);
     transition = lfsm_get_transition_from_lookup(lfsm_handler, EV_BUTTON_PRESS);
     TEST_ASSERT_NULL(transition);
@@ -459,6 +599,914 @@ void test_run_non_existing_state_event_combo(void) {
     // lfsm_run(lfsm_handler);
 }
 
+void test_init_from_const_definition(void) {
+    lfsm_t const_fsm = lfsm_init_definition(&temperature_definition, buffer_callbacks, &my_data, ST_NORMAL);
+    TEST_ASSERT_NOT_NULL(const_fsm);
+    TEST_ASSERT_EQUAL(2, my_data.normal_entry_run_count);
+
+    fsm_add_event(const_fsm, EV_MEASURE);
+    my_data.temperature = ALARM_TEMP + 5;
+    lfsm_run(const_fsm);
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(const_fsm));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_entry_run_count);
+
+    fsm_add_event(const_fsm, EV_BUTTON_PRESS);
+    my_data.temperature = WARN_TEMP - 5;
+    lfsm_run(const_fsm);
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(const_fsm));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_exit_run_count);
+
+    // lookup tables are the application's, deinit must not free them
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_deinit(const_fsm));
+    TEST_ASSERT_EQUAL_PTR(&temperature_transitions[3], temperature_transition_lookup[7]);
+}
+
+void test_dispatch_records_resolve_callbacks(void) {
+    static lfsm_transitions_t dispatch_table[] = {
+        { ST_NORMAL , EV_MEASURE      , NULL , ST_WARN   },
+        { ST_WARN   , EV_MEASURE      , NULL , ST_WARN   }, // self transition
+        { ST_WARN   , EV_BUTTON_PRESS , NULL , ST_ALARM  }, // no functions, no exit
+    };
+    static lfsm_state_functions_t dispatch_states[] = {
+        { ST_NORMAL , normal_entry , NULL     , normal_exit },
+        { ST_WARN   , warn_entry   , warn_run , NULL        },
+    };
+    lfsm_definition_t definition;
+
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_definition_build(&definition, dispatch_table, 3, dispatch_states, 2, LFSM_INDEX_AUTO));
+    TEST_ASSERT_NOT_NULL(definition.dispatch_table);
+    const lfsm_dispatch_t* to_warn = &definition.dispatch_table[0];
+    TEST_ASSERT_EQUAL_PTR(&dispatch_states[0], to_warn->from);
+    TEST_ASSERT_EQUAL_PTR(&dispatch_states[1], to_warn->to);
+    TEST_ASSERT_EQUAL(ST_WARN, to_warn->next_state);
+    TEST_ASSERT_EQUAL(LFSM_DISPATCH_EXIT | LFSM_DISPATCH_ENTRY | LFSM_DISPATCH_RUN, to_warn->callbacks);
+    // sorted: ST_WARN/EV_BUTTON_PRESS comes before the self transition
+    TEST_ASSERT_NULL(definition.dispatch_table[1].to);
+    TEST_ASSERT_EQUAL(0, definition.dispatch_table[1].callbacks);
+    TEST_ASSERT_EQUAL(LFSM_DISPATCH_RUN, definition.dispatch_table[2].callbacks);
+
+    // run through the records: same callbacks as resolving them per event
+    lfsm_t dispatch_fsm = lfsm_init_definition(&definition, buffer_callbacks, &my_data, ST_NORMAL);
+    fsm_add_event(dispatch_fsm, EV_MEASURE);
+    fsm_add_event(dispatch_fsm, EV_MEASURE);
+    lfsm_run(dispatch_fsm);
+    lfsm_run_until_empty(dispatch_fsm);
+    TEST_ASSERT_EQUAL(1, my_data.normal_exit_run_count);
+    TEST_ASSERT_EQUAL(1, my_data.warn_entry_run_count);
+    TEST_ASSERT_EQUAL(2, my_data.warn_run_run_count);
+    lfsm_deinit(dispatch_fsm);
+    lfsm_definition_release(&definition);
+}
+
+enum { ST_H_OFF = 1, ST_H_ON, ST_H_IDLE, ST_H_HEATING, ST_H_BOOST };
+enum { EV_H_START = 1, EV_H_STOP, EV_H_FAULT, EV_H_BOOST };
+static char hierarchy_log[128];
+static lfsm_return_t hierarchy_record(const char* step) {
+    strcat(hierarchy_log, step);
+    return LFSM_OK;
+}
+static lfsm_return_t off_entry(lfsm_t context)     { return hierarchy_record("+OFF"); }
+static lfsm_return_t off_exit(lfsm_t context)      { return hierarchy_record("-OFF"); }
+static lfsm_return_t powered_entry(lfsm_t context) { return hierarchy_record("+ON"); }
+static lfsm_return_t powered_exit(lfsm_t context)  { return hierarchy_record("-ON"); }
+static lfsm_return_t idle_entry(lfsm_t context)    { return hierarchy_record("+IDLE"); }
+static lfsm_return_t idle_exit(lfsm_t context)     { return hierarchy_record("-IDLE"); }
+static lfsm_return_t heating_entry(lfsm_t context) { return hierarchy_record("+HEATING"); }
+static lfsm_return_t heating_exit(lfsm_t context)  { return hierarchy_record("-HEATING"); }
+static lfsm_return_t boost_run(lfsm_t context)     { return hierarchy_record("*BOOST"); }
+
+void test_hierarchical_states_inherit_events(void) {
+    static lfsm_transitions_t hierarchy_transitions[] = {
+        { ST_H_OFF     , EV_H_START , NULL , ST_H_IDLE    },
+        { ST_H_ON      , EV_H_FAULT , NULL , ST_H_OFF     }, // for all states in ST_H_ON
+        { ST_H_ON      , EV_H_STOP  , NULL , ST_H_OFF     },
+        { ST_H_IDLE    , EV_H_START , NULL , ST_H_HEATING },
+        { ST_H_HEATING , EV_H_STOP  , NULL , ST_H_IDLE    }, // overrides ST_H_ON
+        { ST_H_HEATING , EV_H_BOOST , NULL , ST_H_BOOST   },
+    };
+    static lfsm_state_functions_t hierarchy_states[] = {
+        { ST_H_OFF     , off_entry     , NULL      , off_exit                           },
+        { ST_H_ON      , powered_entry , NULL      , powered_exit                       },
+        { ST_H_IDLE    , idle_entry    , NULL      , idle_exit    , LFSM_PARENT(ST_H_ON)      },
+        { ST_H_HEATING , heating_entry , NULL      , heating_exit , LFSM_PARENT(ST_H_ON)      },
+        { ST_H_BOOST   , NULL          , boost_run , NULL         , LFSM_PARENT(ST_H_HEATING) },
+    };
+    static const lfsm_index_type_t index_types[] = { LFSM_INDEX_DENSE, LFSM_INDEX_HASH, LFSM_INDEX_LINEAR };
+    lfsm_definition_t definition;
+
+    for (int i = 0 ; i < ARRAYSIZE(index_types) ; i++) {
+        TEST_ASSERT_EQUAL(LFSM_OK, lfsm_definition_build(&definition, hierarchy_transitions, ARRAYSIZE(hierarchy_transitions), \
+                                                         hierarchy_states, ARRAYSIZE(hierarchy_states), index_types[i]));
+        TEST_ASSERT_EQUAL(ARRAYSIZE(hierarchy_transitions), definition.transition_count);
+        TEST_ASSERT_EQUAL(3, definition.state_paths[ST_H_BOOST - definition.state_number_min].depth);
+        hierarchy_log[0] = '\0';
+        lfsm_t fsm = lfsm_init_definition(&definition, buffer_callbacks, NULL, ST_H_IDLE);
+        TEST_ASSERT_EQUAL_STRING("+ON+IDLE", hierarchy_log);
+
+        // siblings: the common parent stays active
+        hierarchy_log[0] = '\0';
+        fsm_add_event(fsm, EV_H_START);
+        fsm_add_event(fsm, EV_H_BOOST);
+        lfsm_run_until_empty(fsm);
+        TEST_ASSERT_EQUAL_STRING("-IDLE+HEATING*BOOST", hierarchy_log);
+        TEST_ASSERT_EQUAL(ST_H_BOOST, lfsm_get_state(fsm));
+
+        // inherited from the nearest ancestor, exits up to the common ancestor
+        hierarchy_log[0] = '\0';
+        fsm_add_event(fsm, EV_H_STOP);
+        lfsm_run(fsm);
+        TEST_ASSERT_EQUAL_STRING("-HEATING+IDLE", hierarchy_log);
+        hierarchy_log[0] = '\0';
+        fsm_add_event(fsm, EV_H_FAULT);
+        fsm_add_event(fsm, EV_H_START);
+        lfsm_run_batch(fsm, 2);
+        TEST_ASSERT_EQUAL_STRING("-IDLE-ON+OFF-OFF+ON+IDLE", hierarchy_log);
+        TEST_ASSERT_EQUAL(ST_H_IDLE, lfsm_get_state(fsm));
+        lfsm_deinit(fsm);
+        lfsm_definition_release(&definition);
+    }
+}
+
+enum { ST_F_STILL = 1, ST_F_SPIN };
+enum { EV_F_TICK = EV_H_BOOST + 1 };
+static lfsm_return_t still_entry(lfsm_t context) { return hierarchy_record("+STILL"); }
+static lfsm_return_t spin_entry(lfsm_t context)  { return hierarchy_record("+SPIN"); }
+static lfsm_return_t spin_run(lfsm_t context)    { return hierarchy_record("*SPIN"); }
+static lfsm_return_t spin_exit(lfsm_t context)   { return hierarchy_record("-SPIN"); }
+
+void test_regions_share_one_queue(void) {
+    static lfsm_transitions_t heater_transitions[] = {
+        { ST_H_OFF     , EV_H_START , NULL , ST_H_IDLE    },
+        { ST_H_ON      , EV_H_FAULT , NULL , ST_H_OFF     },
+        { ST_H_IDLE    , EV_H_START , NULL , ST_H_HEATING },
+        { ST_H_HEATING , EV_H_BOOST , NULL , ST_H_BOOST   },
+    };
+    static lfsm_state_functions_t heater_states[] = {
+        { ST_H_OFF     , off_entry     , NULL      , off_exit                           },
+        { ST_H_ON      , powered_entry , NULL      , powered_exit                       },
+        { ST_H_IDLE    , idle_entry    , NULL      , idle_exit    , LFSM_PARENT(ST_H_ON)      },
+        { ST_H_HEATING , heating_entry , NULL      , heating_exit , LFSM_PARENT(ST_H_ON)      },
+        { ST_H_BOOST   , NULL          , boost_run , NULL         , LFSM_PARENT(ST_H_HEATING) },
+    };
+    static lfsm_transitions_t fan_transitions[] = {
+        { ST_F_STILL , EV_H_START , NULL , ST_F_SPIN  },
+        { ST_F_SPIN  , EV_F_TICK  , NULL , ST_F_SPIN  },
+        { ST_F_SPIN  , EV_H_FAULT , NULL , ST_F_STILL },
+    };
+    static lfsm_state_functions_t fan_states[] = {
+        { ST_F_STILL , still_entry , NULL     , NULL      },
+        { ST_F_SPIN  , spin_entry  , spin_run , spin_exit },
+    };
+    static const lfsm_id_t initial_states[] = { ST_H_OFF, ST_F_STILL };
+    lfsm_definition_t heater, fan;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_definition_build(&heater, heater_transitions, ARRAYSIZE(heater_transitions), \
+                                                     heater_states, ARRAYSIZE(heater_states), LFSM_INDEX_DENSE));
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_definition_build(&fan, fan_transitions, ARRAYSIZE(fan_transitions), \
+                                                     fan_states, ARRAYSIZE(fan_states), LFSM_INDEX_HASH));
+    const lfsm_definition_t* definitions[] = { &heater, &fan };
+
+    hierarchy_log[0] = '\0';
+    lfsm_t fsm = lfsm_init_regions(definitions, 2, buffer_callbacks, NULL, initial_states);
+    TEST_ASSERT_NOT_NULL(fsm);
+    TEST_ASSERT_EQUAL_STRING("+OFF+STILL", hierarchy_log);
+    lfsm_t fan_region = lfsm_get_region(fsm, 1);
+    TEST_ASSERT_EQUAL_PTR(fsm, lfsm_get_region(fsm, 0));
+    TEST_ASSERT_NULL(lfsm_get_region(fsm, 2));
+
+    // one queue: events of one region are added through the other, each
+    // event runs in all regions that have transitions for it
+    hierarchy_log[0] = '\0';
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(fan_region, EV_H_START));
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(fsm, EV_F_TICK));
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(fsm, EV_H_START));
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(fsm, EV_H_BOOST));
+    lfsm_batch_result_t result = lfsm_run_until_empty(fsm);
+    TEST_ASSERT_EQUAL(4, result.events);
+    TEST_ASSERT_EQUAL(5, result.transitions);
+    // EV_H_START in ST_F_SPIN: no row, on_run runs; EV_F_TICK skips the heater
+    TEST_ASSERT_EQUAL_STRING("-OFF+ON+IDLE+SPIN*SPIN*SPIN-IDLE+HEATING*SPIN*BOOST", hierarchy_log);
+    TEST_ASSERT_EQUAL(ST_H_BOOST, lfsm_get_state(fsm));
+    TEST_ASSERT_EQUAL(ST_F_SPIN, lfsm_get_state(fan_region));
+
+    hierarchy_log[0] = '\0';
+    fsm_add_event(fsm, EV_F_TICK);
+    fsm_add_event(fsm, EV_H_FAULT);
+    TEST_ASSERT_EQUAL(LFSM_MORE_QUEUED, lfsm_run(fsm));
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_run(fsm));
+    TEST_ASSERT_EQUAL_STRING("*SPIN-HEATING-ON+OFF-SPIN+STILL", hierarchy_log);
+    TEST_ASSERT_EQUAL(ST_F_STILL, lfsm_get_state(fan_region));
+
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_deinit(fan_region));
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_deinit(fsm));
+    lfsm_definition_release(&heater);
+    lfsm_definition_release(&fan);
+}
+
+void test_generated_step_replaces_table_lookup(void) {
+    lfsm_definition_t switch_definition = temperature_definition;
+    switch_definition.step = temperature_step;
+    lfsm_t switch_fsm = lfsm_init_definition(&switch_definition, buffer_callbacks, &my_data, ST_NORMAL);
+
+    fsm_add_event(switch_fsm, EV_MEASURE);
+    my_data.temperature = ALARM_TEMP + 5;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_run(switch_fsm));
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(switch_fsm));
+    TEST_ASSERT_EQUAL(1, my_data.normal_exit_run_count);
+    TEST_ASSERT_EQUAL(1, my_data.alarm_entry_run_count);
+
+    // guard rejects: no callbacks, like the table engine
+    fsm_add_event(switch_fsm, EV_BUTTON_PRESS);
+    TEST_ASSERT_EQUAL(LFSM_NOP, lfsm_run(switch_fsm));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_run_run_count);
+
+    // no transition for the pair: on_run of the state; batches count events
+    fsm_add_event(switch_fsm, EV_MEASURE);
+    fsm_add_event(switch_fsm, EV_BUTTON_PRESS);
+    my_data.temperature = WARN_TEMP - 5;
+    lfsm_batch_result_t result = lfsm_run_batch(switch_fsm, 10);
+    TEST_ASSERT_EQUAL(2, result.events);
+    TEST_ASSERT_EQUAL(1, result.transitions);
+    TEST_ASSERT_EQUAL(2, my_data.alarm_run_run_count);
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(switch_fsm));
+    lfsm_deinit(switch_fsm);
+}
+
+void test_coalescing_event_is_queued_once(void) {
+    static const uint32_t coalesce_events[] = { 0x2 }; // EV_MEASURE
+    lfsm_definition_t coalescing_definition = temperature_definition;
+    coalescing_definition.coalesce_events = coalesce_events;
+    lfsm_t coalescing_fsm = lfsm_init_definition(&coalescing_definition, buffer_callbacks, &my_data, ST_NORMAL);
+
+    my_data.temperature = WARN_TEMP + 1;
+    for (int i = 0 ; i < LFSM_EV_QUEUE_SIZE + 2 ; i++) {
+        TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(coalescing_fsm, EV_MEASURE));
+    }
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(coalescing_fsm, EV_BUTTON_PRESS));
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(coalescing_fsm, EV_BUTTON_PRESS));
+    lfsm_batch_result_t result = lfsm_run_until_empty(coalescing_fsm);
+    TEST_ASSERT_EQUAL(3, result.events);
+    TEST_ASSERT_EQUAL(ST_WARN, lfsm_get_state(coalescing_fsm));
+
+    // taken for running: the next one is queued again
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(coalescing_fsm, EV_MEASURE));
+    TEST_ASSERT_EQUAL(1, lfsm_run_until_empty(coalescing_fsm).events);
+    lfsm_deinit(coalescing_fsm);
+}
+
+void test_high_priority_event_overtakes_queued_events(void) {
+    static const uint8_t event_priorities[] = { 1, 0 }; // EV_BUTTON_PRESS, EV_MEASURE
+    lfsm_definition_t priority_definition = temperature_definition;
+    priority_definition.event_priorities = event_priorities;
+
+    if (LFSM_EVENT_PRIORITIES < 2) {
+        TEST_IGNORE_MESSAGE("one event queue for all events (LFSM_EVENT_PRIORITIES)");
+    }
+    lfsm_t priority_fsm = lfsm_init_definition(&priority_definition, buffer_callbacks, &my_data, ST_ALARM);
+    my_data.temperature = WARN_TEMP - 5;
+    fsm_add_event(priority_fsm, EV_MEASURE);
+    fsm_add_event(priority_fsm, EV_MEASURE);
+    fsm_add_event(priority_fsm, EV_BUTTON_PRESS);
+    TEST_ASSERT_EQUAL(LFSM_MORE_QUEUED, lfsm_run(priority_fsm));
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(priority_fsm));
+    TEST_ASSERT_EQUAL(2, lfsm_run_until_empty(priority_fsm).events);
+    lfsm_deinit(priority_fsm);
+}
+
+void test_instances_share_one_definition(void) {
+    lfsm_t second_fsm = lfsm_init(transition_table, state_func_table, buffer_callbacks, &my_data, ST_NORMAL);
+    TEST_ASSERT_NOT_NULL(second_fsm);
+    TEST_ASSERT_EQUAL_PTR(lfsm_get_transition_lookup_table(lfsm_handler), lfsm_get_transition_lookup_table(second_fsm));
+
+    const lfsm_definition_t* definition = lfsm_definition_compile(transition_table, ARRAYSIZE(transition_table), state_func_table, ARRAYSIZE(state_func_table));
+    TEST_ASSERT_EQUAL_PTR(lfsm_get_transition_lookup_table(lfsm_handler), definition->transition_lookup_table);
+
+    // states are per instance
+    lfsm_set_state(second_fsm, ST_ALARM);
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(lfsm_handler));
+
+    lfsm_deinit(second_fsm);
+    lfsm_definition_free(definition);
+    // still referenced by lfsm_handler
+    TEST_ASSERT_NOT_NULL(lfsm_get_transition_from_lookup(lfsm_handler, EV_MEASURE));
+}
+
+static uint8_t snapshot_data[1024];
+static uint32_t snapshot_size;
+static void write_snapshot(const void* data, uint32_t size, void* context) {
+    TEST_ASSERT_LESS_OR_EQUAL(sizeof(snapshot_data), snapshot_size + size);
+    memcpy(&snapshot_data[snapshot_size], data, size);
+    snapshot_size += size;
+}
+
+void test_snapshot_restores_states_and_queued_events(void) {
+    if (!LFSM_USE_BUILTIN_QUEUE) {
+        TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_snapshot(write_snapshot, NULL));
+        TEST_IGNORE_MESSAGE("snapshots need the built-in queue (LFSM_USE_BUILTIN_QUEUE)");
+    }
+    const lfsm_definition_t* definition = lfsm_definition_compile(transition_table, ARRAYSIZE(transition_table), state_func_table, ARRAYSIZE(state_func_table));
+    lfsm_t instances[8];
+    uint32_t instance_count = ARRAYSIZE(instances);
+
+    lfsm_set_state(lfsm_handler, ST_ALARM);
+    fsm_add_event(lfsm_handler, EV_BUTTON_PRESS);
+    snapshot_size = 0;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_snapshot(write_snapshot, NULL));
+    TEST_ASSERT_EQUAL_MEMORY(LFSM_SNAPSHOT_MAGIC, snapshot_data, 8);
+
+    // the definition is found by its hash, not by its address
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_restore(snapshot_data, snapshot_size, NULL, 0, instances, &instance_count));
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_restore(snapshot_data, snapshot_size - 1, &definition, 1, instances, &instance_count));
+    // a state the definition does not have is rejected
+    lfsm_snapshot_instance_t record;
+    uint8_t* record_data = &snapshot_data[snapshot_size - sizeof(lfsm_id_t) - sizeof(record)];
+    memcpy(&record, record_data, sizeof(record));
+    record.current_state = LFSM_INVALID - 1;
+    memcpy(record_data, &record, sizeof(record));
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_restore(snapshot_data, snapshot_size, &definition, 1, instances, &instance_count));
+    record.current_state = ST_ALARM;
+    memcpy(record_data, &record, sizeof(record));
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_restore(snapshot_data, snapshot_size, &definition, 1, instances, &instance_count));
+    TEST_ASSERT_EQUAL(1, instance_count);
+    lfsm_t restored = instances[0];
+    TEST_ASSERT_NOT_EQUAL(lfsm_handler, restored);
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(restored));
+    TEST_ASSERT_EQUAL(0, my_data.alarm_entry_run_count);
+
+    // the queued event is run by the restored instance
+    lfsm_set_user_data(restored, &my_data);
+    my_data.temperature = WARN_TEMP - 5;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_run(restored));
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(restored));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_exit_run_count);
+    TEST_ASSERT_EQUAL(LFSM_NOP, lfsm_run(restored));
+    lfsm_deinit(restored);
+    lfsm_definition_free(definition);
+}
+
+void test_recorder_replays_events_into_same_state(void) {
+    if (!LFSM_ENABLE_RECORDER) {
+        TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_recorder_start(write_snapshot, NULL));
+        TEST_IGNORE_MESSAGE("the event recorder is compiled out (LFSM_ENABLE_RECORDER)");
+    }
+    lfsm_replay_result_t result;
+    snapshot_size = 0;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_recorder_start(write_snapshot, NULL));
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_recorder_start(write_snapshot, NULL));
+    my_data.temperature = ALARM_TEMP + 5;
+    fsm_add_event(lfsm_handler, EV_MEASURE);
+    TEST_ASSERT_EQUAL(LFSM_ERROR, fsm_add_event(lfsm_handler, LFSM_ID_MAX)); // not recorded
+    lfsm_run_until_empty(lfsm_handler);
+    fsm_add_event(lfsm_handler, EV_MEASURE);
+    lfsm_run_until_empty(lfsm_handler);
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_recorder_stop());
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(lfsm_handler));
+    TEST_ASSERT_EQUAL_MEMORY(LFSM_RECORDING_MAGIC, snapshot_data, 8);
+    TEST_ASSERT_LESS_OR_EQUAL(sizeof(lfsm_recording_header_t) + 2 * 8, snapshot_size);
+
+    // without instances the recording is only scanned
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_replay(snapshot_data, snapshot_size, NULL, 0, &result));
+    TEST_ASSERT_EQUAL(2, result.skipped);
+    TEST_ASSERT_EQUAL(lfsm_get_instance_number(lfsm_handler) + 1, result.instance_count);
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_replay(snapshot_data, snapshot_size - 1, NULL, 0, NULL));
+
+    lfsm_t* instances = calloc(result.instance_count, sizeof(lfsm_t));
+    lfsm_t replayed = lfsm_init(transition_table, state_func_table, buffer_callbacks, &my_data, ST_NORMAL);
+    instances[lfsm_get_instance_number(lfsm_handler)] = replayed;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_replay(snapshot_data, snapshot_size, instances, result.instance_count, &result));
+    TEST_ASSERT_EQUAL(2, result.events);
+    TEST_ASSERT_EQUAL(1, result.transitions);
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(replayed));
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event(replayed, EV_MEASURE)); // replay over
+    lfsm_deinit(replayed);
+    free(instances);
+}
+
+// a second thread keeps adding events while the recording is stopped
+#define STOPPING_MAX_EVENTS 10000
+static uint8_t stopping_data[STOPPING_MAX_EVENTS * 8];
+static uint32_t stopping_size;
+static _Atomic uint32_t stopping_added;
+static atomic_int stopping_done;
+static void write_slowly(const void* data, uint32_t size, void* context) {
+    usleep(1000); // events keep coming while the last buffer is written
+    TEST_ASSERT_LESS_OR_EQUAL(sizeof(stopping_data), stopping_size + size);
+    memcpy(&stopping_data[stopping_size], data, size);
+    stopping_size += size;
+}
+static void* add_events_while_stopping(void* context) {
+    lfsm_t fsm = context;
+    while (!atomic_load(&stopping_done) && (atomic_load(&stopping_added) < STOPPING_MAX_EVENTS)) {
+        if (fsm_add_event(fsm, 0) == LFSM_OK) atomic_fetch_add(&stopping_added, 1);
+        lfsm_run_until_empty(fsm);
+    }
+    return NULL;
+}
+
+void test_recorder_stop_keeps_events_of_other_threads(void) {
+    static lfsm_transitions_t toggle_table[] = {
+        { 0, 0, NULL, 1 },
+        { 1, 0, NULL, 0 },
+    };
+    if (!LFSM_ENABLE_RECORDER) {
+        TEST_IGNORE_MESSAGE("the event recorder is compiled out (LFSM_ENABLE_RECORDER)");
+    }
+    lfsm_t fsm = lfsm_init_func(toggle_table, ARRAYSIZE(toggle_table), NULL, 0, buffer_callbacks, NULL, 0);
+    pthread_t producer;
+    lfsm_replay_result_t result;
+
+    stopping_size = 0;
+    atomic_store(&stopping_added, 0);
+    atomic_store(&stopping_done, 0);
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_recorder_start(write_slowly, NULL));
+    pthread_create(&producer, NULL, add_events_while_stopping, fsm);
+    while (atomic_load(&stopping_added) < 100) usleep(100);
+    uint32_t added_before = atomic_load(&stopping_added);
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_recorder_stop());
+    uint32_t added_after = atomic_load(&stopping_added);
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_recorder_stop());
+    atomic_store(&stopping_done, 1);
+    pthread_join(producer, NULL);
+
+    // every event queued before the stop is in the recording
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_replay(stopping_data, stopping_size, NULL, 0, &result));
+    TEST_ASSERT_GREATER_OR_EQUAL(added_before, result.skipped);
+    TEST_ASSERT_LESS_OR_EQUAL(added_after, result.skipped);
+    lfsm_deinit(fsm);
+}
+
+#define STORE_TEST_FILE "test_lovely_fsm_store.bin"
+void test_store_continues_instances_after_reopen(void) {
+    if (!LFSM_ENABLE_STORE) {
+        TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_store_open(STORE_TEST_FILE, 4));
+        TEST_IGNORE_MESSAGE("the instance store is compiled out (LFSM_ENABLE_STORE)");
+    }
+    const lfsm_definition_t* definition = lfsm_definition_compile(transition_table, ARRAYSIZE(transition_table), state_func_table, ARRAYSIZE(state_func_table));
+    remove(STORE_TEST_FILE);
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_store_open(STORE_TEST_FILE, 4));
+    TEST_ASSERT_NULL(lfsm_store_attach(definition, 2, &my_data));
+    my_data.normal_entry_run_count = 0;
+    lfsm_t fsm = lfsm_init_stored(definition, 2, &my_data, ST_NORMAL);
+    TEST_ASSERT_NOT_NULL(fsm);
+    TEST_ASSERT_EQUAL(1, my_data.normal_entry_run_count);
+
+    my_data.temperature = ALARM_TEMP + 5;
+    fsm_add_event(fsm, EV_MEASURE);
+    fsm_add_event(fsm, EV_BUTTON_PRESS);
+    lfsm_run(fsm);
+    lfsm_store_close(); // like a process exit
+
+    // the file only fits a store of the same capacity
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_store_open(STORE_TEST_FILE, 8));
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_store_open(STORE_TEST_FILE, 4));
+    fsm = lfsm_store_attach(definition, 2, &my_data);
+    TEST_ASSERT_NOT_NULL(fsm);
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(fsm));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_entry_run_count);
+
+    // the event queued before the restart is still there
+    my_data.temperature = WARN_TEMP - 5;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_run(fsm));
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(fsm));
+    lfsm_deinit(fsm);
+    TEST_ASSERT_NULL(lfsm_store_attach(definition, 2, &my_data));
+    lfsm_store_close();
+    remove(STORE_TEST_FILE);
+    lfsm_definition_free(definition);
+}
+
+void test_sparse_machine_uses_hash_index(void) {
+    lfsm_t sparse_fsm = lfsm_init(sparse_transition_table, sparse_state_func_table, buffer_callbacks, &my_data, ST_SPARSE_A);
+    TEST_ASSERT_NOT_NULL(sparse_fsm);
+    TEST_ASSERT_EQUAL(LFSM_INDEX_HASH, lfsm_get_index_type(sparse_fsm));
+    TEST_ASSERT_EQUAL(LFSM_INDEX_DENSE, lfsm_get_index_type(lfsm_handler));
+    TEST_ASSERT_NULL(lfsm_get_transition_lookup_table(sparse_fsm));
+
+    // every state/event combination resolves to the first transition of its block
+    for (int state = lfsm_get_state_min(sparse_fsm) ; state <= lfsm_get_state_max(sparse_fsm) ; state++) {
+        lfsm_set_state(sparse_fsm, state);
+        for (int event = lfsm_get_event_min(sparse_fsm) ; event <= lfsm_get_event_max(sparse_fsm) ; event++) {
+            const lfsm_transitions_t* expected = NULL;
+            const lfsm_transitions_t* transition = lfsm_get_transition_table(sparse_fsm);
+            for (int i = 0 ; i < lfsm_get_transition_count(sparse_fsm) ; i++, transition++) {
+                if ((transition->current_state == state) && (transition->event == event)) {
+                    expected = transition;
+                    break;
+                }
+            }
+            TEST_ASSERT_EQUAL_PTR(expected, lfsm_get_transition_from_lookup(sparse_fsm, event));
+        }
+    }
+
+    lfsm_set_state(sparse_fsm, ST_SPARSE_A);
+    fsm_add_event(sparse_fsm, EV_SPARSE_A);
+    lfsm_run(sparse_fsm);
+    TEST_ASSERT_EQUAL(ST_SPARSE_B, lfsm_get_state(sparse_fsm));
+    fsm_add_event(sparse_fsm, EV_SPARSE_B);
+    lfsm_run(sparse_fsm);
+    TEST_ASSERT_EQUAL(ST_SPARSE_C, lfsm_get_state(sparse_fsm));
+    fsm_add_event(sparse_fsm, EV_SPARSE_C);
+    lfsm_run(sparse_fsm);
+    TEST_ASSERT_EQUAL(ST_SPARSE_A, lfsm_get_state(sparse_fsm));
+
+    lfsm_deinit(sparse_fsm);
+}
+
+void test_linear_index_finds_same_transitions_as_dense(void) {
+    lfsm_definition_t dense, linear;
+
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_definition_build(&dense, sparse_transition_table, ARRAYSIZE(sparse_transition_table), \
+                                                     sparse_state_func_table, ARRAYSIZE(sparse_state_func_table), LFSM_INDEX_DENSE));
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_definition_build(&linear, sparse_transition_table, ARRAYSIZE(sparse_transition_table), \
+                                                     sparse_state_func_table, ARRAYSIZE(sparse_state_func_table), LFSM_INDEX_LINEAR));
+    TEST_ASSERT_NULL(linear.transition_lookup_table);
+    TEST_ASSERT_NULL(linear.hash_index);
+    lfsm_t dense_fsm = lfsm_init_definition(&dense, buffer_callbacks, &my_data, ST_SPARSE_A);
+    lfsm_t linear_fsm = lfsm_init_definition(&linear, buffer_callbacks, &my_data, ST_SPARSE_A);
+
+    for (int state = dense.state_number_min ; state <= dense.state_number_max ; state++) {
+        lfsm_set_state(dense_fsm, state);
+        lfsm_set_state(linear_fsm, state);
+        for (int event = dense.event_number_min ; event <= dense.event_number_max ; event++) {
+            TEST_ASSERT_EQUAL_PTR(lfsm_get_transition_from_lookup(dense_fsm, event), \
+                                  lfsm_get_transition_from_lookup(linear_fsm, event));
+        }
+    }
+    lfsm_set_state(linear_fsm, ST_SPARSE_A);
+    fsm_add_event(linear_fsm, EV_SPARSE_A);
+    lfsm_run(linear_fsm);
+    TEST_ASSERT_EQUAL(ST_SPARSE_B, lfsm_get_state(linear_fsm));
+
+    lfsm_deinit(dense_fsm);
+    lfsm_deinit(linear_fsm);
+    lfsm_definition_release(&dense);
+    lfsm_definition_release(&linear);
+}
+
+void test_run_batch_processes_queued_events(void) {
+    lfsm_batch_result_t result;
+
+    lfsm_set_state(lfsm_handler, ST_NORMAL);
+    my_data.temperature = ALARM_TEMP + 5;
+    fsm_add_event(lfsm_handler, EV_MEASURE);      // -> ST_ALARM
+    fsm_add_event(lfsm_handler, EV_MEASURE);      // no transition in ST_ALARM
+    fsm_add_event(lfsm_handler, EV_BUTTON_PRESS); // guard rejects, too hot
+
+    result = lfsm_run_batch(lfsm_handler, 2);
+    TEST_ASSERT_EQUAL(2, result.events);
+    TEST_ASSERT_EQUAL(1, result.transitions);
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(lfsm_handler));
+    TEST_ASSERT_EQUAL(1, my_data.normal_exit_run_count);
+    TEST_ASSERT_EQUAL(1, my_data.alarm_entry_run_count);
+    TEST_ASSERT_EQUAL(2, my_data.alarm_run_run_count);
+    TEST_ASSERT_EQUAL(0, my_data.alarm_exit_run_count);
+
+    result = lfsm_run_until_empty(lfsm_handler);
+    TEST_ASSERT_EQUAL(1, result.events);
+    TEST_ASSERT_EQUAL(0, result.transitions);
+    TEST_ASSERT_EQUAL(2, my_data.alarm_run_run_count);
+    TEST_ASSERT_EQUAL(1, lfsm_no_event_queued(lfsm_handler));
+
+    my_data.temperature = WARN_TEMP - 5;
+    fsm_add_event(lfsm_handler, EV_BUTTON_PRESS); // -> ST_NORMAL
+    fsm_add_event(lfsm_handler, EV_MEASURE);      // guards reject
+    result = lfsm_run_until_empty(lfsm_handler);
+    TEST_ASSERT_EQUAL(2, result.events);
+    TEST_ASSERT_EQUAL(1, result.transitions);
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(lfsm_handler));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_exit_run_count);
+
+    result = lfsm_run_until_empty(lfsm_handler);
+    TEST_ASSERT_EQUAL(0, result.events);
+}
+
+void test_group_runs_batches_per_instance(void) {
+    my_data_t data[3] = { { .temperature = ALARM_TEMP + 5 }, { .temperature = WARN_TEMP + 1 }, { .temperature = WARN_TEMP - 5 } };
+    void* user_data[3] = { &data[0], &data[1], &data[2] };
+    lfsm_batch_result_t result;
+
+    memset((char*)&my_data, 0, sizeof(my_data_t));
+    lfsm_group_t group = lfsm_group_create(&temperature_definition, 3, user_data, ST_NORMAL);
+    TEST_ASSERT_NOT_NULL(group);
+    TEST_ASSERT_EQUAL(3, my_data.normal_entry_run_count);
+
+    lfsm_group_event_t first_batch[] = {
+        { 0, EV_MEASURE }, { 1, EV_MEASURE }, { 7, EV_MEASURE }, { 0, EV_BUTTON_PRESS }, { 2, EV_MEASURE },
+    };
+    result = lfsm_group_run(group, first_batch, ARRAYSIZE(first_batch));
+    TEST_ASSERT_EQUAL(4, result.events);      // instance 7 does not exist
+    TEST_ASSERT_EQUAL(2, result.transitions); // button press: temperature still critical
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_group_get_state(group, 0));
+    TEST_ASSERT_EQUAL(ST_WARN, lfsm_group_get_state(group, 1));
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_group_get_state(group, 2));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_entry_run_count);
+    TEST_ASSERT_EQUAL(1, my_data.warn_entry_run_count);
+    TEST_ASSERT_EQUAL(2, my_data.normal_exit_run_count);
+
+    // events of one instance run in batch order
+    data[0].temperature = WARN_TEMP - 5;
+    lfsm_group_event_t second_batch[] = {
+        { 0, EV_BUTTON_PRESS }, { 1, EV_BUTTON_PRESS }, { 0, EV_MEASURE },
+    };
+    result = lfsm_group_run(group, second_batch, ARRAYSIZE(second_batch));
+    TEST_ASSERT_EQUAL(3, result.events);
+    TEST_ASSERT_EQUAL(1, result.transitions);
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_group_get_state(group, 0));
+    TEST_ASSERT_EQUAL(ST_WARN, lfsm_group_get_state(group, 1));
+    TEST_ASSERT_EQUAL(1, my_data.alarm_exit_run_count);
+    TEST_ASSERT_EQUAL(2, my_data.warn_run_run_count);
+
+    lfsm_group_destroy(group);
+}
+
+void test_event_payload_reaches_conditions(void) {
+    if (!LFSM_EVENT_PAYLOADS) {
+        TEST_IGNORE_MESSAGE("event payloads are disabled (LFSM_EVENT_PAYLOADS)");
+    }
+    lfsm_t payload_fsm = lfsm_init(payload_transition_table, state_func_table, buffer_callbacks, &my_data, ST_NORMAL);
+    TEST_ASSERT_NOT_NULL(payload_fsm);
+
+    // referenced, not copied
+    int16_t cool = WARN_TEMP - 5;
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event_payload(payload_fsm, EV_MEASURE, &cool, sizeof(cool)));
+    lfsm_run(payload_fsm);
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(payload_fsm));
+
+    int16_t* hot = lfsm_payload_alloc(payload_fsm, sizeof(int16_t));
+    TEST_ASSERT_NOT_NULL(hot);
+    *hot = ALARM_TEMP + 5;
+    TEST_ASSERT_EQUAL(LFSM_OK, fsm_add_event_payload(payload_fsm, EV_MEASURE, hot, sizeof(int16_t)));
+    lfsm_run(payload_fsm);
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(payload_fsm));
+    TEST_ASSERT_NULL(lfsm_event_payload(payload_fsm, NULL));
+
+    // arena memory is released after every run
+    TEST_ASSERT_NULL(lfsm_payload_alloc(payload_fsm, LFSM_PAYLOAD_ARENA_SIZE));
+    for (int i = 0 ; i < 100 ; i++) {
+        void* data = lfsm_payload_alloc(payload_fsm, LFSM_PAYLOAD_ARENA_SIZE / 4);
+        TEST_ASSERT_NOT_NULL(data);
+        fsm_add_event_payload(payload_fsm, EV_BUTTON_PRESS, data, LFSM_PAYLOAD_ARENA_SIZE / 4);
+        lfsm_run_until_empty(payload_fsm);
+    }
+    lfsm_deinit(payload_fsm);
+}
+
+void test_stats_count_events_guards_and_callbacks(void) {
+    if (!LFSM_ENABLE_STATS) {
+        TEST_IGNORE_MESSAGE("statistics are compiled out (LFSM_ENABLE_STATS)");
+    }
+    const lfsm_transitions_t* table = lfsm_get_transition_table(lfsm_handler);
+    int warning = lfsm_get_transition_from_lookup(lfsm_handler, EV_MEASURE) - table;
+
+    my_data.temperature = WARN_TEMP - 5;
+    fsm_add_event(lfsm_handler, EV_MEASURE);      // both guards reject
+    fsm_add_event(lfsm_handler, EV_BUTTON_PRESS); // no transition in ST_NORMAL
+    TEST_ASSERT_EQUAL(LFSM_ERROR, fsm_add_event(lfsm_handler, EV_MEASURE + 50));
+    lfsm_run_until_empty(lfsm_handler);
+    my_data.temperature = WARN_TEMP + 5;
+    fsm_add_event(lfsm_handler, EV_MEASURE);      // -> ST_WARN
+    lfsm_run(lfsm_handler);
+    for (int i = 0 ; i <= LFSM_EV_QUEUE_SIZE ; i++) {
+        fsm_add_event(lfsm_handler, EV_BUTTON_PRESS);
+    }
+
+    lfsm_stats_t* stats = lfsm_get_stats(lfsm_handler);
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_EQUAL(3, stats->events_run);
+    TEST_ASSERT_EQUAL(1, stats->events_without_transition);
+    TEST_ASSERT_EQUAL(1, stats->events_rejected);
+    TEST_ASSERT_EQUAL(1, stats->queue_full);
+    TEST_ASSERT_EQUAL(0, stats->events_dropped);
+    TEST_ASSERT_EQUAL(lfsm_get_transition_count(lfsm_handler), stats->transition_count);
+    TEST_ASSERT_EQUAL(2, stats->transitions[warning].guard_evaluations);
+    TEST_ASSERT_EQUAL(1, stats->transitions[warning].guard_rejections);
+    TEST_ASSERT_EQUAL(1, stats->transitions[warning].fired);
+    TEST_ASSERT_EQUAL(1, stats->transitions[warning + 1].guard_evaluations);
+    TEST_ASSERT_EQUAL(0, stats->transitions[warning + 1].fired);
+
+    lfsm_state_stats_t* normal = &stats->states[ST_NORMAL - lfsm_get_state_min(lfsm_handler)];
+    lfsm_state_stats_t* warn = &stats->states[ST_WARN - lfsm_get_state_min(lfsm_handler)];
+    TEST_ASSERT_EQUAL(ST_NORMAL, normal->state);
+    TEST_ASSERT_EQUAL(my_data.normal_run_run_count, normal->callbacks[LFSM_CALLBACK_RUN].calls);
+    TEST_ASSERT_EQUAL(1, normal->callbacks[LFSM_CALLBACK_EXIT].calls);
+    TEST_ASSERT_EQUAL(1, warn->callbacks[LFSM_CALLBACK_ENTRY].calls);
+    uint32_t histogram_calls = 0;
+    for (int bucket = 0 ; bucket < LFSM_STATS_HISTOGRAM_BUCKETS ; bucket++) {
+        histogram_calls += normal->callbacks[LFSM_CALLBACK_RUN].histogram[bucket];
+    }
+    TEST_ASSERT_EQUAL(normal->callbacks[LFSM_CALLBACK_RUN].calls, histogram_calls);
+    lfsm_stats_free(stats);
+    lfsm_run_until_empty(lfsm_handler);
+}
+
+static uint8_t trace_dump[4096];
+static uint32_t trace_dump_size;
+static void write_trace_dump(const void* data, uint32_t size, void* context) {
+    TEST_ASSERT_TRUE(trace_dump_size + size <= sizeof(trace_dump));
+    memcpy(trace_dump + trace_dump_size, data, size);
+    trace_dump_size += size;
+}
+
+void test_trace_records_transitions(void) {
+    if (!LFSM_ENABLE_TRACE) {
+        TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_trace_dump(write_trace_dump, NULL));
+        TEST_IGNORE_MESSAGE("trace is compiled out (LFSM_ENABLE_TRACE)");
+    }
+    lfsm_trace_clear();
+    my_data.temperature = ALARM_TEMP + 5;
+    fsm_add_event(lfsm_handler, EV_MEASURE);      // second guard -> ST_ALARM
+    lfsm_run(lfsm_handler);
+    my_data.temperature = WARN_TEMP - 5;
+    fsm_add_event(lfsm_handler, EV_MEASURE);      // no transition in ST_ALARM
+    fsm_add_event(lfsm_handler, EV_BUTTON_PRESS); // -> ST_NORMAL
+    lfsm_run_until_empty(lfsm_handler);
+
+    trace_dump_size = 0;
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_trace_dump(write_trace_dump, NULL));
+    lfsm_trace_header_t header;
+    memcpy(&header, trace_dump, sizeof(header));
+    TEST_ASSERT_EQUAL_MEMORY(LFSM_TRACE_MAGIC, header.magic, sizeof(header.magic));
+    TEST_ASSERT_EQUAL(sizeof(lfsm_trace_record_t), header.record_size);
+    TEST_ASSERT_EQUAL(1, header.thread_count);
+    lfsm_trace_thread_t thread;
+    memcpy(&thread, trace_dump + sizeof(header), sizeof(thread));
+    TEST_ASSERT_EQUAL(2, thread.record_count);
+    TEST_ASSERT_EQUAL(0, thread.lost);
+    TEST_ASSERT_EQUAL(sizeof(header) + sizeof(thread) + 2 * sizeof(lfsm_trace_record_t), trace_dump_size);
+
+    lfsm_trace_record_t records[2];
+    memcpy(records, trace_dump + sizeof(header) + sizeof(thread), sizeof(records));
+    TEST_ASSERT_EQUAL(EV_MEASURE, records[0].event);
+    TEST_ASSERT_EQUAL(ST_NORMAL, records[0].from_state);
+    TEST_ASSERT_EQUAL(ST_ALARM, records[0].to_state);
+    TEST_ASSERT_EQUAL(1, records[0].guard);
+    TEST_ASSERT_EQUAL(EV_BUTTON_PRESS, records[1].event);
+    TEST_ASSERT_EQUAL(ST_ALARM, records[1].from_state);
+    TEST_ASSERT_EQUAL(ST_NORMAL, records[1].to_state);
+    TEST_ASSERT_EQUAL(0, records[1].guard);
+    TEST_ASSERT_EQUAL(records[0].instance, records[1].instance);
+    TEST_ASSERT_EQUAL(records[0].sequence + 1, records[1].sequence);
+    TEST_ASSERT_TRUE(records[0].timestamp <= records[1].timestamp);
+}
+
+// one of four exclusive guards accepts, depending on the user data
+static int guard_calls;
+static int guard_accepts(lfsm_t context, int guard) {
+    guard_calls++;
+    return *(int*)lfsm_user_data(context) == guard;
+}
+static int guard_0(lfsm_t context) { return guard_accepts(context, 0); }
+static int guard_1(lfsm_t context) { return guard_accepts(context, 1); }
+static int guard_2(lfsm_t context) { return guard_accepts(context, 2); }
+static int guard_3(lfsm_t context) { return guard_accepts(context, 3); }
+
+void test_exclusive_guards_most_frequent_is_tried_first(void) {
+    static lfsm_transitions_t guard_table[] = {
+        { 0, 0, guard_0, 0, LFSM_EXCLUSIVE_GUARD },
+        { 0, 0, guard_1, 1, LFSM_EXCLUSIVE_GUARD },
+        { 0, 0, guard_2, 2, LFSM_EXCLUSIVE_GUARD },
+        { 0, 0, guard_3, 3, LFSM_EXCLUSIVE_GUARD },
+        { 1, 0, NULL   , 0 },
+        { 2, 0, NULL   , 0 },
+        { 3, 0, NULL   , 0 },
+    };
+    int value = 3;
+
+    if (!LFSM_ADAPTIVE_GUARDS) {
+        TEST_IGNORE_MESSAGE("guards are tried in table order (LFSM_ADAPTIVE_GUARDS)");
+    }
+    lfsm_t guard_fsm = lfsm_init_func(guard_table, ARRAYSIZE(guard_table), NULL, 0, buffer_callbacks, &value, 0);
+    TEST_ASSERT_NOT_NULL(guard_fsm);
+
+    // learning: the last guard accepts, all four are called
+    guard_calls = 0;
+    for (int i = 0 ; i < LFSM_GUARD_REORDER_INTERVAL ; i++) {
+        fsm_add_event(guard_fsm, 0); // state 0 -> 3
+        fsm_add_event(guard_fsm, 0); // back to 0
+        lfsm_run_until_empty(guard_fsm);
+    }
+    TEST_ASSERT_EQUAL(4 * LFSM_GUARD_REORDER_INTERVAL, guard_calls);
+    // reordered: the last guard is tried first
+    guard_calls = 0;
+    fsm_add_event(guard_fsm, 0);
+    lfsm_run(guard_fsm);
+    TEST_ASSERT_EQUAL(1, guard_calls);
+    TEST_ASSERT_EQUAL(3, lfsm_get_state(guard_fsm));
+    // the others still select their own transition
+    value = 1;
+    fsm_add_event(guard_fsm, 0);
+    fsm_add_event(guard_fsm, 0);
+    lfsm_run_until_empty(guard_fsm);
+    TEST_ASSERT_EQUAL(1, lfsm_get_state(guard_fsm));
+    lfsm_deinit(guard_fsm);
+}
+
+void test_timers_post_cancel_and_leave_state(void) {
+    if (!LFSM_ENABLE_TIMERS) {
+        TEST_ASSERT_EQUAL(LFSM_NO_TIMER, lfsm_post_event_after(lfsm_handler, EV_MEASURE, 10));
+        TEST_IGNORE_MESSAGE("timers are compiled out (LFSM_ENABLE_TIMERS)");
+    }
+    uint64_t now = lfsm_timers_now();
+    TEST_ASSERT_NOT_EQUAL(LFSM_NO_TIMER, lfsm_post_event_after(lfsm_handler, EV_MEASURE, 10));
+    lfsm_timer_t cancelled = lfsm_post_event_after(lfsm_handler, EV_BUTTON_PRESS, 5);
+    TEST_ASSERT_EQUAL(LFSM_OK, lfsm_timer_cancel(cancelled));
+    TEST_ASSERT_EQUAL(LFSM_NOP, lfsm_timer_cancel(cancelled));
+    TEST_ASSERT_EQUAL(0, lfsm_timers_advance(now + 9));
+    TEST_ASSERT_EQUAL(1, lfsm_timers_advance(now + 10));
+    my_data.temperature = ALARM_TEMP + 5;
+    lfsm_run(lfsm_handler);
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(lfsm_handler));
+
+    // cascades down from a higher wheel level, due at the same tick
+    now += 10;
+    lfsm_post_event_after(lfsm_handler, EV_BUTTON_PRESS, 70000);
+    TEST_ASSERT_EQUAL(0, lfsm_timers_advance(now + 69999));
+    TEST_ASSERT_EQUAL(1, lfsm_timers_advance(now + 70000));
+    my_data.temperature = WARN_TEMP - 5;
+    lfsm_run(lfsm_handler);
+    TEST_ASSERT_EQUAL(ST_NORMAL, lfsm_get_state(lfsm_handler));
+
+    // tied to ST_NORMAL, gone once the instance leaves it
+    now += 70000;
+    lfsm_post_state_event_after(lfsm_handler, EV_BUTTON_PRESS, 20);
+    fsm_add_event(lfsm_handler, EV_MEASURE);
+    my_data.temperature = ALARM_TEMP + 5;
+    lfsm_run(lfsm_handler);
+    TEST_ASSERT_EQUAL(0, lfsm_timers_advance(now + 20));
+
+    // deinit cancels the timers of the instance
+    lfsm_t second_fsm = lfsm_init(transition_table, state_func_table, buffer_callbacks, &my_data, ST_NORMAL);
+    lfsm_post_event_after(second_fsm, EV_MEASURE, 5);
+    lfsm_deinit(second_fsm);
+    TEST_ASSERT_EQUAL(0, lfsm_timers_advance(now + 100));
+}
+
+#define LARGE_STATES 20
+#define LARGE_EVENTS 15
+void test_machine_with_more_than_255_transitions(void) {
+    static lfsm_transitions_t large_table[LARGE_STATES * LARGE_EVENTS];
+    int count = 0;
+
+    // listed in reverse order, so the table has to be sorted
+    for (int state = LARGE_STATES - 1 ; state >= 0 ; state--) {
+        for (int event = LARGE_EVENTS - 1 ; event >= 0 ; event--) {
+            large_table[count++] = (lfsm_transitions_t){ state, event, NULL, (state + event) % LARGE_STATES };
+        }
+    }
+    lfsm_t large_fsm = lfsm_init_func(large_table, count, NULL, 0, buffer_callbacks, NULL, 0);
+    TEST_ASSERT_NOT_NULL(large_fsm);
+    TEST_ASSERT_EQUAL(LARGE_STATES * LARGE_EVENTS, lfsm_get_transition_count(large_fsm));
+    for (int state = 0 ; state < LARGE_STATES ; state++) {
+        lfsm_set_state(large_fsm, state);
+        for (int event = 0 ; event < LARGE_EVENTS ; event++) {
+            const lfsm_transitions_t* transition = lfsm_get_transition_from_lookup(large_fsm, event);
+            TEST_ASSERT_EQUAL(state, transition->current_state);
+            TEST_ASSERT_EQUAL(event, transition->event);
+        }
+    }
+    lfsm_set_state(large_fsm, 0);
+    fsm_add_event(large_fsm, 7);
+    fsm_add_event(large_fsm, 14);
+    lfsm_run_until_empty(large_fsm);
+    TEST_ASSERT_EQUAL(21 % LARGE_STATES, lfsm_get_state(large_fsm));
+    lfsm_deinit(large_fsm);
+
+    // ids that do not fit lfsm_id_t are rejected
+    large_table[0].next_state = (int)(LFSM_ID_MAX + 1);
+    TEST_ASSERT_NULL(lfsm_init_func(large_table, count, NULL, 0, buffer_callbacks, NULL, 0));
+}
+
+#define POOL_TEST_INSTANCES (LFSM_MAX_COUNT + 2 * LFSM_POOL_CHUNK_SIZE + 1)
+void test_instance_pool_grows_and_reuses_instances(void) {
+    static lfsm_t instances[POOL_TEST_INSTANCES];
+
+    if (LFSM_POOL_CHUNK_SIZE == 0) {
+        TEST_IGNORE_MESSAGE("instance pool does not grow (LFSM_POOL_CHUNK_SIZE)");
+    }
+    if (!LFSM_USE_BUILTIN_QUEUE) {
+        TEST_IGNORE_MESSAGE("buffer callbacks cannot release buffers, pool growth needs the built-in queue (LFSM_USE_BUILTIN_QUEUE)");
+    }
+    for (int i = 0 ; i < POOL_TEST_INSTANCES ; i++) {
+        instances[i] = lfsm_init_definition(&temperature_definition, buffer_callbacks, &my_data, ST_NORMAL);
+        TEST_ASSERT_NOT_NULL(instances[i]);
+        fsm_add_event(instances[i], EV_BUTTON_PRESS);
+    }
+    // every instance has its own queue
+    for (int i = 0 ; i < POOL_TEST_INSTANCES ; i++) {
+        TEST_ASSERT_EQUAL(LFSM_OK, lfsm_run(instances[i]));
+    }
+    for (int i = 0 ; i < POOL_TEST_INSTANCES ; i++) {
+        TEST_ASSERT_EQUAL(LFSM_OK, lfsm_deinit(instances[i]));
+    }
+    TEST_ASSERT_EQUAL(LFSM_ERROR, lfsm_deinit(instances[0]));
+
+    // the most recently released instance is reused first, and comes back clean
+    lfsm_t reused = lfsm_init_definition(&temperature_definition, buffer_callbacks, &my_data, ST_ALARM);
+    TEST_ASSERT_EQUAL_PTR(instances[POOL_TEST_INSTANCES - 1], reused);
+    TEST_ASSERT_EQUAL(1, lfsm_no_event_queued(reused));
+    TEST_ASSERT_EQUAL(ST_ALARM, lfsm_get_state(reused));
+    lfsm_deinit(reused);
+}
+
 void test_create_large_second_fsm_instance(void) {
     lfsm_handler = lfsm_init(my_transition_table, my_state_func_table, buffer_callbacks, &my_data, ST_0);
     TEST_ASSERT_NOT_NULL(lfsm_handler);
@@ -0,0 +1,87 @@
+/* --------------------------------------------------------------------------
+ * Executor: many instances, run by a pool of workers. Every instance counts
+ * its events and checks that it is never run by two workers at the same
+ * time. Events are posted by the test thread only, so the default single
+ * producer queue is sufficient.
+ * -------------------------------------------------------------------------- */
+#include "unity.h"
+#include <string.h>
+#include "../../src/lovely_fsm.h"
+#include "../../src/lovely_fsm_executor.h"
+
+#define WORKER_COUNT         4
+#define INSTANCE_COUNT       32
+#define EVENTS_PER_INSTANCE  500
+
+enum { ST_COUNTING = 1 };
+enum { EV_COUNT = 1 };
+
+typedef struct counter_t {
+    atomic_int running;
+    int events;
+    int overlaps;
+} counter_t;
+
+lfsm_return_t count_event(lfsm_t fsm) {
+    counter_t* counter = lfsm_user_data(fsm);
+    if (atomic_fetch_add(&counter->running, 1) != 0) {
+        counter->overlaps++;
+    }
+    counter->events++;
+    atomic_fetch_sub(&counter->running, 1);
+    return LFSM_OK;
+}
+
+lfsm_transitions_t transitions[] = {
+    { ST_COUNTING , EV_COUNT , NULL , ST_COUNTING },
+};
+
+lfsm_state_functions_t states[] = {
+    { ST_COUNTING , NULL , count_event , NULL },
+};
+
+lfsm_buf_callbacks_t buffer_callbacks;
+lfsm_executor_t executor;
+lfsm_t instances[INSTANCE_COUNT];
+counter_t counters[INSTANCE_COUNT];
+
+void setUp(void) {
+    memset(counters, 0, sizeof(counters));
+    for (int i = 0 ; i < INSTANCE_COUNT ; i++) {
+        instances[i] = lfsm_init(transitions, states, buffer_callbacks, &counters[i], ST_COUNTING);
+        TEST_ASSERT_NOT_NULL(instances[i]);
+        counters[i].events = 0; // on_run of the initial state
+    }
+    executor = lfsm_executor_create(WORKER_COUNT);
+    TEST_ASSERT_NOT_NULL(executor);
+}
+
+void tearDown(void) {
+    lfsm_executor_destroy(executor);
+    for (int i = 0 ; i < INSTANCE_COUNT ; i++) {
+        lfsm_deinit(instances[i]);
+    }
+}
+
+void test_executor_runs_every_posted_event(void) {
+    for (int round = 0 ; round < EVENTS_PER_INSTANCE ; round++) {
+        for (int i = 0 ; i < INSTANCE_COUNT ; i++) {
+            while (lfsm_executor_post(executor, instances[i], EV_COUNT) != LFSM_OK) {
+                // queue full, the executor drains it
+            }
+        }
+    }
+    lfsm_executor_wait_idle(executor);
+
+    for (int i = 0 ; i < INSTANCE_COUNT ; i++) {
+        TEST_ASSERT_EQUAL(EVENTS_PER_INSTANCE, counters[i].events);
+        TEST_ASSERT_EQUAL(0, counters[i].overlaps);
+    }
+}
+
+void test_executor_is_idle_without_events(void) {
+    lfsm_executor_wait_idle(executor);
+    lfsm_executor_schedule(executor, instances[0]);
+    lfsm_executor_wait_idle(executor);
+    TEST_ASSERT_EQUAL(0, counters[0].events);
+}
@@ -0,0 +1,100 @@
+/* --------------------------------------------------------------------------
+ * The built-in event queue is header only. This test builds it in multi
+ * producer mode, the single producer mode is covered by test_lovely_fsm.c.
+ * -------------------------------------------------------------------------- */
+#define LFSM_QUEUE_MULTI_PRODUCER 1
+#define LFSM_EV_QUEUE_SIZE        64
+#define LFSM_EVENT_PAYLOADS       1
+
+#include "unity.h"
+#include <pthread.h>
+#include <string.h>
+#include "../../src/lovely_fsm_queue.h"
+
+#define PRODUCER_COUNT       4
+#define EVENTS_PER_PRODUCER  20000
+
+// event = producer number (upper 3 bits) and a running number (lower 5 bits)
+#define EVENT(producer, number) ((uint8_t)(((producer) << 5) | ((number) & 0x1F)))
+
+lfsm_queue_t queue;
+
+void setUp(void) {
+    memset(&queue, 0, sizeof(queue));
+    lfsm_queue_init(&queue);
+}
+
+void tearDown(void) {
+}
+
+void test_queue_is_fifo(void) {
+    TEST_ASSERT_EQUAL(1, lfsm_queue_is_empty(&queue));
+    for (int i = 0 ; i < 10 ; i++) {
+        TEST_ASSERT_EQUAL(0, lfsm_queue_add(&queue, i));
+    }
+    for (int i = 0 ; i < 10 ; i++) {
+        TEST_ASSERT_EQUAL(0, lfsm_queue_is_empty(&queue));
+        TEST_ASSERT_EQUAL(i, lfsm_queue_read(&queue));
+    }
+    TEST_ASSERT_EQUAL(1, lfsm_queue_is_empty(&queue));
+}
+
+void test_queue_full_and_wrap_around(void) {
+    for (int round = 0 ; round < 3 ; round++) {
+        for (int i = 0 ; i < LFSM_EV_QUEUE_SIZE ; i++) {
+            TEST_ASSERT_EQUAL(0, lfsm_queue_add(&queue, i + round));
+        }
+        TEST_ASSERT_EQUAL(1, lfsm_queue_add(&queue, 0xAA));
+        for (int i = 0 ; i < LFSM_EV_QUEUE_SIZE ; i++) {
+            TEST_ASSERT_EQUAL(i + round, lfsm_queue_read(&queue));
+        }
+        TEST_ASSERT_EQUAL(1, lfsm_queue_is_empty(&queue));
+    }
+}
+
+void test_queue_carries_payload_reference(void) {
+    static const char message[] = "payload";
+    lfsm_queue_payload_t payload = { message, sizeof(message), 0, 0 };
+    lfsm_queue_payload_t read_payload;
+
+    TEST_ASSERT_EQUAL(0, lfsm_queue_add_payload(&queue, 7, &payload));
+    TEST_ASSERT_EQUAL(0, lfsm_queue_add(&queue, 8));
+    TEST_ASSERT_EQUAL(7, lfsm_queue_read_payload(&queue, &read_payload));
+    TEST_ASSERT_EQUAL_PTR(message, read_payload.data);
+    TEST_ASSERT_EQUAL(sizeof(message), read_payload.length);
+    TEST_ASSERT_EQUAL(8, lfsm_queue_read_payload(&queue, &read_payload));
+    TEST_ASSERT_NULL(read_payload.data);
+}
+
+void* producer(void* argument) {
+    int producer_number = (int)(intptr_t)argument;
+    for (int i = 0 ; i < EVENTS_PER_PRODUCER ; i++) {
+        while (lfsm_queue_add(&queue, EVENT(producer_number, i))) {
+            // queue full, wait for the consumer
+        }
+    }
+    return NULL;
+}
+
+void test_queue_concurrent_producers_lose_nothing(void) {
+    pthread_t threads[PRODUCER_COUNT];
+    int received[PRODUCER_COUNT] = { 0 };
+
+    for (int i = 0 ; i < PRODUCER_COUNT ; i++) {
+        pthread_create(&threads[i], NULL, producer, (void*)(intptr_t)i);
+    }
+    for (int total = 0 ; total < PRODUCER_COUNT * EVENTS_PER_PRODUCER ; ) {
+        if (lfsm_queue_is_empty(&queue)) continue;
+        uint8_t event = lfsm_queue_read(&queue);
+        int producer_number = event >> 5;
+        // events of one producer keep their order
+        TEST_ASSERT_EQUAL(EVENT(producer_number, received[producer_number]), event);
+        received[producer_number]++;
+        total++;
+    }
+    for (int i = 0 ; i < PRODUCER_COUNT ; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL(EVENTS_PER_PRODUCER, received[i]);
+    }
+    TEST_ASSERT_EQUAL(1, lfsm_queue_is_empty(&queue));
+}